@@ -0,0 +1,148 @@
+// Copyright (c) 2010 Garrett R. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// Measures the cost of obtaining, stepping, resetting and releasing
+// statements, and counts the heap allocations each cycle makes: operator new
+// calls by the wrapper and MemoryPool allocations by the wrapper and by
+// sqlite.
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+#include "sql.h"
+
+namespace {
+
+int64 g_new_count = 0;
+
+int64 CountPoolAllocations() {
+  std::vector<sql::MemoryPool::Stats> stats =
+      sql::MemoryPool::GetInstance()->GetStats();
+  int64 count = 0;
+  for (size_t i = 0; i < stats.size(); ++i)
+    count += stats[i].allocation_count;
+  return count;
+}
+
+// Runs |cycle| |iterations| times, after once to warm up, and prints the
+// time and allocations per run.
+template <typename Cycle>
+void Run(const char* name, int iterations, Cycle cycle) {
+  cycle();
+
+  int64 new_count = g_new_count;
+  int64 pool_count = CountPoolAllocations();
+  std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; ++i)
+    cycle();
+  std::chrono::duration<double, std::nano> elapsed =
+      std::chrono::steady_clock::now() - start;
+
+  printf("%-24s %8.1f ns %8.2f new %8.2f pool allocations\n", name,
+         elapsed.count() / iterations,
+         static_cast<double>(g_new_count - new_count) / iterations,
+         static_cast<double>(CountPoolAllocations() - pool_count) /
+             iterations);
+}
+
+}  // namespace
+
+void* operator new(size_t size) {
+  ++g_new_count;
+  void* block = malloc(size ? size : 1);
+  if (!block)
+    throw std::bad_alloc();
+  return block;
+}
+
+void operator delete(void* block) noexcept {
+  free(block);
+}
+
+void operator delete(void* block, size_t /*size*/) noexcept {
+  free(block);
+}
+
+int main() {
+  // Counts sqlite's own allocations too.
+  sql::MemoryPool::InstallForSqlite();
+
+  sql::Connection db;
+  if (!db.OpenInMemory() ||
+      !db.Execute("CREATE TABLE t(id INTEGER PRIMARY KEY, value TEXT);"
+                  "INSERT INTO t VALUES(1, 'one')")) {
+    fprintf(stderr, "failed to create the database\n");
+    return 1;
+  }
+
+  const int kIterations = 1000000;
+
+  // Obtaining, moving and releasing a cached statement should make no
+  // allocations at all. Whatever the stepped one adds is sqlite's.
+  Run("cached statement", kIterations, [&db]() {
+    sql::Statement statement(db.GetCachedStatement(SQL_FROM_HERE,
+        "SELECT value FROM t WHERE id = ?"));
+    statement.BindInt(0, 1);
+    sql::Statement moved(std::move(statement));
+  });
+
+  Run("cached statement, step", kIterations, [&db]() {
+    sql::Statement statement(db.GetCachedStatement(SQL_FROM_HERE,
+        "SELECT value FROM t WHERE id = ?"));
+    statement.BindInt(0, 1);
+    statement.Step();
+  });
+
+  Run("unique statement", kIterations / 10, [&db]() {
+    sql::Statement statement(db.GetUniqueStatement(
+        "SELECT value FROM t WHERE id = ?"));
+    statement.BindInt(0, 1);
+    statement.Step();
+  });
+
+  // Per-row cost of an insert loop. Taking the statement from the cache for
+  // every row resets it once per row; reusing one Statement with Reset()
+  // does the same, and Reset(false) also keeps the constant parameters bound
+  // so only the changing one is rebound.
+  if (!db.Execute("CREATE TABLE rows(id INTEGER, kind TEXT, owner TEXT)") ||
+      !db.BeginTransaction()) {
+    fprintf(stderr, "failed to create the table\n");
+    return 1;
+  }
+
+  int id = 0;
+  Run("insert, cached per row", kIterations, [&db, &id]() {
+    sql::Statement statement(db.GetCachedStatement(SQL_FROM_HERE,
+        "INSERT INTO rows VALUES(?, ?, ?)"));
+    statement.BindInt(0, ++id);
+    statement.BindCString(1, "kind");
+    statement.BindCString(2, "owner");
+    statement.Run();
+  });
+
+  sql::Statement insert(db.GetCachedStatement(SQL_FROM_HERE,
+      "INSERT INTO rows VALUES(?, ?, ?)"));
+  Run("insert, Reset(true)", kIterations, [&insert, &id]() {
+    insert.BindInt(0, ++id);
+    insert.BindCString(1, "kind");
+    insert.BindCString(2, "owner");
+    insert.Run();
+    insert.Reset(true);
+  });
+
+  insert.BindCString(1, "kind");
+  insert.BindCString(2, "owner");
+  Run("insert, Reset(false)", kIterations, [&insert, &id]() {
+    insert.BindInt(0, ++id);
+    insert.Run();
+    insert.Reset(false);
+  });
+
+  insert.Reset();
+  db.CommitTransaction();
+  return 0;
+}
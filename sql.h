@@ -5,10 +5,31 @@
 #ifndef SQL_H_
 #define SQL_H_
 
+#include "sql/async_connection.h"
+#include "sql/change_recorder.h"
+#include "sql/compressed_vfs.h"
 #include "sql/connection.h"
+#include "sql/connection_cache.h"
+#include "sql/full_text_index.h"
+#include "sql/index_advisor.h"
+#include "sql/instrumented_vfs.h"
+#include "sql/key_filter.h"
+#include "sql/maintenance_scheduler.h"
+#include "sql/memory_pool.h"
 #include "sql/meta_table.h"
+#include "sql/page_cache.h"
+#include "sql/parallel_query.h"
+#include "sql/result_cache.h"
+#include "sql/schema_catalog.h"
+#include "sql/serialized_database.h"
+#include "sql/sharded_database.h"
+#include "sql/snapshot.h"
 #include "sql/statement.h"
+#include "sql/statement_registry.h"
 #include "sql/transaction.h"
+#include "sql/uring_vfs.h"
 #include "sql/utility.h"
+#include "sql/value.h"
+#include "sql/vector_functions.h"
 
 #endif
@@ -0,0 +1,222 @@
+// Copyright (c) 2010 Garrett R. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "async_connection.h"
+
+#include "statement.h"
+#include "transaction.h"
+
+namespace sql {
+
+AsyncConnection::AsyncConnection(const TaskRunner& reply_runner)
+    : reply_runner_(reply_runner),
+      quit_(false),
+      destroyed_(NULL) {
+  worker_ = std::thread(&AsyncConnection::ThreadMain, this);
+}
+
+AsyncConnection::~AsyncConnection() {
+  if (std::this_thread::get_id() == worker_.get_id()) {
+    // Destroyed by a task or a reply running on the worker, which can't
+    // join itself. The rest of the queue is run here instead, and
+    // ThreadMain() returns without touching |this| once the task that got
+    // here is done.
+    *destroyed_ = true;
+    for (;;) {
+      Closure task;
+      {
+        std::lock_guard<std::mutex> lock(lock_);
+        if (tasks_.empty())
+          break;
+        task.swap(tasks_.front());
+        tasks_.pop_front();
+      }
+      task();
+    }
+    connection_.Close();
+    worker_.detach();
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    quit_ = true;
+  }
+  tasks_available_.notify_one();
+  worker_.join();
+}
+
+std::future<bool> AsyncConnection::Open(const std::string& path) {
+  return Run<bool>([path](Connection* connection) {
+    // Only the worker thread touches the connection.
+    return connection->Open(path, Connection::OPEN_NO_MUTEX);
+  });
+}
+
+std::future<bool> AsyncConnection::OpenInMemory() {
+  return Run<bool>([](Connection* connection) {
+    return connection->OpenInMemory();
+  });
+}
+
+std::future<bool> AsyncConnection::Close() {
+  return Run<bool>([](Connection* connection) {
+    connection->Close();
+    return true;
+  });
+}
+
+std::future<bool> AsyncConnection::Execute(const std::string& sql) {
+  return Run<bool>(std::bind(&AsyncConnection::DoExecute, sql,
+                             std::placeholders::_1));
+}
+
+std::future<QueryResult> AsyncConnection::Query(const std::string& sql,
+                                                const Row& params) {
+  return Run<QueryResult>(std::bind(&AsyncConnection::DoQuery, sql, params,
+                                    std::placeholders::_1));
+}
+
+std::future<bool> AsyncConnection::Query(const std::string& sql,
+                                         const Row& params,
+                                         size_t batch_size,
+                                         const BatchCallback& callback) {
+  if (batch_size == 0)
+    batch_size = 1;
+
+  return Run<bool>([this, sql, params, batch_size, callback](
+      Connection* connection) {
+    Statement statement(connection->GetUniqueStatement(sql));
+    if (!statement)
+      return false;
+    for (size_t i = 0; i < params.size(); ++i)
+      statement.BindValue(static_cast<int>(i), params[i]);
+
+    std::shared_ptr<std::vector<Row> > batch(new std::vector<Row>);
+    batch->reserve(batch_size);
+    while (statement.Step()) {
+      batch->push_back(Row());
+      statement.ColumnRow(&batch->back());
+      if (batch->size() == batch_size) {
+        Reply([callback, batch]() { callback(std::move(*batch)); });
+        batch.reset(new std::vector<Row>);
+        batch->reserve(batch_size);
+      }
+    }
+    if (!batch->empty())
+      Reply([callback, batch]() { callback(std::move(*batch)); });
+    return statement.Succeeded();
+  });
+}
+
+std::future<bool> AsyncConnection::Transaction(
+    const TransactionCallback& callback) {
+  return Run<bool>(std::bind(&AsyncConnection::DoTransaction, callback,
+                             std::placeholders::_1));
+}
+
+#if defined(SQL_HAS_COROUTINES)
+AsyncConnection::Awaitable<bool> AsyncConnection::AwaitExecute(
+    const std::string& sql) {
+  return Awaitable<bool>(this, std::bind(&AsyncConnection::DoExecute, sql,
+                                         std::placeholders::_1));
+}
+
+AsyncConnection::Awaitable<QueryResult> AsyncConnection::AwaitQuery(
+    const std::string& sql,
+    const Row& params) {
+  return Awaitable<QueryResult>(
+      this, std::bind(&AsyncConnection::DoQuery, sql, params,
+                      std::placeholders::_1));
+}
+
+AsyncConnection::Awaitable<bool> AsyncConnection::AwaitTransaction(
+    const TransactionCallback& callback) {
+  return Awaitable<bool>(this, std::bind(&AsyncConnection::DoTransaction,
+                                         callback, std::placeholders::_1));
+}
+
+// Compiles every member of the awaitables the library hands out, which
+// would otherwise only happen in code that awaits them.
+template class AsyncConnection::Awaitable<bool>;
+template class AsyncConnection::Awaitable<QueryResult>;
+#endif  // SQL_HAS_COROUTINES
+
+void AsyncConnection::Post(const Closure& task) {
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    tasks_.push_back(task);
+  }
+  tasks_available_.notify_one();
+}
+
+void AsyncConnection::Reply(const Closure& reply) {
+  if (reply_runner_)
+    reply_runner_(reply);
+  else
+    reply();
+}
+
+void AsyncConnection::ThreadMain() {
+  bool destroyed = false;
+  destroyed_ = &destroyed;
+  for (;;) {
+    Closure task;
+    {
+      std::unique_lock<std::mutex> lock(lock_);
+      while (tasks_.empty() && !quit_)
+        tasks_available_.wait(lock);
+      // Drain everything that was queued before quitting so that no future
+      // is left without a value.
+      if (tasks_.empty())
+        break;
+      task.swap(tasks_.front());
+      tasks_.pop_front();
+    }
+    task();
+    if (destroyed)
+      return;
+  }
+
+  connection_.Close();
+}
+
+// static
+bool AsyncConnection::DoExecute(const std::string& sql,
+                                Connection* connection) {
+  return connection->Execute(sql);
+}
+
+// static
+QueryResult AsyncConnection::DoQuery(const std::string& sql,
+                                     const Row& params,
+                                     Connection* connection) {
+  QueryResult result;
+
+  Statement statement(connection->GetUniqueStatement(sql));
+  if (!statement)
+    return result;
+  for (size_t i = 0; i < params.size(); ++i)
+    statement.BindValue(static_cast<int>(i), params[i]);
+
+  while (statement.Step()) {
+    result.rows.push_back(Row());
+    statement.ColumnRow(&result.rows.back());
+  }
+  result.succeeded = statement.Succeeded();
+  return result;
+}
+
+// static
+bool AsyncConnection::DoTransaction(const TransactionCallback& callback,
+                                    Connection* connection) {
+  sql::Transaction transaction(connection);
+  if (!transaction.Begin())
+    return false;
+  if (!callback(connection))
+    return false;  // Rolled back by the Transaction destructor.
+  return transaction.Commit();
+}
+
+}  // namespace sql
@@ -0,0 +1,214 @@
+// Copyright (c) 2010 Garrett R. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef SQL_ASYNC_CONNECTION_H_
+#define SQL_ASYNC_CONNECTION_H_
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "basictypes.h"
+#include "connection.h"
+#include "value.h"
+
+#if defined(__has_include)
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#include <coroutine>
+#define SQL_HAS_COROUTINES 1
+#endif
+#endif
+
+namespace sql {
+
+// The result of AsyncConnection::Query when all rows are collected at once.
+struct QueryResult {
+  QueryResult() : succeeded(false) {}
+
+  // True if the statement compiled and ran to completion.
+  bool succeeded;
+  std::vector<Row> rows;
+};
+
+// AsyncConnection owns a Connection that lives on a dedicated worker thread.
+// Every operation is queued to that thread in order, so the caller never
+// blocks on disk I/O or lock waits. Results come back as std::futures, or,
+// when compiled as C++20, as awaitables that can be used with co_await.
+//
+// Callbacks given to the connection (batch callbacks and coroutine
+// resumption) are delivered through the |reply_runner| given to the
+// constructor, which is normally a function that posts the closure to the
+// caller's event loop. Without one they run on the worker thread, and so
+// must not block.
+//
+// The coroutine API is only declared when compiling as C++20, which for
+// the library itself means configuring with -DSQL_BUILD_CXX20=ON.
+//
+// Example:
+//   sql::AsyncConnection db(post_to_loop);
+//   db.Open("/path/to/db");
+//   db.Query("SELECT id, name FROM foo WHERE kind=?", params, 100,
+//            [](std::vector<sql::Row> batch) { ... });
+//
+//   // In a coroutine:
+//   sql::QueryResult result = co_await db.AwaitQuery("SELECT ...");
+//
+// The wrapped Connection must only be touched from closures given to Run(),
+// which execute on the worker thread.
+class AsyncConnection {
+ public:
+  typedef std::function<void()> Closure;
+  typedef std::function<void(const Closure&)> TaskRunner;
+  typedef std::function<void(std::vector<Row> batch)> BatchCallback;
+  typedef std::function<bool(Connection* connection)> TransactionCallback;
+
+  explicit AsyncConnection(const TaskRunner& reply_runner = TaskRunner());
+
+  // Finishes every queued operation, closes the database and joins the
+  // worker. This waits for outstanding I/O, so event loops should call
+  // Close() and let the future resolve before destroying the object.
+  //
+  // A coroutine resumed without a reply runner runs on the worker, and may
+  // destroy the object there. The queued operations then run in the
+  // destructor, and the worker thread is detached instead of joined. That
+  // isn't allowed from a batch callback, whose query is still running.
+  ~AsyncConnection();
+
+  // Initialization ------------------------------------------------------------
+
+  // Opens the database on the worker. See Connection::Open.
+  std::future<bool> Open(const std::string& path);
+  std::future<bool> OpenInMemory();
+
+  // Closes the database on the worker once every earlier operation is done.
+  std::future<bool> Close();
+
+  // Operations ----------------------------------------------------------------
+
+  // Executes |sql| on the worker. See Connection::Execute.
+  std::future<bool> Execute(const std::string& sql);
+
+  // Runs |sql| with |params| bound in order and collects every row.
+  std::future<QueryResult> Query(const std::string& sql,
+                                 const Row& params = Row());
+
+  // Runs |sql| with |params| bound in order and hands rows to |callback|
+  // through the reply runner in batches of at most |batch_size| rows. The
+  // future resolves once the last batch has been handed off, with true if
+  // the statement ran to completion.
+  std::future<bool> Query(const std::string& sql,
+                          const Row& params,
+                          size_t batch_size,
+                          const BatchCallback& callback);
+
+  // Runs |callback| inside a transaction on the worker. The transaction is
+  // committed if the callback returns true and rolled back otherwise.
+  std::future<bool> Transaction(const TransactionCallback& callback);
+
+  // Runs an arbitrary |task| against the connection on the worker. This is
+  // the building block for everything above, and is also the way to do
+  // pre-open configuration such as Connection::set_page_size.
+  template <typename R>
+  std::future<R> Run(const std::function<R(Connection*)>& task) {
+    std::shared_ptr<std::promise<R> > promise(new std::promise<R>);
+    std::future<R> future = promise->get_future();
+    Post([this, promise, task]() {
+      promise->set_value(task(&connection_));
+    });
+    return future;
+  }
+
+#if defined(SQL_HAS_COROUTINES)
+  // An awaitable for a single operation. The operation is queued when the
+  // awaiting coroutine suspends, and the coroutine is resumed through the
+  // reply runner once the result is available.
+  template <typename R>
+  class Awaitable {
+   public:
+    Awaitable(AsyncConnection* owner, const std::function<R(Connection*)>& task)
+        : owner_(owner),
+          task_(task),
+          result_(new R()) {
+    }
+
+    bool await_ready() const { return false; }
+
+    void await_suspend(std::coroutine_handle<> handle) {
+      AsyncConnection* owner = owner_;
+      std::function<R(Connection*)> task = task_;
+      std::shared_ptr<R> result = result_;
+      owner->Post([owner, task, result, handle]() {
+        *result = task(&owner->connection_);
+        owner->Reply([handle]() { handle.resume(); });
+      });
+    }
+
+    R await_resume() { return std::move(*result_); }
+
+   private:
+    AsyncConnection* owner_;
+    std::function<R(Connection*)> task_;
+    std::shared_ptr<R> result_;
+  };
+
+  // Awaitable versions of the operations above.
+  Awaitable<bool> AwaitExecute(const std::string& sql);
+  Awaitable<QueryResult> AwaitQuery(const std::string& sql,
+                                    const Row& params = Row());
+  Awaitable<bool> AwaitTransaction(const TransactionCallback& callback);
+
+  template <typename R>
+  Awaitable<R> AwaitRun(const std::function<R(Connection*)>& task) {
+    return Awaitable<R>(this, task);
+  }
+#endif  // SQL_HAS_COROUTINES
+
+ private:
+  // Queues |task| for the worker thread.
+  void Post(const Closure& task);
+
+  // Delivers |reply| through the reply runner, or runs it directly on the
+  // worker if there is none.
+  void Reply(const Closure& reply);
+
+  // The worker thread's main loop.
+  void ThreadMain();
+
+  // Implementations of the operations, run on the worker.
+  static bool DoExecute(const std::string& sql, Connection* connection);
+  static QueryResult DoQuery(const std::string& sql, const Row& params,
+                             Connection* connection);
+  static bool DoTransaction(const TransactionCallback& callback,
+                            Connection* connection);
+
+  TaskRunner reply_runner_;
+
+  // Only used on the worker thread.
+  Connection connection_;
+
+  // Guards |tasks_| and |quit_|.
+  std::mutex lock_;
+  std::condition_variable tasks_available_;
+  std::deque<Closure> tasks_;
+  bool quit_;
+
+  // Points at a flag in ThreadMain() that the destructor sets when it runs
+  // on the worker. Only used on the worker thread.
+  bool* destroyed_;
+
+  std::thread worker_;
+
+  DISALLOW_COPY_AND_ASSIGN(AsyncConnection);
+};
+
+}  // namespace sql
+
+#endif  // SQL_ASYNC_CONNECTION_H_
@@ -39,4 +39,13 @@
 #error Please add support for your compiler in build_config.h
 #endif
 
+// Processor architecture detection. Unknown architectures get neither.
+#if defined(_M_X64) || defined(__x86_64__)
+#define ARCH_CPU_X86_FAMILY 1
+#define ARCH_CPU_X86_64 1
+#elif defined(_M_IX86) || defined(__i386__)
+#define ARCH_CPU_X86_FAMILY 1
+#define ARCH_CPU_X86 1
+#endif
+
 #endif  // SQL_BUILD_CONFIG_H_
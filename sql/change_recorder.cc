@@ -0,0 +1,343 @@
+// Copyright (c) 2010 Garrett R. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "change_recorder.h"
+
+#include <cstdio>
+
+#include <sqlite3.h>
+
+#include "build_config.h"
+
+#if !defined(OS_WIN)
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace sql {
+
+namespace {
+
+#if defined(SQL_HAVE_SQLITE_SESSION)
+
+int FilterNothing(void* /*context*/, const char* /*table*/) {
+  return 1;
+}
+
+int HandleConflict(void* context, int conflict, sqlite3_changeset_iter* iter) {
+  const ChangeRecorder::ConflictHandler* handler =
+      static_cast<const ChangeRecorder::ConflictHandler*>(context);
+
+  ChangeRecorder::ConflictType type;
+  switch (conflict) {
+    case SQLITE_CHANGESET_DATA:
+      type = ChangeRecorder::CONFLICT_DATA;
+      break;
+    case SQLITE_CHANGESET_NOTFOUND:
+      type = ChangeRecorder::CONFLICT_NOTFOUND;
+      break;
+    case SQLITE_CHANGESET_CONFLICT:
+      type = ChangeRecorder::CONFLICT_CONFLICT;
+      break;
+    case SQLITE_CHANGESET_CONSTRAINT:
+      type = ChangeRecorder::CONFLICT_CONSTRAINT;
+      break;
+    case SQLITE_CHANGESET_FOREIGN_KEY:
+      type = ChangeRecorder::CONFLICT_FOREIGN_KEY;
+      break;
+    default:
+      //NOTREACHED();
+      return SQLITE_CHANGESET_ABORT;
+  }
+
+  const char* table = "";
+  int columns = 0;
+  int op = SQLITE_INSERT;
+  int indirect = 0;
+  if (type != ChangeRecorder::CONFLICT_FOREIGN_KEY)
+    sqlite3changeset_op(iter, &table, &columns, &op, &indirect);
+
+  ChangeObserver::ChangeType change = ChangeObserver::CHANGE_INSERT;
+  if (op == SQLITE_UPDATE)
+    change = ChangeObserver::CHANGE_UPDATE;
+  else if (op == SQLITE_DELETE)
+    change = ChangeObserver::CHANGE_DELETE;
+
+  ChangeRecorder::ConflictAction action;
+  if (handler && *handler) {
+    action = (*handler)(type, change, table);
+  } else if (type == ChangeRecorder::CONFLICT_DATA ||
+             type == ChangeRecorder::CONFLICT_CONFLICT) {
+    action = ChangeRecorder::CONFLICT_REPLACE;
+  } else if (type == ChangeRecorder::CONFLICT_NOTFOUND) {
+    action = ChangeRecorder::CONFLICT_OMIT;
+  } else {
+    action = ChangeRecorder::CONFLICT_ABORT;
+  }
+
+  switch (action) {
+    case ChangeRecorder::CONFLICT_REPLACE:
+      // sqlite treats REPLACE for the other conflict types as misuse.
+      if (type == ChangeRecorder::CONFLICT_DATA ||
+          type == ChangeRecorder::CONFLICT_CONFLICT)
+        return SQLITE_CHANGESET_REPLACE;
+      return SQLITE_CHANGESET_OMIT;
+    case ChangeRecorder::CONFLICT_OMIT:
+      return SQLITE_CHANGESET_OMIT;
+    case ChangeRecorder::CONFLICT_ABORT:
+      break;
+  }
+  return SQLITE_CHANGESET_ABORT;
+}
+
+#endif  // defined(SQL_HAVE_SQLITE_SESSION)
+
+}  // namespace
+
+ChangeRecorder::ChangeRecorder(Connection* db, const char* database)
+    : db_(db),
+      database_(database ? database : "main"),
+      session_(NULL) {
+}
+
+ChangeRecorder::~ChangeRecorder() {
+  Stop();
+}
+
+// static
+bool ChangeRecorder::IsSupported() {
+#if defined(SQL_HAVE_SQLITE_SESSION)
+  return true;
+#else
+  return false;
+#endif
+}
+
+bool ChangeRecorder::AddTable(const char* table) {
+  if (!table || !*table)
+    return false;
+  if (!session_)
+    session_ = CreateSession();
+  if (!session_)
+    return false;
+
+#if defined(SQL_HAVE_SQLITE_SESSION)
+  if (sqlite3session_attach(session_, table) != SQLITE_OK)
+    return false;
+  tables_.push_back(table);
+  return true;
+#else
+  return false;
+#endif
+}
+
+bool ChangeRecorder::AddAllTables() {
+  if (!session_)
+    session_ = CreateSession();
+  if (!session_)
+    return false;
+
+#if defined(SQL_HAVE_SQLITE_SESSION)
+  if (sqlite3session_attach(session_, NULL) != SQLITE_OK)
+    return false;
+  tables_.push_back(std::string());
+  return true;
+#else
+  return false;
+#endif
+}
+
+bool ChangeRecorder::IsEmpty() const {
+#if defined(SQL_HAVE_SQLITE_SESSION)
+  if (session_)
+    return !!sqlite3session_isempty(session_);
+#endif
+  return true;
+}
+
+bool ChangeRecorder::Checkpoint(std::string* changeset) {
+  if (!changeset)
+    return false;
+  changeset->clear();
+
+#if defined(SQL_HAVE_SQLITE_SESSION)
+  if (!session_)
+    return false;
+
+  // A session can't be emptied, so recording goes on in a fresh one. It is
+  // created first so that the old one, and its changes, are kept if that
+  // fails. Nothing can change in between since the connection is only used
+  // from this thread.
+  sqlite3_session* next_session = CreateSession();
+  if (!next_session)
+    return false;
+
+  int size = 0;
+  void* data = NULL;
+  if (sqlite3session_changeset(session_, &size, &data) != SQLITE_OK) {
+    DeleteSession(next_session);
+    return false;
+  }
+  changeset->assign(static_cast<const char*>(data), size);
+  sqlite3_free(data);
+
+  DeleteSession(session_);
+  session_ = next_session;
+  return true;
+#else
+  return false;
+#endif
+}
+
+void ChangeRecorder::Stop() {
+#if defined(SQL_HAVE_SQLITE_SESSION)
+  if (session_)
+    DeleteSession(session_);
+#endif
+  session_ = NULL;
+  tables_.clear();
+}
+
+// static
+bool ChangeRecorder::Concatenate(std::string* first,
+                                 const std::string& second) {
+  if (!first)
+    return false;
+
+#if defined(SQL_HAVE_SQLITE_SESSION)
+  int size = 0;
+  void* data = NULL;
+  // sqlite doesn't modify the inputs, the casts are OK.
+  int err = sqlite3changeset_concat(
+      static_cast<int>(first->size()), const_cast<char*>(first->data()),
+      static_cast<int>(second.size()), const_cast<char*>(second.data()),
+      &size, &data);
+  if (err != SQLITE_OK)
+    return false;
+  first->assign(static_cast<const char*>(data), size);
+  sqlite3_free(data);
+  return true;
+#else
+  return false;
+#endif
+}
+
+// static
+bool ChangeRecorder::WriteToFile(const std::string& path,
+                                 const std::string& changeset) {
+  // Write next to the destination and rename over it, so that a reader never
+  // sees half a changeset.
+  std::string temp_path = path + "-tmp";
+  FILE* file = fopen(temp_path.c_str(), "wb");
+  if (!file)
+    return false;
+
+  bool succeeded =
+      fwrite(changeset.data(), 1, changeset.size(), file) == changeset.size();
+#if !defined(OS_WIN)
+  // The data must be on disk before the rename is, or a crash could leave
+  // |path| naming an empty file.
+  if (fflush(file) != 0 || fsync(fileno(file)) != 0)
+    succeeded = false;
+#endif
+  if (fclose(file) != 0)
+    succeeded = false;
+
+  if (!succeeded || rename(temp_path.c_str(), path.c_str()) != 0) {
+    remove(temp_path.c_str());
+    return false;
+  }
+
+#if !defined(OS_WIN)
+  // And the rename itself is only durable once the directory is synced.
+  std::string::size_type slash = path.rfind('/');
+  std::string directory =
+      slash == std::string::npos ? "." : path.substr(0, slash + 1);
+  int fd = open(directory.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+  succeeded = fsync(fd) == 0;
+  close(fd);
+#endif
+  return succeeded;
+}
+
+// static
+bool ChangeRecorder::ReadFromFile(const std::string& path,
+                                  std::string* changeset) {
+  if (!changeset)
+    return false;
+  changeset->clear();
+
+  FILE* file = fopen(path.c_str(), "rb");
+  if (!file)
+    return false;
+
+  char buffer[4096];
+  size_t read;
+  while ((read = fread(buffer, 1, sizeof(buffer), file)) > 0)
+    changeset->append(buffer, read);
+
+  bool succeeded = !ferror(file);
+  fclose(file);
+  return succeeded;
+}
+
+// static
+bool ChangeRecorder::Apply(Connection* target,
+                           const std::string& changeset,
+                           const ConflictHandler& handler) {
+  if (!target || !target->is_open())
+    return false;
+  if (changeset.empty())
+    return true;
+
+#if defined(SQL_HAVE_SQLITE_SESSION)
+  // sqlite doesn't modify the changeset, the cast is OK.
+  int err = sqlite3changeset_apply(
+      target->db_, static_cast<int>(changeset.size()),
+      const_cast<char*>(changeset.data()), &FilterNothing, &HandleConflict,
+      const_cast<ConflictHandler*>(&handler));
+  return err == SQLITE_OK;
+#else
+  (void)handler;
+  return false;
+#endif
+}
+
+sqlite3_session* ChangeRecorder::CreateSession() {
+#if defined(SQL_HAVE_SQLITE_SESSION)
+  if (!db_ || !db_->is_open())
+    return NULL;
+  sqlite3_session* session = NULL;
+  db_->AddSession();
+  if (sqlite3session_create(db_->db_, database_.c_str(),
+                            &session) != SQLITE_OK) {
+    db_->RemoveSession();
+    return NULL;
+  }
+
+  for (size_t i = 0; i < tables_.size(); ++i) {
+    const char* table = tables_[i].empty() ? NULL : tables_[i].c_str();
+    if (sqlite3session_attach(session, table) != SQLITE_OK) {
+      DeleteSession(session);
+      return NULL;
+    }
+  }
+  return session;
+#else
+  return NULL;
+#endif
+}
+
+void ChangeRecorder::DeleteSession(sqlite3_session* session) {
+#if defined(SQL_HAVE_SQLITE_SESSION)
+  sqlite3session_delete(session);
+  db_->RemoveSession();
+#else
+  (void)session;
+#endif
+}
+
+}  // namespace sql
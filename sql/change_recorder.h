@@ -0,0 +1,157 @@
+// Copyright (c) 2010 Garrett R. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef SQL_CHANGE_RECORDER_H_
+#define SQL_CHANGE_RECORDER_H_
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "basictypes.h"
+#include "connection.h"
+
+struct sqlite3_session;
+
+namespace sql {
+
+// ChangeRecorder records the rows changed on a Connection, using sqlite's
+// session extension, and hands them out as changesets at each checkpoint. A
+// changeset can be saved to a file and later applied to another database,
+// which keeps a replica current at a cost proportional to the amount of
+// change rather than to the size of the database, as BackupTo would be.
+//
+// Normal usage:
+//   sql::ChangeRecorder recorder(&db);
+//   if (!recorder.AddTable("items"))
+//     return false;
+//   ... modify the database through |db| ...
+//   std::string changeset;
+//   if (!recorder.Checkpoint(&changeset) ||
+//       !sql::ChangeRecorder::Apply(&replica, changeset, NULL))
+//     return false;
+//
+// Only tables with a PRIMARY KEY are recorded; changes to other tables are
+// silently ignored by sqlite. Several changes to the same row between two
+// checkpoints are folded into one, and a changeset only holds committed
+// changes if it is taken outside of a transaction.
+//
+// The recorder must be destroyed before its Connection is closed.
+class ChangeRecorder {
+ public:
+  // Why a change could not be applied as recorded.
+  enum ConflictType {
+    // The row exists but its current values aren't those the change expects.
+    CONFLICT_DATA,
+
+    // An update or delete found no row with the recorded primary key.
+    CONFLICT_NOTFOUND,
+
+    // An insert found a row with the same primary key already there.
+    CONFLICT_CONFLICT,
+
+    // Applying the change violated a constraint other than the primary key.
+    CONFLICT_CONSTRAINT,
+
+    // The changeset leaves foreign key constraints unsatisfied. This is only
+    // reported once, after everything else has been applied.
+    CONFLICT_FOREIGN_KEY,
+  };
+
+  // What Apply() does about a conflict.
+  enum ConflictAction {
+    // Skips the change.
+    CONFLICT_OMIT,
+
+    // Overwrites the target row with the recorded one. Only allowed for
+    // CONFLICT_DATA and CONFLICT_CONFLICT, it's treated as CONFLICT_OMIT
+    // otherwise.
+    CONFLICT_REPLACE,
+
+    // Stops and rolls back everything applied so far; Apply() returns false.
+    CONFLICT_ABORT,
+  };
+
+  // Decides what to do when the change of type |change| to |table| conflicts
+  // with the target database.
+  typedef std::function<ConflictAction(ConflictType conflict,
+                                       ChangeObserver::ChangeType change,
+                                       const char* table)> ConflictHandler;
+
+  // Records changes to |database| ("main", "temp" or an attached name) on
+  // |db|. Nothing is recorded until tables are added.
+  explicit ChangeRecorder(Connection* db, const char* database = "main");
+  ~ChangeRecorder();
+
+  // Returns true if the linked sqlite was built with the session extension.
+  // When it isn't, AddTable() and AddAllTables() always fail.
+  static bool IsSupported();
+
+  // Starts recording changes to |table|, which need not exist yet. Returns
+  // false on failure.
+  bool AddTable(const char* table);
+
+  // Starts recording changes to every table, including ones created later.
+  bool AddAllTables();
+
+  // Returns true if changes are being recorded.
+  bool is_recording() const { return !!session_; }
+
+  // Returns true if nothing has been recorded since the last checkpoint.
+  bool IsEmpty() const;
+
+  // Puts the changes recorded since the last checkpoint (or since the first
+  // table was added) in |changeset| and starts recording anew. Returns false
+  // on failure, in which case the recorded changes are kept.
+  bool Checkpoint(std::string* changeset);
+
+  // Stops recording and forgets the changes recorded so far.
+  void Stop();
+
+  // Merges |second| into |first|, as if the changes in both had been recorded
+  // by a single checkpoint. This lets a replica that fell behind catch up by
+  // applying one changeset. Returns false if either is malformed.
+  static bool Concatenate(std::string* first, const std::string& second);
+
+  // Writes |changeset| to the file at |path|, replacing it, and syncs it to
+  // disk. Returns false on failure.
+  static bool WriteToFile(const std::string& path,
+                          const std::string& changeset);
+
+  // Reads back a changeset written by WriteToFile(). Returns false on
+  // failure.
+  static bool ReadFromFile(const std::string& path, std::string* changeset);
+
+  // Applies |changeset| to the "main" database of |target| in a single
+  // transaction, consulting |handler| about each conflict. A NULL handler
+  // makes the target converge on the source: rows that differ are replaced,
+  // missing rows are skipped, and constraint violations abort. Returns false
+  // if the changeset could not be applied, in which case |target| is left
+  // unchanged.
+  static bool Apply(Connection* target,
+                    const std::string& changeset,
+                    const ConflictHandler& handler);
+
+ private:
+  // Returns a new session with the tables in |tables_| attached, or NULL on
+  // failure.
+  sqlite3_session* CreateSession();
+
+  // Deletes a session made by CreateSession().
+  void DeleteSession(sqlite3_session* session);
+
+  Connection* db_;
+  std::string database_;
+
+  // The tables to record, an empty string meaning all of them.
+  std::vector<std::string> tables_;
+
+  sqlite3_session* session_;
+
+  DISALLOW_COPY_AND_ASSIGN(ChangeRecorder);
+};
+
+}  // namespace sql
+
+#endif  // SQL_CHANGE_RECORDER_H_
@@ -0,0 +1,1355 @@
+// Copyright (c) 2010 Garrett R. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "compressed_vfs.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <sqlite3.h>
+
+#if defined(SQL_HAVE_ZLIB)
+#include <zlib.h>
+#endif
+
+#include "connection.h"
+
+namespace sql {
+
+// static
+const char CompressedVfs::kName[] = "sql-compressed";
+
+CompressedVfs::Stats::Stats()
+    : logical_bytes(0),
+      physical_bytes(0),
+      compression_ratio(0),
+      free_bytes(0),
+      pages_compressed(0),
+      pages_stored_raw(0),
+      compress_microseconds(0),
+      decompress_microseconds(0),
+      io_microseconds(0) {
+}
+
+#if defined(SQL_HAVE_ZLIB)
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+// File layout. The file starts with two superblock slots, written
+// alternately so that one of them is always intact. Everything else is
+// allocated in sectors: the stored pages, the map in chunks of
+// kChunkEntries pages, and a directory of the chunks.
+//
+// Superblock:
+//   0  magic
+//   8  generation, incremented by every write of the map
+//   16 logical size of the database
+//   24 page size
+//   28 number of pages in the map
+//   32 directory sector, directory length
+//   40 directory checksum
+//   44 checksum of the bytes above
+//
+// Map entry, per page: sector and stored length. A length of 0 means the
+// page has never been written, a length equal to the page size that it is
+// stored uncompressed.
+//
+// Directory entry, per chunk: sector, length and checksum.
+const char kMagic[8] = { 'S', 'Q', 'L', 'Z', 'V', 'F', 'S', '1' };
+const int64 kSuperblockSize = 512;
+const int kSuperblockBytesUsed = 48;
+const int64 kSectorSize = 256;
+const uint32 kFirstDataSector = 2 * kSuperblockSize / kSectorSize;
+const size_t kEntrySize = 8;
+const size_t kDirectoryEntrySize = 12;
+const size_t kChunkEntries = 4096;
+
+// Used until sqlite's first write tells the page size.
+const int kDefaultPageSize = 4096;
+
+// zlib's fastest level, which still gets most of the gain on typical pages.
+const int kCompressionLevel = 1;
+
+// Space freed by a map write is only reused after the file is synced. With
+// synchronous=OFF sqlite never syncs, so the file is synced anyway once
+// this much has piled up.
+const int64 kMaxUnsyncedFreeSectors = (16 << 20) / kSectorSize;
+
+// The shared memory lock slots sqlite's WAL uses for readers.
+const int kWalFirstReadLock = 3;
+
+// A file control of our own that fills in a CompressedVfs::Stats. Going
+// through sqlite3_file_control() lets it reach the file through other shims
+// stacked on top, which pass on opcodes they don't know.
+const int kStatsFileControl = 0x53514c01;
+
+struct Extent {
+  Extent() : sector(0), length(0) {}
+  Extent(uint32 sector, uint32 length) : sector(sector), length(length) {}
+
+  uint32 sector;
+  uint32 length;
+};
+
+uint32 Get32(const unsigned char* p) {
+  return static_cast<uint32>(p[0]) | static_cast<uint32>(p[1]) << 8 |
+         static_cast<uint32>(p[2]) << 16 | static_cast<uint32>(p[3]) << 24;
+}
+
+uint64 Get64(const unsigned char* p) {
+  return static_cast<uint64>(Get32(p)) |
+         static_cast<uint64>(Get32(p + 4)) << 32;
+}
+
+void Put32(unsigned char* p, uint32 value) {
+  p[0] = static_cast<unsigned char>(value);
+  p[1] = static_cast<unsigned char>(value >> 8);
+  p[2] = static_cast<unsigned char>(value >> 16);
+  p[3] = static_cast<unsigned char>(value >> 24);
+}
+
+void Put64(unsigned char* p, uint64 value) {
+  Put32(p, static_cast<uint32>(value));
+  Put32(p + 4, static_cast<uint32>(value >> 32));
+}
+
+uint32 Checksum(const unsigned char* data, size_t length) {
+  return static_cast<uint32>(
+      crc32(crc32(0, Z_NULL, 0), data, static_cast<uInt>(length)));
+}
+
+uint32 SectorsFor(int64 bytes) {
+  return static_cast<uint32>((bytes + kSectorSize - 1) / kSectorSize);
+}
+
+int64 MicrosecondsSince(Clock::time_point start) {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+      Clock::now() - start).count();
+}
+
+// The free sectors of a file, as runs of consecutive sectors.
+class FreeSpace {
+ public:
+  FreeSpace() : total_(0) {}
+
+  void Clear() {
+    by_start_.clear();
+    by_size_.clear();
+    total_ = 0;
+  }
+
+  // Returns the first of |count| consecutive free sectors, or 0 if there
+  // are none. Taking the lowest run that fits keeps data towards the start
+  // of the file, so that space at the end becomes free and can be trimmed.
+  uint32 Allocate(uint32 count) {
+    if (by_size_.empty() || by_size_.rbegin()->first < count)
+      return 0;
+
+    std::map<uint32, uint32>::iterator fit = by_start_.begin();
+    while (fit->second < count)
+      ++fit;
+    uint32 start = fit->first;
+    uint32 size = fit->second;
+    Remove(start, size);
+    if (size > count)
+      Insert(start + count, size - count);
+    return start;
+  }
+
+  // Frees |count| sectors from |start|, merging them with adjacent runs.
+  void Add(uint32 start, uint32 count) {
+    if (count == 0)
+      return;
+
+    std::map<uint32, uint32>::iterator next = by_start_.lower_bound(start);
+    if (next != by_start_.begin()) {
+      std::map<uint32, uint32>::iterator previous = next;
+      --previous;
+      if (previous->first + previous->second == start) {
+        start = previous->first;
+        count += previous->second;
+        Remove(previous->first, previous->second);
+      }
+    }
+    next = by_start_.find(start + count);
+    if (next != by_start_.end()) {
+      count += next->second;
+      Remove(next->first, next->second);
+    }
+    Insert(start, count);
+  }
+
+  // Removes the run ending at |end| and returns its first sector, or returns
+  // |end| if the sector before |end| is in use.
+  uint32 TrimTail(uint32 end) {
+    std::map<uint32, uint32>::iterator last = by_start_.lower_bound(end);
+    if (last == by_start_.begin())
+      return end;
+    --last;
+    if (last->first + last->second != end)
+      return end;
+
+    uint32 start = last->first;
+    Remove(start, last->second);
+    return start;
+  }
+
+  int64 total() const { return total_; }
+
+ private:
+  void Insert(uint32 start, uint32 count) {
+    by_start_[start] = count;
+    by_size_.insert(std::make_pair(count, start));
+    total_ += count;
+  }
+
+  void Remove(uint32 start, uint32 count) {
+    by_start_.erase(start);
+    by_size_.erase(std::make_pair(count, start));
+    total_ -= count;
+  }
+
+  std::map<uint32, uint32> by_start_;
+  std::set<std::pair<uint32, uint32> > by_size_;
+  int64 total_;
+};
+
+// The state of one database file, shared by every connection in the process
+// that opens it. |lock| guards everything but the counters.
+struct SharedFile {
+  SharedFile()
+      : refs(0),
+        loaded(false),
+        generation(0),
+        logical_size(0),
+        page_size(0),
+        dirty(false),
+        end_sector(kFirstDataSector),
+        unsynced_free_sectors(0),
+        pages_compressed(0),
+        pages_stored_raw(0),
+        compress_microseconds(0),
+        decompress_microseconds(0),
+        io_microseconds(0) {
+  }
+
+  std::mutex lock;
+  std::string path;
+  int refs;
+
+  bool loaded;
+  uint64 generation;
+  int64 logical_size;
+
+  // 0 until the first page is written.
+  int page_size;
+
+  std::vector<Extent> pages;
+
+  // Where each chunk of the map and the directory are stored, and whether a
+  // chunk changed since the map was last written.
+  std::vector<Extent> chunks;
+  std::vector<uint32> chunk_checksums;
+  std::vector<bool> dirty_chunks;
+  Extent directory;
+
+  // True if the map changed since it was last written.
+  bool dirty;
+
+  // One past the last sector in use.
+  uint32 end_sector;
+
+  FreeSpace free_space;
+
+  // Space freed since the map was last written, which the map on disk may
+  // still refer to.
+  std::vector<Extent> pending_free;
+
+  // Space freed by map writes since the last sync. After a power loss the
+  // file may come back with the map from before them, which still refers
+  // to it.
+  std::vector<Extent> unsynced_free;
+  int64 unsynced_free_sectors;
+
+  std::atomic<int64> pages_compressed;
+  std::atomic<int64> pages_stored_raw;
+  std::atomic<int64> compress_microseconds;
+  std::atomic<int64> decompress_microseconds;
+  std::atomic<int64> io_microseconds;
+};
+
+std::mutex g_files_lock;
+
+std::map<std::string, SharedFile*>& Files() {
+  // Leaked on purpose, like sqlite's own list of open files.
+  static std::map<std::string, SharedFile*>* files =
+      new std::map<std::string, SharedFile*>;
+  return *files;
+}
+
+SharedFile* AcquireSharedFile(const std::string& path) {
+  std::lock_guard<std::mutex> lock(g_files_lock);
+  SharedFile*& shared = Files()[path];
+  if (!shared) {
+    shared = new SharedFile;
+    shared->path = path;
+  }
+  ++shared->refs;
+  return shared;
+}
+
+void ReleaseSharedFile(SharedFile* shared) {
+  std::lock_guard<std::mutex> lock(g_files_lock);
+  if (--shared->refs == 0) {
+    Files().erase(shared->path);
+    delete shared;
+  }
+}
+
+// An open database file. sqlite allocates this, followed by the file of the
+// underlying VFS.
+struct CompressedFile {
+  sqlite3_file base;
+  SharedFile* shared;
+
+  // Scratch space for one page and one compressed page.
+  unsigned char* page_buffer;
+  unsigned char* compressed_buffer;
+  size_t buffer_size;
+
+  // zlib streams, reused because setting one up costs more than compressing
+  // a page. Created on first use.
+  z_stream* deflater;
+  z_stream* inflater;
+
+  int lock_level;
+
+  sqlite3_file* real() {
+    return reinterpret_cast<sqlite3_file*>(this + 1);
+  }
+};
+
+CompressedFile* ToCompressedFile(sqlite3_file* file) {
+  return reinterpret_cast<CompressedFile*>(file);
+}
+
+sqlite3_vfs* BaseVfs(sqlite3_vfs* vfs) {
+  return static_cast<sqlite3_vfs*>(vfs->pAppData);
+}
+
+// Makes sure the scratch buffers can hold a page of |page_size| bytes.
+void ReserveBuffers(CompressedFile* file, int page_size) {
+  size_t needed = page_size;
+  if (file->buffer_size >= needed)
+    return;
+
+  delete[] file->page_buffer;
+  delete[] file->compressed_buffer;
+  file->page_buffer = new unsigned char[needed];
+  file->compressed_buffer = new unsigned char[needed];
+  file->buffer_size = needed;
+}
+
+// I/O on the underlying file, timed.
+
+int PhysicalRead(CompressedFile* file, void* buffer, int64 length,
+                 int64 offset) {
+  Clock::time_point start = Clock::now();
+  sqlite3_file* real = file->real();
+  int err = real->pMethods->xRead(real, buffer, static_cast<int>(length),
+                                  offset);
+  file->shared->io_microseconds += MicrosecondsSince(start);
+  return err;
+}
+
+int PhysicalWrite(CompressedFile* file, const void* buffer, int64 length,
+                  int64 offset) {
+  Clock::time_point start = Clock::now();
+  sqlite3_file* real = file->real();
+  int err = real->pMethods->xWrite(real, buffer, static_cast<int>(length),
+                                   offset);
+  file->shared->io_microseconds += MicrosecondsSince(start);
+  return err;
+}
+
+int PhysicalSync(CompressedFile* file, int flags) {
+  Clock::time_point start = Clock::now();
+  sqlite3_file* real = file->real();
+  int err = real->pMethods->xSync(real, flags);
+  file->shared->io_microseconds += MicrosecondsSince(start);
+  return err;
+}
+
+bool IsValidSuperblock(const unsigned char* slot) {
+  return memcmp(slot, kMagic, sizeof(kMagic)) == 0 &&
+         Get32(slot + 44) == Checksum(slot, 44);
+}
+
+// Reads both superblock slots into |slots| and returns the newest valid
+// one, or NULL. If |older| is not NULL it is pointed at the other slot if
+// that is valid too, or set to NULL.
+const unsigned char* ReadSuperblock(CompressedFile* file,
+                                    unsigned char* slots,
+                                    const unsigned char** older) {
+  if (older)
+    *older = NULL;
+
+  // The second slot is missing until the map has been written twice, which
+  // reads as zeros.
+  int err = PhysicalRead(file, slots, 2 * kSuperblockSize, 0);
+  if (err != SQLITE_OK && err != SQLITE_IOERR_SHORT_READ)
+    return NULL;
+
+  const unsigned char* first = slots;
+  const unsigned char* second = slots + kSuperblockSize;
+  if (!IsValidSuperblock(second))
+    return IsValidSuperblock(first) ? first : NULL;
+  if (!IsValidSuperblock(first))
+    return second;
+  if (Get64(second + 8) > Get64(first + 8))
+    std::swap(first, second);
+  if (older)
+    *older = second;
+  return first;
+}
+
+// Marks the chunk of the map holding |page| as changed.
+void MarkPageDirty(SharedFile* shared, size_t page) {
+  size_t chunk = page / kChunkEntries;
+  if (chunk >= shared->dirty_chunks.size())
+    shared->dirty_chunks.resize(chunk + 1, true);
+  shared->dirty_chunks[chunk] = true;
+  shared->dirty = true;
+}
+
+// Returns the first of |count| sectors to store something in, reusing free
+// space if possible.
+uint32 AllocateSectors(SharedFile* shared, uint32 count) {
+  uint32 sector = shared->free_space.Allocate(count);
+  if (sector)
+    return sector;
+  sector = shared->end_sector;
+  shared->end_sector += count;
+  return sector;
+}
+
+void FreeExtent(SharedFile* shared, const Extent& extent) {
+  if (extent.length)
+    shared->pending_free.push_back(extent);
+}
+
+// Clears the map, before loading it. The caller holds |shared->lock|.
+void ResetMap(SharedFile* shared) {
+  shared->loaded = false;
+  shared->generation = 0;
+  shared->logical_size = 0;
+  shared->page_size = 0;
+  shared->pages.clear();
+  shared->chunks.clear();
+  shared->chunk_checksums.clear();
+  shared->dirty_chunks.clear();
+  shared->directory = Extent();
+  shared->dirty = false;
+  shared->end_sector = kFirstDataSector;
+  shared->free_space.Clear();
+  shared->pending_free.clear();
+  shared->unsynced_free.clear();
+  shared->unsynced_free_sectors = 0;
+}
+
+// Loads the map |superblock| points to from a file of |physical_size|
+// bytes. The caller holds |shared->lock|.
+int LoadMap(CompressedFile* file, const unsigned char* superblock,
+            int64 physical_size) {
+  SharedFile* shared = file->shared;
+  ResetMap(shared);
+
+  int err;
+  uint64 generation = Get64(superblock + 8);
+  int64 logical_size = static_cast<int64>(Get64(superblock + 16));
+  int page_size = static_cast<int>(Get32(superblock + 24));
+  uint32 page_count = Get32(superblock + 28);
+  Extent directory(Get32(superblock + 32), Get32(superblock + 36));
+  uint32 directory_checksum = Get32(superblock + 40);
+
+  uint32 physical_sectors = SectorsFor(physical_size);
+  size_t chunk_count = (page_count + kChunkEntries - 1) / kChunkEntries;
+  if (directory.length != chunk_count * kDirectoryEntrySize ||
+      (directory.length &&
+       directory.sector + SectorsFor(directory.length) > physical_sectors))
+    return SQLITE_CORRUPT;
+
+  std::vector<unsigned char> buffer(directory.length);
+  if (directory.length) {
+    err = PhysicalRead(file, &buffer[0], directory.length,
+                       directory.sector * kSectorSize);
+    if (err != SQLITE_OK)
+      return err;
+    if (Checksum(&buffer[0], directory.length) != directory_checksum)
+      return SQLITE_CORRUPT;
+  }
+
+  std::vector<Extent> used;
+  used.push_back(directory);
+  shared->pages.resize(page_count);
+  shared->chunks.resize(chunk_count);
+  shared->chunk_checksums.resize(chunk_count);
+  shared->dirty_chunks.resize(chunk_count, false);
+  std::vector<unsigned char> chunk_buffer(kChunkEntries * kEntrySize);
+  for (size_t i = 0; i < chunk_count; ++i) {
+    const unsigned char* entry = &buffer[i * kDirectoryEntrySize];
+    Extent chunk(Get32(entry), Get32(entry + 4));
+    uint32 checksum = Get32(entry + 8);
+    size_t first = i * kChunkEntries;
+    size_t entries = std::min(kChunkEntries, page_count - first);
+    if (chunk.length != entries * kEntrySize ||
+        chunk.sector + SectorsFor(chunk.length) > physical_sectors)
+      return SQLITE_CORRUPT;
+
+    err = PhysicalRead(file, &chunk_buffer[0], chunk.length,
+                       chunk.sector * kSectorSize);
+    if (err != SQLITE_OK)
+      return err;
+    if (Checksum(&chunk_buffer[0], chunk.length) != checksum)
+      return SQLITE_CORRUPT;
+
+    for (size_t j = 0; j < entries; ++j) {
+      const unsigned char* page = &chunk_buffer[j * kEntrySize];
+      Extent extent(Get32(page), Get32(page + 4));
+      if (extent.length &&
+          extent.sector + SectorsFor(extent.length) > physical_sectors)
+        return SQLITE_CORRUPT;
+      shared->pages[first + j] = extent;
+      used.push_back(extent);
+    }
+    shared->chunks[i] = chunk;
+    shared->chunk_checksums[i] = checksum;
+    used.push_back(chunk);
+  }
+
+  // Everything between the extents in use is free, including any garbage
+  // past the last of them.
+  std::sort(used.begin(), used.end(),
+            [](const Extent& a, const Extent& b) {
+              return a.sector < b.sector;
+            });
+  uint32 next = kFirstDataSector;
+  for (size_t i = 0; i < used.size(); ++i) {
+    if (!used[i].length)
+      continue;
+    if (used[i].sector > next)
+      shared->free_space.Add(next, used[i].sector - next);
+    next = std::max(next, used[i].sector + SectorsFor(used[i].length));
+  }
+  if (physical_sectors > next)
+    shared->free_space.Add(next, physical_sectors - next);
+  shared->end_sector = std::max(next, physical_sectors);
+
+  shared->generation = generation;
+  shared->logical_size = logical_size;
+  shared->page_size = page_size;
+  shared->directory = directory;
+  shared->loaded = true;
+  return SQLITE_OK;
+}
+
+// Loads the map from the file. The caller holds |shared->lock|.
+int Load(CompressedFile* file) {
+  SharedFile* shared = file->shared;
+  ResetMap(shared);
+
+  sqlite3_int64 physical_size = 0;
+  int err = file->real()->pMethods->xFileSize(file->real(), &physical_size);
+  if (err != SQLITE_OK)
+    return err;
+  if (physical_size == 0) {
+    shared->loaded = true;
+    return SQLITE_OK;
+  }
+
+  unsigned char slots[2 * kSuperblockSize];
+  const unsigned char* older = NULL;
+  const unsigned char* superblock = ReadSuperblock(file, slots, &older);
+  if (!superblock)
+    return SQLITE_NOTADB;
+
+  // A power loss can leave the newest superblock on disk without the map it
+  // points to. The older one then still describes the last synced state.
+  err = LoadMap(file, superblock, physical_size);
+  if (err == SQLITE_CORRUPT && older)
+    err = LoadMap(file, older, physical_size);
+  return err;
+}
+
+// Loads the map if it hasn't been yet. The caller holds |shared->lock|.
+int EnsureLoaded(CompressedFile* file) {
+  return file->shared->loaded ? SQLITE_OK : Load(file);
+}
+
+// Reloads the map if another process changed it. Called when a transaction
+// starts, when the map on disk can't be in the middle of changing.
+int Refresh(CompressedFile* file) {
+  SharedFile* shared = file->shared;
+  std::lock_guard<std::mutex> lock(shared->lock);
+  if (!shared->loaded)
+    return Load(file);
+  if (shared->dirty)
+    return SQLITE_OK;
+
+  sqlite3_int64 physical_size = 0;
+  int err = file->real()->pMethods->xFileSize(file->real(), &physical_size);
+  if (err != SQLITE_OK)
+    return err;
+  if (physical_size == 0)
+    return shared->generation == 0 ? SQLITE_OK : Load(file);
+
+  unsigned char slots[2 * kSuperblockSize];
+  const unsigned char* superblock = ReadSuperblock(file, slots, NULL);
+  if (superblock && Get64(superblock + 8) == shared->generation)
+    return SQLITE_OK;
+  return Load(file);
+}
+
+// Makes the space freed since the last sync available again, after the
+// file was synced with the current map. The caller holds |shared->lock|.
+void ReleaseFreedSpace(SharedFile* shared) {
+  for (size_t i = 0; i < shared->unsynced_free.size(); ++i) {
+    const Extent& extent = shared->unsynced_free[i];
+    shared->free_space.Add(extent.sector, SectorsFor(extent.length));
+  }
+  shared->unsynced_free.clear();
+  shared->unsynced_free_sectors = 0;
+}
+
+// Syncs the file, after which the current map is the one that survives a
+// power loss. The caller holds |shared->lock|.
+int SyncMap(CompressedFile* file, int sync_flags) {
+  int err = PhysicalSync(file, sync_flags);
+  if (err == SQLITE_OK)
+    ReleaseFreedSpace(file->shared);
+  return err;
+}
+
+// Writes the changed parts of the map and a new superblock. If
+// |sync_flags| is not 0 the file is synced before and after the
+// superblock, so the new map only becomes current once everything it
+// refers to is on disk.
+int Flush(CompressedFile* file, int sync_flags) {
+  SharedFile* shared = file->shared;
+  std::lock_guard<std::mutex> lock(shared->lock);
+  if (!shared->dirty)
+    return sync_flags ? SyncMap(file, sync_flags) : SQLITE_OK;
+
+  size_t page_count = shared->pages.size();
+  size_t chunk_count = (page_count + kChunkEntries - 1) / kChunkEntries;
+  for (size_t i = chunk_count; i < shared->chunks.size(); ++i)
+    FreeExtent(shared, shared->chunks[i]);
+  shared->chunks.resize(chunk_count);
+  shared->chunk_checksums.resize(chunk_count);
+  shared->dirty_chunks.resize(chunk_count, true);
+
+  int err = SQLITE_OK;
+  std::vector<unsigned char> buffer(kChunkEntries * kEntrySize);
+  for (size_t i = 0; i < chunk_count; ++i) {
+    if (!shared->dirty_chunks[i])
+      continue;
+
+    size_t first = i * kChunkEntries;
+    size_t entries = std::min(kChunkEntries, page_count - first);
+    for (size_t j = 0; j < entries; ++j) {
+      const Extent& page = shared->pages[first + j];
+      Put32(&buffer[j * kEntrySize], page.sector);
+      Put32(&buffer[j * kEntrySize + 4], page.length);
+    }
+
+    Extent chunk(0, static_cast<uint32>(entries * kEntrySize));
+    chunk.sector = AllocateSectors(shared, SectorsFor(chunk.length));
+    err = PhysicalWrite(file, &buffer[0], chunk.length,
+                        chunk.sector * kSectorSize);
+    if (err != SQLITE_OK)
+      return err;
+    FreeExtent(shared, shared->chunks[i]);
+    shared->chunks[i] = chunk;
+    shared->chunk_checksums[i] = Checksum(&buffer[0], chunk.length);
+    shared->dirty_chunks[i] = false;
+  }
+
+  std::vector<unsigned char> directory_buffer(
+      chunk_count * kDirectoryEntrySize);
+  for (size_t i = 0; i < chunk_count; ++i) {
+    unsigned char* entry = &directory_buffer[i * kDirectoryEntrySize];
+    Put32(entry, shared->chunks[i].sector);
+    Put32(entry + 4, shared->chunks[i].length);
+    Put32(entry + 8, shared->chunk_checksums[i]);
+  }
+  Extent directory(0, static_cast<uint32>(directory_buffer.size()));
+  uint32 directory_checksum = 0;
+  if (directory.length) {
+    directory.sector = AllocateSectors(shared, SectorsFor(directory.length));
+    err = PhysicalWrite(file, &directory_buffer[0], directory.length,
+                        directory.sector * kSectorSize);
+    if (err != SQLITE_OK)
+      return err;
+    directory_checksum = Checksum(&directory_buffer[0], directory.length);
+  }
+  FreeExtent(shared, shared->directory);
+  shared->directory = directory;
+
+  if (sync_flags && (err = PhysicalSync(file, sync_flags)) != SQLITE_OK)
+    return err;
+
+  unsigned char superblock[kSuperblockSize];
+  memset(superblock, 0, sizeof(superblock));
+  uint64 generation = shared->generation + 1;
+  memcpy(superblock, kMagic, sizeof(kMagic));
+  Put64(superblock + 8, generation);
+  Put64(superblock + 16, static_cast<uint64>(shared->logical_size));
+  Put32(superblock + 24, static_cast<uint32>(shared->page_size));
+  Put32(superblock + 28, static_cast<uint32>(page_count));
+  Put32(superblock + 32, directory.sector);
+  Put32(superblock + 36, directory.length);
+  Put32(superblock + 40, directory_checksum);
+  Put32(superblock + 44, Checksum(superblock, 44));
+  err = PhysicalWrite(file, superblock, kSuperblockBytesUsed,
+                      (generation % 2) * kSuperblockSize);
+  if (err != SQLITE_OK)
+    return err;
+  shared->generation = generation;
+  shared->dirty = false;
+
+  // The new map no longer refers to the space freed so far, but until the
+  // file is synced the old one may be what's on disk after a power loss.
+  for (size_t i = 0; i < shared->pending_free.size(); ++i) {
+    const Extent& extent = shared->pending_free[i];
+    shared->unsynced_free.push_back(extent);
+    shared->unsynced_free_sectors += SectorsFor(extent.length);
+  }
+  shared->pending_free.clear();
+  if (sync_flags ||
+      shared->unsynced_free_sectors > kMaxUnsyncedFreeSectors) {
+    err = SyncMap(file, sync_flags ? sync_flags : SQLITE_SYNC_NORMAL);
+    if (err != SQLITE_OK)
+      return err;
+  }
+
+  uint32 end = shared->free_space.TrimTail(shared->end_sector);
+  if (end < shared->end_sector) {
+    shared->end_sector = end;
+    sqlite3_file* real = file->real();
+    Clock::time_point start = Clock::now();
+    err = real->pMethods->xTruncate(real, end * kSectorSize);
+    shared->io_microseconds += MicrosecondsSince(start);
+  }
+  return err;
+}
+
+// Compresses |page| into the file's buffer. Returns the compressed length,
+// or 0 if the page doesn't get smaller.
+uint32 Compress(CompressedFile* file, const unsigned char* page,
+                int page_size) {
+  z_stream* stream = file->deflater;
+  if (!stream) {
+    stream = new z_stream;
+    memset(stream, 0, sizeof(*stream));
+    // Raw deflate: the map already has the length and a checksum would
+    // only be checked by zlib.
+    if (deflateInit2(stream, kCompressionLevel, Z_DEFLATED, -MAX_WBITS, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK) {
+      delete stream;
+      return 0;
+    }
+    file->deflater = stream;
+  } else {
+    deflateReset(stream);
+  }
+
+  stream->next_in = const_cast<Bytef*>(page);
+  stream->avail_in = page_size;
+  stream->next_out = file->compressed_buffer;
+  stream->avail_out = page_size - 1;
+  if (deflate(stream, Z_FINISH) != Z_STREAM_END)
+    return 0;
+  return static_cast<uint32>(stream->total_out);
+}
+
+// Decompresses |length| bytes from the file's buffer into |page|. Returns
+// false if they don't make up a page of |page_size| bytes.
+bool Decompress(CompressedFile* file, uint32 length, unsigned char* page,
+                int page_size) {
+  z_stream* stream = file->inflater;
+  if (!stream) {
+    stream = new z_stream;
+    memset(stream, 0, sizeof(*stream));
+    if (inflateInit2(stream, -MAX_WBITS) != Z_OK) {
+      delete stream;
+      return false;
+    }
+    file->inflater = stream;
+  } else {
+    inflateReset(stream);
+  }
+
+  stream->next_in = file->compressed_buffer;
+  stream->avail_in = length;
+  stream->next_out = page;
+  stream->avail_out = page_size;
+  return inflate(stream, Z_FINISH) == Z_STREAM_END &&
+         stream->total_out == static_cast<uLong>(page_size);
+}
+
+// Reads page |index| into |page|, which holds |page_size| bytes.
+int ReadPage(CompressedFile* file, size_t index, int page_size,
+             unsigned char* page) {
+  SharedFile* shared = file->shared;
+  Extent extent;
+  {
+    std::lock_guard<std::mutex> lock(shared->lock);
+    if (index < shared->pages.size())
+      extent = shared->pages[index];
+  }
+
+  if (!extent.length) {
+    memset(page, 0, page_size);
+    return SQLITE_OK;
+  }
+  if (extent.length == static_cast<uint32>(page_size))
+    return PhysicalRead(file, page, page_size, extent.sector * kSectorSize);
+
+  int err = PhysicalRead(file, file->compressed_buffer, extent.length,
+                         extent.sector * kSectorSize);
+  if (err != SQLITE_OK)
+    return err;
+
+  Clock::time_point start = Clock::now();
+  bool success = Decompress(file, extent.length, page, page_size);
+  shared->decompress_microseconds += MicrosecondsSince(start);
+  return success ? SQLITE_OK : SQLITE_CORRUPT;
+}
+
+// Compresses and stores |page| as page |index|.
+int WritePage(CompressedFile* file, size_t index, int page_size,
+              const unsigned char* page) {
+  SharedFile* shared = file->shared;
+
+  Clock::time_point start = Clock::now();
+  uint32 length = Compress(file, page, page_size);
+  shared->compress_microseconds += MicrosecondsSince(start);
+
+  const unsigned char* data = file->compressed_buffer;
+  if (!length) {
+    data = page;
+    length = page_size;
+    ++shared->pages_stored_raw;
+  } else {
+    ++shared->pages_compressed;
+  }
+
+  Extent extent(0, length);
+  {
+    std::lock_guard<std::mutex> lock(shared->lock);
+    extent.sector = AllocateSectors(shared, SectorsFor(length));
+    if (index >= shared->pages.size())
+      shared->pages.resize(index + 1);
+    FreeExtent(shared, shared->pages[index]);
+    shared->pages[index] = extent;
+    MarkPageDirty(shared, index);
+  }
+  return PhysicalWrite(file, data, length, extent.sector * kSectorSize);
+}
+
+// sqlite3_io_methods --------------------------------------------------------
+
+int CompressedClose(sqlite3_file* base) {
+  CompressedFile* file = ToCompressedFile(base);
+  int err = SQLITE_OK;
+  if (file->shared) {
+    err = Flush(file, 0);
+    ReleaseSharedFile(file->shared);
+    file->shared = NULL;
+  }
+  delete[] file->page_buffer;
+  delete[] file->compressed_buffer;
+  if (file->deflater) {
+    deflateEnd(file->deflater);
+    delete file->deflater;
+  }
+  if (file->inflater) {
+    inflateEnd(file->inflater);
+    delete file->inflater;
+  }
+  int close_err = file->real()->pMethods->xClose(file->real());
+  return err != SQLITE_OK ? err : close_err;
+}
+
+int CompressedRead(sqlite3_file* base, void* buffer, int amount,
+                   sqlite3_int64 offset) {
+  CompressedFile* file = ToCompressedFile(base);
+  SharedFile* shared = file->shared;
+  unsigned char* out = static_cast<unsigned char*>(buffer);
+
+  int page_size;
+  int64 logical_size;
+  {
+    std::lock_guard<std::mutex> lock(shared->lock);
+    int err = EnsureLoaded(file);
+    if (err != SQLITE_OK)
+      return err;
+    page_size = shared->page_size;
+    logical_size = shared->logical_size;
+  }
+
+  int64 end = offset + amount;
+  int64 available = std::min(end, logical_size);
+  if (page_size == 0 || available <= offset) {
+    memset(out, 0, amount);
+    return SQLITE_IOERR_SHORT_READ;
+  }
+  ReserveBuffers(file, page_size);
+
+  // sqlite reads whole pages, except for the header of page 1.
+  for (int64 position = offset; position < available; ) {
+    size_t index = static_cast<size_t>(position / page_size);
+    int64 page_start = static_cast<int64>(index) * page_size;
+    int64 piece_end = std::min(available, page_start + page_size);
+    unsigned char* destination = out + (position - offset);
+    int err;
+    if (position == page_start && piece_end == page_start + page_size) {
+      err = ReadPage(file, index, page_size, destination);
+    } else {
+      err = ReadPage(file, index, page_size, file->page_buffer);
+      memcpy(destination, file->page_buffer + (position - page_start),
+             piece_end - position);
+    }
+    if (err != SQLITE_OK)
+      return err;
+    position = piece_end;
+  }
+
+  if (available < end) {
+    memset(out + (available - offset), 0, end - available);
+    return SQLITE_IOERR_SHORT_READ;
+  }
+  return SQLITE_OK;
+}
+
+int CompressedWrite(sqlite3_file* base, const void* buffer, int amount,
+                    sqlite3_int64 offset) {
+  CompressedFile* file = ToCompressedFile(base);
+  SharedFile* shared = file->shared;
+  const unsigned char* in = static_cast<const unsigned char*>(buffer);
+
+  int page_size;
+  {
+    std::lock_guard<std::mutex> lock(shared->lock);
+    int err = EnsureLoaded(file);
+    if (err != SQLITE_OK)
+      return err;
+    if (shared->page_size == 0) {
+      // The first write is page 1, and tells the page size.
+      bool valid = amount >= 512 && amount <= 65536 &&
+                   (amount & (amount - 1)) == 0 && offset % amount == 0;
+      shared->page_size = valid ? amount : kDefaultPageSize;
+    }
+    page_size = shared->page_size;
+  }
+  ReserveBuffers(file, page_size);
+
+  // Writes that don't match the stored page size, after changing it with
+  // VACUUM for example, are split up or merged into the stored pages.
+  int64 end = offset + amount;
+  for (int64 position = offset; position < end; ) {
+    size_t index = static_cast<size_t>(position / page_size);
+    int64 page_start = static_cast<int64>(index) * page_size;
+    int64 piece_end = std::min(end, page_start + page_size);
+    const unsigned char* page = in + (position - offset);
+    if (position != page_start || piece_end != page_start + page_size) {
+      int err = ReadPage(file, index, page_size, file->page_buffer);
+      if (err != SQLITE_OK)
+        return err;
+      memcpy(file->page_buffer + (position - page_start), page,
+             piece_end - position);
+      page = file->page_buffer;
+    }
+    int err = WritePage(file, index, page_size, page);
+    if (err != SQLITE_OK)
+      return err;
+    position = piece_end;
+  }
+
+  std::lock_guard<std::mutex> lock(shared->lock);
+  if (end > shared->logical_size) {
+    shared->logical_size = end;
+    shared->dirty = true;
+  }
+  return SQLITE_OK;
+}
+
+int CompressedTruncate(sqlite3_file* base, sqlite3_int64 size) {
+  CompressedFile* file = ToCompressedFile(base);
+  SharedFile* shared = file->shared;
+  std::lock_guard<std::mutex> lock(shared->lock);
+  int err = EnsureLoaded(file);
+  if (err != SQLITE_OK)
+    return err;
+
+  if (shared->page_size) {
+    size_t keep = static_cast<size_t>(
+        (size + shared->page_size - 1) / shared->page_size);
+    for (size_t i = keep; i < shared->pages.size(); ++i)
+      FreeExtent(shared, shared->pages[i]);
+    if (keep < shared->pages.size()) {
+      shared->pages.resize(keep);
+      if (keep)
+        MarkPageDirty(shared, keep - 1);
+    }
+  }
+  shared->logical_size = size;
+  shared->dirty = true;
+  return SQLITE_OK;
+}
+
+int CompressedSync(sqlite3_file* base, int flags) {
+  return Flush(ToCompressedFile(base), flags);
+}
+
+int CompressedFileSize(sqlite3_file* base, sqlite3_int64* size) {
+  CompressedFile* file = ToCompressedFile(base);
+  std::lock_guard<std::mutex> lock(file->shared->lock);
+  int err = EnsureLoaded(file);
+  if (err != SQLITE_OK)
+    return err;
+  *size = file->shared->logical_size;
+  return SQLITE_OK;
+}
+
+int CompressedLock(sqlite3_file* base, int level) {
+  CompressedFile* file = ToCompressedFile(base);
+  sqlite3_file* real = file->real();
+  int err = real->pMethods->xLock(real, level);
+  if (err != SQLITE_OK)
+    return err;
+
+  int previous = file->lock_level;
+  file->lock_level = level;
+  if (previous == SQLITE_LOCK_NONE && level == SQLITE_LOCK_SHARED)
+    return Refresh(file);
+  return SQLITE_OK;
+}
+
+int CompressedUnlock(sqlite3_file* base, int level) {
+  CompressedFile* file = ToCompressedFile(base);
+  sqlite3_file* real = file->real();
+
+  // Other processes must see the new map before they can lock the file.
+  if (file->lock_level >= SQLITE_LOCK_RESERVED &&
+      level < SQLITE_LOCK_RESERVED) {
+    int err = Flush(file, 0);
+    if (err != SQLITE_OK)
+      return err;
+  }
+  file->lock_level = level;
+  return real->pMethods->xUnlock(real, level);
+}
+
+int CompressedCheckReservedLock(sqlite3_file* base, int* reserved) {
+  sqlite3_file* real = ToCompressedFile(base)->real();
+  return real->pMethods->xCheckReservedLock(real, reserved);
+}
+
+void FillStats(SharedFile* shared, CompressedVfs::Stats* stats) {
+  std::lock_guard<std::mutex> lock(shared->lock);
+  stats->logical_bytes = shared->logical_size;
+  stats->physical_bytes =
+      shared->generation || shared->dirty ?
+          static_cast<int64>(shared->end_sector) * kSectorSize : 0;
+  stats->compression_ratio = stats->physical_bytes ?
+      static_cast<double>(stats->logical_bytes) / stats->physical_bytes : 0;
+  stats->free_bytes = shared->free_space.total() * kSectorSize;
+  stats->pages_compressed = shared->pages_compressed;
+  stats->pages_stored_raw = shared->pages_stored_raw;
+  stats->compress_microseconds = shared->compress_microseconds;
+  stats->decompress_microseconds = shared->decompress_microseconds;
+  stats->io_microseconds = shared->io_microseconds;
+}
+
+int CompressedFileControl(sqlite3_file* base, int op, void* arg) {
+  CompressedFile* file = ToCompressedFile(base);
+  switch (op) {
+    case SQLITE_FCNTL_SIZE_HINT:
+    case SQLITE_FCNTL_CHUNK_SIZE:
+      // The physical size has nothing to do with the logical one.
+      return SQLITE_OK;
+    case SQLITE_FCNTL_MMAP_SIZE:
+      // Mapped pages would be the compressed bytes.
+      *static_cast<sqlite3_int64*>(arg) = 0;
+      return SQLITE_OK;
+    case kStatsFileControl:
+      FillStats(file->shared,
+                static_cast<CompressedVfs::Stats*>(arg));
+      return SQLITE_OK;
+    case SQLITE_FCNTL_CKPT_DONE: {
+      // WAL checkpoints write the database without locking the file. sqlite
+      // only syncs after this, so the map is synced here before the
+      // superblock that points to it is written.
+      int err = Flush(file, SQLITE_SYNC_NORMAL);
+      if (err != SQLITE_OK)
+        return err;
+      break;
+    }
+  }
+  sqlite3_file* real = file->real();
+  return real->pMethods->xFileControl(real, op, arg);
+}
+
+int CompressedSectorSize(sqlite3_file* base) {
+  sqlite3_file* real = ToCompressedFile(base)->real();
+  return real->pMethods->xSectorSize(real);
+}
+
+int CompressedDeviceCharacteristics(sqlite3_file* base) {
+  sqlite3_file* real = ToCompressedFile(base)->real();
+  // A page write is several writes of the underlying file.
+  const int kAtomicWrites =
+      SQLITE_IOCAP_ATOMIC | SQLITE_IOCAP_ATOMIC512 | SQLITE_IOCAP_ATOMIC1K |
+      SQLITE_IOCAP_ATOMIC2K | SQLITE_IOCAP_ATOMIC4K | SQLITE_IOCAP_ATOMIC8K |
+      SQLITE_IOCAP_ATOMIC16K | SQLITE_IOCAP_ATOMIC32K |
+      SQLITE_IOCAP_ATOMIC64K | SQLITE_IOCAP_BATCH_ATOMIC;
+  return real->pMethods->xDeviceCharacteristics(real) & ~kAtomicWrites;
+}
+
+int CompressedShmMap(sqlite3_file* base, int region, int size, int extend,
+                     void volatile** memory) {
+  sqlite3_file* real = ToCompressedFile(base)->real();
+  if (real->pMethods->iVersion < 2)
+    return SQLITE_IOERR_SHMMAP;
+  return real->pMethods->xShmMap(real, region, size, extend, memory);
+}
+
+int CompressedShmLock(sqlite3_file* base, int offset, int count, int flags) {
+  CompressedFile* file = ToCompressedFile(base);
+  sqlite3_file* real = file->real();
+  int err = real->pMethods->xShmLock(real, offset, count, flags);
+  if (err != SQLITE_OK)
+    return err;
+
+  // Taking a read lock starts a WAL read transaction.
+  if ((flags & SQLITE_SHM_LOCK) && (flags & SQLITE_SHM_SHARED) &&
+      offset >= kWalFirstReadLock)
+    return Refresh(file);
+  return SQLITE_OK;
+}
+
+void CompressedShmBarrier(sqlite3_file* base) {
+  sqlite3_file* real = ToCompressedFile(base)->real();
+  real->pMethods->xShmBarrier(real);
+}
+
+int CompressedShmUnmap(sqlite3_file* base, int delete_flag) {
+  sqlite3_file* real = ToCompressedFile(base)->real();
+  return real->pMethods->xShmUnmap(real, delete_flag);
+}
+
+// Version 2: pages can't be memory mapped.
+const sqlite3_io_methods kIoMethods = {
+  2,
+  &CompressedClose,
+  &CompressedRead,
+  &CompressedWrite,
+  &CompressedTruncate,
+  &CompressedSync,
+  &CompressedFileSize,
+  &CompressedLock,
+  &CompressedUnlock,
+  &CompressedCheckReservedLock,
+  &CompressedFileControl,
+  &CompressedSectorSize,
+  &CompressedDeviceCharacteristics,
+  &CompressedShmMap,
+  &CompressedShmLock,
+  &CompressedShmBarrier,
+  &CompressedShmUnmap,
+  NULL,
+  NULL,
+};
+
+// sqlite3_vfs ---------------------------------------------------------------
+
+int VfsOpen(sqlite3_vfs* vfs, const char* name, sqlite3_file* base,
+            int flags, int* out_flags) {
+  sqlite3_vfs* base_vfs = BaseVfs(vfs);
+
+  // Journals, WAL and temporary files are opened as they are, in place.
+  if (!name || !(flags & SQLITE_OPEN_MAIN_DB))
+    return base_vfs->xOpen(base_vfs, name, base, flags, out_flags);
+
+  CompressedFile* file = ToCompressedFile(base);
+  memset(file, 0, sizeof(*file));
+  int err = base_vfs->xOpen(base_vfs, name, file->real(), flags, out_flags);
+  if (err != SQLITE_OK) {
+    if (file->real()->pMethods)
+      file->real()->pMethods->xClose(file->real());
+    return err;
+  }
+
+  file->shared = AcquireSharedFile(name);
+  {
+    std::lock_guard<std::mutex> lock(file->shared->lock);
+    err = EnsureLoaded(file);
+  }
+  if (err != SQLITE_OK) {
+    ReleaseSharedFile(file->shared);
+    file->real()->pMethods->xClose(file->real());
+    return err;
+  }
+  file->base.pMethods = &kIoMethods;
+  return SQLITE_OK;
+}
+
+int VfsDelete(sqlite3_vfs* vfs, const char* name, int sync_dir) {
+  sqlite3_vfs* base_vfs = BaseVfs(vfs);
+  return base_vfs->xDelete(base_vfs, name, sync_dir);
+}
+
+int VfsAccess(sqlite3_vfs* vfs, const char* name, int flags, int* result) {
+  sqlite3_vfs* base_vfs = BaseVfs(vfs);
+  return base_vfs->xAccess(base_vfs, name, flags, result);
+}
+
+int VfsFullPathname(sqlite3_vfs* vfs, const char* name, int size,
+                    char* out) {
+  sqlite3_vfs* base_vfs = BaseVfs(vfs);
+  return base_vfs->xFullPathname(base_vfs, name, size, out);
+}
+
+void* VfsDlOpen(sqlite3_vfs* vfs, const char* name) {
+  sqlite3_vfs* base_vfs = BaseVfs(vfs);
+  return base_vfs->xDlOpen(base_vfs, name);
+}
+
+void VfsDlError(sqlite3_vfs* vfs, int size, char* message) {
+  sqlite3_vfs* base_vfs = BaseVfs(vfs);
+  base_vfs->xDlError(base_vfs, size, message);
+}
+
+void (*VfsDlSym(sqlite3_vfs* vfs, void* handle, const char* symbol))(void) {
+  sqlite3_vfs* base_vfs = BaseVfs(vfs);
+  return base_vfs->xDlSym(base_vfs, handle, symbol);
+}
+
+void VfsDlClose(sqlite3_vfs* vfs, void* handle) {
+  sqlite3_vfs* base_vfs = BaseVfs(vfs);
+  base_vfs->xDlClose(base_vfs, handle);
+}
+
+int VfsRandomness(sqlite3_vfs* vfs, int size, char* out) {
+  sqlite3_vfs* base_vfs = BaseVfs(vfs);
+  return base_vfs->xRandomness(base_vfs, size, out);
+}
+
+int VfsSleep(sqlite3_vfs* vfs, int microseconds) {
+  sqlite3_vfs* base_vfs = BaseVfs(vfs);
+  return base_vfs->xSleep(base_vfs, microseconds);
+}
+
+int VfsCurrentTime(sqlite3_vfs* vfs, double* now) {
+  sqlite3_vfs* base_vfs = BaseVfs(vfs);
+  return base_vfs->xCurrentTime(base_vfs, now);
+}
+
+int VfsGetLastError(sqlite3_vfs* vfs, int size, char* message) {
+  sqlite3_vfs* base_vfs = BaseVfs(vfs);
+  return base_vfs->xGetLastError(base_vfs, size, message);
+}
+
+int VfsCurrentTimeInt64(sqlite3_vfs* vfs, sqlite3_int64* now) {
+  sqlite3_vfs* base_vfs = BaseVfs(vfs);
+  return base_vfs->xCurrentTimeInt64(base_vfs, now);
+}
+
+std::mutex g_register_lock;
+sqlite3_vfs g_vfs;
+bool g_registered = false;
+
+}  // namespace
+
+// static
+bool CompressedVfs::IsSupported() {
+  return true;
+}
+
+// static
+bool CompressedVfs::Register() {
+  std::lock_guard<std::mutex> lock(g_register_lock);
+  if (g_registered)
+    return true;
+
+  sqlite3_vfs* base_vfs = sqlite3_vfs_find(NULL);
+  if (!base_vfs || base_vfs->iVersion < 2)
+    return false;
+
+  memset(&g_vfs, 0, sizeof(g_vfs));
+  g_vfs.iVersion = 2;
+  g_vfs.szOsFile = static_cast<int>(sizeof(CompressedFile)) +
+                   base_vfs->szOsFile;
+  g_vfs.mxPathname = base_vfs->mxPathname;
+  g_vfs.zName = kName;
+  g_vfs.pAppData = base_vfs;
+  g_vfs.xOpen = &VfsOpen;
+  g_vfs.xDelete = &VfsDelete;
+  g_vfs.xAccess = &VfsAccess;
+  g_vfs.xFullPathname = &VfsFullPathname;
+  g_vfs.xDlOpen = &VfsDlOpen;
+  g_vfs.xDlError = &VfsDlError;
+  g_vfs.xDlSym = &VfsDlSym;
+  g_vfs.xDlClose = &VfsDlClose;
+  g_vfs.xRandomness = &VfsRandomness;
+  g_vfs.xSleep = &VfsSleep;
+  g_vfs.xCurrentTime = &VfsCurrentTime;
+  g_vfs.xGetLastError = &VfsGetLastError;
+  g_vfs.xCurrentTimeInt64 = &VfsCurrentTimeInt64;
+
+  if (sqlite3_vfs_register(&g_vfs, 0) != SQLITE_OK)
+    return false;
+  g_registered = true;
+  return true;
+}
+
+// static
+bool CompressedVfs::GetStats(Connection* db, Stats* stats) {
+  if (!db->is_open())
+    return false;
+  return sqlite3_file_control(db->db_, "main", kStatsFileControl, stats) ==
+         SQLITE_OK;
+}
+
+#else  // defined(SQL_HAVE_ZLIB)
+
+// static
+bool CompressedVfs::IsSupported() {
+  return false;
+}
+
+// static
+bool CompressedVfs::Register() {
+  return false;
+}
+
+// static
+bool CompressedVfs::GetStats(Connection* db, Stats* stats) {
+  return false;
+}
+
+#endif  // defined(SQL_HAVE_ZLIB)
+
+}  // namespace sql
@@ -0,0 +1,86 @@
+// Copyright (c) 2010 Garrett R. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef SQL_COMPRESSED_VFS_H_
+#define SQL_COMPRESSED_VFS_H_
+
+#include "basictypes.h"
+
+namespace sql {
+
+class Connection;
+
+// CompressedVfs is an sqlite VFS that stores every page of a database file
+// compressed with zlib at its fastest setting, trading CPU for disk I/O. It
+// sits on top of the default VFS and is selected per connection by opening
+// with Connection::OPEN_COMPRESSED:
+//
+//   sql::Connection db;
+//   db.Open(path, sql::Connection::OPEN_COMPRESSED);
+//
+// Only database files are compressed. Rollback journals and WAL files are
+// passed through unchanged, so both journal modes work as usual, and pages
+// are compressed when they are written back to the database file. Backups
+// go through sqlite's pager and work in both directions between compressed
+// and plain databases.
+//
+// The file holds a map from each page to the place its compressed bytes
+// are stored. A page that is rewritten goes to free space, never over the
+// live copy, and the map is written out when sqlite syncs the file. Space
+// is reused once a newer map that no longer refers to it has been synced,
+// and free space at the end of the file is given back. If a power loss
+// leaves the newest map incomplete, the file opens with the one before.
+//
+// A compressed database file can only be opened through this VFS. Several
+// connections in one process share its map; connections in other processes
+// reload it when they start a transaction.
+class CompressedVfs {
+ public:
+  // The name the VFS is registered under.
+  static const char kName[];
+
+  struct Stats {
+    Stats();
+
+    // The size of the database as sqlite sees it, and of the file on disk.
+    int64 logical_bytes;
+    int64 physical_bytes;
+
+    // logical_bytes / physical_bytes, or 0 for an empty file.
+    double compression_ratio;
+
+    // Space inside the file that is free for reuse.
+    int64 free_bytes;
+
+    // Pages written compressed, and pages stored as they were because they
+    // didn't compress.
+    int64 pages_compressed;
+    int64 pages_stored_raw;
+
+    // CPU time spent compressing and decompressing pages, and time spent
+    // waiting for reads, writes and syncs of the file.
+    int64 compress_microseconds;
+    int64 decompress_microseconds;
+    int64 io_microseconds;
+  };
+
+  // Returns true if the VFS is available, which needs zlib at build time.
+  static bool IsSupported();
+
+  // Registers the VFS with sqlite. It is not made the default. Calling this
+  // more than once is harmless. Returns false if the VFS isn't supported.
+  static bool Register();
+
+  // Fills in |stats| for the main database of |db|, counting from when the
+  // file was first opened in this process. Returns false if the database
+  // isn't open through this VFS.
+  static bool GetStats(Connection* db, Stats* stats);
+
+ private:
+  DISALLOW_IMPLICIT_CONSTRUCTORS(CompressedVfs);
+};
+
+}  // namespace sql
+
+#endif  // SQL_COMPRESSED_VFS_H_
@@ -8,17 +8,42 @@
 
 #include "connection.h"
 
+#include <algorithm>
+#include <atomic>
 #include <cstring>
-
 #include <sstream>
+#include <utility>
 
 #include <sqlite3.h>
 
+#include "compressed_vfs.h"
+#include "index_advisor.h"
+#include "instrumented_vfs.h"
+#include "result_cache.h"
+#include "schema_catalog.h"
 #include "statement.h"
+#include "statement_registry.h"
+#include "uring_vfs.h"
 //#include "base/logging.h"
 
 namespace sql {
 
+namespace {
+
+// See Connection::SetProcessMemoryBudget().
+std::atomic<int64> g_process_memory_budget(0);
+
+// Returns the current value of one of sqlite's per-connection counters.
+int64 GetDbStatus(sqlite3* db, int op) {
+  int current = 0;
+  int highwater = 0;
+  if (sqlite3_db_status(db, op, &current, &highwater, 0) != SQLITE_OK)
+    return 0;
+  return current;
+}
+
+}  // namespace
+
 bool StatementID::operator<(const StatementID& other) const {
   if (number_ != other.number_)
     return number_ < other.number_;
@@ -27,13 +52,23 @@ bool StatementID::operator<(const StatementID& other) const {
 
 Connection::StatementRef::StatementRef()
     : connection_(NULL),
-      stmt_(NULL) {
+      stmt_(NULL),
+      previous_(NULL),
+      next_(NULL),
+      last_used_(0),
+      stepped_(false),
+      has_bindings_(false) {
 }
 
 Connection::StatementRef::StatementRef(Connection* connection,
                                        sqlite3_stmt* stmt)
     : connection_(connection),
-      stmt_(stmt) {
+      stmt_(stmt),
+      previous_(NULL),
+      next_(NULL),
+      last_used_(0),
+      stepped_(false),
+      has_bindings_(false) {
   connection_->StatementRefCreated(this);
 }
 
@@ -43,40 +78,160 @@ Connection::StatementRef::~StatementRef() {
   Close();
 }
 
+// static
+void* Connection::StatementRef::operator new(size_t size) {
+  void* block = MemoryPool::GetInstance()->Allocate(size);
+  if (!block)
+    throw std::bad_alloc();
+  return block;
+}
+
+// static
+void Connection::StatementRef::operator delete(void* block) {
+  MemoryPool::GetInstance()->Free(block);
+}
+
 void Connection::StatementRef::Close() {
   if (stmt_) {
     sqlite3_finalize(stmt_);
     stmt_ = NULL;
   }
+  stepped_ = false;
+  has_bindings_ = false;
   connection_ = NULL;  // The connection may be getting deleted.
 }
 
+MemoryStats::MemoryStats()
+    : cache_used(0),
+      schema_used(0),
+      statement_used(0),
+      cache_hits(0),
+      cache_misses(0),
+      cache_writes(0),
+      cache_spills(0),
+      cached_statements(0),
+      process_memory_used(0),
+      process_memory_peak(0),
+      process_allocation_count(0) {
+}
+
+class Connection::HookTrampolines {
+ public:
+  static void OnUpdate(void* self, int operation, const char* database,
+                       const char* table, sqlite3_int64 rowid) {
+    ChangeObserver::ChangeType type = ChangeObserver::CHANGE_UPDATE;
+    if (operation == SQLITE_INSERT)
+      type = ChangeObserver::CHANGE_INSERT;
+    else if (operation == SQLITE_DELETE)
+      type = ChangeObserver::CHANGE_DELETE;
+
+    Connection* connection = static_cast<Connection*>(self);
+    for (size_t i = 0; i < connection->change_observers_.size(); ++i) {
+      connection->change_observers_[i]->OnRowChanged(type, database, table,
+                                                     rowid);
+    }
+  }
+
+#if defined(SQLITE_ENABLE_PREUPDATE_HOOK)
+  // Unlike the update hook, this also reports WITHOUT ROWID tables, and
+  // sqlite skips the truncate optimization while it is set.
+  static void OnPreUpdate(void* self, sqlite3* /*db*/, int operation,
+                          const char* database, const char* table,
+                          sqlite3_int64 old_rowid, sqlite3_int64 new_rowid) {
+    OnUpdate(self, operation, database, table,
+             operation == SQLITE_DELETE ? old_rowid : new_rowid);
+  }
+#endif
+
+  static void OnRollback(void* self) {
+    Connection* connection = static_cast<Connection*>(self);
+    for (size_t i = 0; i < connection->change_observers_.size(); ++i)
+      connection->change_observers_[i]->OnRollback();
+  }
+};
+
 Connection::Connection()
     : db_(NULL),
       page_size_(0),
       cache_size_(0),
+      lookaside_slot_size_(0),
+      lookaside_slot_count_(0),
       exclusive_locking_(false),
-      transaction_nesting_(0) {
+      warm_statements_on_open_(false),
+      statement_use_count_(0),
+      open_statements_(NULL),
+      session_count_(0),
+      authorizer_(NULL),
+      authorizer_arg_(NULL),
+      progress_instructions_(0),
+      progress_handler_(NULL),
+      progress_arg_(NULL),
+      transaction_nesting_(0),
+      transaction_count_(0) {
 }
 
 Connection::~Connection() {
   Close();
 }
 
-bool Connection::Open(const char* file_name) {
+bool Connection::Open(const char* file_name, int flags, const char* vfs_name) {
   if (db_) {
     //NOTREACHED() << "sql::Connection is already open.";
     return false;
   }
 
-  int err = sqlite3_open(file_name, &db_);
+  int open_flags = (flags & OPEN_READ_ONLY) ? SQLITE_OPEN_READONLY :
+      (flags & OPEN_NO_CREATE) ? SQLITE_OPEN_READWRITE :
+      SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;
+  if (flags & OPEN_NO_MUTEX)
+    open_flags |= SQLITE_OPEN_NOMUTEX;
+  if (flags & OPEN_FULL_MUTEX)
+    open_flags |= SQLITE_OPEN_FULLMUTEX;
+  if (flags & OPEN_URI)
+    open_flags |= SQLITE_OPEN_URI;
+  if (flags & OPEN_SHARED_CACHE)
+    open_flags |= SQLITE_OPEN_SHAREDCACHE;
+  if (flags & OPEN_PRIVATE_CACHE)
+    open_flags |= SQLITE_OPEN_PRIVATECACHE;
+  if (flags & OPEN_MEMORY)
+    open_flags |= SQLITE_OPEN_MEMORY;
+
+  if (flags & OPEN_COMPRESSED) {
+    if (!CompressedVfs::Register())
+      return false;
+    vfs_name = CompressedVfs::kName;
+  } else if (flags & OPEN_IO_URING) {
+    if (!UringVfs::Register())
+      return false;
+    vfs_name = UringVfs::kName;
+  }
+  if (flags & OPEN_INSTRUMENTED) {
+    instrumented_vfs_.reset(new InstrumentedVfs(vfs_name));
+    if (!instrumented_vfs_->Register()) {
+      instrumented_vfs_.reset();
+      return false;
+    }
+    vfs_name = instrumented_vfs_->name();
+  }
+
+  int err = sqlite3_open_v2(file_name, &db_, open_flags, vfs_name);
   if (err != SQLITE_OK) {
     OnSqliteError(err, NULL);
+    // sqlite usually allocates a handle even when opening fails.
+    sqlite3_close(db_);
     db_ = NULL;
+    instrumented_vfs_.reset();
     return false;
   }
 
-  if (page_size_ != 0) {
+  // Lookaside can only be changed while no statements are prepared, so do
+  // it first. sqlite allocates the slots itself.
+  if (lookaside_slot_size_ > 0 && lookaside_slot_count_ > 0) {
+    sqlite3_db_config(db_, SQLITE_DBCONFIG_LOOKASIDE, NULL,
+                      lookaside_slot_size_, lookaside_slot_count_);
+  }
+
+  if (page_size_ != 0 && !is_read_only()) {
     Statement statment(GetUniqueStatement("PRAGMA page_size=%d"));
 
     if (statment) {
@@ -108,18 +263,43 @@ bool Connection::Open(const char* file_name) {
     }
   }
 
+  UpdateChangeHooks();
+  if (authorizer_)
+    sqlite3_set_authorizer(db_, authorizer_, authorizer_arg_);
+  if (progress_handler_)
+    sqlite3_progress_handler(db_, progress_instructions_, progress_handler_,
+                             progress_arg_);
+
+  warmup_errors_.clear();
+  if (warm_statements_on_open_)
+    WarmStatements(&warmup_errors_);
+
   return true;
 }
 
 void Connection::Close() {
   ClearCache();
+  schema_catalog_.reset();
+  if (result_cache_)
+    result_cache_->Clear();
 
-  //DCHECK(open_statements_.empty());
+  //DCHECK(!open_statements_);
 
   if (db_) {
-    sqlite3_close(db_);
+    if (sqlite3_close(db_) != SQLITE_OK) {
+      // Statements still held elsewhere keep the handle open. sqlite closes
+      // it once they are finalized, and until then it may still use our
+      // VFS, which must therefore outlive us.
+      sqlite3_close_v2(db_);
+      instrumented_vfs_.release();
+    }
     db_ = NULL;
   }
+  instrumented_vfs_.reset();
+}
+
+bool Connection::is_read_only() const {
+  return db_ && sqlite3_db_readonly(db_, "main") == 1;
 }
 
 bool Connection::BeginTransaction() {
@@ -133,6 +313,8 @@ bool Connection::BeginTransaction() {
   if (!begin || !begin.Run()) {
     success = false;
     --transaction_nesting_;
+  } else if (transaction_nesting_ == 1) {
+    ++transaction_count_;
   }
 
   return success;
@@ -167,6 +349,9 @@ bool Connection::RollbackTransaction() {
     Statement rollback_to(GetUniqueStatement(rollback_to_stmt));
 
     if (rollback_to && rollback_to.Run()) {
+      InvalidateSchemaCatalog();
+      // sqlite's rollback hook doesn't fire for ROLLBACK TO.
+      HookTrampolines::OnRollback(this);
       if (!ReleaseTransaction())
         --transaction_nesting_;
 
@@ -184,6 +369,7 @@ bool Connection::RollbackAllTransactions() {
     Statement rollback(GetCachedStatement(SQL_FROM_HERE, "ROLLBACK"));
 
     if (rollback && rollback.Run()) {
+      InvalidateSchemaCatalog();
       success = true;
       transaction_nesting_ = 0;
     }
@@ -195,7 +381,15 @@ bool Connection::RollbackAllTransactions() {
 bool Connection::Execute(const char* sql) {
   if (!db_)
     return false;
-  return sqlite3_exec(db_, sql, NULL, NULL, NULL) == SQLITE_OK;
+
+  bool succeeded = sqlite3_exec(db_, sql, NULL, NULL, NULL) == SQLITE_OK;
+
+  // Execute is how the schema is normally changed, which the result cache
+  // has no way of noticing by itself. Row changes reach it through the
+  // update hook.
+  if (result_cache_)
+    result_cache_->CheckSchema();
+  return succeeded;
 }
 
 bool Connection::HasCachedStatement(const StatementID& id) const {
@@ -210,19 +404,56 @@ scoped_refptr<Connection::StatementRef> Connection::GetCachedStatement(
     // Statement is in the cache. It should still be active (we're the only
     // one invalidating cached statements, and we'll remove it from the cache
     // if we do that. Make sure we reset it before giving out the cached one in
-    // case it still has some stuff bound.
+    // case it is still running. The previous Statement normally did already.
     if (i->second->is_valid()) {
-      sqlite3_reset(i->second->stmt());
+      if (i->second->stepped_) {
+        sqlite3_reset(i->second->stmt());
+        i->second->stepped_ = false;
+      }
+      i->second->last_used_ = ++statement_use_count_;
       return i->second;
     }
   }
 
+  CheckMemoryBudget();
+
   scoped_refptr<StatementRef> statement = GetUniqueStatement(sql);
-  if (statement->is_valid())
-    statement_cache_[id] = statement;  // Only cache valid statements.
+  if (statement->is_valid()) {
+    // Only cache valid statements.
+    statement->last_used_ = ++statement_use_count_;
+    statement_cache_[id] = statement;
+  }
   return statement;
 }
 
+scoped_refptr<Connection::StatementRef> Connection::GetCachedStatement(
+    const RegisteredStatement& statement) {
+  return GetCachedStatement(statement.id(), statement.sql());
+}
+
+bool Connection::WarmStatements(std::vector<std::string>* errors) {
+  bool success = true;
+
+  std::vector<StatementRegistry::Entry> entries =
+      StatementRegistry::GetInstance()->GetEntries();
+  for (size_t i = 0; i < entries.size(); ++i) {
+    if (HasCachedStatement(entries[i].id))
+      continue;
+
+    if (!GetCachedStatement(entries[i].id, entries[i].sql)->is_valid()) {
+      success = false;
+      if (errors) {
+        std::string error(entries[i].sql);
+        error.append(": ");
+        error.append(GetErrorMessage());
+        errors->push_back(error);
+      }
+    }
+  }
+
+  return success;
+}
+
 scoped_refptr<Connection::StatementRef> Connection::GetUniqueStatement(
     const char* sql) {
   sqlite3_stmt* stmt = NULL;
@@ -235,6 +466,42 @@ scoped_refptr<Connection::StatementRef> Connection::GetUniqueStatement(
   return new StatementRef(this, stmt);
 }
 
+void Connection::EnableResultCache(size_t max_bytes) {
+  result_cache_.reset();
+  if (max_bytes)
+    result_cache_.reset(new ResultCache(this, max_bytes));
+}
+
+bool Connection::CachedQuery(const StatementID& id,
+                             const char* sql,
+                             const Row& params,
+                             std::vector<Row>* rows) {
+  if (result_cache_)
+    return result_cache_->Query(id, sql, params, rows);
+
+  if (!rows)
+    return false;
+  rows->clear();
+  return QueryRows(id, sql, params, rows);
+}
+
+bool Connection::QueryRows(const StatementID& id,
+                           const char* sql,
+                           const Row& params,
+                           std::vector<Row>* rows) {
+  Statement statement(GetCachedStatement(id, sql));
+  if (!statement)
+    return false;
+  for (size_t i = 0; i < params.size(); ++i)
+    statement.BindValue(static_cast<int>(i), params[i]);
+
+  while (statement.Step()) {
+    rows->push_back(Row());
+    statement.ColumnRow(&rows->back());
+  }
+  return statement.Succeeded();
+}
+
 bool Connection::BackupDatabaseTo(const char* src_db,
     Connection& conn, const char* dest_db) const {
   bool success = false;
@@ -318,35 +585,195 @@ bool Connection::BackupTemporaryTo(Connection& conn) const {
   return success;
 }
 
+bool Connection::Serialize(const char* schema,
+                           bool borrow,
+                           SerializedDatabase* database) const {
+#if defined(SQL_HAVE_SQLITE_DESERIALIZE)
+  if (!is_open())
+    return false;
+
+  // Serializing is non-mutating, so this cast is OK.
+  sqlite3* db = const_cast<sqlite3*>(db_);
+  sqlite3_int64 size = 0;
+  if (borrow) {
+    unsigned char* data =
+        sqlite3_serialize(db, schema, &size, SQLITE_SERIALIZE_NOCOPY);
+    if (data) {
+      database->Adopt(data, static_cast<size_t>(size),
+                      SerializedDatabase::BORROWED);
+      return true;
+    }
+  }
+
+  unsigned char* data = sqlite3_serialize(db, schema, &size, 0);
+  if (!data) {
+    // An empty database serializes to nothing.
+    if (sqlite3_db_filename(db, schema) == NULL)
+      return false;
+    database->Reset();
+    return true;
+  }
+  database->Adopt(data, static_cast<size_t>(size),
+                  SerializedDatabase::SQLITE_MEMORY);
+  return true;
+#else
+  return false;
+#endif
+}
+
+bool Connection::Deserialize(const SerializedDatabase& database,
+                             bool read_only) {
+#if defined(SQL_HAVE_SQLITE_DESERIALIZE)
+  if (!is_open() && !OpenInMemory())
+    return false;
+  if (transaction_nesting_ > 0 || !sqlite3_get_autocommit(db_))
+    return false;
+
+  unsigned char* data = NULL;
+  unsigned int flags = 0;
+  if (read_only) {
+    // sqlite doesn't write to read-only databases, so this cast is OK.
+    data = const_cast<unsigned char*>(database.data());
+    flags = SQLITE_DESERIALIZE_READONLY;
+  } else if (!database.empty()) {
+    data = static_cast<unsigned char*>(sqlite3_malloc64(database.size()));
+    if (!data)
+      return false;
+    memcpy(data, database.data(), database.size());
+    flags = SQLITE_DESERIALIZE_FREEONCLOSE | SQLITE_DESERIALIZE_RESIZEABLE;
+  }
+
+  // Cached statements keep read transactions open once stepped.
+  ClearCache();
+
+  sqlite3_int64 size = static_cast<sqlite3_int64>(database.size());
+  int err = sqlite3_deserialize(db_, "main", data, size, size, flags);
+  InvalidateSchemaCatalog();
+  if (result_cache_)
+    result_cache_->Clear();
+  if (err != SQLITE_OK) {
+    // sqlite frees the copy on failure too.
+    OnSqliteError(err, NULL);
+    return false;
+  }
+  return true;
+#else
+  return false;
+#endif
+}
+
+SchemaCatalog* Connection::GetSchemaCatalog() const {
+  if (!db_)
+    return NULL;
+  // The catalog only reads from the database, so this cast is OK.
+  if (!schema_catalog_)
+    schema_catalog_.reset(new SchemaCatalog(const_cast<Connection*>(this)));
+  return schema_catalog_.get();
+}
+
 bool Connection::DoesTableExist(const char* table_name) const {
-  // GetUniqueStatement can't be const since statements may modify the
-  // database, but we know ours doesn't modify it, so the cast is safe.
-  Statement statement(const_cast<Connection*>(this)->GetUniqueStatement(
-      "SELECT name FROM sqlite_master "
-      "WHERE type='table' AND name=?"));
+  SchemaCatalog* catalog = GetSchemaCatalog();
+  if (!catalog || !table_name)
+    return false;
+
+  // The catalog answers the common cases without a statement. It matches
+  // names without regard to case and lets temp tables hide main ones, so
+  // anything else is checked against sqlite_master itself.
+  const TableInfo* info = catalog->GetTable(table_name);
+  if (!info)
+    return false;
+  if (info->schema == "main" && !info->is_view && info->name == table_name)
+    return true;
+
+  // Our SQL is non-mutating, so this cast is OK.
+  Statement statement(const_cast<Connection*>(this)->GetCachedStatement(
+      SQL_FROM_HERE,
+      "SELECT name FROM sqlite_master WHERE type='table' AND name=?"));
   if (!statement)
     return false;
-  statement.BindString(0, table_name);
-  return statement.Step();  // Table exists if any row was returned.
+  statement.BindCString(0, table_name);
+  return statement.Step();
 }
 
 bool Connection::DoesColumnExist(const char* table_name,
                                  const char* column_name) const {
-  std::string sql("PRAGMA TABLE_INFO(");
-  sql.append(table_name);
-  sql.append(")");
+  SchemaCatalog* catalog = GetSchemaCatalog();
+  if (!catalog || !table_name || !column_name)
+    return false;
+  return catalog->DoesColumnExist(table_name, column_name);
+}
 
-  // Our SQL is non-mutating, so this cast is OK.
-  Statement statement(const_cast<Connection*>(this)->GetUniqueStatement(
-      sql.c_str()));
-  if (!statement)
+int64 Connection::GetDataVersion() const {
+  if (!db_)
+    return 0;
+
+  // The pragma is non-mutating, so this cast is OK.
+  Statement statement(const_cast<Connection*>(this)->GetCachedStatement(
+      SQL_FROM_HERE, "PRAGMA data_version"));
+  if (!statement || !statement.Step())
+    return 0;
+  return statement.ColumnInt64(0);
+}
+
+int64 Connection::GetTotalChangeCount() const {
+  if (!db_)
+    return 0;
+  return sqlite3_total_changes(db_);
+}
+
+bool Connection::AnalyzeWorkload(WorkloadReport* report) {
+  if (!db_)
     return false;
 
-  while (statement.Step()) {
-    if (!statement.ColumnString(1).compare(column_name))
-      return true;
+  IndexAdvisor advisor(this);
+  for (CachedStatementMap::const_iterator i = statement_cache_.begin();
+       i != statement_cache_.end(); ++i) {
+    if (i->second->is_valid())
+      advisor.AddStatement(sqlite3_sql(i->second->stmt()));
   }
-  return false;
+  return advisor.Analyze(report);
+}
+
+bool Connection::GetMemoryStats(MemoryStats* stats) const {
+  if (!stats)
+    return false;
+  *stats = MemoryStats();
+
+  sqlite3_int64 current = 0;
+  sqlite3_int64 highwater = 0;
+  if (sqlite3_status64(SQLITE_STATUS_MEMORY_USED, &current, &highwater,
+                       0) == SQLITE_OK) {
+    stats->process_memory_used = current;
+    stats->process_memory_peak = highwater;
+  }
+  if (sqlite3_status64(SQLITE_STATUS_MALLOC_COUNT, &current, &highwater,
+                       0) == SQLITE_OK)
+    stats->process_allocation_count = current;
+
+  if (!db_)
+    return false;
+
+  stats->cache_used = GetDbStatus(db_, SQLITE_DBSTATUS_CACHE_USED);
+  stats->schema_used = GetDbStatus(db_, SQLITE_DBSTATUS_SCHEMA_USED);
+  stats->statement_used = GetDbStatus(db_, SQLITE_DBSTATUS_STMT_USED);
+  stats->cache_hits = GetDbStatus(db_, SQLITE_DBSTATUS_CACHE_HIT);
+  stats->cache_misses = GetDbStatus(db_, SQLITE_DBSTATUS_CACHE_MISS);
+  stats->cache_writes = GetDbStatus(db_, SQLITE_DBSTATUS_CACHE_WRITE);
+  stats->cache_spills = GetDbStatus(db_, SQLITE_DBSTATUS_CACHE_SPILL);
+  stats->cached_statements = static_cast<int>(statement_cache_.size());
+  return true;
+}
+
+bool Connection::GetIoStats(IoStats* stats) const {
+  if (!is_open() || !instrumented_vfs_)
+    return false;
+  instrumented_vfs_->GetStats(stats);
+  return true;
+}
+
+void Connection::ResetIoStats() {
+  if (instrumented_vfs_)
+    instrumented_vfs_->ResetStats();
 }
 
 int64 Connection::GetLastInsertRowId() const {
@@ -365,6 +792,73 @@ int Connection::GetLastChangeCount() const {
   return sqlite3_changes(db_);
 }
 
+int64 Connection::ReleaseMemory(MemoryPressure level) {
+  if (!db_)
+    return 0;
+
+  int64 statement_used = GetDbStatus(db_, SQLITE_DBSTATUS_STMT_USED);
+  int64 cache_used = GetDbStatus(db_, SQLITE_DBSTATUS_CACHE_USED);
+
+  // Only the cache holds a reference to statements that aren't in use.
+  typedef std::pair<uint64, CachedStatementMap::iterator> IdleStatement;
+  std::vector<IdleStatement> idle;
+  for (CachedStatementMap::iterator i = statement_cache_.begin();
+       i != statement_cache_.end(); ++i) {
+    if (i->second->HasOneRef())
+      idle.push_back(IdleStatement(i->second->last_used_, i));
+  }
+
+  size_t drop_count = idle.size();
+  if (level == MEMORY_PRESSURE_MODERATE) {
+    drop_count = (idle.size() + 1) / 2;
+    std::nth_element(idle.begin(), idle.begin() + drop_count, idle.end(),
+                     [](const IdleStatement& a, const IdleStatement& b) {
+                       return a.first < b.first;
+                     });
+  }
+  for (size_t i = 0; i < drop_count; ++i)
+    statement_cache_.erase(idle[i].second);
+
+  if (level == MEMORY_PRESSURE_CRITICAL && result_cache_)
+    result_cache_->Clear();
+
+  sqlite3_db_release_memory(db_);
+
+  return (statement_used - GetDbStatus(db_, SQLITE_DBSTATUS_STMT_USED)) +
+         (cache_used - GetDbStatus(db_, SQLITE_DBSTATUS_CACHE_USED));
+}
+
+// static
+void Connection::SetProcessMemoryBudget(int64 bytes) {
+  if (bytes < 0)
+    bytes = 0;
+  g_process_memory_budget = bytes;
+  sqlite3_soft_heap_limit64(bytes);
+}
+
+// static
+int64 Connection::GetProcessMemoryBudget() {
+  return g_process_memory_budget;
+}
+
+void Connection::AddChangeObserver(ChangeObserver* observer) {
+  if (!observer)
+    return;
+  change_observers_.push_back(observer);
+  UpdateChangeHooks();
+}
+
+void Connection::RemoveChangeObserver(ChangeObserver* observer) {
+  for (ChangeObserverList::iterator i = change_observers_.begin();
+       i != change_observers_.end(); ++i) {
+    if (*i == observer) {
+      change_observers_.erase(i);
+      break;
+    }
+  }
+  UpdateChangeHooks();
+}
+
 int Connection::GetErrorCode() const {
   if (!db_)
     return SQLITE_ERROR;
@@ -378,18 +872,25 @@ const char* Connection::GetErrorMessage() const {
 }
 
 void Connection::StatementRefCreated(StatementRef* ref) {
-  if (open_statements_.find(ref) == open_statements_.end()) {
-    open_statements_.insert(ref);
-  }
+  ref->previous_ = NULL;
+  ref->next_ = open_statements_;
+  if (open_statements_)
+    open_statements_->previous_ = ref;
+  open_statements_ = ref;
 }
 
 void Connection::StatementRefDeleted(StatementRef* ref) {
-  StatementRefSet::iterator i = open_statements_.find(ref);
-  if (i == open_statements_.end()) {
-    //NOTREACHED();
-  } else {
-    open_statements_.erase(i);
-  }
+  if (ref->previous_)
+    ref->previous_->next_ = ref->next_;
+  else if (open_statements_ == ref)
+    open_statements_ = ref->next_;
+  else
+    return;  //NOTREACHED();
+
+  if (ref->next_)
+    ref->next_->previous_ = ref->previous_;
+  ref->previous_ = NULL;
+  ref->next_ = NULL;
 }
 
 void Connection::ClearCache() {
@@ -397,10 +898,15 @@ void Connection::ClearCache() {
 
   // The cache clear will get most statements. There may be still be references
   // to some statements that are held by others (including one-shot statements).
-  // This will deactivate them so they can't be used again.
-  for (StatementRefSet::iterator i = open_statements_.begin();
-       i != open_statements_.end(); ++i)
-    (*i)->Close();
+  // This will deactivate them so they can't be used again. Closing a ref
+  // detaches it from us, so unlink it too or it would never be removed.
+  while (open_statements_) {
+    StatementRef* ref = open_statements_;
+    open_statements_ = ref->next_;
+    ref->previous_ = NULL;
+    ref->next_ = NULL;
+    ref->Close();
+  }
 }
 
 int Connection::OnSqliteError(int err, sql::Statement *stmt) {
@@ -411,6 +917,78 @@ int Connection::OnSqliteError(int err, sql::Statement *stmt) {
   return err;
 }
 
+void Connection::CheckMemoryBudget() {
+  int64 budget = g_process_memory_budget;
+  if (budget > 0 && sqlite3_memory_used() > budget / 10 * 9)
+    ReleaseMemory(MEMORY_PRESSURE_MODERATE);
+}
+
+void Connection::SetAuthorizer(Authorizer authorizer, void* arg) {
+  authorizer_ = authorizer;
+  authorizer_arg_ = arg;
+  if (db_)
+    sqlite3_set_authorizer(db_, authorizer_, authorizer_arg_);
+}
+
+void Connection::SetProgressHandler(int instructions,
+                                    ProgressHandler handler,
+                                    void* arg) {
+  progress_instructions_ = instructions;
+  progress_handler_ = handler;
+  progress_arg_ = arg;
+  if (db_)
+    sqlite3_progress_handler(db_, instructions, handler, arg);
+}
+
+void Connection::UpdateChangeHooks() {
+  if (!db_)
+    return;
+
+  // Only pay for the hooks while someone is listening. The preupdate hook
+  // is preferred, but sessions need it for themselves.
+  bool listening = !change_observers_.empty();
+  bool use_preupdate = false;
+#if defined(SQLITE_ENABLE_PREUPDATE_HOOK)
+  if (!session_count_) {
+    use_preupdate = listening;
+    sqlite3_preupdate_hook(
+        db_, use_preupdate ? &HookTrampolines::OnPreUpdate : NULL,
+        use_preupdate ? this : NULL);
+  }
+#endif
+  if (listening && !use_preupdate)
+    sqlite3_update_hook(db_, &HookTrampolines::OnUpdate, this);
+  else
+    sqlite3_update_hook(db_, NULL, NULL);
+  if (listening)
+    sqlite3_rollback_hook(db_, &HookTrampolines::OnRollback, this);
+  else
+    sqlite3_rollback_hook(db_, NULL, NULL);
+}
+
+void Connection::AddSession() {
+  if (session_count_++ || !db_)
+    return;
+#if defined(SQLITE_ENABLE_PREUPDATE_HOOK)
+  // sqlite3session_create() takes whatever the hook's argument is for the
+  // list of sessions, so it must not find ours.
+  sqlite3_preupdate_hook(db_, NULL, NULL);
+#endif
+  UpdateChangeHooks();
+}
+
+void Connection::RemoveSession() {
+  if (--session_count_ == 0)
+    UpdateChangeHooks();
+}
+
+void Connection::InvalidateSchemaCatalog() {
+  // A rollback restores the old schema_version, which a later schema change
+  // could then reach again with a different schema.
+  if (schema_catalog_)
+    schema_catalog_->Invalidate();
+}
+
 bool Connection::ReleaseTransaction() {
   bool success = false;
 
@@ -10,18 +10,28 @@
 #define SQL_CONNECTION_H_
 
 #include <map>
-#include <set>
+#include <memory>
 #include <string>
+#include <vector>
 
 #include "basictypes.h"
+#include "memory_pool.h"
 #include "ref_counted.h"
+#include "serialized_database.h"
+#include "value.h"
 
 struct sqlite3;
 struct sqlite3_stmt;
 
 namespace sql {
 
+class InstrumentedVfs;
+class RegisteredStatement;
+class ResultCache;
+class SchemaCatalog;
 class Statement;
+struct IoStats;
+struct WorkloadReport;
 
 // Uniquely identifies a statement. There are two modes of operation:
 //
@@ -98,6 +108,72 @@ class ErrorDelegate : public base::RefCounted<ErrorDelegate> {
   virtual ~ErrorDelegate() {}
 };
 
+// ChangeObserver is notified of row changes made through a Connection. It
+// is what lets in-memory structures such as the result cache follow the
+// database precisely. See Connection::AddChangeObserver().
+class ChangeObserver {
+ public:
+  enum ChangeType {
+    CHANGE_INSERT,
+    CHANGE_UPDATE,
+    CHANGE_DELETE,
+  };
+
+  // Called for every row changed in a table of |database|, from sqlite's
+  // preupdate hook where sqlite has one, before the change is made. The
+  // hook is taken over by sessions, see ChangeRecorder, so while one
+  // records the update hook is used instead, after the change. That one
+  // doesn't report rows of WITHOUT ROWID tables or rows deleted by the
+  // truncate optimization ("DELETE FROM t" without a WHERE). Compare
+  // Connection::GetTotalChangeCount() with the number of calls seen to
+  // detect those. Rows replaced by ON CONFLICT REPLACE are reported by the
+  // preupdate hook but not counted. |rowid| is 0 for WITHOUT ROWID tables.
+  //
+  // This runs in the middle of executing a statement, so it must not use the
+  // connection in any way.
+  virtual void OnRowChanged(ChangeType type,
+                            const char* database,
+                            const char* table,
+                            int64 rowid) = 0;
+
+  // Called when a transaction or a nested transaction is rolled back,
+  // undoing some of the changes reported since the outermost one began. The
+  // same restrictions as above apply.
+  virtual void OnRollback() = 0;
+
+ protected:
+  virtual ~ChangeObserver() {}
+};
+
+// Memory used by a Connection, and by sqlite in the whole process. See
+// Connection::GetMemoryStats().
+struct MemoryStats {
+  MemoryStats();
+
+  // Bytes of heap used by the connection's page cache, schema and prepared
+  // statements.
+  int64 cache_used;
+  int64 schema_used;
+  int64 statement_used;
+
+  // Page cache hits, misses, pages written and pages written to free memory
+  // in the middle of a transaction, since the connection was opened.
+  int64 cache_hits;
+  int64 cache_misses;
+  int64 cache_writes;
+  int64 cache_spills;
+
+  // Number of statements in the statement cache.
+  int cached_statements;
+
+  // Bytes of heap used by sqlite in the whole process, now and at most.
+  int64 process_memory_used;
+  int64 process_memory_peak;
+
+  // Number of separate allocations sqlite holds in the whole process.
+  int64 process_allocation_count;
+};
+
 class Connection {
  private:
   class StatementRef;  // Forward declaration, see real one below.
@@ -136,6 +212,25 @@ class Connection {
   // This must be called before Open() to have an effect.
   void set_exclusive_locking() { exclusive_locking_ = true; }
 
+  // Gives the connection |slot_count| lookaside slots of |slot_size| bytes,
+  // from which sqlite serves its small, short-lived allocations without
+  // going through the allocator or taking any lock. Zero keeps sqlite's
+  // default. This has no effect if sqlite was built without lookaside.
+  //
+  // This must be called before Open() to have an effect.
+  void set_lookaside(int slot_size, int slot_count) {
+    lookaside_slot_size_ = slot_size;
+    lookaside_slot_count_ = slot_count;
+  }
+
+  // Call to prepare every statement in the StatementRegistry as part of
+  // Open(), so that the connection is warm before it takes traffic. Open()
+  // still succeeds if some of them fail to prepare (for example because the
+  // schema hasn't been migrated yet); see warmup_errors().
+  //
+  // This must be called before Open() to have an effect.
+  void set_warm_statements_on_open() { warm_statements_on_open_ = true; }
+
   // Sets the object that will handle errors. Recomended that it should be set
   // before calling Open(). If not set, the default is to ignore errors on
   // release and assert on debug builds.
@@ -145,18 +240,83 @@ class Connection {
 
   // Initialization ------------------------------------------------------------
 
+  // Flags for Open(), which can be or'ed together. They map directly to
+  // sqlite's SQLITE_OPEN_* flags.
+  enum OpenFlags {
+    // Read-write, creating the file if it doesn't exist, with sqlite's
+    // default threading mode.
+    OPEN_DEFAULT = 0,
+
+    // Opens the database read-only. It must already exist.
+    OPEN_READ_ONLY = 1 << 0,
+
+    // Opens the database read-write, but fails if it doesn't exist.
+    OPEN_NO_CREATE = 1 << 1,
+
+    // Skips the connection's mutex. Only for connections that are used by
+    // one thread at a time, which is all of them unless the caller shares
+    // one across threads.
+    OPEN_NO_MUTEX = 1 << 2,
+
+    // Serializes every use of the connection with its mutex, even if sqlite
+    // defaults to something else.
+    OPEN_FULL_MUTEX = 1 << 3,
+
+    // Interprets the path as a "file:" URI, so that query parameters such
+    // as cache=shared, mode=ro, mode=memory or immutable=1 can be given.
+    OPEN_URI = 1 << 4,
+
+    // Shares one page cache between the connections of this process that
+    // open the same file, or uses a private one even if shared cache was
+    // enabled process-wide.
+    OPEN_SHARED_CACHE = 1 << 5,
+    OPEN_PRIVATE_CACHE = 1 << 6,
+
+    // Opens an in-memory database. Connections opening the same name with
+    // OPEN_SHARED_CACHE see the same database.
+    OPEN_MEMORY = 1 << 7,
+
+    // Stores the database compressed, see CompressedVfs. Any VFS name given
+    // to Open() is ignored.
+    OPEN_COMPRESSED = 1 << 8,
+
+    // Records the connection's file I/O for GetIoStats(), see
+    // InstrumentedVfs. Combines with the other flags and VFS names.
+    OPEN_INSTRUMENTED = 1 << 9,
+
+    // Writes the database through io_uring and reads ahead of scans, see
+    // UringVfs. Like OPEN_COMPRESSED it replaces any VFS name, and it is
+    // ignored along with OPEN_COMPRESSED. Open() fails if it isn't built in.
+    OPEN_IO_URING = 1 << 10,
+  };
+
   // Initializes the SQL connection for the given file, returning true if the
   // file could be opened. You can call this or OpenInMemory.
   //
   // The file name is always 8 bits since we want to use the 8-bit version of
   // sqlite3_open. The string can also be sqlite's special ":memory:" string.
-  bool Open(const char* path);
+  bool Open(const char* path) {
+    return Open(path, OPEN_DEFAULT, NULL);
+  }
 
   // See Open for information.
   bool Open(const std::string& path) {
     return Open(path.c_str());
   }
 
+  // Opens the database with a combination of OpenFlags and, if |vfs_name| is
+  // not NULL, the VFS registered under that name instead of the default.
+  // The pre-init configuration above applies as usual, except that a page
+  // size can't be set on a read-only database.
+  bool Open(const char* path, int flags, const char* vfs_name);
+
+  bool Open(const std::string& path, int flags) {
+    return Open(path.c_str(), flags, NULL);
+  }
+  bool Open(const std::string& path, int flags, const std::string& vfs_name) {
+    return Open(path.c_str(), flags, vfs_name.c_str());
+  }
+
   // Initializes the SQL connection for a temporary in-memory database. There
   // will be no associated file on disk, and the initial database will be
   // empty. You can call this or Open.
@@ -167,6 +327,10 @@ class Connection {
   // Returns trie if the database has been successfully opened.
   bool is_open() const { return !!db_; }
 
+  // Returns true if the main database was opened read-only, either with
+  // OPEN_READ_ONLY or because the file couldn't be opened for writing.
+  bool is_read_only() const;
+
   // Closes the database. This is automatically performed on destruction for
   // you, but this allows you to close the database early. You must not call
   // any other functions after closing it. It is permissable to call Close on
@@ -190,6 +354,10 @@ class Connection {
   // no open transactions.
   unsigned int transaction_nesting() const { return transaction_nesting_; }
 
+  // Returns the number of outermost transactions begun so far, which
+  // identifies the current one while transaction_nesting() is not 0.
+  uint64 transaction_count() const { return transaction_count_; }
+
   // Statements ----------------------------------------------------------------
 
   // Executes the given SQL string, returning true on success. This is
@@ -238,6 +406,23 @@ class Connection {
     return GetCachedStatement(id, sql.c_str());
   }
 
+  // Returns the cached statement for a statement declared in the
+  // StatementRegistry. See GetCachedStatement above for information.
+  scoped_refptr<StatementRef> GetCachedStatement(
+      const RegisteredStatement& statement);
+
+  // Prepares every statement in the StatementRegistry that isn't cached yet
+  // and adds it to the statement cache. Returns true if they all prepared.
+  // Otherwise, if |errors| is non-NULL, one message per failed statement is
+  // appended to it, so that all of them can be reported together.
+  bool WarmStatements(std::vector<std::string>* errors);
+
+  // The errors from warming statements during Open(), if requested with
+  // set_warm_statements_on_open().
+  const std::vector<std::string>& warmup_errors() const {
+    return warmup_errors_;
+  }
+
   // Returns a non-cached statement for the given SQL. Use this for SQL that
   // is only executed once or only rarely (there is overhead associated with
   // keeping a statement cached).
@@ -250,6 +435,24 @@ class Connection {
     return GetUniqueStatement(sql.c_str());
   }
 
+  // Result cache --------------------------------------------------------------
+
+  // Enables caching the results of CachedQuery() up to |max_bytes| of memory,
+  // or disables it when |max_bytes| is 0. See ResultCache for how cached
+  // results are kept up to date.
+  void EnableResultCache(size_t max_bytes);
+
+  // Returns the result cache, or NULL if it is not enabled.
+  ResultCache* result_cache() const { return result_cache_.get(); }
+
+  // Runs |sql| with |params| bound in order and stores every row in |rows|,
+  // going through the result cache when it is enabled. The StatementID and
+  // SQL are used as for GetCachedStatement. Returns false on error.
+  bool CachedQuery(const StatementID& id,
+                   const char* sql,
+                   const Row& params,
+                   std::vector<Row>* rows);
+
   // Backup --------------------------------------------------------------------
 
   // Returns if backing up the database was successful
@@ -268,9 +471,46 @@ class Connection {
   // Returns if backing up the temporary database was successful
   bool BackupTemporaryTo(Connection& conn) const;
 
+  // Serialization -------------------------------------------------------------
+
+  // Copies the whole |schema| database ("main", "temp" or the name of an
+  // attached one) into |database|. Returns false if the database isn't open,
+  // |schema| doesn't exist or sqlite was built without serialization.
+  //
+  // If |borrow| is true and the database lives in sqlite's in-memory VFS,
+  // which is the case after Deserialize(), |database| points at the
+  // database's own memory instead of a copy. It is then only valid until the
+  // database is next written or closed. Other databases are always copied.
+  bool Serialize(const char* schema,
+                 bool borrow,
+                 SerializedDatabase* database) const;
+
+  // Copies the main database, see above.
+  bool Serialize(SerializedDatabase* database) const {
+    return Serialize("main", false, database);
+  }
+
+  // Replaces the contents of the main database with |database|, which then
+  // lives in memory. If the connection isn't open yet it is first opened on
+  // an empty in-memory database. Fails if a transaction is open.
+  //
+  // If |read_only| is true the database uses |database|'s buffer in place,
+  // without copying it, so |database| must outlive the connection or the
+  // next Deserialize(). Otherwise the connection gets its own copy, which
+  // can grow.
+  bool Deserialize(const SerializedDatabase& database, bool read_only);
+
   // Info querying -------------------------------------------------------------
 
-  // Returns true if the given table exists.
+  // Returns the in-memory catalog of the main database's tables, columns and
+  // indexes. It is loaded on first use and reloaded only when the schema
+  // changes. Returns NULL if the database is not open.
+  SchemaCatalog* GetSchemaCatalog() const;
+
+  // Returns true if the given table exists in the main database. The name
+  // must match exactly; views and the tables of the temp and attached
+  // databases are not found. See SchemaCatalog::DoesTableOrViewExist for a
+  // lookup that resolves names the way a query does.
   bool DoesTableExist(const char* table_name) const;
 
   // See DoesTableExist for information.
@@ -287,6 +527,35 @@ class Connection {
     return DoesColumnExist(table_name.c_str(), column_name.c_str());
   }
 
+  // Returns the value of "PRAGMA data_version", which changes whenever
+  // another connection commits a change to the main database. Commits made
+  // through this connection leave it unchanged. Returns 0 if the database is
+  // closed or the pragma fails.
+  int64 GetDataVersion() const;
+
+  // Returns sqlite's count of every row inserted, updated or deleted since the
+  // database was opened, including changes made by triggers. Will be 0 if
+  // the database is closed.
+  int64 GetTotalChangeCount() const;
+
+  // Checks the query plans of every statement in the statement cache for
+  // full table scans, sorts and automatic indexes, and suggests indexes that
+  // would avoid them, most beneficial first. The suggestions are checked
+  // against an in-memory copy of the schema; nothing is changed in the
+  // database. See IndexAdvisor. Returns false on failure.
+  bool AnalyzeWorkload(WorkloadReport* report);
+
+  // Fills in |stats| with this connection's and the process's memory usage.
+  // The process figures are filled in even if the database is closed.
+  // Returns false if the database is closed.
+  bool GetMemoryStats(MemoryStats* stats) const;
+
+  // Fills in |stats| with the file I/O the connection did since it was
+  // opened or ResetIoStats() was called. Returns false unless the database
+  // is open with OPEN_INSTRUMENTED.
+  bool GetIoStats(IoStats* stats) const;
+  void ResetIoStats();
+
   // Returns sqlite's internal ID for the last inserted row. Valid only
   // immediately after an insert.
   int64 GetLastInsertRowId() const;
@@ -296,6 +565,56 @@ class Connection {
   // is closed.
   int GetLastChangeCount() const;
 
+  // Memory --------------------------------------------------------------------
+
+  enum MemoryPressure {
+    // Drops the least recently used half of the cached statements that
+    // aren't in use and the page cache pages that aren't in use.
+    MEMORY_PRESSURE_MODERATE,
+
+    // Drops every cached statement that isn't in use, the result cache, and
+    // the page cache pages that aren't in use.
+    MEMORY_PRESSURE_CRITICAL,
+  };
+
+  // Frees memory held by this connection that it can do without, at the cost
+  // of re-preparing statements and re-reading pages later. Statements held by
+  // a sql::Statement are never dropped. Returns the number of bytes freed
+  // from the page cache and statements, as far as sqlite can tell.
+  int64 ReleaseMemory(MemoryPressure level);
+
+  // Sets how many bytes of heap sqlite may use across the whole process, or
+  // removes the limit when |bytes| is 0. This is also given to sqlite as its
+  // soft heap limit. Once sqlite's usage passes 90% of the budget, a
+  // connection that needs to prepare a new statement first calls
+  // ReleaseMemory(MEMORY_PRESSURE_MODERATE) on itself.
+  static void SetProcessMemoryBudget(int64 bytes);
+  static int64 GetProcessMemoryBudget();
+
+  // Change observers -----------------------------------------------------------
+
+  // Adds or removes an observer of row changes and rollbacks. The connection
+  // doesn't own observers, which must be removed before they are destroyed.
+  // Observers stay registered across Close() and Open().
+  void AddChangeObserver(ChangeObserver* observer);
+  void RemoveChangeObserver(ChangeObserver* observer);
+
+  // Installs |authorizer| as sqlite's authorizer, called with |arg| for every
+  // action of every statement being prepared; see sqlite3_set_authorizer().
+  // NULL removes it. It stays installed across Close() and Open().
+  typedef int (*Authorizer)(void* arg, int action, const char* arg1,
+                            const char* arg2, const char* database,
+                            const char* trigger);
+  void SetAuthorizer(Authorizer authorizer, void* arg);
+
+  // Installs |handler| as sqlite's progress handler, called with |arg| about
+  // every |instructions| virtual machine instructions while a statement runs;
+  // see sqlite3_progress_handler(). Returning non-zero interrupts the
+  // statement. NULL removes it. It stays installed across Close() and Open().
+  typedef int (*ProgressHandler)(void* arg);
+  void SetProgressHandler(int instructions, ProgressHandler handler,
+                          void* arg);
+
   // Errors --------------------------------------------------------------------
 
   // Returns the error code associated with the last sqlite operation.
@@ -310,6 +629,16 @@ class Connection {
   // (they should go through Statement).
   friend class Statement;
 
+  // These need the raw sqlite handle.
+  friend class ChangeRecorder;
+  friend class CompressedVfs;
+  friend class IndexAdvisor;
+  friend class MaintenanceScheduler;
+  friend class ResultCache;
+  friend class Snapshot;
+  friend class UringVfs;
+  friend class VectorFunctions;
+
   // A StatementRef is a refcounted wrapper around a sqlite statement pointer.
   // Refcounting allows us to give these statements out to sql::Statement
   // objects while also optionally maintaining a cache of compiled statements
@@ -342,14 +671,35 @@ class Connection {
     // no longer be active.
     void Close();
 
+    // StatementRefs are created and destroyed for every statement use, so
+    // they come from the MemoryPool.
+    static void* operator new(size_t size);
+    static void operator delete(void* block);
+
    private:
     friend class base::RefCounted<StatementRef>;
+    friend class Connection;
+    friend class Statement;
 
     ~StatementRef();
 
     Connection* connection_;
     sqlite3_stmt* stmt_;
 
+    // Links in the connection's list of open statements.
+    StatementRef* previous_;
+    StatementRef* next_;
+
+    // The connection's statement_use_count_ when this statement was last
+    // taken from the statement cache.
+    uint64 last_used_;
+
+    // Whether the statement has been stepped since it was last reset, and
+    // whether anything has been bound since the bindings were last cleared.
+    // Statement uses these to skip resets and clears that would do nothing.
+    bool stepped_;
+    bool has_bindings_;
+
     DISALLOW_COPY_AND_ASSIGN(StatementRef);
   };
   friend class StatementRef;
@@ -362,6 +712,13 @@ class Connection {
   // Frees all cached statements from statement_cache_.
   void ClearCache();
 
+  // Runs |sql| through the statement cache and appends every row to |rows|.
+  // This is CachedQuery() without the result cache.
+  bool QueryRows(const StatementID& id,
+                 const char* sql,
+                 const Row& params,
+                 std::vector<Row>* rows);
+
   // Called by Statement objects when an sqlite function returns an error.
   // The return value is the error code reflected back to client code.
   int OnSqliteError(int err, Statement* stmt);
@@ -370,6 +727,22 @@ class Connection {
   // "'sql_sp_{transaction_nesting_}_'"
   std::string SavePointName() const;
 
+  // Installs or removes the sqlite hooks that feed |change_observers_|.
+  void UpdateChangeHooks();
+
+  // Called by ChangeRecorder before it creates an sqlite session and after
+  // it deletes one. Sessions use sqlite's preupdate hook, so while any
+  // exist the update hook feeds |change_observers_| instead.
+  void AddSession();
+  void RemoveSession();
+
+  // Holds the functions given to sqlite as hooks, which need sqlite's own
+  // types in their signatures. Defined in connection.cc.
+  class HookTrampolines;
+
+  // Makes the schema catalog reload on its next use, see schema_catalog_.
+  void InvalidateSchemaCatalog();
+
   // Releases/Commits the current transaction.
   bool ReleaseTransaction();
 
@@ -381,23 +754,70 @@ class Connection {
   // use the default value.
   int page_size_;
   int cache_size_;
+  int lookaside_slot_size_;
+  int lookaside_slot_count_;
   bool exclusive_locking_;
+  bool warm_statements_on_open_;
+
+  // See warmup_errors().
+  std::vector<std::string> warmup_errors_;
+
+  // Called when a statement is about to be prepared for the statement cache.
+  // Releases memory if the process is near its budget.
+  void CheckMemoryBudget();
 
   // All cached statements. Keeping a reference to these statements means that
   // they'll remain active.
-  typedef std::map<StatementID, scoped_refptr<StatementRef> >
+  typedef std::map<StatementID, scoped_refptr<StatementRef>,
+                   std::less<StatementID>,
+                   PoolAllocator<std::pair<const StatementID,
+                                           scoped_refptr<StatementRef> > > >
       CachedStatementMap;
   CachedStatementMap statement_cache_;
 
+  // Counts the times a statement was taken from the statement cache, which
+  // tells ReleaseMemory() which ones are cold.
+  uint64 statement_use_count_;
+
   // A list of all StatementRefs we've given out. Each ref must register with
   // us when it's created or destroyed. This allows us to potentially close
-  // any open statements when we encounter an error.
-  typedef std::set<StatementRef*> StatementRefSet;
-  StatementRefSet open_statements_;
+  // any open statements when we encounter an error. The list is linked
+  // through the refs themselves so that tracking them never allocates.
+  StatementRef* open_statements_;
+
+  // Created by GetSchemaCatalog() and destroyed when the database is closed.
+  mutable std::unique_ptr<SchemaCatalog> schema_catalog_;
+
+  // See AddChangeObserver().
+  typedef std::vector<ChangeObserver*> ChangeObserverList;
+  ChangeObserverList change_observers_;
+
+  // See AddSession().
+  int session_count_;
+
+  // See SetAuthorizer().
+  Authorizer authorizer_;
+  void* authorizer_arg_;
+
+  // See SetProgressHandler().
+  int progress_instructions_;
+  ProgressHandler progress_handler_;
+  void* progress_arg_;
+
+  // See EnableResultCache(). This is declared after |change_observers_| so
+  // that it can still unregister itself when the connection is destroyed.
+  std::unique_ptr<ResultCache> result_cache_;
+
+  // The VFS recording I/O for GetIoStats(), while open with
+  // OPEN_INSTRUMENTED. It is destroyed after the database is closed.
+  std::unique_ptr<InstrumentedVfs> instrumented_vfs_;
 
   // Number of currently-nested transactions.
   unsigned int transaction_nesting_;
 
+  // Number of outermost transactions begun, see transaction_count().
+  uint64 transaction_count_;
+
   // This object handles errors resulting from all forms of executing sqlite
   // commands or statements. It can be null which means default handling.
   scoped_refptr<ErrorDelegate> error_delegate_;
@@ -0,0 +1,333 @@
+// Copyright (c) 2010 Garrett R. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "connection_cache.h"
+
+#include "connection.h"
+#include "statement.h"
+
+namespace sql {
+
+namespace {
+
+// Returns the memory |connection| holds for its page cache, schema and
+// prepared statements.
+int64 MeasureMemory(const Connection& connection) {
+  MemoryStats stats;
+  if (!connection.GetMemoryStats(&stats))
+    return 0;
+  return stats.cache_used + stats.schema_used + stats.statement_used;
+}
+
+}  // namespace
+
+ConnectionCache::Stats::Stats()
+    : hits(0),
+      prefetch_hits(0),
+      misses(0),
+      prefetches(0),
+      evictions(0),
+      connections(0),
+      leased(0),
+      file_descriptors(0),
+      memory_bytes(0) {
+}
+
+ConnectionCache::Lease::Lease()
+    : cache_(NULL),
+      file_descriptors_(0) {
+}
+
+ConnectionCache::Lease::Lease(ConnectionCache* cache,
+                              const std::string& path,
+                              std::unique_ptr<Connection> connection,
+                              int file_descriptors)
+    : cache_(cache),
+      path_(path),
+      connection_(std::move(connection)),
+      file_descriptors_(file_descriptors) {
+}
+
+ConnectionCache::Lease::Lease(Lease&& other)
+    : cache_(other.cache_),
+      path_(std::move(other.path_)),
+      connection_(std::move(other.connection_)),
+      file_descriptors_(other.file_descriptors_) {
+  other.cache_ = NULL;
+}
+
+ConnectionCache::Lease& ConnectionCache::Lease::operator=(Lease&& other) {
+  if (this != &other) {
+    Return(false);
+    cache_ = other.cache_;
+    path_ = std::move(other.path_);
+    connection_ = std::move(other.connection_);
+    file_descriptors_ = other.file_descriptors_;
+    other.cache_ = NULL;
+  }
+  return *this;
+}
+
+ConnectionCache::Lease::~Lease() {
+  Return(false);
+}
+
+void ConnectionCache::Lease::Discard() {
+  Return(true);
+}
+
+void ConnectionCache::Lease::Return(bool discard) {
+  if (cache_ && connection_)
+    cache_->Return(path_, std::move(connection_), file_descriptors_, discard);
+  cache_ = NULL;
+  connection_.reset();
+}
+
+ConnectionCache::ConnectionCache()
+    : open_flags_(Connection::OPEN_DEFAULT),
+      max_connections_(64),
+      max_file_descriptors_(0),
+      max_memory_bytes_(0),
+      connections_(0),
+      leased_(0),
+      file_descriptors_(0),
+      memory_bytes_(0),
+      quit_(false) {
+}
+
+ConnectionCache::~ConnectionCache() {
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    quit_ = true;
+  }
+  prefetch_available_.notify_one();
+  if (prefetch_thread_.joinable())
+    prefetch_thread_.join();
+  Clear();
+}
+
+void ConnectionCache::set_max_connections(int connections) {
+  std::vector<Entry> evicted;
+  std::lock_guard<std::mutex> lock(lock_);
+  max_connections_ = connections;
+  EnforceLimits(&evicted);
+}
+
+void ConnectionCache::set_max_file_descriptors(int file_descriptors) {
+  std::vector<Entry> evicted;
+  std::lock_guard<std::mutex> lock(lock_);
+  max_file_descriptors_ = file_descriptors;
+  EnforceLimits(&evicted);
+}
+
+void ConnectionCache::set_max_memory_bytes(int64 bytes) {
+  std::vector<Entry> evicted;
+  std::lock_guard<std::mutex> lock(lock_);
+  max_memory_bytes_ = bytes;
+  EnforceLimits(&evicted);
+}
+
+ConnectionCache::Lease ConnectionCache::Acquire(const std::string& path) {
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    PathMap::iterator found = idle_by_path_.find(path);
+    if (found != idle_by_path_.end()) {
+      Entry entry = RemoveIdle(found->second);
+      memory_bytes_ -= entry.memory_bytes;
+      ++leased_;
+      ++stats_.hits;
+      if (entry.prefetched)
+        ++stats_.prefetch_hits;
+      return Lease(this, path, std::move(entry.connection),
+                   entry.file_descriptors);
+    }
+    ++stats_.misses;
+  }
+
+  int file_descriptors;
+  std::unique_ptr<Connection> connection =
+      OpenConnection(path, &file_descriptors);
+  if (!connection)
+    return Lease();
+
+  // The new connection is leased, so it can't be evicted, but it can push
+  // idle ones out.
+  std::vector<Entry> evicted;
+  std::lock_guard<std::mutex> lock(lock_);
+  ++connections_;
+  ++leased_;
+  file_descriptors_ += file_descriptors;
+  EnforceLimits(&evicted);
+  return Lease(this, path, std::move(connection), file_descriptors);
+}
+
+void ConnectionCache::Prefetch(const std::string& path) {
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    if (idle_by_path_.count(path) || !prefetch_pending_.insert(path).second)
+      return;
+    prefetch_queue_.push_back(path);
+    if (!prefetch_thread_.joinable())
+      prefetch_thread_ = std::thread(&ConnectionCache::PrefetchMain, this);
+  }
+  prefetch_available_.notify_one();
+}
+
+void ConnectionCache::Evict(const std::string& path) {
+  std::vector<Entry> evicted;
+  std::lock_guard<std::mutex> lock(lock_);
+  for (PathMap::iterator it = idle_by_path_.find(path);
+       it != idle_by_path_.end();
+       it = idle_by_path_.find(path)) {
+    evicted.push_back(RemoveIdle(it->second));
+    --connections_;
+    file_descriptors_ -= evicted.back().file_descriptors;
+    memory_bytes_ -= evicted.back().memory_bytes;
+  }
+}
+
+void ConnectionCache::Clear() {
+  std::vector<Entry> evicted;
+  std::lock_guard<std::mutex> lock(lock_);
+  while (!idle_.empty()) {
+    evicted.push_back(RemoveIdle(--idle_.end()));
+    --connections_;
+    file_descriptors_ -= evicted.back().file_descriptors;
+    memory_bytes_ -= evicted.back().memory_bytes;
+  }
+}
+
+ConnectionCache::Stats ConnectionCache::GetStats() const {
+  std::lock_guard<std::mutex> lock(lock_);
+  Stats stats = stats_;
+  stats.connections = connections_;
+  stats.leased = leased_;
+  stats.file_descriptors = file_descriptors_;
+  stats.memory_bytes = memory_bytes_;
+  return stats;
+}
+
+std::unique_ptr<Connection> ConnectionCache::OpenConnection(
+    const std::string& path,
+    int* file_descriptors) {
+  std::unique_ptr<Connection> connection(new Connection());
+  connection->set_warm_statements_on_open();
+  if (configure_callback_)
+    configure_callback_(connection.get());
+  if (!connection->Open(path, open_flags_))
+    return std::unique_ptr<Connection>();
+
+  // A WAL database also keeps its -wal and -shm files open.
+  *file_descriptors = 1;
+  Statement journal_mode(connection->GetUniqueStatement(
+      "PRAGMA journal_mode"));
+  if (journal_mode.Step() && journal_mode.ColumnString(0) == "wal")
+    *file_descriptors = 3;
+  return connection;
+}
+
+void ConnectionCache::AddIdle(Entry entry) {
+  std::string path = entry.path;
+  idle_.push_front(std::move(entry));
+  idle_by_path_.insert(std::make_pair(path, idle_.begin()));
+}
+
+ConnectionCache::Entry ConnectionCache::RemoveIdle(EntryList::iterator entry) {
+  std::pair<PathMap::iterator, PathMap::iterator> range =
+      idle_by_path_.equal_range(entry->path);
+  for (PathMap::iterator it = range.first; it != range.second; ++it) {
+    if (it->second == entry) {
+      idle_by_path_.erase(it);
+      break;
+    }
+  }
+  Entry removed = std::move(*entry);
+  idle_.erase(entry);
+  return removed;
+}
+
+void ConnectionCache::EnforceLimits(std::vector<Entry>* evicted) {
+  while (!idle_.empty() &&
+         ((max_connections_ && connections_ > max_connections_) ||
+          (max_file_descriptors_ &&
+           file_descriptors_ > max_file_descriptors_) ||
+          (max_memory_bytes_ && memory_bytes_ > max_memory_bytes_))) {
+    evicted->push_back(RemoveIdle(--idle_.end()));
+    --connections_;
+    file_descriptors_ -= evicted->back().file_descriptors;
+    memory_bytes_ -= evicted->back().memory_bytes;
+    ++stats_.evictions;
+  }
+}
+
+void ConnectionCache::Return(const std::string& path,
+                             std::unique_ptr<Connection> connection,
+                             int file_descriptors,
+                             bool discard) {
+  // The connection is ours again, so it can be measured without the lock.
+  int64 memory_bytes = discard ? 0 : MeasureMemory(*connection);
+
+  std::vector<Entry> evicted;
+  std::lock_guard<std::mutex> lock(lock_);
+  --leased_;
+  if (discard || !connection->is_open()) {
+    --connections_;
+    file_descriptors_ -= file_descriptors;
+    // Closed after the lock is released, with the evicted connections.
+    Entry closed;
+    closed.connection = std::move(connection);
+    evicted.push_back(std::move(closed));
+    return;
+  }
+
+  Entry entry;
+  entry.path = path;
+  entry.connection = std::move(connection);
+  entry.file_descriptors = file_descriptors;
+  entry.memory_bytes = memory_bytes;
+  entry.prefetched = false;
+  memory_bytes_ += memory_bytes;
+  AddIdle(std::move(entry));
+  EnforceLimits(&evicted);
+}
+
+void ConnectionCache::PrefetchMain() {
+  for (;;) {
+    std::string path;
+    {
+      std::unique_lock<std::mutex> lock(lock_);
+      while (prefetch_queue_.empty() && !quit_)
+        prefetch_available_.wait(lock);
+      if (quit_)
+        break;
+      path = prefetch_queue_.front();
+      prefetch_queue_.pop_front();
+    }
+
+    int file_descriptors;
+    std::unique_ptr<Connection> connection =
+        OpenConnection(path, &file_descriptors);
+    int64 memory_bytes = connection ? MeasureMemory(*connection) : 0;
+
+    std::vector<Entry> evicted;
+    std::lock_guard<std::mutex> lock(lock_);
+    prefetch_pending_.erase(path);
+    if (!connection)
+      continue;
+    Entry entry;
+    entry.path = path;
+    entry.connection = std::move(connection);
+    entry.file_descriptors = file_descriptors;
+    entry.memory_bytes = memory_bytes;
+    entry.prefetched = true;
+    ++connections_;
+    file_descriptors_ += file_descriptors;
+    memory_bytes_ += memory_bytes;
+    ++stats_.prefetches;
+    AddIdle(std::move(entry));
+    EnforceLimits(&evicted);
+  }
+}
+
+}  // namespace sql
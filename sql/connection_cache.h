@@ -0,0 +1,229 @@
+// Copyright (c) 2010 Garrett R. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef SQL_CONNECTION_CACHE_H_
+#define SQL_CONNECTION_CACHE_H_
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "basictypes.h"
+
+namespace sql {
+
+class Connection;
+
+// ConnectionCache keeps connections to many database files open between
+// uses, so that a request for one of them doesn't pay for opening the file,
+// parsing its schema and preparing its statements again. It is meant for
+// servers with a database per tenant:
+//
+//   sql::ConnectionCache cache;
+//   cache.set_max_file_descriptors(1024);
+//   ...
+//   sql::ConnectionCache::Lease db = cache.Acquire(TenantPath(tenant));
+//   if (!db)
+//     return false;
+//   sql::Statement s(db->GetCachedStatement(SQL_FROM_HERE, "SELECT ..."));
+//
+// A Lease gives its holder sole use of a connection until it is destroyed,
+// which returns the connection to the cache with its statement cache intact.
+// Acquiring a path whose connections are all leased opens another one.
+//
+// Idle connections are closed, least recently used first, when the cache
+// holds more connections, file descriptors or memory than its limits allow.
+// Leased connections are never closed, so the limits can be exceeded while
+// too many are leased at once. A connection is counted as one descriptor,
+// or three in WAL mode, for the WAL and its shared memory.
+//
+// Connections are opened with the open flags and configure callback set
+// below, with Connection::set_warm_statements_on_open(), so every statement
+// in the StatementRegistry is ready on a new connection. Prefetch() opens
+// one in the background for a path that is about to be needed.
+//
+// The methods may be called from any thread. Every Lease must be destroyed
+// before the cache.
+class ConnectionCache {
+ public:
+  // Called with each new connection before it is opened, for settings such
+  // as Connection::set_cache_size(). It runs on the prefetch thread for
+  // prefetched connections.
+  typedef std::function<void(Connection* connection)> ConfigureCallback;
+
+  struct Stats {
+    Stats();
+
+    // Acquire() calls that found an idle connection, the ones of those that
+    // had been opened by Prefetch(), and the ones that opened a connection.
+    int64 hits;
+    int64 prefetch_hits;
+    int64 misses;
+
+    // Connections opened by Prefetch(), and idle ones closed to stay
+    // within the limits.
+    int64 prefetches;
+    int64 evictions;
+
+    // What the open connections use now, leased or idle. Memory is only
+    // counted for idle connections.
+    int connections;
+    int leased;
+    int file_descriptors;
+    int64 memory_bytes;
+  };
+
+  // A connection on loan from the cache. This object is movable but not
+  // copyable.
+  class Lease {
+   public:
+    Lease();
+    Lease(Lease&& other);
+    Lease& operator=(Lease&& other);
+
+    // Returns the connection to the cache.
+    ~Lease();
+
+    Connection* get() const { return connection_.get(); }
+    Connection* operator->() const { return connection_.get(); }
+    explicit operator bool() const { return !!connection_; }
+
+    // Closes the connection instead of returning it to the cache, for
+    // example after it reported that the database is corrupt.
+    void Discard();
+
+   private:
+    friend class ConnectionCache;
+
+    Lease(ConnectionCache* cache, const std::string& path,
+          std::unique_ptr<Connection> connection, int file_descriptors);
+
+    // Gives the connection back to the cache, or closes it if |discard|.
+    void Return(bool discard);
+
+    ConnectionCache* cache_;
+    std::string path_;
+    std::unique_ptr<Connection> connection_;
+    int file_descriptors_;
+
+    DISALLOW_COPY_AND_ASSIGN(Lease);
+  };
+
+  ConnectionCache();
+
+  // Closes every idle connection and stops the prefetch thread.
+  ~ConnectionCache();
+
+  // Limits on what the cache's connections may use. 0 means no limit. The
+  // default is 64 connections, and no limit on descriptors or memory.
+  void set_max_connections(int connections);
+  void set_max_file_descriptors(int file_descriptors);
+  void set_max_memory_bytes(int64 bytes);
+
+  // Sets the flags given to Connection::Open(), Connection::OPEN_DEFAULT by
+  // default, and the callback run on new connections.
+  //
+  // These must be called before the first Acquire() or Prefetch().
+  void set_open_flags(int flags) { open_flags_ = flags; }
+  void set_configure_callback(const ConfigureCallback& callback) {
+    configure_callback_ = callback;
+  }
+
+  // Returns a connection to |path|, opening one if none is idle. The lease
+  // is empty if the database couldn't be opened.
+  Lease Acquire(const std::string& path);
+
+  // Opens a connection to |path| on the prefetch thread, unless one is
+  // already idle or being prefetched, so that the next Acquire() finds it.
+  void Prefetch(const std::string& path);
+
+  // Closes the idle connections to |path|, for example before the file is
+  // deleted or replaced.
+  void Evict(const std::string& path);
+
+  // Closes every idle connection.
+  void Clear();
+
+  Stats GetStats() const;
+
+ private:
+  // An idle connection.
+  struct Entry {
+    std::string path;
+    std::unique_ptr<Connection> connection;
+    int file_descriptors;
+    int64 memory_bytes;
+    bool prefetched;
+  };
+  typedef std::list<Entry> EntryList;
+  typedef std::unordered_multimap<std::string, EntryList::iterator> PathMap;
+
+  // Opens a configured connection to |path|, and counts the descriptors it
+  // uses. Returns NULL on failure. Called without |lock_|.
+  std::unique_ptr<Connection> OpenConnection(const std::string& path,
+                                             int* file_descriptors);
+
+  // Adds an idle connection as the most recently used one.
+  void AddIdle(Entry entry);
+
+  // Removes the idle connection |entry| from the cache, returning it.
+  Entry RemoveIdle(EntryList::iterator entry);
+
+  // Moves idle connections into |evicted|, least recently used first, until
+  // the cache is within its limits. The caller destroys them after
+  // releasing |lock_|, since closing a connection can wait on the disk.
+  void EnforceLimits(std::vector<Entry>* evicted);
+
+  // Called by Lease.
+  void Return(const std::string& path,
+              std::unique_ptr<Connection> connection,
+              int file_descriptors,
+              bool discard);
+
+  // The prefetch thread's main loop.
+  void PrefetchMain();
+
+  int open_flags_;
+  ConfigureCallback configure_callback_;
+
+  mutable std::mutex lock_;
+
+  int max_connections_;
+  int max_file_descriptors_;
+  int64 max_memory_bytes_;
+
+  // Idle connections, the most recently used first, and by path.
+  EntryList idle_;
+  PathMap idle_by_path_;
+
+  // Totals over open connections, leased or idle, except that memory is
+  // only counted for idle ones: a leased one is measured when it returns.
+  int connections_;
+  int leased_;
+  int file_descriptors_;
+  int64 memory_bytes_;
+
+  Stats stats_;
+
+  // Paths waiting to be prefetched, in order and as a set.
+  std::deque<std::string> prefetch_queue_;
+  std::set<std::string> prefetch_pending_;
+  std::condition_variable prefetch_available_;
+  bool quit_;
+  std::thread prefetch_thread_;
+
+  DISALLOW_COPY_AND_ASSIGN(ConnectionCache);
+};
+
+}  // namespace sql
+
+#endif  // SQL_CONNECTION_CACHE_H_
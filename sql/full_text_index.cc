@@ -0,0 +1,435 @@
+// Copyright (c) 2010 Garrett R. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "full_text_index.h"
+
+#include <cctype>
+#include <chrono>
+
+#include "connection.h"
+#include "statement.h"
+#include "transaction.h"
+#include "utility.h"
+
+namespace sql {
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+// The progress of a rebuild that has indexed every row.
+const int64 kMaxRowId = 9223372036854775807LL;
+
+// The pages each step of MergeSlice() asks FTS5 to write.
+const int kMergePages = 32;
+
+}  // namespace
+
+FullTextIndex::FullTextIndex()
+    : db_(NULL),
+      rebuild_batch_rows_(1000),
+      merging_(false) {
+}
+
+FullTextIndex::~FullTextIndex() {
+}
+
+bool FullTextIndex::Init(Connection* db,
+                         const std::string& source_table,
+                         const std::vector<std::string>& columns) {
+  if (columns.empty() || !db->DoesTableExist(source_table))
+    return false;
+
+  db_ = db;
+  source_table_ = source_table;
+  columns_ = columns;
+  index_table_ = source_table + "_fts";
+  progress_table_ = index_table_ + "_progress";
+  merging_ = false;
+
+  // Fails for WITHOUT ROWID tables.
+  Statement has_rowid(db_->GetUniqueStatement(
+      "SELECT rowid FROM " + quote_identifier(source_table_) + " LIMIT 0"));
+  if (!has_rowid)
+    return false;
+
+  std::string source = quote_identifier(source_table_);
+  std::string index = quote_identifier(index_table_);
+  std::string progress = quote_identifier(progress_table_);
+  std::string column_list;
+  std::string new_values;
+  std::string old_values;
+  std::string changed = "old.rowid IS NOT new.rowid";
+  for (size_t i = 0; i < columns_.size(); ++i) {
+    std::string column = quote_identifier(columns_[i]);
+    column_list += ", " + column;
+    new_values += ", new." + column;
+    old_values += ", old." + column;
+    changed += " OR old." + column + " IS NOT new." + column;
+  }
+  // Rows past the progress of a rebuild are left to it.
+  std::string indexed_through =
+      "(SELECT indexed_through FROM " + progress + ")";
+
+  Transaction transaction(db_);
+  if (!transaction.Begin())
+    return false;
+
+  bool index_existed = db_->DoesTableExist(index_table_);
+  if (!index_existed) {
+    std::string options = ", content=" + quote(source_table_) +
+                          ", content_rowid='rowid'";
+    if (!tokenizer_.empty())
+      options += ", tokenize=" + quote(tokenizer_);
+    if (!db_->Execute("CREATE VIRTUAL TABLE " + index + " USING fts5(" +
+                      column_list.substr(2) + options + ")"))
+      return false;
+  }
+
+  if (!db_->Execute("CREATE TABLE IF NOT EXISTS " + progress +
+                    "(indexed_through INTEGER)"))
+    return false;
+
+  // An index without progress, left by an older version or by a progress
+  // table dropped on its own, can't be trusted to match the rows, so it is
+  // emptied for the rebuild below.
+  Statement has_progress(db_->GetUniqueStatement(
+      "SELECT 1 FROM " + progress));
+  if (!has_progress)
+    return false;
+  bool progress_existed = has_progress.Step();
+  has_progress.Reset();
+  if (index_existed && !progress_existed &&
+      !RunCommand("delete-all", std::string()))
+    return false;
+
+  // A new index starts out rebuilding, unless there is nothing to index.
+  if (!db_->Execute(sql::printf(
+          "INSERT INTO %s SELECT CASE WHEN EXISTS (SELECT 1 FROM %s) "
+          "THEN NULL ELSE %lld END WHERE NOT EXISTS (SELECT 1 FROM %s)",
+          progress.c_str(), source.c_str(), kMaxRowId, progress.c_str())))
+    return false;
+
+  std::string triggers[] = {
+    "CREATE TRIGGER IF NOT EXISTS " +
+        quote_identifier(index_table_ + "_insert") + " AFTER INSERT ON " +
+        source + " WHEN new.rowid <= " + indexed_through + " BEGIN " +
+        "INSERT INTO " + index + "(rowid" + column_list + ") " +
+        "VALUES (new.rowid" + new_values + "); END",
+    "CREATE TRIGGER IF NOT EXISTS " +
+        quote_identifier(index_table_ + "_delete") + " AFTER DELETE ON " +
+        source + " WHEN old.rowid <= " + indexed_through + " BEGIN " +
+        "INSERT INTO " + index + "(" + index + ", rowid" + column_list +
+        ") VALUES ('delete', old.rowid" + old_values + "); END",
+    "CREATE TRIGGER IF NOT EXISTS " +
+        quote_identifier(index_table_ + "_update") + " AFTER UPDATE ON " +
+        source + " WHEN " + changed + " BEGIN " +
+        "INSERT INTO " + index + "(" + index + ", rowid" + column_list +
+        ") SELECT 'delete', old.rowid" + old_values +
+        " WHERE old.rowid <= " + indexed_through + "; " +
+        "INSERT INTO " + index + "(rowid" + column_list + ") " +
+        "SELECT new.rowid" + new_values +
+        " WHERE new.rowid <= " + indexed_through + "; END",
+  };
+  for (size_t i = 0; i < arraysize(triggers); ++i) {
+    if (!db_->Execute(triggers[i]))
+      return false;
+  }
+
+  return transaction.Commit();
+}
+
+bool FullTextIndex::Drop() {
+  if (!db_)
+    return false;
+
+  Transaction transaction(db_);
+  if (!transaction.Begin())
+    return false;
+  const char* triggers[] = { "_insert", "_delete", "_update" };
+  for (size_t i = 0; i < arraysize(triggers); ++i) {
+    if (!db_->Execute("DROP TRIGGER IF EXISTS " +
+                      quote_identifier(index_table_ + triggers[i])))
+      return false;
+  }
+  if (!db_->Execute("DROP TABLE IF EXISTS " +
+                    quote_identifier(index_table_)) ||
+      !db_->Execute("DROP TABLE IF EXISTS " +
+                    quote_identifier(progress_table_)))
+    return false;
+  return transaction.Commit();
+}
+
+bool FullTextIndex::StartRebuild() {
+  if (!db_)
+    return false;
+
+  Transaction transaction(db_);
+  if (!transaction.Begin())
+    return false;
+  if (!RunCommand("delete-all", std::string()) ||
+      !db_->Execute("UPDATE " + quote_identifier(progress_table_) +
+                    " SET indexed_through = NULL"))
+    return false;
+  merging_ = false;
+  return transaction.Commit();
+}
+
+bool FullTextIndex::IsRebuilding() const {
+  if (!db_)
+    return false;
+
+  Statement statement(db_->GetUniqueStatement(
+      "SELECT indexed_through FROM " + quote_identifier(progress_table_)));
+  if (!statement || !statement.Step())
+    return false;
+  return statement.ColumnType(0) == COLUMN_TYPE_NULL ||
+         statement.ColumnInt64(0) != kMaxRowId;
+}
+
+bool FullTextIndex::RebuildBatch(bool* done) {
+  *done = false;
+
+  Transaction transaction(db_);
+  if (!transaction.Begin())
+    return false;
+
+  std::string progress = quote_identifier(progress_table_);
+  Statement read_progress(db_->GetUniqueStatement(
+      "SELECT indexed_through FROM " + progress));
+  if (!read_progress || !read_progress.Step())
+    return false;
+  bool started = read_progress.ColumnType(0) != COLUMN_TYPE_NULL;
+  int64 indexed_through = read_progress.ColumnInt64(0);
+  read_progress.Reset();
+  if (started && indexed_through == kMaxRowId) {
+    *done = true;
+    return transaction.Commit();
+  }
+
+  // Separate queries for the first batch keep the rowid range usable.
+  std::string source = quote_identifier(source_table_);
+  std::string remaining = started ? " WHERE rowid > ?" : "";
+  Statement batch_end(db_->GetUniqueStatement(
+      "SELECT max(rowid), count(*) FROM (SELECT rowid FROM " + source +
+      remaining + " ORDER BY rowid LIMIT ?)"));
+  if (!batch_end)
+    return false;
+  int index = 0;
+  if (started)
+    batch_end.BindInt64(index++, indexed_through);
+  batch_end.BindInt(index, rebuild_batch_rows_);
+  if (!batch_end.Step())
+    return false;
+
+  // A short batch holds every remaining row, so the rebuild finishes with
+  // it, even if rows keep being appended between batches. Rows appended
+  // from then on are indexed by the triggers.
+  int64 last_rowid = kMaxRowId;
+  if (batch_end.ColumnType(0) != COLUMN_TYPE_NULL) {
+    int64 batch_last_rowid = batch_end.ColumnInt64(0);
+    if (batch_end.ColumnInt(1) == rebuild_batch_rows_)
+      last_rowid = batch_last_rowid;
+
+    std::string column_list;
+    for (size_t i = 0; i < columns_.size(); ++i)
+      column_list += ", " + quote_identifier(columns_[i]);
+    Statement insert(db_->GetUniqueStatement(
+        "INSERT INTO " + quote_identifier(index_table_) + "(rowid" +
+        column_list + ") SELECT rowid" + column_list + " FROM " + source +
+        " WHERE " + (started ? "rowid > ? AND " : "") + "rowid <= ?"));
+    if (!insert)
+      return false;
+    index = 0;
+    if (started)
+      insert.BindInt64(index++, indexed_through);
+    insert.BindInt64(index, batch_last_rowid);
+    if (!insert.Run())
+      return false;
+  }
+
+  Statement update(db_->GetUniqueStatement(
+      "UPDATE " + progress + " SET indexed_through = ?"));
+  if (!update)
+    return false;
+  update.BindInt64(0, last_rowid);
+  if (!update.Run())
+    return false;
+
+  *done = last_rowid == kMaxRowId;
+  return transaction.Commit();
+}
+
+bool FullTextIndex::RebuildSlice(int budget_ms) {
+  if (!db_)
+    return false;
+
+  Clock::time_point deadline =
+      Clock::now() + std::chrono::milliseconds(budget_ms);
+  bool done = false;
+  do {
+    if (!RebuildBatch(&done))
+      return false;
+  } while (!done && Clock::now() < deadline);
+  return true;
+}
+
+bool FullTextIndex::Rebuild() {
+  if (!IsRebuilding() && !StartRebuild())
+    return false;
+
+  bool done = false;
+  while (!done) {
+    if (!RebuildBatch(&done))
+      return false;
+  }
+  return true;
+}
+
+bool FullTextIndex::SetAutomerge(int segments) {
+  return RunCommand("automerge", sql::printf("%d", segments));
+}
+
+bool FullTextIndex::MergeSlice(int budget_ms) {
+  if (!db_)
+    return false;
+
+  // A negative page count starts merging every segment into one, which
+  // positive counts then continue. The merge command inserts a row, and did
+  // no work if nothing else changed.
+  Clock::time_point deadline =
+      Clock::now() + std::chrono::milliseconds(budget_ms);
+  for (;;) {
+    int64 changes = db_->GetTotalChangeCount();
+    int pages = merging_ ? kMergePages : -kMergePages;
+    if (!RunCommand("merge", sql::printf("%d", pages))) {
+      merging_ = false;
+      return false;
+    }
+    if (db_->GetTotalChangeCount() - changes < 2) {
+      merging_ = false;
+      return false;
+    }
+    merging_ = true;
+    if (Clock::now() >= deadline)
+      return true;
+  }
+}
+
+bool FullTextIndex::Optimize() {
+  merging_ = false;
+  return RunCommand("optimize", std::string());
+}
+
+bool FullTextIndex::SetColumnWeights(const std::vector<double>& weights) {
+  if (weights.size() != columns_.size())
+    return false;
+
+  std::string function = "bm25(";
+  for (size_t i = 0; i < weights.size(); ++i) {
+    if (i)
+      function += ", ";
+    function += sql::printf("%.6f", weights[i]);
+  }
+  function += ")";
+  return RunCommand("rank", function);
+}
+
+bool FullTextIndex::Search(const std::string& query,
+                           int limit,
+                           std::vector<Match>* matches) {
+  matches->clear();
+  if (!db_)
+    return false;
+
+  // FTS5 sorts by rank using the index alone; the source table isn't read.
+  std::string index = quote_identifier(index_table_);
+  Statement statement(db_->GetUniqueStatement(
+      "SELECT rowid, rank FROM " + index + " WHERE " + index +
+      " MATCH ? ORDER BY rank LIMIT ?"));
+  if (!statement)
+    return false;
+  statement.BindString(0, query);
+  statement.BindInt(1, limit);
+  while (statement.Step()) {
+    Match match;
+    match.rowid = statement.ColumnInt64(0);
+    match.rank = statement.ColumnDouble(1);
+    matches->push_back(match);
+  }
+  return statement.Succeeded();
+}
+
+bool FullTextIndex::SearchWords(const std::string& words,
+                                bool prefix_last_word,
+                                int limit,
+                                std::vector<Match>* matches) {
+  std::string query = QuoteWords(words, prefix_last_word);
+  if (query.empty()) {
+    matches->clear();
+    return true;
+  }
+  return Search(query, limit, matches);
+}
+
+int64 FullTextIndex::CountMatches(const std::string& query) {
+  if (!db_)
+    return -1;
+
+  std::string index = quote_identifier(index_table_);
+  Statement statement(db_->GetUniqueStatement(
+      "SELECT count(*) FROM " + index + " WHERE " + index + " MATCH ?"));
+  if (!statement)
+    return -1;
+  statement.BindString(0, query);
+  if (!statement.Step())
+    return -1;
+  return statement.ColumnInt64(0);
+}
+
+bool FullTextIndex::RunCommand(const char* command,
+                               const std::string& argument) {
+  if (!db_)
+    return false;
+
+  std::string index = quote_identifier(index_table_);
+  std::string sql = "INSERT INTO " + index + "(" + index;
+  sql += argument.empty() ? ") VALUES (?)" : ", rank) VALUES (?, ?)";
+  Statement statement(db_->GetUniqueStatement(sql));
+  if (!statement)
+    return false;
+  statement.BindCString(0, command);
+  if (!argument.empty())
+    statement.BindString(1, argument);
+  return statement.Run();
+}
+
+// static
+std::string FullTextIndex::QuoteWords(const std::string& words,
+                                      bool prefix_last) {
+  std::string query;
+  size_t i = 0;
+  while (i < words.size()) {
+    while (i < words.size() && isspace(static_cast<unsigned char>(words[i])))
+      ++i;
+    if (i == words.size())
+      break;
+
+    if (!query.empty())
+      query += ' ';
+    query += '"';
+    for (; i < words.size() &&
+           !isspace(static_cast<unsigned char>(words[i])); ++i) {
+      if (words[i] == '"')
+        query += '"';
+      query += words[i];
+    }
+    query += '"';
+  }
+  if (prefix_last && !query.empty())
+    query += '*';
+  return query;
+}
+
+}  // namespace sql
@@ -0,0 +1,179 @@
+// Copyright (c) 2010 Garrett R. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef SQL_FULL_TEXT_INDEX_H_
+#define SQL_FULL_TEXT_INDEX_H_
+
+#include <string>
+#include <vector>
+
+#include "basictypes.h"
+
+namespace sql {
+
+class Connection;
+
+// FullTextIndex keeps an FTS5 index of some text columns of a table, so that
+// keyword searches use the index instead of scanning the table with LIKE.
+//
+// The index is an external content FTS5 table named "<table>_fts": it holds
+// only the index, and reads the text itself from the source table. Triggers
+// on the source table keep it up to date, so rows written through any
+// connection are indexed as part of the same transaction.
+//
+//   sql::FullTextIndex index;
+//   std::vector<std::string> columns;
+//   columns.push_back("title");
+//   columns.push_back("body");
+//   if (!index.Init(&db, "notes", columns))
+//     return false;
+//   index.Rebuild();
+//   ...
+//   std::vector<sql::FullTextIndex::Match> matches;
+//   index.SearchWords("quarterly report", 20, &matches);
+//
+// Indexing an existing table and merging the index's segments both take
+// time in proportion to the table, so they can be done in slices instead,
+// see RebuildSlice() and MergeSlice(). While a rebuild is in progress,
+// searches only find the rows indexed so far.
+//
+// The source table must have a rowid, so WITHOUT ROWID tables can't be
+// indexed. The FullTextIndex must be destroyed before its Connection.
+class FullTextIndex {
+ public:
+  // A row found by a search. |rank| is the bm25 score FTS5 computes, which
+  // is negative, and lower for better matches.
+  struct Match {
+    int64 rowid;
+    double rank;
+  };
+
+  FullTextIndex();
+  ~FullTextIndex();
+
+  // Sets the FTS5 tokenizer, such as "porter unicode61" to match word
+  // stems. The default is FTS5's own, "unicode61".
+  //
+  // This must be called before Init() creates the index to have an effect.
+  void set_tokenizer(const std::string& tokenizer) { tokenizer_ = tokenizer; }
+
+  // Sets the rows each step of a rebuild indexes in one transaction. The
+  // default is 1000.
+  void set_rebuild_batch_rows(int rows) { rebuild_batch_rows_ = rows; }
+
+  // Creates the index of |columns| of |source_table| and its triggers if
+  // they don't exist yet. A new index is empty; if the table has rows, a
+  // rebuild is started for them. Returns false if FTS5 isn't available or
+  // the table can't be indexed.
+  bool Init(Connection* db,
+            const std::string& source_table,
+            const std::vector<std::string>& columns);
+
+  // The name of the FTS5 table, for queries that need more than Search(),
+  // such as highlight() or snippet().
+  const std::string& index_table() const { return index_table_; }
+
+  // Drops the index and its triggers.
+  bool Drop();
+
+  // Rebuilding ----------------------------------------------------------------
+
+  // Clears the index and starts indexing the source table again, from the
+  // first rowid. The rows are indexed by RebuildSlice() or Rebuild().
+  bool StartRebuild();
+
+  // Returns true while a rebuild hasn't indexed every row.
+  bool IsRebuilding() const;
+
+  // Indexes batches of rows until the rebuild is complete or |budget_ms|
+  // has passed. Each batch is a transaction of its own, so writers aren't
+  // blocked for longer than one batch. Returns false on error.
+  bool RebuildSlice(int budget_ms);
+
+  // Finishes the rebuild in progress, or does a whole new one if there is
+  // none. Returns false on error.
+  bool Rebuild();
+
+  // Merging -------------------------------------------------------------------
+
+  // FTS5 adds a segment to the index for each transaction that writes to
+  // it, and merges them automatically as they accumulate. Setting
+  // |segments| to 0 turns automatic merging off, leaving it to
+  // MergeSlice(), so that writes never pay for it. The setting is stored in
+  // the index. Returns false on error.
+  bool SetAutomerge(int segments);
+
+  // Merges segments for up to |budget_ms|, working towards an index of a
+  // single segment the way Optimize() does, but a little at a time. Returns
+  // true if there is more merging to do, and false when there is nothing
+  // left to merge or on error.
+  bool MergeSlice(int budget_ms);
+
+  // Merges every segment into one, which makes searches fastest, in one
+  // long transaction. Returns false on error.
+  bool Optimize();
+
+  // Searching -----------------------------------------------------------------
+
+  // Sets the weight of each column in ranking, in the order given to
+  // Init(), so that a match in a title can count for more than one in a
+  // body. The weights are stored in the index. Returns false on error.
+  bool SetColumnWeights(const std::vector<double>& weights);
+
+  // Finds up to |limit| rows matching |query|, which uses FTS5's query
+  // syntax, best matches first. Returns false if the query is invalid.
+  bool Search(const std::string& query,
+              int limit,
+              std::vector<Match>* matches);
+
+  // Like Search(), but for text a user typed: finds rows containing every
+  // word of |words|, without interpreting any of it as query syntax. The
+  // last word also matches as a prefix if |prefix_last_word|, for searching
+  // as the user types.
+  bool SearchWords(const std::string& words,
+                   int limit,
+                   std::vector<Match>* matches) {
+    return SearchWords(words, false, limit, matches);
+  }
+  bool SearchWords(const std::string& words,
+                   bool prefix_last_word,
+                   int limit,
+                   std::vector<Match>* matches);
+
+  // Returns the number of rows matching |query|, or -1 on error.
+  int64 CountMatches(const std::string& query);
+
+ private:
+  // Runs an FTS5 command such as 'optimize', with |argument| as its rank
+  // value if not empty.
+  bool RunCommand(const char* command, const std::string& argument);
+
+  // Indexes one batch of rows. Sets |*done| if there were no rows left.
+  bool RebuildBatch(bool* done);
+
+  // Quotes |words| as FTS5 strings joined by spaces, which FTS5 treats as
+  // AND.
+  static std::string QuoteWords(const std::string& words, bool prefix_last);
+
+  Connection* db_;
+
+  std::string source_table_;
+  std::vector<std::string> columns_;
+  std::string tokenizer_;
+  int rebuild_batch_rows_;
+
+  // The FTS5 table, and the table holding the last rowid a rebuild has
+  // indexed. The triggers only index rows up to it.
+  std::string index_table_;
+  std::string progress_table_;
+
+  // Set once a merge pass has started, see MergeSlice().
+  bool merging_;
+
+  DISALLOW_COPY_AND_ASSIGN(FullTextIndex);
+};
+
+}  // namespace sql
+
+#endif  // SQL_FULL_TEXT_INDEX_H_
@@ -0,0 +1,648 @@
+// Copyright (c) 2010 Garrett R. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "index_advisor.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+
+#include <sqlite3.h>
+
+#include "connection.h"
+#include "schema_catalog.h"
+#include "statement.h"
+#include "utility.h"
+
+namespace sql {
+
+namespace {
+
+// The number of rows sqlite assumes a table has when it knows nothing else.
+const int64 kDefaultRowCount = 1000000;
+
+const char kStandInModule[] = "sql_index_advisor";
+
+typedef std::pair<std::string, std::vector<std::string> > IndexColumns;
+
+// The tables the stand-in virtual tables imitate, and where xBestIndex
+// records what it learns about the statement being prepared.
+struct StandInSchema {
+  StandInSchema() : candidates(NULL), tables_read(NULL) {}
+
+  std::map<std::string, std::vector<ColumnInfo> > tables;
+
+  std::set<IndexColumns>* candidates;
+  std::set<std::string>* tables_read;
+};
+
+struct StandInTable {
+  sqlite3_vtab base;
+  StandInSchema* schema;
+  std::string name;
+};
+
+struct StandInCursor {
+  sqlite3_vtab_cursor base;
+};
+
+int StandInConnect(sqlite3* db, void* aux, int argc, const char* const* argv,
+                   sqlite3_vtab** vtab, char** error) {
+  StandInSchema* schema = static_cast<StandInSchema*>(aux);
+  std::map<std::string, std::vector<ColumnInfo> >::const_iterator found =
+      argc > 2 ? schema->tables.find(argv[2]) : schema->tables.end();
+  if (found == schema->tables.end()) {
+    *error = sqlite3_mprintf("no such table");
+    return SQLITE_ERROR;
+  }
+
+  std::string declaration("CREATE TABLE x(");
+  for (size_t i = 0; i < found->second.size(); ++i) {
+    if (i)
+      declaration.append(", ");
+    declaration.append(quote_identifier(found->second[i].name));
+    declaration.append(" ");
+    declaration.append(found->second[i].declared_type);
+  }
+  declaration.append(")");
+
+  int err = sqlite3_declare_vtab(db, declaration.c_str());
+  if (err != SQLITE_OK)
+    return err;
+
+  StandInTable* table = new StandInTable;
+  memset(&table->base, 0, sizeof(table->base));
+  table->schema = schema;
+  table->name = found->first;
+  *vtab = &table->base;
+  return SQLITE_OK;
+}
+
+int StandInBestIndex(sqlite3_vtab* vtab, sqlite3_index_info* info) {
+  StandInTable* table = reinterpret_cast<StandInTable*>(vtab);
+  StandInSchema* schema = table->schema;
+  const std::vector<ColumnInfo>& columns = schema->tables[table->name];
+
+  if (schema->tables_read)
+    schema->tables_read->insert(table->name);
+
+  // Equality constraints make the leading columns of an index, followed by
+  // either one range constraint or the ORDER BY columns.
+  std::vector<std::string> equal;
+  std::string range;
+  for (int i = 0; i < info->nConstraint; ++i) {
+    const sqlite3_index_info::sqlite3_index_constraint& constraint =
+        info->aConstraint[i];
+    if (!constraint.usable || constraint.iColumn < 0)
+      continue;
+
+    const std::string& column = columns[constraint.iColumn].name;
+    switch (constraint.op) {
+      case SQLITE_INDEX_CONSTRAINT_EQ:
+      case SQLITE_INDEX_CONSTRAINT_IS:
+        if (std::find(equal.begin(), equal.end(), column) == equal.end())
+          equal.push_back(column);
+        break;
+      case SQLITE_INDEX_CONSTRAINT_GT:
+      case SQLITE_INDEX_CONSTRAINT_LE:
+      case SQLITE_INDEX_CONSTRAINT_LT:
+      case SQLITE_INDEX_CONSTRAINT_GE:
+        if (range.empty())
+          range = column;
+        break;
+    }
+  }
+
+  if (schema->candidates) {
+    std::vector<std::string> with_range(equal);
+    if (!range.empty() &&
+        std::find(equal.begin(), equal.end(), range) == equal.end())
+      with_range.push_back(range);
+    if (!with_range.empty())
+      schema->candidates->insert(IndexColumns(table->name, with_range));
+
+    std::vector<std::string> with_order(equal);
+    for (int i = 0; i < info->nOrderBy; ++i) {
+      if (info->aOrderBy[i].iColumn < 0)
+        break;
+      const std::string& column = columns[info->aOrderBy[i].iColumn].name;
+      if (std::find(with_order.begin(), with_order.end(), column) ==
+          with_order.end())
+        with_order.push_back(column);
+    }
+    if (with_order.size() > equal.size())
+      schema->candidates->insert(IndexColumns(table->name, with_order));
+  }
+
+  // Make constrained plans look cheaper so that sqlite asks about them.
+  info->estimatedCost =
+      static_cast<double>(kDefaultRowCount) / (1 + 10 * equal.size());
+  return SQLITE_OK;
+}
+
+int StandInDisconnect(sqlite3_vtab* vtab) {
+  delete reinterpret_cast<StandInTable*>(vtab);
+  return SQLITE_OK;
+}
+
+int StandInOpen(sqlite3_vtab* /*vtab*/, sqlite3_vtab_cursor** cursor) {
+  StandInCursor* result = new StandInCursor;
+  memset(&result->base, 0, sizeof(result->base));
+  *cursor = &result->base;
+  return SQLITE_OK;
+}
+
+int StandInClose(sqlite3_vtab_cursor* cursor) {
+  delete reinterpret_cast<StandInCursor*>(cursor);
+  return SQLITE_OK;
+}
+
+int StandInFilter(sqlite3_vtab_cursor* /*cursor*/, int /*index*/,
+                  const char* /*index_name*/, int /*argc*/,
+                  sqlite3_value** /*argv*/) {
+  return SQLITE_OK;
+}
+
+int StandInNext(sqlite3_vtab_cursor* /*cursor*/) {
+  return SQLITE_OK;
+}
+
+int StandInEof(sqlite3_vtab_cursor* /*cursor*/) {
+  return 1;
+}
+
+int StandInColumn(sqlite3_vtab_cursor* /*cursor*/, sqlite3_context* context,
+                  int /*column*/) {
+  sqlite3_result_null(context);
+  return SQLITE_OK;
+}
+
+int StandInRowid(sqlite3_vtab_cursor* /*cursor*/, sqlite3_int64* rowid) {
+  *rowid = 0;
+  return SQLITE_OK;
+}
+
+// Present only so that UPDATE and DELETE statements can be prepared. The
+// stand-ins are never run.
+int StandInUpdate(sqlite3_vtab* /*vtab*/, int /*argc*/,
+                  sqlite3_value** /*argv*/, sqlite3_int64* /*rowid*/) {
+  return SQLITE_READONLY;
+}
+
+sqlite3_module* GetStandInModule() {
+  static sqlite3_module module;
+  if (!module.xBestIndex) {
+    module.iVersion = 1;
+    module.xCreate = &StandInConnect;
+    module.xConnect = &StandInConnect;
+    module.xDisconnect = &StandInDisconnect;
+    module.xDestroy = &StandInDisconnect;
+    module.xOpen = &StandInOpen;
+    module.xClose = &StandInClose;
+    module.xFilter = &StandInFilter;
+    module.xNext = &StandInNext;
+    module.xEof = &StandInEof;
+    module.xColumn = &StandInColumn;
+    module.xRowid = &StandInRowid;
+    module.xUpdate = &StandInUpdate;
+    module.xBestIndex = &StandInBestIndex;
+  }
+  return &module;
+}
+
+// Finds the plan problem reported by one line of EXPLAIN QUERY PLAN output,
+// and the table or alias it concerns. Returns false if there is none.
+bool ClassifyPlanDetail(const std::string& detail,
+                        PlanProblem::Type* type,
+                        std::string* table) {
+  table->clear();
+
+  if (detail.compare(0, 15, "USE TEMP B-TREE") == 0) {
+    *type = PlanProblem::TEMP_BTREE;
+    return true;
+  }
+
+  size_t name_start;
+  if (detail.compare(0, 5, "SCAN ") == 0)
+    name_start = 5;
+  else if (detail.compare(0, 7, "SEARCH ") == 0)
+    name_start = 7;
+  else
+    return false;
+
+  size_t name_end = detail.find(' ', name_start);
+  table->assign(detail, name_start, name_end - name_start);
+
+  if (detail.find("AUTOMATIC") != std::string::npos) {
+    *type = PlanProblem::AUTOMATIC_INDEX;
+    return true;
+  }
+
+  // Subqueries, constant rows, virtual tables and anything using an index
+  // are fine.
+  if (name_start == 5 && name_end == std::string::npos &&
+      (*table)[0] != '(') {
+    *type = PlanProblem::FULL_SCAN;
+    return true;
+  }
+  return false;
+}
+
+// Words that can follow a table name in a FROM clause without being its
+// alias.
+const char* const kNotAliases[] = {
+  "as", "cross", "except", "full", "group", "having", "indexed", "inner",
+  "intersect", "join", "left", "limit", "natural", "not", "on", "order",
+  "outer", "returning", "right", "set", "union", "using", "values", "where",
+  "window",
+};
+
+// Splits |sql| into identifiers, with quotes removed, and single punctuation
+// characters. String literals are dropped.
+void Tokenize(const std::string& sql, std::vector<std::string>* tokens) {
+  size_t i = 0;
+  while (i < sql.size()) {
+    char c = sql[i];
+    if (isspace(static_cast<unsigned char>(c))) {
+      ++i;
+    } else if (isalpha(static_cast<unsigned char>(c)) || c == '_') {
+      size_t start = i;
+      while (i < sql.size() &&
+             (isalnum(static_cast<unsigned char>(sql[i])) || sql[i] == '_' ||
+              sql[i] == '$'))
+        ++i;
+      tokens->push_back(sql.substr(start, i - start));
+    } else if (c == '"' || c == '`' || c == '[' || c == '\'') {
+      char close = c == '[' ? ']' : c;
+      std::string token;
+      for (++i; i < sql.size(); ++i) {
+        if (sql[i] == close) {
+          if (close != ']' && i + 1 < sql.size() && sql[i + 1] == close) {
+            token.push_back(close);
+            ++i;
+            continue;
+          }
+          ++i;
+          break;
+        }
+        token.push_back(sql[i]);
+      }
+      if (c != '\'')
+        tokens->push_back(token);
+      else
+        tokens->push_back("'");
+    } else {
+      tokens->push_back(std::string(1, c));
+      ++i;
+    }
+  }
+}
+
+// Maps the aliases given to |tables| in |sql| to the tables, since query
+// plans name tables by their aliases.
+void FindAliases(const std::string& sql,
+                 const std::set<std::string>& tables,
+                 std::map<std::string, std::string>* aliases) {
+  std::vector<std::string> tokens;
+  Tokenize(sql, &tokens);
+  for (size_t i = 0; i + 1 < tokens.size(); ++i) {
+    if (!tables.count(tokens[i]))
+      continue;
+    size_t alias = i + 1;
+    if (sqlite3_stricmp(tokens[alias].c_str(), "as") == 0)
+      ++alias;
+    if (alias >= tokens.size() || tables.count(tokens[alias]))
+      continue;
+
+    const std::string& name = tokens[alias];
+    bool is_alias = !name.empty() &&
+        (isalpha(static_cast<unsigned char>(name[0])) || name[0] == '_');
+    for (size_t j = 0; is_alias && j < arraysize(kNotAliases); ++j) {
+      if (sqlite3_stricmp(name.c_str(), kNotAliases[j]) == 0)
+        is_alias = false;
+    }
+    if (is_alias)
+      (*aliases)[name] = tokens[i];
+  }
+}
+
+// Returns true if |detail| says the plan uses the index named |index|.
+bool UsesIndex(const std::string& detail, const std::string& index) {
+  std::string needle("INDEX ");
+  needle.append(index);
+  size_t found = detail.find(needle);
+  if (found == std::string::npos)
+    return false;
+  size_t end = found + needle.size();
+  return end == detail.size() || detail[end] == ' ';
+}
+
+}  // namespace
+
+IndexSuggestion::IndexSuggestion() : benefit(0) {
+}
+
+IndexAdvisor::IndexAdvisor(Connection* db) : db_(db) {
+}
+
+IndexAdvisor::~IndexAdvisor() {
+}
+
+void IndexAdvisor::AddStatement(const std::string& sql) {
+  if (std::find(statements_.begin(), statements_.end(), sql) ==
+      statements_.end())
+    statements_.push_back(sql);
+}
+
+bool IndexAdvisor::Analyze(WorkloadReport* report) {
+  if (!report)
+    return false;
+  report->problems.clear();
+  report->suggestions.clear();
+
+  SchemaCatalog* catalog = db_ ? db_->GetSchemaCatalog() : NULL;
+  if (!catalog)
+    return false;
+
+  // The stand-in tables, declared before the connection using them.
+  StandInSchema schema;
+  std::vector<std::string> names = catalog->GetTableNames();
+  for (size_t i = 0; i < names.size(); ++i) {
+    const TableInfo* table = catalog->GetTable(names[i]);
+    if (table && !table->is_view && !table->columns.empty() &&
+        names[i].compare(0, 7, "sqlite_") != 0)
+      schema.tables[names[i]] = table->columns;
+  }
+
+  Connection stand_in;
+  if (!stand_in.OpenInMemory() ||
+      sqlite3_create_module(stand_in.db_, kStandInModule, GetStandInModule(),
+                            &schema) != SQLITE_OK)
+    return false;
+  for (std::map<std::string, std::vector<ColumnInfo> >::const_iterator i =
+           schema.tables.begin(); i != schema.tables.end(); ++i) {
+    std::string create("CREATE VIRTUAL TABLE ");
+    create.append(quote_identifier(i->first));
+    create.append(" USING ");
+    create.append(kStandInModule);
+    if (!stand_in.Execute(create))
+      return false;
+  }
+  {
+    Statement views(db_->GetUniqueStatement(
+        "SELECT sql FROM sqlite_master WHERE type='view'"));
+    while (views.Step())
+      stand_in.Execute(views.ColumnString(0));  // Failures are harmless.
+  }
+
+  Connection copy;
+  if (!copy.OpenInMemory() || !CopySchema(&copy))
+    return false;
+
+  // Find the problems and the candidate indexes that could fix them.
+  struct AnalyzedStatement {
+    std::string sql;
+    std::set<std::string> tables;
+    int64 cost;
+  };
+  std::vector<AnalyzedStatement> analyzed;
+  std::map<IndexColumns, std::vector<size_t> > candidates;
+
+  for (size_t i = 0; i < statements_.size(); ++i) {
+    std::vector<PlanProblem> problems;
+    if (!ExplainProblems(db_, statements_[i], &problems) || problems.empty())
+      continue;
+    report->problems.insert(report->problems.end(), problems.begin(),
+                            problems.end());
+
+    std::set<IndexColumns> found;
+    AnalyzedStatement statement;
+    statement.sql = statements_[i];
+    schema.candidates = &found;
+    schema.tables_read = &statement.tables;
+    sqlite3_stmt* stmt = NULL;
+    int err = sqlite3_prepare_v2(stand_in.db_, statements_[i].c_str(), -1,
+                                 &stmt, NULL);
+    sqlite3_finalize(stmt);
+    schema.candidates = NULL;
+    schema.tables_read = NULL;
+    if (err != SQLITE_OK || found.empty())
+      continue;
+
+    statement.cost = EstimateCost(&copy, statement.sql, statement.tables,
+                                  std::string(), NULL);
+    if (statement.cost <= 0)
+      continue;
+
+    analyzed.push_back(statement);
+    for (std::set<IndexColumns>::const_iterator j = found.begin();
+         j != found.end(); ++j) {
+      if (!IsCoveredByExistingIndex(*j))
+        candidates[*j].push_back(analyzed.size() - 1);
+    }
+  }
+
+  // Try each candidate on the copy and keep the ones that pay off.
+  for (std::map<IndexColumns, std::vector<size_t> >::const_iterator i =
+           candidates.begin(); i != candidates.end(); ++i) {
+    IndexSuggestion suggestion;
+    suggestion.table = i->first.first;
+    suggestion.columns = i->first.second;
+
+    std::string name(suggestion.table);
+    std::string columns;
+    for (size_t j = 0; j < suggestion.columns.size(); ++j) {
+      name.append("_");
+      name.append(suggestion.columns[j]);
+      if (j)
+        columns.append(", ");
+      columns.append(quote_identifier(suggestion.columns[j]));
+    }
+    name.append("_index");
+    suggestion.create_sql = "CREATE INDEX " + quote_identifier(name) +
+        " ON " + quote_identifier(suggestion.table) + "(" + columns + ")";
+
+    if (!copy.Execute(suggestion.create_sql))
+      continue;
+
+    for (size_t j = 0; j < i->second.size(); ++j) {
+      const AnalyzedStatement& statement = analyzed[i->second[j]];
+      bool uses_index = false;
+      int64 cost = EstimateCost(&copy, statement.sql, statement.tables, name,
+                                &uses_index);
+      if (cost >= 0 && uses_index && cost < statement.cost) {
+        suggestion.benefit += statement.cost - cost;
+        suggestion.statements.push_back(statement.sql);
+      }
+    }
+    copy.Execute("DROP INDEX " + quote_identifier(name));
+
+    if (suggestion.benefit > 0)
+      report->suggestions.push_back(suggestion);
+  }
+
+  std::stable_sort(report->suggestions.begin(), report->suggestions.end(),
+                   [](const IndexSuggestion& a, const IndexSuggestion& b) {
+                     return a.benefit > b.benefit;
+                   });
+  return true;
+}
+
+// static
+bool IndexAdvisor::ExplainProblems(Connection* db,
+                                   const std::string& sql,
+                                   std::vector<PlanProblem>* problems) {
+  Statement plan(db->GetUniqueStatement("EXPLAIN QUERY PLAN " + sql));
+  if (!plan)
+    return false;
+
+  while (plan.Step()) {
+    PlanProblem problem;
+    std::string table;
+    problem.detail = plan.ColumnString(3);
+    if (ClassifyPlanDetail(problem.detail, &problem.type, &table)) {
+      problem.sql = sql;
+      problems->push_back(problem);
+    }
+  }
+  return plan.Succeeded();
+}
+
+bool IndexAdvisor::CopySchema(Connection* copy) {
+  Statement schema(db_->GetUniqueStatement(
+      "SELECT sql FROM sqlite_master "
+      "WHERE sql IS NOT NULL AND name NOT LIKE 'sqlite\\_%' ESCAPE '\\' "
+      "AND type IN ('table', 'index', 'view') "
+      "ORDER BY CASE type WHEN 'table' THEN 0 WHEN 'index' THEN 1 ELSE 2 END, "
+      "rowid"));
+  if (!schema)
+    return false;
+
+  // Some statements fail harmlessly, such as the shadow tables of virtual
+  // tables, which creating the virtual table already made.
+  while (schema.Step())
+    copy->Execute(schema.ColumnString(0));
+  if (!schema.Succeeded())
+    return false;
+
+  if (!db_->DoesTableExist("sqlite_stat1"))
+    return true;
+
+  // Analyzing the (empty) schema table creates sqlite_stat1. Analyzing it
+  // again after filling in the real statistics makes sqlite load them.
+  if (!copy->Execute("ANALYZE sqlite_master"))
+    return false;
+
+  Statement stats(db_->GetUniqueStatement(
+      "SELECT tbl, idx, stat FROM sqlite_stat1"));
+  Statement insert(copy->GetUniqueStatement(
+      "INSERT INTO sqlite_stat1(tbl, idx, stat) VALUES(?, ?, ?)"));
+  if (!stats || !insert)
+    return false;
+  while (stats.Step()) {
+    insert.BindValue(0, stats.ColumnValue(0));
+    insert.BindValue(1, stats.ColumnValue(1));
+    insert.BindValue(2, stats.ColumnValue(2));
+    insert.Run();
+    insert.Reset();
+  }
+
+  return copy->Execute("ANALYZE sqlite_master");
+}
+
+int64 IndexAdvisor::EstimateCost(Connection* copy,
+                                 const std::string& sql,
+                                 const std::set<std::string>& tables,
+                                 const std::string& index,
+                                 bool* uses_index) {
+  Statement plan(copy->GetUniqueStatement("EXPLAIN QUERY PLAN " + sql));
+  if (!plan)
+    return -1;
+
+  // Plans name tables by their aliases. Other names are CTEs and the like;
+  // assume the worst of them.
+  std::map<std::string, std::string> aliases;
+  FindAliases(sql, tables, &aliases);
+  int64 largest = 1;
+  for (std::set<std::string>::const_iterator i = tables.begin();
+       i != tables.end(); ++i)
+    largest = std::max(largest, GetRowCount(*i));
+
+  // Every full scan or automatic index costs the rows of its table, and
+  // every sort the rows of the table read just before it.
+  int64 cost = 0;
+  int64 last_rows = largest;
+  while (plan.Step()) {
+    std::string detail = plan.ColumnString(3);
+    if (uses_index && !index.empty() && UsesIndex(detail, index))
+      *uses_index = true;
+
+    PlanProblem::Type type;
+    std::string table;
+    bool problem = ClassifyPlanDetail(detail, &type, &table);
+    if (!table.empty()) {
+      std::map<std::string, std::string>::const_iterator alias =
+          aliases.find(table);
+      if (alias != aliases.end())
+        last_rows = GetRowCount(alias->second);
+      else
+        last_rows = tables.count(table) ? GetRowCount(table) : largest;
+    }
+    if (problem)
+      cost += last_rows;
+  }
+  return plan.Succeeded() ? cost : -1;
+}
+
+int64 IndexAdvisor::GetRowCount(const std::string& table) {
+  std::map<std::string, int64>::const_iterator found =
+      row_counts_.find(table);
+  if (found != row_counts_.end())
+    return found->second;
+
+  int64 rows = -1;
+  if (db_->DoesTableExist("sqlite_stat1")) {
+    // The first number of any of the table's statistics is its row count.
+    Statement stat(db_->GetCachedStatement(SQL_FROM_HERE,
+        "SELECT stat FROM sqlite_stat1 WHERE tbl=? LIMIT 1"));
+    stat.BindString(0, table);
+    if (stat.Step())
+      rows = atoll(stat.ColumnString(0).c_str());
+  }
+  if (rows < 0) {
+    // Cheap on rowid tables, and a good guess unless many rows were deleted.
+    Statement max_rowid(db_->GetUniqueStatement(
+        "SELECT MAX(rowid) FROM " + quote_identifier(table)));
+    if (max_rowid && max_rowid.Step())
+      rows = max_rowid.ColumnInt64(0);
+    else
+      rows = kDefaultRowCount;
+  }
+
+  // Even an empty table gets a nominal cost, so that suggestions still show
+  // up on development databases.
+  rows = std::max(rows, static_cast<int64>(1));
+  row_counts_[table] = rows;
+  return rows;
+}
+
+bool IndexAdvisor::IsCoveredByExistingIndex(const IndexColumns& candidate) {
+  SchemaCatalog* catalog = db_->GetSchemaCatalog();
+  const TableInfo* table = catalog ? catalog->GetTable(candidate.first) : NULL;
+  if (!table)
+    return false;
+
+  std::vector<std::string> indexes = table->indexes;
+  for (size_t i = 0; i < indexes.size(); ++i) {
+    const IndexInfo* index = catalog->GetIndex(indexes[i]);
+    if (index && index->columns.size() >= candidate.second.size() &&
+        std::equal(candidate.second.begin(), candidate.second.end(),
+                   index->columns.begin()))
+      return true;
+  }
+  return false;
+}
+
+}  // namespace sql
@@ -0,0 +1,131 @@
+// Copyright (c) 2010 Garrett R. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef SQL_INDEX_ADVISOR_H_
+#define SQL_INDEX_ADVISOR_H_
+
+#include <map>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "basictypes.h"
+
+namespace sql {
+
+class Connection;
+
+// Something in a statement's query plan that usually means a missing index.
+struct PlanProblem {
+  enum Type {
+    // The plan reads every row of a table ("SCAN t").
+    FULL_SCAN,
+
+    // The plan sorts rows for ORDER BY, GROUP BY or DISTINCT.
+    TEMP_BTREE,
+
+    // sqlite builds a throwaway index every time the statement runs.
+    AUTOMATIC_INDEX,
+  };
+
+  Type type;
+  std::string sql;
+
+  // The line of EXPLAIN QUERY PLAN output reporting the problem.
+  std::string detail;
+};
+
+// An index that would improve some of the analyzed statements.
+struct IndexSuggestion {
+  IndexSuggestion();
+
+  std::string table;
+  std::vector<std::string> columns;
+
+  // The statement that creates the index.
+  std::string create_sql;
+
+  // A rough count of the rows the analyzed statements would no longer have
+  // to visit or sort, each running once. Only meaningful for ranking.
+  int64 benefit;
+
+  // The analyzed statements whose plans use the index.
+  std::vector<std::string> statements;
+};
+
+struct WorkloadReport {
+  std::vector<PlanProblem> problems;
+
+  // Most beneficial first.
+  std::vector<IndexSuggestion> suggestions;
+};
+
+// IndexAdvisor looks for missing indexes the way sqlite's "expert" extension
+// does. Each statement with a plan problem is prepared against stand-in
+// virtual tables whose xBestIndex records the columns it constrains and
+// sorts on, which gives the candidate indexes without parsing any SQL. Each
+// candidate is then created in an in-memory copy of the schema (and of
+// sqlite_stat1, so the planner makes the same choices) and kept only if the
+// planner actually uses it and the plans get cheaper.
+//
+// The database itself is only read: its schema, its statistics and the
+// plans of the statements. Normally used through
+// Connection::AnalyzeWorkload().
+class IndexAdvisor {
+ public:
+  explicit IndexAdvisor(Connection* db);
+  ~IndexAdvisor();
+
+  // Adds a statement to analyze. Statements using temporary or attached
+  // tables, or functions registered on the connection, are only checked for
+  // problems.
+  void AddStatement(const std::string& sql);
+
+  // Analyzes the statements added so far. Returns false if the database is
+  // not open or its schema can't be copied.
+  bool Analyze(WorkloadReport* report);
+
+ private:
+  // A possible index: the table and the columns in order.
+  typedef std::pair<std::string, std::vector<std::string> > IndexColumns;
+
+  // Gets the plan problems for |sql| from |db|. Returns false if the
+  // statement can't be explained there.
+  static bool ExplainProblems(Connection* db,
+                              const std::string& sql,
+                              std::vector<PlanProblem>* problems);
+
+  // Creates the tables, indexes, views and statistics of the database in
+  // |copy|.
+  bool CopySchema(Connection* copy);
+
+  // Returns the estimated cost of running |sql| in |copy|, or -1 if it
+  // can't be explained. If |index| is not empty, also sets |*uses_index| to
+  // whether the plan uses the index of that name.
+  int64 EstimateCost(Connection* copy,
+                     const std::string& sql,
+                     const std::set<std::string>& tables,
+                     const std::string& index,
+                     bool* uses_index);
+
+  // Returns the estimated number of rows in |table|.
+  int64 GetRowCount(const std::string& table);
+
+  // Returns true if an existing index on |candidate|'s table starts with its
+  // columns.
+  bool IsCoveredByExistingIndex(const IndexColumns& candidate);
+
+  Connection* db_;
+  std::vector<std::string> statements_;
+
+  // See GetRowCount().
+  std::map<std::string, int64> row_counts_;
+
+  DISALLOW_COPY_AND_ASSIGN(IndexAdvisor);
+};
+
+}  // namespace sql
+
+#endif  // SQL_INDEX_ADVISOR_H_
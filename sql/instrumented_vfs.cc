@@ -0,0 +1,436 @@
+// Copyright (c) 2010 Garrett R. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "instrumented_vfs.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+
+#include <sqlite3.h>
+
+namespace sql {
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+int64 MicrosecondsSince(Clock::time_point start) {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+      Clock::now() - start).count();
+}
+
+IoStats::FileType FileTypeForFlags(int flags) {
+  if (flags & SQLITE_OPEN_MAIN_DB)
+    return IoStats::MAIN_DB;
+  if (flags & (SQLITE_OPEN_MAIN_JOURNAL | SQLITE_OPEN_SUPER_JOURNAL))
+    return IoStats::JOURNAL;
+  if (flags & SQLITE_OPEN_WAL)
+    return IoStats::WAL;
+  return IoStats::TEMP;
+}
+
+// Gives every instance its own VFS name.
+std::atomic<int> g_next_id(0);
+
+}  // namespace
+
+LatencyHistogram::LatencyHistogram()
+    : count(0),
+      total_microseconds(0),
+      max_microseconds(0) {
+  memset(buckets, 0, sizeof(buckets));
+}
+
+void LatencyHistogram::Add(int64 microseconds) {
+  int bucket = 0;
+  while (bucket < kBucketCount - 1 && (int64(1) << bucket) <= microseconds)
+    ++bucket;
+  ++buckets[bucket];
+  ++count;
+  total_microseconds += microseconds;
+  if (microseconds > max_microseconds)
+    max_microseconds = microseconds;
+}
+
+int64 LatencyHistogram::Percentile(double percentile) const {
+  if (count == 0)
+    return 0;
+
+  double wanted = count * percentile / 100;
+  int64 seen = 0;
+  for (int i = 0; i < kBucketCount - 1; ++i) {
+    seen += buckets[i];
+    if (seen >= wanted)
+      return int64(1) << i;
+  }
+  return max_microseconds;
+}
+
+FileIoStats::FileIoStats()
+    : opens(0),
+      bytes_read(0),
+      bytes_written(0),
+      busy_locks(0) {
+}
+
+IoStats::IoStats() {
+}
+
+class InstrumentedVfs::Methods {
+ public:
+  // An open file. sqlite allocates this, followed by the file of the
+  // underlying VFS.
+  struct File {
+    sqlite3_file base;
+    InstrumentedVfs* vfs;
+    IoStats::FileType type;
+
+    sqlite3_file* real() {
+      return reinterpret_cast<sqlite3_file*>(this + 1);
+    }
+  };
+
+  static const sqlite3_io_methods kIoMethods;
+
+  static File* ToFile(sqlite3_file* file) {
+    return reinterpret_cast<File*>(file);
+  }
+
+  static InstrumentedVfs* ToVfs(sqlite3_vfs* vfs) {
+    return static_cast<InstrumentedVfs*>(vfs->pAppData);
+  }
+
+  static FileIoStats* StatsFor(File* file) {
+    return &file->vfs->stats_.files[file->type];
+  }
+
+  // sqlite3_io_methods
+
+  static int Close(sqlite3_file* base) {
+    sqlite3_file* real = ToFile(base)->real();
+    return real->pMethods->xClose(real);
+  }
+
+  static int Read(sqlite3_file* base, void* buffer, int amount,
+                  sqlite3_int64 offset) {
+    File* file = ToFile(base);
+    Clock::time_point start = Clock::now();
+    int err = file->real()->pMethods->xRead(file->real(), buffer, amount,
+                                            offset);
+    int64 elapsed = MicrosecondsSince(start);
+
+    std::lock_guard<std::mutex> lock(file->vfs->lock_);
+    FileIoStats* stats = StatsFor(file);
+    stats->reads.Add(elapsed);
+    if (err == SQLITE_OK)
+      stats->bytes_read += amount;
+    return err;
+  }
+
+  static int Write(sqlite3_file* base, const void* buffer, int amount,
+                   sqlite3_int64 offset) {
+    File* file = ToFile(base);
+    Clock::time_point start = Clock::now();
+    int err = file->real()->pMethods->xWrite(file->real(), buffer, amount,
+                                             offset);
+    int64 elapsed = MicrosecondsSince(start);
+
+    std::lock_guard<std::mutex> lock(file->vfs->lock_);
+    FileIoStats* stats = StatsFor(file);
+    stats->writes.Add(elapsed);
+    if (err == SQLITE_OK)
+      stats->bytes_written += amount;
+    return err;
+  }
+
+  static int Truncate(sqlite3_file* base, sqlite3_int64 size) {
+    sqlite3_file* real = ToFile(base)->real();
+    return real->pMethods->xTruncate(real, size);
+  }
+
+  static int Sync(sqlite3_file* base, int flags) {
+    File* file = ToFile(base);
+    Clock::time_point start = Clock::now();
+    int err = file->real()->pMethods->xSync(file->real(), flags);
+    int64 elapsed = MicrosecondsSince(start);
+
+    std::lock_guard<std::mutex> lock(file->vfs->lock_);
+    StatsFor(file)->syncs.Add(elapsed);
+    return err;
+  }
+
+  static int FileSize(sqlite3_file* base, sqlite3_int64* size) {
+    sqlite3_file* real = ToFile(base)->real();
+    return real->pMethods->xFileSize(real, size);
+  }
+
+  static int Lock(sqlite3_file* base, int level) {
+    File* file = ToFile(base);
+    Clock::time_point start = Clock::now();
+    int err = file->real()->pMethods->xLock(file->real(), level);
+    RecordLock(file, err, MicrosecondsSince(start));
+    return err;
+  }
+
+  static int Unlock(sqlite3_file* base, int level) {
+    sqlite3_file* real = ToFile(base)->real();
+    return real->pMethods->xUnlock(real, level);
+  }
+
+  static int CheckReservedLock(sqlite3_file* base, int* reserved) {
+    sqlite3_file* real = ToFile(base)->real();
+    return real->pMethods->xCheckReservedLock(real, reserved);
+  }
+
+  static int FileControl(sqlite3_file* base, int op, void* arg) {
+    sqlite3_file* real = ToFile(base)->real();
+    return real->pMethods->xFileControl(real, op, arg);
+  }
+
+  static int SectorSize(sqlite3_file* base) {
+    sqlite3_file* real = ToFile(base)->real();
+    return real->pMethods->xSectorSize(real);
+  }
+
+  static int DeviceCharacteristics(sqlite3_file* base) {
+    sqlite3_file* real = ToFile(base)->real();
+    return real->pMethods->xDeviceCharacteristics(real);
+  }
+
+  static int ShmMap(sqlite3_file* base, int region, int size, int extend,
+                    void volatile** memory) {
+    sqlite3_file* real = ToFile(base)->real();
+    if (real->pMethods->iVersion < 2)
+      return SQLITE_IOERR_SHMMAP;
+    return real->pMethods->xShmMap(real, region, size, extend, memory);
+  }
+
+  static int ShmLock(sqlite3_file* base, int offset, int count, int flags) {
+    File* file = ToFile(base);
+    Clock::time_point start = Clock::now();
+    int err = file->real()->pMethods->xShmLock(file->real(), offset, count,
+                                               flags);
+    if (flags & SQLITE_SHM_LOCK)
+      RecordLock(file, err, MicrosecondsSince(start));
+    return err;
+  }
+
+  static void ShmBarrier(sqlite3_file* base) {
+    sqlite3_file* real = ToFile(base)->real();
+    real->pMethods->xShmBarrier(real);
+  }
+
+  static int ShmUnmap(sqlite3_file* base, int delete_flag) {
+    sqlite3_file* real = ToFile(base)->real();
+    return real->pMethods->xShmUnmap(real, delete_flag);
+  }
+
+  static int Fetch(sqlite3_file* base, sqlite3_int64 offset, int amount,
+                   void** pointer) {
+    sqlite3_file* real = ToFile(base)->real();
+    if (real->pMethods->iVersion < 3) {
+      // sqlite reads the page instead.
+      *pointer = NULL;
+      return SQLITE_OK;
+    }
+    return real->pMethods->xFetch(real, offset, amount, pointer);
+  }
+
+  static int Unfetch(sqlite3_file* base, sqlite3_int64 offset,
+                     void* pointer) {
+    sqlite3_file* real = ToFile(base)->real();
+    if (real->pMethods->iVersion < 3)
+      return SQLITE_OK;
+    return real->pMethods->xUnfetch(real, offset, pointer);
+  }
+
+  static void RecordLock(File* file, int err, int64 elapsed) {
+    std::lock_guard<std::mutex> lock(file->vfs->lock_);
+    FileIoStats* stats = StatsFor(file);
+    stats->locks.Add(elapsed);
+    if (err == SQLITE_BUSY)
+      ++stats->busy_locks;
+  }
+
+  // sqlite3_vfs
+
+  static int Open(sqlite3_vfs* vfs, const char* name, sqlite3_file* base,
+                  int flags, int* out_flags) {
+    InstrumentedVfs* instrumented = ToVfs(vfs);
+    sqlite3_vfs* base_vfs = instrumented->base_;
+    File* file = ToFile(base);
+    memset(file, 0, sizeof(*file));
+    int err = base_vfs->xOpen(base_vfs, name, file->real(), flags,
+                              out_flags);
+    if (err != SQLITE_OK) {
+      if (file->real()->pMethods)
+        file->real()->pMethods->xClose(file->real());
+      return err;
+    }
+
+    file->vfs = instrumented;
+    file->type = FileTypeForFlags(flags);
+    file->base.pMethods = &kIoMethods;
+
+    std::lock_guard<std::mutex> lock(instrumented->lock_);
+    ++StatsFor(file)->opens;
+    return SQLITE_OK;
+  }
+
+  static int Delete(sqlite3_vfs* vfs, const char* name, int sync_dir) {
+    sqlite3_vfs* base_vfs = ToVfs(vfs)->base_;
+    return base_vfs->xDelete(base_vfs, name, sync_dir);
+  }
+
+  static int Access(sqlite3_vfs* vfs, const char* name, int flags,
+                    int* result) {
+    sqlite3_vfs* base_vfs = ToVfs(vfs)->base_;
+    return base_vfs->xAccess(base_vfs, name, flags, result);
+  }
+
+  static int FullPathname(sqlite3_vfs* vfs, const char* name, int size,
+                          char* out) {
+    sqlite3_vfs* base_vfs = ToVfs(vfs)->base_;
+    return base_vfs->xFullPathname(base_vfs, name, size, out);
+  }
+
+  static void* DlOpen(sqlite3_vfs* vfs, const char* name) {
+    sqlite3_vfs* base_vfs = ToVfs(vfs)->base_;
+    return base_vfs->xDlOpen(base_vfs, name);
+  }
+
+  static void DlError(sqlite3_vfs* vfs, int size, char* message) {
+    sqlite3_vfs* base_vfs = ToVfs(vfs)->base_;
+    base_vfs->xDlError(base_vfs, size, message);
+  }
+
+  static void (*DlSym(sqlite3_vfs* vfs, void* handle,
+                      const char* symbol))(void) {
+    sqlite3_vfs* base_vfs = ToVfs(vfs)->base_;
+    return base_vfs->xDlSym(base_vfs, handle, symbol);
+  }
+
+  static void DlClose(sqlite3_vfs* vfs, void* handle) {
+    sqlite3_vfs* base_vfs = ToVfs(vfs)->base_;
+    base_vfs->xDlClose(base_vfs, handle);
+  }
+
+  static int Randomness(sqlite3_vfs* vfs, int size, char* out) {
+    sqlite3_vfs* base_vfs = ToVfs(vfs)->base_;
+    return base_vfs->xRandomness(base_vfs, size, out);
+  }
+
+  // sqlite's busy handler waits for locks with this.
+  static int Sleep(sqlite3_vfs* vfs, int microseconds) {
+    InstrumentedVfs* instrumented = ToVfs(vfs);
+    sqlite3_vfs* base_vfs = instrumented->base_;
+    Clock::time_point start = Clock::now();
+    int slept = base_vfs->xSleep(base_vfs, microseconds);
+    int64 elapsed = MicrosecondsSince(start);
+
+    std::lock_guard<std::mutex> lock(instrumented->lock_);
+    instrumented->stats_.busy_sleeps.Add(elapsed);
+    return slept;
+  }
+
+  static int CurrentTime(sqlite3_vfs* vfs, double* now) {
+    sqlite3_vfs* base_vfs = ToVfs(vfs)->base_;
+    return base_vfs->xCurrentTime(base_vfs, now);
+  }
+
+  static int GetLastError(sqlite3_vfs* vfs, int size, char* message) {
+    sqlite3_vfs* base_vfs = ToVfs(vfs)->base_;
+    return base_vfs->xGetLastError(base_vfs, size, message);
+  }
+
+  static int CurrentTimeInt64(sqlite3_vfs* vfs, sqlite3_int64* now) {
+    sqlite3_vfs* base_vfs = ToVfs(vfs)->base_;
+    return base_vfs->xCurrentTimeInt64(base_vfs, now);
+  }
+};
+
+const sqlite3_io_methods InstrumentedVfs::Methods::kIoMethods = {
+  3,
+  &Methods::Close,
+  &Methods::Read,
+  &Methods::Write,
+  &Methods::Truncate,
+  &Methods::Sync,
+  &Methods::FileSize,
+  &Methods::Lock,
+  &Methods::Unlock,
+  &Methods::CheckReservedLock,
+  &Methods::FileControl,
+  &Methods::SectorSize,
+  &Methods::DeviceCharacteristics,
+  &Methods::ShmMap,
+  &Methods::ShmLock,
+  &Methods::ShmBarrier,
+  &Methods::ShmUnmap,
+  &Methods::Fetch,
+  &Methods::Unfetch,
+};
+
+InstrumentedVfs::InstrumentedVfs(const char* base_name)
+    : name_("sql-instrumented-" + std::to_string(++g_next_id)),
+      base_name_(base_name ? base_name : ""),
+      has_base_name_(base_name != NULL),
+      vfs_(new sqlite3_vfs),
+      base_(NULL),
+      registered_(false) {
+  memset(vfs_, 0, sizeof(*vfs_));
+}
+
+InstrumentedVfs::~InstrumentedVfs() {
+  if (registered_)
+    sqlite3_vfs_unregister(vfs_);
+  delete vfs_;
+}
+
+bool InstrumentedVfs::Register() {
+  if (registered_)
+    return true;
+
+  base_ = sqlite3_vfs_find(has_base_name_ ? base_name_.c_str() : NULL);
+  if (!base_ || base_->iVersion < 2)
+    return false;
+
+  vfs_->iVersion = 2;
+  vfs_->szOsFile = static_cast<int>(sizeof(Methods::File)) +
+                   base_->szOsFile;
+  vfs_->mxPathname = base_->mxPathname;
+  vfs_->zName = name_.c_str();
+  vfs_->pAppData = this;
+  vfs_->xOpen = &Methods::Open;
+  vfs_->xDelete = &Methods::Delete;
+  vfs_->xAccess = &Methods::Access;
+  vfs_->xFullPathname = &Methods::FullPathname;
+  vfs_->xDlOpen = &Methods::DlOpen;
+  vfs_->xDlError = &Methods::DlError;
+  vfs_->xDlSym = &Methods::DlSym;
+  vfs_->xDlClose = &Methods::DlClose;
+  vfs_->xRandomness = &Methods::Randomness;
+  vfs_->xSleep = &Methods::Sleep;
+  vfs_->xCurrentTime = &Methods::CurrentTime;
+  vfs_->xGetLastError = &Methods::GetLastError;
+  vfs_->xCurrentTimeInt64 = &Methods::CurrentTimeInt64;
+
+  if (sqlite3_vfs_register(vfs_, 0) != SQLITE_OK)
+    return false;
+  registered_ = true;
+  return true;
+}
+
+void InstrumentedVfs::GetStats(IoStats* stats) const {
+  std::lock_guard<std::mutex> lock(lock_);
+  *stats = stats_;
+}
+
+void InstrumentedVfs::ResetStats() {
+  std::lock_guard<std::mutex> lock(lock_);
+  stats_ = IoStats();
+}
+
+}  // namespace sql
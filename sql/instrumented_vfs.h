@@ -0,0 +1,134 @@
+// Copyright (c) 2010 Garrett R. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef SQL_INSTRUMENTED_VFS_H_
+#define SQL_INSTRUMENTED_VFS_H_
+
+#include <mutex>
+#include <string>
+
+#include "basictypes.h"
+
+struct sqlite3_vfs;
+
+namespace sql {
+
+// Counts calls by how long they took, in power of two buckets: bucket 0
+// holds calls under a microsecond, bucket i calls that took from 2^(i-1) up
+// to 2^i microseconds, and the last bucket everything slower.
+struct LatencyHistogram {
+  enum { kBucketCount = 24 };
+
+  LatencyHistogram();
+
+  void Add(int64 microseconds);
+
+  // Returns the upper bound of the bucket holding the |percentile|th call,
+  // for example Percentile(99) for the p99 latency, or 0 if there were no
+  // calls.
+  int64 Percentile(double percentile) const;
+
+  int64 count;
+  int64 total_microseconds;
+  int64 max_microseconds;
+  int64 buckets[kBucketCount];
+};
+
+// The I/O a connection did to one kind of file.
+struct FileIoStats {
+  FileIoStats();
+
+  int64 opens;
+  int64 bytes_read;
+  int64 bytes_written;
+
+  // Lock calls that failed because another connection held the lock.
+  int64 busy_locks;
+
+  // Counts and latencies of xRead, xWrite, xSync and xLock. The lock
+  // latency of the main database also covers the WAL's shared memory locks.
+  // Pages read through memory-mapped I/O aren't counted.
+  LatencyHistogram reads;
+  LatencyHistogram writes;
+  LatencyHistogram syncs;
+  LatencyHistogram locks;
+};
+
+struct IoStats {
+  enum FileType {
+    MAIN_DB,
+    // Rollback and super-journals.
+    JOURNAL,
+    WAL,
+    // Temporary databases, statement journals and files used for sorting
+    // and materializing views.
+    TEMP,
+    FILE_TYPE_COUNT,
+  };
+
+  IoStats();
+
+  FileIoStats files[FILE_TYPE_COUNT];
+
+  // Time spent sleeping in the busy handler, waiting for a lock.
+  LatencyHistogram busy_sleeps;
+};
+
+// InstrumentedVfs is a pass-through VFS that records the I/O of one
+// connection, so that it can tell whether commits are waiting on fsync or
+// on locks. It is created by Connection::Open() for OPEN_INSTRUMENTED and
+// read with Connection::GetIoStats():
+//
+//   db.Open(path, sql::Connection::OPEN_INSTRUMENTED);
+//   ...
+//   sql::IoStats stats;
+//   db.GetIoStats(&stats);
+//   int64 p99_fsync = stats.files[sql::IoStats::MAIN_DB].syncs.Percentile(99);
+//
+// Each instance registers itself with sqlite under a name of its own on top
+// of another VFS, and must outlive the connection using it.
+class InstrumentedVfs {
+ public:
+  // Wraps the VFS registered as |base_name|, or the default VFS if NULL.
+  explicit InstrumentedVfs(const char* base_name);
+
+  // Unregisters the VFS.
+  ~InstrumentedVfs();
+
+  // Registers the VFS with sqlite, without making it the default. Returns
+  // false if the base VFS doesn't exist.
+  bool Register();
+
+  // The name to give sqlite3_open_v2().
+  const char* name() const { return name_.c_str(); }
+
+  // Copies the counters into |stats|.
+  void GetStats(IoStats* stats) const;
+
+  // Clears the counters.
+  void ResetStats();
+
+ private:
+  // Holds the functions given to sqlite, which need sqlite's own types in
+  // their signatures. Defined in instrumented_vfs.cc.
+  class Methods;
+
+  std::string name_;
+  std::string base_name_;
+  bool has_base_name_;
+
+  // The VFS given to sqlite, and the one it forwards to.
+  sqlite3_vfs* vfs_;
+  sqlite3_vfs* base_;
+  bool registered_;
+
+  mutable std::mutex lock_;
+  IoStats stats_;
+
+  DISALLOW_COPY_AND_ASSIGN(InstrumentedVfs);
+};
+
+}  // namespace sql
+
+#endif  // SQL_INSTRUMENTED_VFS_H_
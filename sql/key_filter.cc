@@ -0,0 +1,489 @@
+// Copyright (c) 2010 Garrett R. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "key_filter.h"
+
+#include <cmath>
+#include <cstring>
+
+#include <sqlite3.h>
+
+#include "schema_catalog.h"
+#include "transaction.h"
+#include "utility.h"
+
+namespace sql {
+
+namespace {
+
+// Each block is 8 words, and each key sets one bit in every word of its
+// block, chosen by multiplying the key's hash with the word's salt. This is
+// the "split block" layout of Parquet's Bloom filters.
+const size_t kWordsPerBlock = 8;
+const uint32 kSalts[kWordsPerBlock] = {
+  0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+  0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U,
+};
+
+// Seeds that keep an integer, a string and a real with the same bits from
+// hashing alike.
+const uint64 kIntegerSeed = 0x9e3779b97f4a7c15ULL;
+const uint64 kStringSeed = 0xc2b2ae3d27d4eb4fULL;
+const uint64 kRealSeed = 0x165667b19e3779f9ULL;
+
+const char kSavedFiltersTable[] = "key_filters";
+
+// The splitmix64 finalizer.
+uint64 Mix(uint64 value) {
+  value ^= value >> 30;
+  value *= 0xbf58476d1ce4e5b9ULL;
+  value ^= value >> 27;
+  value *= 0x94d049bb133111ebULL;
+  value ^= value >> 31;
+  return value;
+}
+
+uint64 HashInteger(int64 value) {
+  return Mix(static_cast<uint64>(value) ^ kIntegerSeed);
+}
+
+uint64 HashBytes(const void* data, size_t size, uint64 seed) {
+  const unsigned char* bytes = static_cast<const unsigned char*>(data);
+  uint64 hash = seed ^ (size * kIntegerSeed);
+  while (size >= 8) {
+    uint64 chunk;
+    memcpy(&chunk, bytes, 8);
+    hash = (hash ^ Mix(chunk)) * kIntegerSeed;
+    bytes += 8;
+    size -= 8;
+  }
+  if (size) {
+    uint64 chunk = 0;
+    memcpy(&chunk, bytes, size);
+    hash = (hash ^ Mix(chunk)) * kIntegerSeed;
+  }
+  return Mix(hash);
+}
+
+uint64 HashString(const std::string& value) {
+  return HashBytes(value.data(), value.size(), kStringSeed);
+}
+
+// Hashes the value of |column| of the current row as a lookup of the same
+// key would. Returns false for NULL, which no lookup matches.
+bool HashColumn(const Statement& statement, int column, uint64* hash) {
+  switch (statement.ColumnType(column)) {
+    case COLUMN_TYPE_INTEGER:
+      *hash = HashInteger(statement.ColumnInt64(column));
+      return true;
+    case COLUMN_TYPE_FLOAT: {
+      // A REAL equal to an integer matches the integer.
+      double value = statement.ColumnDouble(column);
+      if (value == std::floor(value) && value >= -9.2e18 && value <= 9.2e18)
+        *hash = HashInteger(static_cast<int64>(value));
+      else
+        *hash = HashBytes(&value, sizeof(value), kRealSeed);
+      return true;
+    }
+    case COLUMN_TYPE_TEXT:
+    case COLUMN_TYPE_BLOB:
+      *hash = HashBytes(statement.ColumnBlob(column),
+                        statement.ColumnByteLength(column), kStringSeed);
+      return true;
+    case COLUMN_TYPE_NULL:
+      break;
+  }
+  return false;
+}
+
+}  // namespace
+
+KeyFilter::Stats::Stats()
+    : lookups(0),
+      filtered(0),
+      false_positives(0),
+      untrusted(0),
+      keys(0),
+      capacity(0) {
+}
+
+KeyFilter::KeyFilter()
+    : db_(NULL),
+      bits_per_key_(10),
+      key_is_rowid_(false),
+      block_count_(0),
+      sole_writer_(false),
+      trusted_(false),
+      data_version_(0) {
+}
+
+KeyFilter::~KeyFilter() {
+  if (db_)
+    db_->RemoveChangeObserver(this);
+}
+
+bool KeyFilter::Init(Connection* db, const std::string& table,
+                     const std::string& column) {
+  if (db_)
+    db_->RemoveChangeObserver(this);
+  db_ = NULL;
+  exists_statement_.Assign(NULL);
+  key_statement_.Assign(NULL);
+
+  if (!db->is_open() || !db->DoesTableExist(table))
+    return false;
+
+  // rowid and its aliases aren't listed as columns unless declared.
+  const TableInfo* info = db->GetSchemaCatalog()->GetTable(table);
+  if (!info)
+    return false;
+  const ColumnInfo* column_info = info->GetColumn(column);
+  int primary_key_columns = 0;
+  for (size_t i = 0; i < info->columns.size(); ++i) {
+    if (info->columns[i].primary_key)
+      ++primary_key_columns;
+  }
+  if (column_info) {
+    // A primary key that isn't the rowid gets an index of its own, which
+    // is how "INTEGER PRIMARY KEY DESC" differs from an alias.
+    Statement pk_index(db->GetUniqueStatement(
+        "SELECT 1 FROM pragma_index_list(?, 'main') WHERE origin = 'pk'"));
+    if (!pk_index)
+      return false;
+    pk_index.BindString(0, table);
+    key_is_rowid_ = primary_key_columns == 1 && column_info->primary_key &&
+        !pk_index.Step();
+  } else if (sqlite3_stricmp(column.c_str(), "rowid") == 0 ||
+             sqlite3_stricmp(column.c_str(), "oid") == 0 ||
+             sqlite3_stricmp(column.c_str(), "_rowid_") == 0) {
+    key_is_rowid_ = true;
+  } else {
+    return false;
+  }
+
+  // Fails for WITHOUT ROWID tables, whose changes the hook doesn't see.
+  Statement has_rowid(db->GetUniqueStatement(
+      "SELECT rowid FROM " + quote_identifier(table) + " LIMIT 0"));
+  if (!has_rowid)
+    return false;
+
+  db_ = db;
+  table_ = table;
+  column_ = column;
+  db_->AddChangeObserver(this);
+  return Load() || Rebuild();
+}
+
+bool KeyFilter::Rebuild() {
+  if (!db_)
+    return false;
+
+  // Read the data version and the keys in one transaction, so that no
+  // commit can fall between them.
+  Transaction transaction(db_);
+  if (!transaction.Begin())
+    return false;
+
+  std::string table = quote_identifier(table_);
+  Statement count(db_->GetUniqueStatement("SELECT count(*) FROM " + table));
+  if (!count || !count.Step())
+    return false;
+  data_version_ = db_->GetDataVersion();
+  Reset(count.ColumnInt64(0));
+
+  Statement keys(db_->GetUniqueStatement(
+      "SELECT " + quote_identifier(column_) + " FROM " + table));
+  if (!keys)
+    return false;
+  uint64 hash;
+  while (keys.Step()) {
+    if (HashColumn(keys, 0, &hash))
+      Add(hash);
+  }
+  if (!keys.Succeeded())
+    return false;
+
+  changed_rows_.clear();
+  trusted_ = true;
+  return transaction.Commit();
+}
+
+bool KeyFilter::Save() {
+  if (!db_ || !Validate())
+    return false;
+
+  Transaction transaction(db_);
+  if (!transaction.Begin())
+    return false;
+
+  std::string saved_table = quote_identifier(kSavedFiltersTable);
+  if (!db_->Execute("CREATE TABLE IF NOT EXISTS " + saved_table +
+                    "(name TEXT PRIMARY KEY, block_count INTEGER NOT NULL, "
+                    "key_count INTEGER NOT NULL, capacity INTEGER NOT NULL, "
+                    "stale INTEGER NOT NULL, filter BLOB NOT NULL)"))
+    return false;
+
+  // Any new key makes the saved filter stale, whichever connection adds
+  // it. Once it is, the triggers cost one lookup of the name.
+  std::string table = quote_identifier(table_);
+  std::string column = quote_identifier(column_);
+  std::string mark_stale = "UPDATE " + saved_table + " SET stale = 1 "
+      "WHERE name = " + quote(SavedName()) + " AND stale = 0; END";
+  std::string trigger_prefix = table_ + "_" + column_ + "_key_filter_";
+  if (!db_->Execute("CREATE TRIGGER IF NOT EXISTS " +
+                    quote_identifier(trigger_prefix + "insert") +
+                    " AFTER INSERT ON " + table + " BEGIN " + mark_stale) ||
+      !db_->Execute("CREATE TRIGGER IF NOT EXISTS " +
+                    quote_identifier(trigger_prefix + "update") +
+                    " AFTER UPDATE ON " + table + " WHEN old." + column +
+                    " IS NOT new." + column + " BEGIN " + mark_stale))
+    return false;
+
+  std::vector<unsigned char> filter(words_.size() * sizeof(uint32));
+  for (size_t i = 0; i < words_.size(); ++i) {
+    for (size_t byte = 0; byte < sizeof(uint32); ++byte)
+      filter[i * sizeof(uint32) + byte] = (words_[i] >> (byte * 8)) & 0xff;
+  }
+
+  Statement save(db_->GetUniqueStatement(
+      "INSERT OR REPLACE INTO " + saved_table + " VALUES (?, ?, ?, ?, 0, ?)"));
+  if (!save)
+    return false;
+  save.BindString(0, SavedName());
+  save.BindInt64(1, block_count_);
+  save.BindInt64(2, stats_.keys);
+  save.BindInt64(3, stats_.capacity);
+  save.BindBlob(4, filter.empty() ? NULL : &filter[0],
+                static_cast<int>(filter.size()));
+  if (!save.Run())
+    return false;
+  return transaction.Commit();
+}
+
+bool KeyFilter::Load() {
+  if (!db_->DoesTableExist(kSavedFiltersTable))
+    return false;
+
+  Transaction transaction(db_);
+  if (!transaction.Begin())
+    return false;
+
+  // Dropping the table drops the triggers that would have marked the filter
+  // stale, so a table created again under the same name may have keys the
+  // filter never saw. The saved filter is then of no use to anyone.
+  std::string trigger_prefix = table_ + "_" + column_ + "_key_filter_";
+  Statement triggers(db_->GetUniqueStatement(
+      "SELECT count(*) FROM sqlite_master WHERE type = 'trigger' AND "
+      "name IN (?, ?) AND tbl_name = ? COLLATE NOCASE"));
+  if (!triggers)
+    return false;
+  triggers.BindString(0, trigger_prefix + "insert");
+  triggers.BindString(1, trigger_prefix + "update");
+  triggers.BindString(2, table_);
+  if (!triggers.Step())
+    return false;
+  if (triggers.ColumnInt(0) != 2) {
+    Statement forget(db_->GetUniqueStatement(
+        "DELETE FROM " + quote_identifier(kSavedFiltersTable) +
+        " WHERE name = ?"));
+    if (!forget)
+      return false;
+    forget.BindString(0, SavedName());
+    if (forget.Run())
+      transaction.Commit();
+    return false;
+  }
+
+  Statement load(db_->GetUniqueStatement(
+      "SELECT block_count, key_count, capacity, filter FROM " +
+      quote_identifier(kSavedFiltersTable) + " WHERE name = ? AND stale = 0"));
+  if (!load)
+    return false;
+  load.BindString(0, SavedName());
+  if (!load.Step())
+    return false;
+
+  int64 block_count = load.ColumnInt64(0);
+  const unsigned char* filter =
+      static_cast<const unsigned char*>(load.ColumnBlob(3));
+  size_t size = static_cast<size_t>(load.ColumnByteLength(3));
+  if (block_count <= 0 ||
+      size != block_count * kWordsPerBlock * sizeof(uint32))
+    return false;
+
+  data_version_ = db_->GetDataVersion();
+  block_count_ = static_cast<size_t>(block_count);
+  words_.assign(block_count_ * kWordsPerBlock, 0);
+  for (size_t i = 0; i < words_.size(); ++i) {
+    for (size_t byte = 0; byte < sizeof(uint32); ++byte) {
+      words_[i] |= static_cast<uint32>(filter[i * sizeof(uint32) + byte])
+          << (byte * 8);
+    }
+  }
+  stats_.keys = load.ColumnInt64(1);
+  stats_.capacity = load.ColumnInt64(2);
+
+  changed_rows_.clear();
+  trusted_ = true;
+  return transaction.Commit();
+}
+
+bool KeyFilter::MightContain(int64 key) {
+  uint64 hash = HashInteger(key);
+  ++stats_.lookups;
+  if (!Validate()) {
+    ++stats_.untrusted;
+    return true;
+  }
+  if (Test(hash))
+    return true;
+  ++stats_.filtered;
+  return false;
+}
+
+bool KeyFilter::MightContain(const std::string& key) {
+  uint64 hash = HashString(key);
+  ++stats_.lookups;
+  if (!Validate()) {
+    ++stats_.untrusted;
+    return true;
+  }
+  if (Test(hash))
+    return true;
+  ++stats_.filtered;
+  return false;
+}
+
+bool KeyFilter::Exists(int64 key) {
+  if (!MightContain(key))
+    return false;
+
+  Statement* statement = Prepare(&exists_statement_,
+      "SELECT 1 FROM " + quote_identifier(table_) + " WHERE " +
+      quote_identifier(column_) + " = ? LIMIT 1");
+  if (!statement)
+    return false;
+  statement->BindInt64(0, key);
+  return LookUp(statement);
+}
+
+bool KeyFilter::Exists(const std::string& key) {
+  if (!MightContain(key))
+    return false;
+
+  Statement* statement = Prepare(&exists_statement_,
+      "SELECT 1 FROM " + quote_identifier(table_) + " WHERE " +
+      quote_identifier(column_) + " = ? LIMIT 1");
+  if (!statement)
+    return false;
+  statement->BindString(0, key);
+  return LookUp(statement);
+}
+
+void KeyFilter::OnRowChanged(ChangeType type,
+                             const char* database,
+                             const char* table,
+                             int64 rowid) {
+  // Deleted keys stay in the filter, see the class comment.
+  if (type == CHANGE_DELETE || strcmp(database, "main") != 0 ||
+      sqlite3_stricmp(table, table_.c_str()) != 0)
+    return;
+
+  if (key_is_rowid_) {
+    Add(HashInteger(rowid));
+    ++stats_.keys;
+  } else {
+    changed_rows_.push_back(rowid);
+  }
+}
+
+void KeyFilter::OnRollback() {
+  // Nothing to do: keys of rolled back rows only cause false positives, and
+  // a row that is gone when its key is read is skipped.
+}
+
+void KeyFilter::Reset(int64 keys) {
+  // At least one block, and a little room to grow.
+  int64 capacity = keys + keys / 4 + 1;
+  int64 bits = capacity * bits_per_key_;
+  int64 block_bits = kWordsPerBlock * 32;
+  block_count_ = static_cast<size_t>((bits + block_bits - 1) / block_bits);
+  words_.assign(block_count_ * kWordsPerBlock, 0);
+  stats_.keys = keys;
+  stats_.capacity = capacity;
+}
+
+void KeyFilter::Add(uint64 hash) {
+  uint32* block = &words_[((hash >> 32) * block_count_ >> 32) *
+                          kWordsPerBlock];
+  uint32 key = static_cast<uint32>(hash);
+  for (size_t i = 0; i < kWordsPerBlock; ++i)
+    block[i] |= 1U << ((key * kSalts[i]) >> 27);
+}
+
+bool KeyFilter::Test(uint64 hash) const {
+  const uint32* block = &words_[((hash >> 32) * block_count_ >> 32) *
+                                kWordsPerBlock];
+  uint32 key = static_cast<uint32>(hash);
+  for (size_t i = 0; i < kWordsPerBlock; ++i) {
+    if (!(block[i] & (1U << ((key * kSalts[i]) >> 27))))
+      return false;
+  }
+  return true;
+}
+
+bool KeyFilter::AddRow(int64 rowid) {
+  Statement* statement = Prepare(&key_statement_,
+      "SELECT " + quote_identifier(column_) + " FROM " +
+      quote_identifier(table_) + " WHERE rowid = ?");
+  if (!statement)
+    return false;
+
+  statement->BindInt64(0, rowid);
+  uint64 hash;
+  if (statement->Step() && HashColumn(*statement, 0, &hash)) {
+    Add(hash);
+    ++stats_.keys;
+  }
+  bool succeeded = statement->Succeeded();
+  statement->Reset(true);
+  return succeeded;
+}
+
+bool KeyFilter::Validate() {
+  if (!trusted_)
+    return false;
+
+  if (!sole_writer_ && db_->GetDataVersion() != data_version_) {
+    trusted_ = false;
+    changed_rows_.clear();
+    return false;
+  }
+
+  while (!changed_rows_.empty()) {
+    if (!AddRow(changed_rows_.back())) {
+      trusted_ = false;
+      changed_rows_.clear();
+      return false;
+    }
+    changed_rows_.pop_back();
+  }
+  return true;
+}
+
+bool KeyFilter::LookUp(Statement* statement) {
+  bool found = statement->Step();
+  statement->Reset(true);
+  if (!found && trusted_)
+    ++stats_.false_positives;
+  return found;
+}
+
+Statement* KeyFilter::Prepare(Statement* statement, const std::string& sql) {
+  if (!statement->is_valid())
+    statement->Assign(db_->GetUniqueStatement(sql));
+  return statement->is_valid() ? statement : NULL;
+}
+
+}  // namespace sql
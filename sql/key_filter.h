@@ -0,0 +1,177 @@
+// Copyright (c) 2010 Garrett R. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef SQL_KEY_FILTER_H_
+#define SQL_KEY_FILTER_H_
+
+#include <string>
+#include <vector>
+
+#include "basictypes.h"
+#include "connection.h"
+#include "statement.h"
+
+namespace sql {
+
+// KeyFilter answers "is there a row with this key?" for one column of a
+// table, without a B-tree descent when the answer is no. It keeps a blocked
+// Bloom filter of every value in the column: each key sets 8 bits within
+// one 32-byte block, so a lookup touches a single cache line. A key the
+// filter has never seen is certainly absent; anything else is looked up.
+//
+//   sql::KeyFilter users;
+//   if (!users.Init(&db, "users", "email"))
+//     return false;
+//   if (!users.Exists(email))
+//     ...
+//
+// Rows inserted or updated through the connection are added as they change,
+// using the update hook. Deleted keys can't be taken out of a Bloom filter,
+// so they only make it less effective, until Rebuild(). Once another
+// connection commits, the filter can no longer know what it missed and
+// stops filtering, sending every lookup to the database, until Rebuild().
+// Noticing that means checking PRAGMA data_version on every lookup, unless
+// the connection is known to be the only writer, see set_sole_writer().
+//
+// Save() stores the filter in the database, in the "key_filters" table,
+// so that Init() can load it instead of scanning the column. Triggers mark
+// the saved filter stale as soon as any connection inserts or updates a
+// key, and a stale filter is rebuilt rather than loaded.
+//
+// Integer keys must be looked up as integers and other keys as strings,
+// the way the column stores them: a TEXT key "5" doesn't match the integer 5
+// here, even where sqlite's type affinity would convert it. The table must
+// be a rowid table. The KeyFilter must be destroyed before its Connection.
+class KeyFilter : public ChangeObserver {
+ public:
+  struct Stats {
+    Stats();
+
+    // Lookups made, and the ones the filter answered without the
+    // database.
+    int64 lookups;
+    int64 filtered;
+
+    // Lookups the filter passed on that found nothing.
+    int64 false_positives;
+
+    // Lookups passed on because the filter couldn't be trusted.
+    int64 untrusted;
+
+    // The keys added since the filter was built, including ones since
+    // deleted, and the number it was sized for.
+    int64 keys;
+    int64 capacity;
+  };
+
+  KeyFilter();
+  virtual ~KeyFilter();
+
+  // Sets the size of the filter in bits per key, which trades memory for
+  // fewer false positives: 10 bits, the default, give about 1% of them.
+  //
+  // This must be called before Init() or Rebuild() to have an effect.
+  void set_bits_per_key(int bits) { bits_per_key_ = bits; }
+
+  // Call if every write to the table goes through this connection, for
+  // example because it uses exclusive locking. The filter then skips
+  // checking for other connections' commits, which otherwise costs about as
+  // much as the lookups it saves.
+  void set_sole_writer() { sole_writer_ = true; }
+
+  // Loads the saved filter of |column| of |table|, or builds one by scanning
+  // the column. Returns false on error.
+  bool Init(Connection* db, const std::string& table,
+            const std::string& column);
+
+  // Builds the filter again from the column, sized for the rows it has now.
+  bool Rebuild();
+
+  // Stores the filter in the database, creating the key_filters table and
+  // the triggers that mark it stale if needed. Returns false on error.
+  bool Save();
+
+  // Returns false if there is certainly no row with |key|.
+  bool MightContain(int64 key);
+  bool MightContain(const std::string& key);
+
+  // Returns true if there is a row with |key|, looking it up only if the
+  // filter can't rule it out.
+  bool Exists(int64 key);
+  bool Exists(const std::string& key);
+
+  // Returns false once the filter has stopped filtering because of another
+  // connection's commit.
+  bool is_trusted() const { return trusted_; }
+
+  const Stats& stats() const { return stats_; }
+
+  // ChangeObserver implementation.
+  virtual void OnRowChanged(ChangeType type,
+                            const char* database,
+                            const char* table,
+                            int64 rowid);
+  virtual void OnRollback();
+
+ private:
+  // Sizes the filter for |keys| and clears it.
+  void Reset(int64 keys);
+
+  void Add(uint64 hash);
+  bool Test(uint64 hash) const;
+
+  // Adds the key of the row |rowid|, if there is one.
+  bool AddRow(int64 rowid);
+
+  // Adds the keys of the rows changed since the last lookup, and stops
+  // trusting the filter if another connection has committed. Returns false
+  // if the filter can't be used.
+  bool Validate();
+
+  // Loads the filter saved by Save(), if it isn't stale and its triggers
+  // still exist. Otherwise deletes it.
+  bool Load();
+
+  // Runs the lookup behind Exists() with the key bound.
+  bool LookUp(Statement* statement);
+
+  // Returns |statement|, preparing it with |sql| if it isn't yet or the
+  // connection was reopened.
+  Statement* Prepare(Statement* statement, const std::string& sql);
+
+  // The name of the filter in the key_filters table.
+  std::string SavedName() const { return table_ + "." + column_; }
+
+  Connection* db_;
+  std::string table_;
+  std::string column_;
+  int bits_per_key_;
+
+  // True if the key column is the rowid, so keys are known from the update
+  // hook alone.
+  bool key_is_rowid_;
+
+  // 8 words of 32 bits per block.
+  std::vector<uint32> words_;
+  size_t block_count_;
+
+  // Rows inserted or updated since the last lookup, whose keys are added
+  // then because the hook can't read them.
+  std::vector<int64> changed_rows_;
+
+  bool sole_writer_;
+  bool trusted_;
+  int64 data_version_;
+
+  Statement exists_statement_;
+  Statement key_statement_;
+
+  Stats stats_;
+
+  DISALLOW_COPY_AND_ASSIGN(KeyFilter);
+};
+
+}  // namespace sql
+
+#endif  // SQL_KEY_FILTER_H_
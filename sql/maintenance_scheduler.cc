@@ -0,0 +1,262 @@
+// Copyright (c) 2010 Garrett R. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "maintenance_scheduler.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+
+#include <sqlite3.h>
+
+#include "connection.h"
+#include "utility.h"
+
+namespace sql {
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+// How much of each index "PRAGMA optimize" may look at; see analysis_limit.
+const int kAnalysisLimit = 400;
+
+// Bounds on the pages asked of each incremental vacuum slice.
+const int kMinVacuumPages = 8;
+const int kMaxVacuumPages = 4096;
+
+// Checked by sqlite every kProgressOps virtual machine instructions.
+const int kProgressOps = 1000;
+
+// What the progress handler of a slice checks.
+struct SliceState {
+  Clock::time_point deadline;
+
+  // The connection's own progress handler, which can still interrupt.
+  Connection::ProgressHandler handler;
+  void* arg;
+};
+
+int InterruptAfterDeadline(void* state) {
+  SliceState* slice = static_cast<SliceState*>(state);
+  if (slice->handler && slice->handler(slice->arg))
+    return 1;
+  return Clock::now() > slice->deadline;
+}
+
+int64 MicrosecondsSince(Clock::time_point start) {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+      Clock::now() - start).count();
+}
+
+}  // namespace
+
+MaintenanceScheduler::Stats::Stats()
+    : slices(0),
+      cycles(0),
+      pages_reclaimed(0),
+      writer_stall_microseconds(0),
+      max_writer_stall_microseconds(0),
+      tables_checked(0),
+      tables_skipped(0) {
+}
+
+MaintenanceScheduler::MaintenanceScheduler(Connection* db)
+    : db_(db),
+      slice_budget_ms_(10),
+      phase_(PHASE_DONE),
+      vacuum_pages_(64) {
+}
+
+MaintenanceScheduler::~MaintenanceScheduler() {
+}
+
+bool MaintenanceScheduler::IsIdle() const {
+  if (!db_ || !db_->is_open() || db_->transaction_nesting() > 0)
+    return false;
+
+  // Transactions begun with Execute("BEGIN") aren't counted by the
+  // connection, so ask sqlite too.
+  sqlite3* db = db_->db_;
+  if (!sqlite3_get_autocommit(db))
+    return false;
+  for (sqlite3_stmt* stmt = sqlite3_next_stmt(db, NULL); stmt;
+       stmt = sqlite3_next_stmt(db, stmt)) {
+    if (sqlite3_stmt_busy(stmt))
+      return false;
+  }
+  return true;
+}
+
+bool MaintenanceScheduler::RunSlice() {
+  if (!IsIdle())
+    return false;
+
+  if (phase_ == PHASE_DONE)
+    phase_ = PHASE_OPTIMIZE;
+
+  int64 stall = 0;
+  switch (phase_) {
+    case PHASE_OPTIMIZE:
+      stall = RunOptimize();
+      break;
+    case PHASE_VACUUM:
+      stall = RunVacuum();
+      break;
+    case PHASE_CHECK:
+      stall = RunCheck();
+      break;
+    case PHASE_DONE:
+      break;
+  }
+
+  ++stats_.slices;
+  if (phase_ == PHASE_DONE)
+    ++stats_.cycles;
+  stats_.writer_stall_microseconds += stall;
+  stats_.max_writer_stall_microseconds =
+      std::max(stats_.max_writer_stall_microseconds, stall);
+  return true;
+}
+
+int64 MaintenanceScheduler::RunOptimize() {
+  // optimize runs ANALYZE on tables that need it, which writes
+  // sqlite_stat1. If it runs out of time, a later cycle finishes the job.
+  int64 previous_limit = GetPragma("analysis_limit");
+  RunWithBudget(sql::printf("PRAGMA analysis_limit=%d", kAnalysisLimit),
+                NULL);
+
+  Clock::time_point start = Clock::now();
+  RunWithBudget("PRAGMA optimize", NULL);
+  int64 stall = MicrosecondsSince(start);
+
+  if (previous_limit >= 0) {
+    RunWithBudget(sql::printf("PRAGMA analysis_limit=%d",
+                               static_cast<int>(previous_limit)), NULL);
+  }
+
+  phase_ = PHASE_VACUUM;
+  return stall;
+}
+
+int64 MaintenanceScheduler::RunVacuum() {
+  // Without auto_vacuum=INCREMENTAL only a full VACUUM can shrink the file,
+  // which is exactly what this class avoids.
+  const int64 kIncremental = 2;
+  int64 free_pages = GetPragma("freelist_count");
+  if (GetPragma("auto_vacuum") != kIncremental || free_pages <= 0) {
+    tables_to_check_.clear();
+    phase_ = PHASE_CHECK;
+    return 0;
+  }
+
+  Clock::time_point start = Clock::now();
+  int err = RunWithBudget(
+      sql::printf("PRAGMA incremental_vacuum(%d)", vacuum_pages_), NULL);
+  int64 stall = MicrosecondsSince(start);
+
+  int64 remaining = GetPragma("freelist_count");
+  if (remaining >= 0 && remaining < free_pages)
+    stats_.pages_reclaimed += free_pages - remaining;
+
+  // Aim for slices that use about half the budget.
+  int64 budget = static_cast<int64>(slice_budget_ms_) * 1000;
+  if (err == SQLITE_INTERRUPT || stall > budget)
+    vacuum_pages_ = std::max(kMinVacuumPages, vacuum_pages_ / 2);
+  else if (stall < budget / 4)
+    vacuum_pages_ = std::min(kMaxVacuumPages, vacuum_pages_ * 2);
+
+  if (remaining <= 0) {
+    tables_to_check_.clear();
+    phase_ = PHASE_CHECK;
+  }
+  return stall;
+}
+
+int64 MaintenanceScheduler::RunCheck() {
+  if (tables_to_check_.empty()) {
+    std::vector<std::string> tables;
+    RunWithBudget("SELECT name FROM sqlite_master WHERE type='table' "
+                  "ORDER BY name DESC", &tables);
+    tables_to_check_.swap(tables);
+    if (tables_to_check_.empty()) {
+      phase_ = PHASE_DONE;
+      return 0;
+    }
+  }
+
+  std::string table = tables_to_check_.back();
+  tables_to_check_.pop_back();
+
+  std::vector<std::string> results;
+  Clock::time_point start = Clock::now();
+  int err = RunWithBudget(
+      "PRAGMA quick_check(" + quote_identifier(table) + ")", &results);
+  int64 elapsed = MicrosecondsSince(start);
+
+  if (err == SQLITE_OK) {
+    ++stats_.tables_checked;
+    for (size_t i = 0; i < results.size(); ++i) {
+      if (results[i] != "ok")
+        stats_.integrity_problems.push_back(table + ": " + results[i]);
+    }
+  } else {
+    ++stats_.tables_skipped;
+  }
+
+  if (tables_to_check_.empty())
+    phase_ = PHASE_DONE;
+
+  // In WAL mode readers don't block writers. Otherwise the read lock held
+  // by the check does.
+  std::vector<std::string> mode;
+  RunWithBudget("PRAGMA journal_mode", &mode);
+  bool wal = !mode.empty() && sqlite3_stricmp(mode[0].c_str(), "wal") == 0;
+  return wal ? 0 : elapsed;
+}
+
+int MaintenanceScheduler::RunWithBudget(const std::string& sql,
+                                        std::vector<std::string>* rows) {
+  // Run directly on the handle: being interrupted is expected and shouldn't
+  // reach the connection's error delegate.
+  sqlite3* db = db_->db_;
+  SliceState slice;
+  slice.deadline = Clock::now() + std::chrono::milliseconds(slice_budget_ms_);
+  slice.handler = db_->progress_handler_;
+  slice.arg = db_->progress_arg_;
+  int instructions = kProgressOps;
+  if (slice.handler && db_->progress_instructions_ > 0)
+    instructions = std::min(instructions, db_->progress_instructions_);
+  sqlite3_progress_handler(db, instructions, &InterruptAfterDeadline, &slice);
+
+  sqlite3_stmt* stmt = NULL;
+  int err = sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, NULL);
+  if (err == SQLITE_OK) {
+    while ((err = sqlite3_step(stmt)) == SQLITE_ROW) {
+      if (rows) {
+        const char* text =
+            reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
+        rows->push_back(text ? text : "");
+      }
+    }
+    if (err == SQLITE_DONE)
+      err = SQLITE_OK;
+  }
+  sqlite3_finalize(stmt);
+
+  sqlite3_progress_handler(db, db_->progress_instructions_,
+                           db_->progress_handler_, db_->progress_arg_);
+  return err;
+}
+
+int64 MaintenanceScheduler::GetPragma(const char* pragma) {
+  std::vector<std::string> rows;
+  std::string sql("PRAGMA ");
+  sql.append(pragma);
+  if (RunWithBudget(sql, &rows) != SQLITE_OK || rows.empty())
+    return -1;
+  return atoll(rows[0].c_str());
+}
+
+}  // namespace sql
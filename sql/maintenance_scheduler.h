@@ -0,0 +1,130 @@
+// Copyright (c) 2010 Garrett R. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef SQL_MAINTENANCE_SCHEDULER_H_
+#define SQL_MAINTENANCE_SCHEDULER_H_
+
+#include <string>
+#include <vector>
+
+#include "basictypes.h"
+
+namespace sql {
+
+class Connection;
+
+// MaintenanceScheduler spreads routine database maintenance over many short
+// slices instead of one long VACUUM or ANALYZE that stalls writers. Each
+// maintenance cycle:
+//   1. runs "PRAGMA optimize" with a bounded analysis_limit,
+//   2. reclaims free pages with "PRAGMA incremental_vacuum", a few pages per
+//      slice, if the database uses auto_vacuum=INCREMENTAL,
+//   3. runs "PRAGMA quick_check" one table per slice.
+//
+// Slices only run while the connection is idle: no transaction is open and
+// no statement is in the middle of stepping. Each slice is interrupted when
+// it exceeds its time budget; a vacuum slice then reclaims fewer pages next
+// time, and a table too large to check within the budget is skipped. The
+// budget is enforced with a progress handler; one installed through
+// Connection::SetProgressHandler() is still called during slices, possibly
+// more often, and can interrupt them too.
+//
+// The scheduler doesn't own a thread or timer. Call RunSlice() from wherever
+// the connection is used when there is time to spare:
+//
+//   sql::MaintenanceScheduler maintenance(&db);
+//   ...
+//   // In an idle callback:
+//   maintenance.RunSlice();
+//
+// The scheduler must be destroyed before its Connection.
+class MaintenanceScheduler {
+ public:
+  struct Stats {
+    Stats();
+
+    // Number of slices run and cycles completed.
+    int64 slices;
+    int64 cycles;
+
+    // Free pages given back to the file system by incremental vacuum.
+    int64 pages_reclaimed;
+
+    // Time spent holding locks that block writers, in total and in the
+    // longest slice.
+    int64 writer_stall_microseconds;
+    int64 max_writer_stall_microseconds;
+
+    // Tables checked with quick_check, and tables skipped because checking
+    // them didn't fit in a slice.
+    int64 tables_checked;
+    int64 tables_skipped;
+
+    // The problems quick_check reported, as "table: message".
+    std::vector<std::string> integrity_problems;
+  };
+
+  explicit MaintenanceScheduler(Connection* db);
+  ~MaintenanceScheduler();
+
+  // Sets the time a slice may take before it is interrupted. The default is
+  // 10 milliseconds.
+  void set_slice_budget_ms(int milliseconds) {
+    slice_budget_ms_ = milliseconds;
+  }
+
+  // Returns true if the connection has no open transaction and no statement
+  // in progress, which is when slices may run.
+  bool IsIdle() const;
+
+  // Runs the next slice of maintenance if the connection is idle, starting a
+  // new cycle if the last one is complete. Returns true if a slice ran.
+  bool RunSlice();
+
+  // Returns true if the current cycle has finished. The next RunSlice()
+  // starts a new one.
+  bool is_cycle_done() const { return phase_ == PHASE_DONE; }
+
+  const Stats& stats() const { return stats_; }
+
+ private:
+  enum Phase {
+    PHASE_OPTIMIZE,
+    PHASE_VACUUM,
+    PHASE_CHECK,
+    PHASE_DONE,
+  };
+
+  // Each runs one slice of a phase and moves to the next phase when done.
+  // They return the time spent holding locks that block writers.
+  int64 RunOptimize();
+  int64 RunVacuum();
+  int64 RunCheck();
+
+  // Runs |sql| with the slice's time budget, putting the first column of
+  // each row in |rows| if not NULL. Returns the sqlite result code, which is
+  // SQLITE_INTERRUPT if the budget ran out.
+  int RunWithBudget(const std::string& sql, std::vector<std::string>* rows);
+
+  // Returns the integer result of "PRAGMA <pragma>", or -1.
+  int64 GetPragma(const char* pragma);
+
+  Connection* db_;
+  int slice_budget_ms_;
+  Phase phase_;
+
+  // The number of pages the next vacuum slice asks for.
+  int vacuum_pages_;
+
+  // The tables left to check in this cycle.
+  std::vector<std::string> tables_to_check_;
+
+  Stats stats_;
+
+  DISALLOW_COPY_AND_ASSIGN(MaintenanceScheduler);
+};
+
+}  // namespace sql
+
+#endif  // SQL_MAINTENANCE_SCHEDULER_H_
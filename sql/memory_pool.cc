@@ -0,0 +1,279 @@
+// Copyright (c) 2010 Garrett R. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "memory_pool.h"
+
+#include <cstdlib>
+#include <cstring>
+
+#include <sqlite3.h>
+
+namespace sql {
+
+namespace {
+
+// The usable sizes of the classes. Each step is at most 50% larger than the
+// previous one, which bounds the space wasted by rounding up.
+const size_t kClassSizes[] = {
+  16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048, 3072,
+  4096,
+};
+
+// Every block is preceded by a header holding its class index or, for large
+// blocks, the requested size. Since large sizes are always bigger than any
+// class, the two can't be confused. The header also keeps blocks 8-byte
+// aligned.
+typedef uint64 BlockHeader;
+const size_t kHeaderSize = sizeof(BlockHeader);
+
+// Each class grows by this much at a time.
+const size_t kSlabSize = 64 * 1024;
+
+BlockHeader* HeaderOf(const void* block) {
+  return reinterpret_cast<BlockHeader*>(
+      static_cast<char*>(const_cast<void*>(block)) - kHeaderSize);
+}
+
+bool g_installed_for_sqlite = false;
+
+void* SqliteMalloc(int size) {
+  return MemoryPool::GetInstance()->Allocate(size);
+}
+
+void SqliteFree(void* block) {
+  MemoryPool::GetInstance()->Free(block);
+}
+
+void* SqliteRealloc(void* block, int size) {
+  return MemoryPool::GetInstance()->Reallocate(block, size);
+}
+
+int SqliteSize(void* block) {
+  return static_cast<int>(MemoryPool::GetInstance()->GetSize(block));
+}
+
+int SqliteRoundup(int size) {
+  return static_cast<int>(MemoryPool::GetInstance()->RoundUp(size));
+}
+
+int SqliteInit(void* /*data*/) {
+  return SQLITE_OK;
+}
+
+void SqliteShutdown(void* /*data*/) {
+}
+
+}  // namespace
+
+// A free block holds the next free block of its class.
+struct FreeBlock {
+  FreeBlock* next;
+};
+
+// Each class is on its own cache line so that threads working on different
+// classes don't contend for it.
+struct alignas(64) MemoryPool::SizeClass {
+  SizeClass() : free_list(NULL) {}
+
+  std::mutex lock;
+  FreeBlock* free_list;
+  Stats stats;
+};
+
+MemoryPool::Stats::Stats()
+    : block_size(0),
+      current_bytes(0),
+      peak_bytes(0),
+      reserved_bytes(0),
+      allocation_count(0) {
+}
+
+// static
+MemoryPool* MemoryPool::GetInstance() {
+  // Leaked on purpose: sqlite and static objects may still free blocks
+  // during process exit.
+  static MemoryPool* instance = new MemoryPool;
+  return instance;
+}
+
+// static
+bool MemoryPool::InstallForSqlite() {
+  static const sqlite3_mem_methods kMethods = {
+    &SqliteMalloc,
+    &SqliteFree,
+    &SqliteRealloc,
+    &SqliteSize,
+    &SqliteRoundup,
+    &SqliteInit,
+    &SqliteShutdown,
+    NULL,
+  };
+
+  if (g_installed_for_sqlite)
+    return true;
+
+  // sqlite3_config only copies the methods, the cast is OK.
+  if (sqlite3_config(SQLITE_CONFIG_MALLOC,
+                     const_cast<sqlite3_mem_methods*>(&kMethods)) !=
+      SQLITE_OK)
+    return false;
+
+  g_installed_for_sqlite = true;
+  return true;
+}
+
+// static
+bool MemoryPool::IsInstalledForSqlite() {
+  return g_installed_for_sqlite;
+}
+
+MemoryPool::MemoryPool()
+    : classes_(NULL),
+      class_count_(static_cast<int>(arraysize(kClassSizes))) {
+  classes_ = new SizeClass[class_count_];
+  for (int i = 0; i < class_count_; ++i)
+    classes_[i].stats.block_size = kClassSizes[i];
+
+  size_t largest = kClassSizes[class_count_ - 1];
+  class_for_size_.resize(largest / 16 + 1);
+  int index = 0;
+  for (size_t i = 0; i < class_for_size_.size(); ++i) {
+    while (kClassSizes[index] < i * 16)
+      ++index;
+    class_for_size_[i] = static_cast<int8>(index);
+  }
+}
+
+MemoryPool::~MemoryPool() {
+  delete[] classes_;
+}
+
+void* MemoryPool::Allocate(size_t size) {
+  int index = ClassForSize(size);
+  if (index < 0) {
+    BlockHeader* header =
+        static_cast<BlockHeader*>(malloc(kHeaderSize + size));
+    if (!header)
+      return NULL;
+    *header = size;
+
+    std::lock_guard<std::mutex> lock(large_lock_);
+    large_.current_bytes += size;
+    large_.reserved_bytes += size;
+    if (large_.current_bytes > large_.peak_bytes)
+      large_.peak_bytes = large_.current_bytes;
+    ++large_.allocation_count;
+    return header + 1;
+  }
+
+  SizeClass* size_class = &classes_[index];
+  std::lock_guard<std::mutex> lock(size_class->lock);
+  if (!size_class->free_list && !Grow(size_class))
+    return NULL;
+
+  FreeBlock* block = size_class->free_list;
+  size_class->free_list = block->next;
+
+  Stats& stats = size_class->stats;
+  stats.current_bytes += stats.block_size;
+  if (stats.current_bytes > stats.peak_bytes)
+    stats.peak_bytes = stats.current_bytes;
+  ++stats.allocation_count;
+
+  *HeaderOf(block) = index;
+  return block;
+}
+
+void MemoryPool::Free(void* block) {
+  if (!block)
+    return;
+
+  BlockHeader* header = HeaderOf(block);
+  if (*header >= static_cast<BlockHeader>(class_count_)) {
+    {
+      std::lock_guard<std::mutex> lock(large_lock_);
+      large_.current_bytes -= *header;
+      large_.reserved_bytes -= *header;
+    }
+    free(header);
+    return;
+  }
+
+  SizeClass* size_class = &classes_[*header];
+  std::lock_guard<std::mutex> lock(size_class->lock);
+  FreeBlock* free_block = static_cast<FreeBlock*>(block);
+  free_block->next = size_class->free_list;
+  size_class->free_list = free_block;
+  size_class->stats.current_bytes -= size_class->stats.block_size;
+}
+
+void* MemoryPool::Reallocate(void* block, size_t size) {
+  if (!block)
+    return Allocate(size);
+
+  size_t old_size = GetSize(block);
+  int index = ClassForSize(size);
+  if (index >= 0 && static_cast<BlockHeader>(index) == *HeaderOf(block))
+    return block;
+
+  void* resized = Allocate(size);
+  if (!resized)
+    return NULL;
+  memcpy(resized, block, old_size < size ? old_size : size);
+  Free(block);
+  return resized;
+}
+
+size_t MemoryPool::GetSize(const void* block) const {
+  if (!block)
+    return 0;
+  BlockHeader header = *HeaderOf(block);
+  if (header >= static_cast<BlockHeader>(class_count_))
+    return static_cast<size_t>(header);
+  return kClassSizes[header];
+}
+
+size_t MemoryPool::RoundUp(size_t size) const {
+  int index = ClassForSize(size);
+  if (index < 0)
+    return (size + 7) & ~static_cast<size_t>(7);
+  return kClassSizes[index];
+}
+
+std::vector<MemoryPool::Stats> MemoryPool::GetStats() const {
+  std::vector<Stats> stats;
+  for (int i = 0; i < class_count_; ++i) {
+    std::lock_guard<std::mutex> lock(classes_[i].lock);
+    stats.push_back(classes_[i].stats);
+  }
+
+  std::lock_guard<std::mutex> lock(large_lock_);
+  stats.push_back(large_);
+  return stats;
+}
+
+int MemoryPool::ClassForSize(size_t size) const {
+  size_t slot = (size + 15) / 16;
+  if (slot >= class_for_size_.size())
+    return -1;
+  return class_for_size_[slot];
+}
+
+bool MemoryPool::Grow(SizeClass* size_class) {
+  char* slab = static_cast<char*>(malloc(kSlabSize));
+  if (!slab)
+    return false;
+
+  size_t stride = kHeaderSize + size_class->stats.block_size;
+  for (size_t offset = 0; offset + stride <= kSlabSize; offset += stride) {
+    FreeBlock* block = reinterpret_cast<FreeBlock*>(slab + offset +
+                                                    kHeaderSize);
+    block->next = size_class->free_list;
+    size_class->free_list = block;
+  }
+  size_class->stats.reserved_bytes += kSlabSize;
+  return true;
+}
+
+}  // namespace sql
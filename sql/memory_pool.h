@@ -0,0 +1,147 @@
+// Copyright (c) 2010 Garrett R. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef SQL_MEMORY_POOL_H_
+#define SQL_MEMORY_POOL_H_
+
+#include <cstddef>
+#include <mutex>
+#include <new>
+#include <vector>
+
+#include "basictypes.h"
+
+namespace sql {
+
+// MemoryPool is a process-wide allocator that serves small blocks from
+// per-size-class free lists. Each size class has its own lock, so threads
+// allocating different sizes (or running different connections) don't
+// serialize on a single malloc lock, and freed blocks are reused rather than
+// returned to the system.
+//
+// The wrapper's own small objects (statement references and the nodes of
+// the statement bookkeeping containers) always come from the pool. sqlite's
+// allocations do too once InstallForSqlite() has been called, which must
+// happen before the first connection is opened:
+//
+//   int main() {
+//     sql::MemoryPool::InstallForSqlite();
+//     ...
+//   }
+//
+// Blocks are 8-byte aligned. Requests larger than the biggest size class are
+// passed to malloc but still counted. Memory taken for a size class is kept
+// for the lifetime of the process.
+class MemoryPool {
+ public:
+  // Usage of one size class.
+  struct Stats {
+    Stats();
+
+    // The largest request served by this class, or 0 for the requests that
+    // are too large for any class.
+    size_t block_size;
+
+    // Bytes handed out and not yet freed, now and at most.
+    int64 current_bytes;
+    int64 peak_bytes;
+
+    // Bytes taken from the system for this class, including free blocks.
+    int64 reserved_bytes;
+
+    // Number of allocations served so far.
+    int64 allocation_count;
+  };
+
+  static MemoryPool* GetInstance();
+
+  // Routes sqlite's allocations through the pool. Returns false if sqlite
+  // has already been initialized, in which case it keeps its allocator.
+  static bool InstallForSqlite();
+
+  // Returns true if InstallForSqlite() succeeded.
+  static bool IsInstalledForSqlite();
+
+  // Returns a block of at least |size| bytes, or NULL if out of memory.
+  void* Allocate(size_t size);
+
+  // Returns |block| to its size class. |block| may be NULL.
+  void Free(void* block);
+
+  // Resizes |block| like realloc(), keeping it in place when the new size
+  // fits in its size class.
+  void* Reallocate(void* block, size_t size);
+
+  // Returns the usable size of a block from Allocate().
+  size_t GetSize(const void* block) const;
+
+  // Returns the size of the block that would be used for |size| bytes.
+  size_t RoundUp(size_t size) const;
+
+  // Returns the usage of every size class, smallest first, followed by the
+  // usage of large requests.
+  std::vector<Stats> GetStats() const;
+
+ private:
+  struct SizeClass;
+
+  MemoryPool();
+  ~MemoryPool();
+
+  // Returns the index of the class serving |size|, or -1 if it's too large.
+  int ClassForSize(size_t size) const;
+
+  // Takes a new slab from the system and puts its blocks on |size_class|'s
+  // free list. Called with the class's lock held.
+  bool Grow(SizeClass* size_class);
+
+  SizeClass* classes_;
+  int class_count_;
+
+  // Maps (size + 15) / 16 to a class index for every pooled size.
+  std::vector<int8> class_for_size_;
+
+  // Usage of requests too large for any class.
+  mutable std::mutex large_lock_;
+  Stats large_;
+
+  DISALLOW_COPY_AND_ASSIGN(MemoryPool);
+};
+
+// An STL allocator taking its memory from the MemoryPool, for containers
+// whose nodes are allocated and freed often:
+//
+//   std::set<Foo*, std::less<Foo*>, sql::PoolAllocator<Foo*> > foos;
+template <typename T>
+class PoolAllocator {
+ public:
+  typedef T value_type;
+
+  PoolAllocator() {}
+
+  template <typename U>
+  PoolAllocator(const PoolAllocator<U>&) {}
+
+  T* allocate(size_t count) {
+    static_assert(alignof(T) <= 8, "MemoryPool blocks are 8-byte aligned");
+    void* block = MemoryPool::GetInstance()->Allocate(count * sizeof(T));
+    if (!block)
+      throw std::bad_alloc();
+    return static_cast<T*>(block);
+  }
+
+  void deallocate(T* block, size_t /*count*/) {
+    MemoryPool::GetInstance()->Free(block);
+  }
+
+  template <typename U>
+  bool operator==(const PoolAllocator<U>&) const { return true; }
+
+  template <typename U>
+  bool operator!=(const PoolAllocator<U>&) const { return false; }
+};
+
+}  // namespace sql
+
+#endif  // SQL_MEMORY_POOL_H_
@@ -10,6 +10,7 @@
 
 #include "connection.h"
 #include "statement.h"
+#include "transaction.h"
 //#include "base/logging.h"
 
 namespace sql {
@@ -23,7 +24,12 @@ bool MetaTable::DoesTableExist(const sql::Connection& db) {
   return db.DoesTableExist("meta");
 }
 
-MetaTable::MetaTable() : db_(NULL) {
+MetaTable::MetaTable()
+    : db_(NULL),
+      loaded_(false),
+      data_version_(0),
+      sole_writer_(false),
+      checked_transaction_(0) {
 }
 
 MetaTable::~MetaTable() {
@@ -36,69 +42,63 @@ bool MetaTable::Init(Connection* db, int version, int compatible_version) {
 
   db_ = db;
   if (!DoesTableExist(*db_)) {
+    // Create the table and its version numbers in one transaction so that a
+    // new database costs a single sync, and never has a meta table without
+    // version numbers.
+    Transaction transaction(db_);
+    if (!transaction.Begin())
+      return false;
+
+    // The key is the primary key of a WITHOUT ROWID table, so the table is
+    // its own index.
     if (!db_->Execute("CREATE TABLE meta"
-        "(key LONGVARCHAR NOT NULL UNIQUE PRIMARY KEY,"
-         "value LONGVARCHAR)"))
+        "(key LONGVARCHAR NOT NULL PRIMARY KEY,"
+         "value LONGVARCHAR) WITHOUT ROWID"))
       return false;
 
-    // Note: there is no index over the meta table. We currently only have a
-    // couple of keys, so it doesn't matter. If we start storing more stuff in
-    // there, we should create an index.
     SetVersionNumber(version);
     SetCompatibleVersionNumber(compatible_version);
+    return transaction.Commit();
   }
   return true;
 }
 
 bool MetaTable::SetValue(const char* key, const std::string& value) {
-  Statement s;
-  if (!PrepareSetStatement(&s, key))
-    return false;
-  s.BindString(1, value);
-  return s.Run();
+  return StoreValue(key, value);
 }
 
 bool MetaTable::GetValue(const char* key, std::string* value) const {
-  Statement s;
-  if (!PrepareGetStatement(&s, key))
+  Value found;
+  if (!LookupValue(key, &found))
     return false;
 
-  *value = s.ColumnString(0);
+  *value = found.AsString();
   return true;
 }
 
 bool MetaTable::SetValue(const char* key, int value) {
-  Statement s;
-  if (!PrepareSetStatement(&s, key))
-    return false;
-
-  s.BindInt(1, value);
-  return s.Run();
+  return StoreValue(key, Value(value).AsString());
 }
 
 bool MetaTable::GetValue(const char* key, int* value) const {
-  Statement s;
-  if (!PrepareGetStatement(&s, key))
+  Value found;
+  if (!LookupValue(key, &found))
     return false;
 
-  *value = s.ColumnInt(0);
+  *value = found.AsInt();
   return true;
 }
 
 bool MetaTable::SetValue(const char* key, int64 value) {
-  Statement s;
-  if (!PrepareSetStatement(&s, key))
-    return false;
-  s.BindInt64(1, value);
-  return s.Run();
+  return StoreValue(key, Value(value).AsString());
 }
 
 bool MetaTable::GetValue(const char* key, int64* value) const {
-  Statement s;
-  if (!PrepareGetStatement(&s, key))
+  Value found;
+  if (!LookupValue(key, &found))
     return false;
 
-  *value = s.ColumnInt64(0);
+  *value = found.AsInt64();
   return true;
 }
 
@@ -157,4 +157,92 @@ bool MetaTable::PrepareGetStatement(Statement* statement,
   return true;
 }
 
+bool MetaTable::StoreValue(const char* key, const std::string& value) {
+  Statement s;
+  if (!PrepareSetStatement(&s, key))
+    return false;
+
+  // The value column has TEXT affinity, so numbers are stored as text. The
+  // in-memory copy holds the same, which keeps conversions identical.
+  s.BindString(1, value);
+  if (!s.Run()) {
+    loaded_ = false;
+    return false;
+  }
+
+  if (db_->transaction_nesting() > 0) {
+    // The write may still be rolled back, so stop trusting the copy until
+    // it can be reloaded outside of the transaction.
+    loaded_ = false;
+  } else if (loaded_) {
+    values_[key] = Value(value);
+  }
+  return true;
+}
+
+bool MetaTable::LookupValue(const char* key, Value* value) const {
+  if (!db_ || !key)
+    return false;
+
+  if (loaded_ && NeedsVersionCheck() &&
+      db_->GetDataVersion() != data_version_)
+    loaded_ = false;  // Another connection committed since we loaded.
+
+  // Loading inside a transaction could record a state that later turns out
+  // to be rolled back or to be older than the data version, so only do it
+  // outside of one.
+  if (!loaded_ && db_->transaction_nesting() == 0)
+    LoadValues();
+
+  if (!loaded_) {
+    Statement s;
+    if (!PrepareGetStatement(&s, key))
+      return false;
+    *value = s.ColumnValue(0);
+    return true;
+  }
+
+  ValueMap::const_iterator found = values_.find(key);
+  if (found == values_.end())
+    return false;
+  *value = found->second;
+  return true;
+}
+
+bool MetaTable::NeedsVersionCheck() const {
+  if (db_->transaction_nesting() == 0) {
+    checked_transaction_ = 0;
+    return !sole_writer_;
+  }
+  // Checking starts a read transaction if there wasn't one yet, so the
+  // version can't change again before the transaction ends.
+  if (checked_transaction_ == db_->transaction_count())
+    return false;
+  checked_transaction_ = db_->transaction_count();
+  return true;
+}
+
+bool MetaTable::LoadValues() const {
+  values_.clear();
+  loaded_ = false;
+
+  // Read the version first: a commit that lands while we're loading will
+  // then show up as a changed version and cause another reload.
+  data_version_ = db_->GetDataVersion();
+
+  // Statement is non-mutating, so this cast is OK.
+  Statement s(const_cast<sql::Connection*>(db_)->GetCachedStatement(
+      SQL_FROM_HERE, "SELECT key, value FROM meta"));
+  if (!s)
+    return false;
+
+  while (s.Step())
+    values_[s.ColumnString(0)] = s.ColumnValue(1);
+
+  loaded_ = s.Succeeded();
+  if (!loaded_)
+    values_.clear();
+  return loaded_;
+}
+
 }  // namespace sql
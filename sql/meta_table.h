@@ -9,15 +9,27 @@
 #ifndef SQL_META_TABLE_H_
 #define SQL_META_TABLE_H_
 
+#include <map>
 #include <string>
 
 #include "basictypes.h"
+#include "value.h"
 
 namespace sql {
 
 class Connection;
 class Statement;
 
+// MetaTable keeps every key of the meta table in memory, so lookups don't
+// touch the database. Writes go to the database and the in-memory copy at
+// the same time. Commits by other connections are noticed through
+// Connection::GetDataVersion() and cause the copy to be reloaded, so all
+// writes made through this connection must go through the MetaTable.
+//
+// Another connection's commit can only show up when a transaction starts,
+// so within a transaction of this connection the data version is checked
+// once. Outside of one each read is a transaction of its own and checks it,
+// unless set_sole_writer() says no other connection writes the table.
 class MetaTable {
  public:
   // Returns true if the 'meta' table exists.
@@ -26,6 +38,11 @@ class MetaTable {
   MetaTable();
   ~MetaTable();
 
+  // Call if no other connection writes the meta table, for example because
+  // the database is opened by one connection at a time. Reads outside of a
+  // transaction then skip checking the data version.
+  void set_sole_writer() { sole_writer_ = true; }
+
   // Initializes the MetaTableHelper, creating the meta table if necessary. For
   // new tables, it will initialize the version number to |version| and the
   // compatible version number to |compatible_version|.
@@ -68,13 +85,42 @@ class MetaTable {
   bool GetValue(const char* key, int64* value) const;
 
  private:
+  typedef std::map<std::string, Value> ValueMap;
+
   // Conveniences to prepare the two types of statements used by
   // MetaTableHelper.
   bool PrepareSetStatement(Statement* statement, const char* key);
   bool PrepareGetStatement(Statement* statement, const char* key) const;
 
+  // Stores |value| under |key| in the database and in |values_|.
+  bool StoreValue(const char* key, const std::string& value);
+
+  // Looks |key| up in |values_|, reloading them first if they may be out of
+  // date. Falls back to the database while a transaction that wrote to the
+  // table is still open, since it may yet be rolled back.
+  bool LookupValue(const char* key, Value* value) const;
+
+  // Returns true if |values_| must be checked against the data version
+  // before use, and records that it was checked in this transaction.
+  bool NeedsVersionCheck() const;
+
+  // Reads the whole table into |values_|.
+  bool LoadValues() const;
+
   Connection* db_;
 
+  // The in-memory copy of the table. It is only trusted while |loaded_| is
+  // set and the connection's data version is still |data_version_|.
+  mutable ValueMap values_;
+  mutable bool loaded_;
+  mutable int64 data_version_;
+
+  bool sole_writer_;
+
+  // The Connection::transaction_count() of the transaction in which the
+  // data version was last checked, or 0 if outside of one.
+  mutable uint64 checked_transaction_;
+
   DISALLOW_COPY_AND_ASSIGN(MetaTable);
 };
 
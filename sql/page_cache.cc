@@ -0,0 +1,480 @@
+// Copyright (c) 2010 Garrett R. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "page_cache.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <unordered_map>
+#include <vector>
+
+#include <sqlite3.h>
+
+namespace sql {
+
+namespace {
+
+bool g_installed_for_sqlite = false;
+
+// The protected segment may hold this share of the budget, in percent.
+const int64 kProtectedPercent = 80;
+
+// A cache asking for a page only if it is easy to get is refused once this
+// share of the budget, or of its own cache_size, is pinned, in percent, so
+// that it writes out dirty pages rather than keeping them all.
+const int64 kPinnedPercent = 90;
+
+}  // namespace
+
+// One sqlite pager's pages.
+struct PageCache::Cache {
+  Cache(int page_size, int extra_size, bool purgeable)
+      : page_size(page_size),
+        extra_size(extra_size),
+        purgeable(purgeable),
+        max_pages(0),
+        pinned_pages(0) {
+  }
+
+  // The bytes taken by each page, including its Page.
+  size_t AllocationSize() const;
+
+  int page_size;
+  int extra_size;
+
+  // False for in-memory and temporary databases, whose pages are the only
+  // copy of their data.
+  bool purgeable;
+
+  // The connection's cache_size, in pages.
+  int max_pages;
+
+  std::unordered_map<unsigned, Page*> pages;
+  int pinned_pages;
+};
+
+// A page lives in a single block: this header, followed by the page's data
+// and sqlite's per-page data. |base| must come first, since sqlite hands it
+// back to us.
+struct alignas(16) PageCache::Page {
+  sqlite3_pcache_page base;
+  Cache* cache;
+  unsigned key;
+  bool pinned;
+
+  // True if the page was used again after it was first unpinned, which
+  // sends it to the protected segment when it is unpinned.
+  bool reused;
+
+  // The segment holding the page while it is unpinned, and its neighbours
+  // there.
+  PageList* list;
+  Page* previous;
+  Page* next;
+};
+
+size_t PageCache::Cache::AllocationSize() const {
+  return sizeof(Page) + page_size + extra_size;
+}
+
+// An intrusive list of unpinned pages, most recently used first.
+class PageCache::PageList {
+ public:
+  PageList() : head_(NULL), tail_(NULL) {}
+
+  Page* tail() const { return tail_; }
+
+  void PushFront(Page* page) {
+    page->list = this;
+    page->previous = NULL;
+    page->next = head_;
+    if (head_)
+      head_->previous = page;
+    else
+      tail_ = page;
+    head_ = page;
+  }
+
+  void Remove(Page* page) {
+    if (page->previous)
+      page->previous->next = page->next;
+    else
+      head_ = page->next;
+    if (page->next)
+      page->next->previous = page->previous;
+    else
+      tail_ = page->previous;
+    page->list = NULL;
+    page->previous = NULL;
+    page->next = NULL;
+  }
+
+ private:
+  Page* head_;
+  Page* tail_;
+
+  DISALLOW_COPY_AND_ASSIGN(PageList);
+};
+
+PageCache::Stats::Stats()
+    : hits(0),
+      misses(0),
+      evictions(0),
+      promotions(0),
+      pages(0),
+      bytes(0),
+      pinned_bytes(0),
+      protected_bytes(0),
+      budget_bytes(0) {
+}
+
+// static
+PageCache* PageCache::GetInstance() {
+  // Leaked on purpose, like sqlite's own page cache, which outlives every
+  // static object that may close a connection.
+  static PageCache* instance = new PageCache;
+  return instance;
+}
+
+// static
+bool PageCache::InstallForSqlite(int64 budget_bytes) {
+  static const sqlite3_pcache_methods2 kMethods = {
+    1,
+    NULL,
+    &PageCache::Init,
+    &PageCache::Shutdown,
+    &PageCache::Create,
+    &PageCache::Cachesize,
+    &PageCache::Pagecount,
+    &PageCache::Fetch,
+    &PageCache::Unpin,
+    &PageCache::Rekey,
+    &PageCache::Truncate,
+    &PageCache::Destroy,
+    &PageCache::Shrink,
+  };
+
+  GetInstance()->set_budget_bytes(budget_bytes);
+  if (g_installed_for_sqlite)
+    return true;
+
+  // sqlite3_config only copies the methods, the cast is OK.
+  if (sqlite3_config(SQLITE_CONFIG_PCACHE2,
+                     const_cast<sqlite3_pcache_methods2*>(&kMethods)) !=
+      SQLITE_OK)
+    return false;
+
+  g_installed_for_sqlite = true;
+  return true;
+}
+
+// static
+bool PageCache::IsInstalledForSqlite() {
+  return g_installed_for_sqlite;
+}
+
+void PageCache::set_budget_bytes(int64 bytes) {
+  std::lock_guard<std::mutex> lock(lock_);
+  stats_.budget_bytes = bytes;
+  BalanceSegments();
+  EvictToBudget();
+}
+
+PageCache::Stats PageCache::GetStats() const {
+  std::lock_guard<std::mutex> lock(lock_);
+  return stats_;
+}
+
+PageCache::PageCache()
+    : probation_(new PageList),
+      protected_(new PageList) {
+}
+
+PageCache::~PageCache() {
+  delete probation_;
+  delete protected_;
+}
+
+// static
+int PageCache::Init(void* /*arg*/) {
+  return SQLITE_OK;
+}
+
+// static
+void PageCache::Shutdown(void* /*arg*/) {
+}
+
+// static
+sqlite3_pcache* PageCache::Create(int page_size,
+                                  int extra_size,
+                                  int purgeable) {
+  Cache* cache = new (std::nothrow) Cache(page_size, extra_size, !!purgeable);
+  return reinterpret_cast<sqlite3_pcache*>(cache);
+}
+
+// static
+void PageCache::Cachesize(sqlite3_pcache* cache, int pages) {
+  PageCache* self = GetInstance();
+  std::lock_guard<std::mutex> lock(self->lock_);
+  reinterpret_cast<Cache*>(cache)->max_pages = pages;
+}
+
+// static
+int PageCache::Pagecount(sqlite3_pcache* cache) {
+  PageCache* self = GetInstance();
+  std::lock_guard<std::mutex> lock(self->lock_);
+  return static_cast<int>(reinterpret_cast<Cache*>(cache)->pages.size());
+}
+
+// static
+sqlite3_pcache_page* PageCache::Fetch(sqlite3_pcache* pcache,
+                                      unsigned key,
+                                      int create) {
+  Cache* cache = reinterpret_cast<Cache*>(pcache);
+  PageCache* self = GetInstance();
+  std::lock_guard<std::mutex> lock(self->lock_);
+
+  std::unordered_map<unsigned, Page*>::iterator found = cache->pages.find(key);
+  if (found != cache->pages.end()) {
+    Page* page = found->second;
+    if (!page->pinned) {
+      if (page->list == self->probation_) {
+        page->reused = true;
+        ++self->stats_.promotions;
+      } else if (page->list == self->protected_) {
+        self->stats_.protected_bytes -= cache->AllocationSize();
+      }
+      if (page->list)
+        page->list->Remove(page);
+      page->pinned = true;
+      ++cache->pinned_pages;
+      if (cache->purgeable)
+        self->stats_.pinned_bytes += cache->AllocationSize();
+    }
+    ++self->stats_.hits;
+    return &page->base;
+  }
+
+  if (!create)
+    return NULL;
+
+  // With |create| 1 sqlite can do without the page, by writing out dirty
+  // pages so that they can be unpinned.
+  if (create == 1 && cache->purgeable) {
+    int64 size = static_cast<int64>(cache->AllocationSize());
+    if (cache->max_pages > 0 &&
+        cache->pinned_pages * 100LL >= cache->max_pages * kPinnedPercent)
+      return NULL;
+    if ((self->stats_.pinned_bytes + size) * 100 >
+        self->stats_.budget_bytes * kPinnedPercent)
+      return NULL;
+  }
+
+  Page* page = self->NewPage(cache, key);
+  if (!page)
+    return NULL;
+  ++self->stats_.misses;
+  return &page->base;
+}
+
+// static
+void PageCache::Unpin(sqlite3_pcache* pcache,
+                      sqlite3_pcache_page* base,
+                      int discard) {
+  Cache* cache = reinterpret_cast<Cache*>(pcache);
+  Page* page = reinterpret_cast<Page*>(base);
+  PageCache* self = GetInstance();
+  std::lock_guard<std::mutex> lock(self->lock_);
+
+  if (discard) {
+    self->FreePage(page);
+    return;
+  }
+
+  page->pinned = false;
+  --cache->pinned_pages;
+  if (!cache->purgeable)
+    return;
+
+  self->stats_.pinned_bytes -= cache->AllocationSize();
+  if (page->reused) {
+    self->protected_->PushFront(page);
+    self->stats_.protected_bytes += cache->AllocationSize();
+    self->BalanceSegments();
+  } else {
+    self->probation_->PushFront(page);
+  }
+  self->EvictToBudget();
+}
+
+// static
+void PageCache::Rekey(sqlite3_pcache* pcache,
+                      sqlite3_pcache_page* base,
+                      unsigned old_key,
+                      unsigned new_key) {
+  Cache* cache = reinterpret_cast<Cache*>(pcache);
+  Page* page = reinterpret_cast<Page*>(base);
+  PageCache* self = GetInstance();
+  std::lock_guard<std::mutex> lock(self->lock_);
+
+  // A page already at |new_key| is unpinned, and replaced.
+  std::unordered_map<unsigned, Page*>::iterator found =
+      cache->pages.find(new_key);
+  if (found != cache->pages.end() && found->second != page)
+    self->FreePage(found->second);
+
+  cache->pages.erase(old_key);
+  page->key = new_key;
+  cache->pages[new_key] = page;
+}
+
+// static
+void PageCache::Truncate(sqlite3_pcache* pcache, unsigned limit) {
+  Cache* cache = reinterpret_cast<Cache*>(pcache);
+  PageCache* self = GetInstance();
+  std::lock_guard<std::mutex> lock(self->lock_);
+
+  // Pinned pages past |limit| are discarded too.
+  std::vector<Page*> truncated;
+  for (std::unordered_map<unsigned, Page*>::iterator it = cache->pages.begin();
+       it != cache->pages.end(); ++it) {
+    if (it->first >= limit)
+      truncated.push_back(it->second);
+  }
+  for (size_t i = 0; i < truncated.size(); ++i)
+    self->FreePage(truncated[i]);
+}
+
+// static
+void PageCache::Destroy(sqlite3_pcache* pcache) {
+  Cache* cache = reinterpret_cast<Cache*>(pcache);
+  PageCache* self = GetInstance();
+  {
+    std::lock_guard<std::mutex> lock(self->lock_);
+    while (!cache->pages.empty())
+      self->FreePage(cache->pages.begin()->second);
+  }
+  delete cache;
+}
+
+// static
+void PageCache::Shrink(sqlite3_pcache* pcache) {
+  Cache* cache = reinterpret_cast<Cache*>(pcache);
+  PageCache* self = GetInstance();
+  std::lock_guard<std::mutex> lock(self->lock_);
+
+  std::vector<Page*> unpinned;
+  for (std::unordered_map<unsigned, Page*>::iterator it = cache->pages.begin();
+       it != cache->pages.end(); ++it) {
+    if (!it->second->pinned)
+      unpinned.push_back(it->second);
+  }
+  for (size_t i = 0; i < unpinned.size(); ++i)
+    self->FreePage(unpinned[i]);
+}
+
+PageCache::Page* PageCache::NewPage(Cache* cache, unsigned key) {
+  size_t size = cache->AllocationSize();
+  Page* page = NULL;
+
+  if (cache->purgeable) {
+    while (stats_.bytes + static_cast<int64>(size) > stats_.budget_bytes) {
+      Page* victim = Victim();
+      if (!victim)
+        break;
+      ++stats_.evictions;
+      if (!page && victim->cache->AllocationSize() == size) {
+        Detach(victim);
+        page = victim;
+      } else {
+        FreePage(victim);
+      }
+    }
+  }
+
+  if (!page) {
+    void* block = malloc(size);
+    if (!block)
+      return NULL;
+    page = new (block) Page;
+  }
+
+  char* data = reinterpret_cast<char*>(page) + sizeof(Page);
+  page->base.pBuf = data;
+  page->base.pExtra = data + cache->page_size;
+  // sqlite expects its per-page data zeroed on a new page.
+  memset(page->base.pExtra, 0, cache->extra_size);
+  page->cache = cache;
+  page->key = key;
+  page->pinned = true;
+  page->reused = false;
+  page->list = NULL;
+  page->previous = NULL;
+  page->next = NULL;
+
+  cache->pages[key] = page;
+  ++cache->pinned_pages;
+  if (cache->purgeable) {
+    ++stats_.pages;
+    stats_.bytes += size;
+    stats_.pinned_bytes += size;
+  }
+  return page;
+}
+
+void PageCache::FreePage(Page* page) {
+  Detach(page);
+  free(page);
+}
+
+void PageCache::Detach(Page* page) {
+  Cache* cache = page->cache;
+  int64 size = static_cast<int64>(cache->AllocationSize());
+
+  if (page->list == protected_)
+    stats_.protected_bytes -= size;
+  if (page->list)
+    page->list->Remove(page);
+  if (page->pinned) {
+    --cache->pinned_pages;
+    if (cache->purgeable)
+      stats_.pinned_bytes -= size;
+  }
+  if (cache->purgeable) {
+    --stats_.pages;
+    stats_.bytes -= size;
+  }
+  cache->pages.erase(page->key);
+}
+
+void PageCache::EvictToBudget() {
+  while (stats_.bytes > stats_.budget_bytes) {
+    Page* victim = Victim();
+    if (!victim)
+      break;
+    ++stats_.evictions;
+    FreePage(victim);
+  }
+}
+
+PageCache::Page* PageCache::Victim() const {
+  if (probation_->tail())
+    return probation_->tail();
+  return protected_->tail();
+}
+
+void PageCache::BalanceSegments() {
+  int64 limit = stats_.budget_bytes * kProtectedPercent / 100;
+  while (stats_.protected_bytes > limit && protected_->tail()) {
+    Page* page = protected_->tail();
+    protected_->Remove(page);
+    stats_.protected_bytes -= page->cache->AllocationSize();
+    // It must be used again to be protected again.
+    page->reused = false;
+    probation_->PushFront(page);
+  }
+}
+
+}  // namespace sql
@@ -0,0 +1,150 @@
+// Copyright (c) 2010 Garrett R. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef SQL_PAGE_CACHE_H_
+#define SQL_PAGE_CACHE_H_
+
+#include <mutex>
+
+#include "basictypes.h"
+
+struct sqlite3_pcache;
+struct sqlite3_pcache_page;
+
+namespace sql {
+
+// PageCache is a process-wide page cache for sqlite, which holds the pages
+// of every connection within one budget of bytes. Without it each
+// connection caches up to its own cache_size, so a pool of N connections
+// needs N times the memory for its hot pages, most of it idle at any
+// moment. Here a connection that is busy takes pages from idle ones, least
+// recently used first, and the pool as a whole never holds more than the
+// budget. It must be installed before the first connection is opened:
+//
+//   int main() {
+//     sql::PageCache::InstallForSqlite(256 * 1024 * 1024);
+//     ...
+//   }
+//
+// Eviction is a segmented LRU, which keeps a large scan from flushing the
+// cache. A page enters a probation segment, and moves to a protected one,
+// at most 80% of the budget, only when it is used again after its first
+// use. Pages are evicted from the probation segment first, so the pages of
+// a scan that are read once push out each other rather than the working
+// set of the other connections.
+//
+// Each connection still has its own copy of a page it reads: sqlite's pager
+// writes into its pages in place and, in WAL mode, may be reading an older
+// snapshot than another connection, and a page cache isn't told which file
+// a page belongs to. Connection::OPEN_SHARED_CACHE shares pages between the
+// connections to a file at the cost of table-level locking.
+//
+// A connection's cache_size no longer limits the pages it keeps. It still
+// decides when the connection writes dirty pages of a large transaction
+// out to the file rather than keeping them, since those can't be evicted.
+// Caches of in-memory and temporary databases, which sqlite can't evict
+// from, aren't counted in the budget.
+class PageCache {
+ public:
+  struct Stats {
+    Stats();
+
+    // Pages found in the cache and pages sqlite had to read.
+    int64 hits;
+    int64 misses;
+
+    // Pages evicted to stay within the budget, and pages moved from the
+    // probation to the protected segment.
+    int64 evictions;
+    int64 promotions;
+
+    // Pages held and their bytes, including sqlite's per-page data, and the
+    // bytes in use by sqlite and in the protected segment. Only pages counted
+    // in the budget are included.
+    int64 pages;
+    int64 bytes;
+    int64 pinned_bytes;
+    int64 protected_bytes;
+
+    int64 budget_bytes;
+  };
+
+  static PageCache* GetInstance();
+
+  // Installs the cache for sqlite with a budget of |budget_bytes|. Returns
+  // false if sqlite has already been initialized, in which case it keeps
+  // its own page cache.
+  static bool InstallForSqlite(int64 budget_bytes);
+
+  // Returns true if InstallForSqlite() succeeded.
+  static bool IsInstalledForSqlite();
+
+  // Changes the budget, evicting pages if it shrank. Pages in use can't be
+  // evicted, so the cache can stay over a budget that is too small for them.
+  void set_budget_bytes(int64 bytes);
+
+  Stats GetStats() const;
+
+ private:
+  struct Cache;
+  struct Page;
+  class PageList;
+
+  PageCache();
+  ~PageCache();
+
+  // sqlite3_pcache_methods2 implementation. Each takes |lock_|, since
+  // connections on different threads share the pages.
+  static int Init(void* arg);
+  static void Shutdown(void* arg);
+  static sqlite3_pcache* Create(int page_size, int extra_size, int purgeable);
+  static void Cachesize(sqlite3_pcache* cache, int pages);
+  static int Pagecount(sqlite3_pcache* cache);
+  static sqlite3_pcache_page* Fetch(sqlite3_pcache* cache, unsigned key,
+                                    int create);
+  static void Unpin(sqlite3_pcache* cache, sqlite3_pcache_page* page,
+                    int discard);
+  static void Rekey(sqlite3_pcache* cache, sqlite3_pcache_page* page,
+                    unsigned old_key, unsigned new_key);
+  static void Truncate(sqlite3_pcache* cache, unsigned limit);
+  static void Destroy(sqlite3_pcache* cache);
+  static void Shrink(sqlite3_pcache* cache);
+
+  // The methods below are called with |lock_| held.
+
+  // Adds a pinned page for |key| to |cache|, evicting pages to make room if
+  // the cache counts in the budget, and reusing the memory of an evicted
+  // page of the same size. Returns NULL if out of memory.
+  Page* NewPage(Cache* cache, unsigned key);
+
+  // Removes |page| from its cache and frees it.
+  void FreePage(Page* page);
+
+  // Takes |page| out of its segment and its cache without freeing it.
+  void Detach(Page* page);
+
+  // Evicts unpinned pages until the cache is within its budget.
+  void EvictToBudget();
+
+  // Returns the least valuable unpinned page, or NULL if there is none.
+  Page* Victim() const;
+
+  // Moves protected pages to the probation segment while the protected one
+  // is over its share of the budget.
+  void BalanceSegments();
+
+  mutable std::mutex lock_;
+
+  // Unpinned pages of purgeable caches, most recently used first.
+  PageList* probation_;
+  PageList* protected_;
+
+  Stats stats_;
+
+  DISALLOW_COPY_AND_ASSIGN(PageCache);
+};
+
+}  // namespace sql
+
+#endif  // SQL_PAGE_CACHE_H_
@@ -0,0 +1,334 @@
+// Copyright (c) 2010 Garrett R. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "parallel_query.h"
+
+#include <limits>
+#include <map>
+#include <queue>
+#include <thread>
+
+#include "connection.h"
+#include "snapshot.h"
+#include "statement.h"
+#include "transaction.h"
+#include "utility.h"
+
+namespace sql {
+
+namespace {
+
+// A bound below every non-NULL integer, real or text key.
+Value LowestKey() {
+  return Value(-std::numeric_limits<double>::infinity());
+}
+
+// A bound above every integer, real or text key: sqlite sorts all BLOBs
+// after them, even an empty one.
+Value HighestKey() {
+  return Value::Blob("", 0);
+}
+
+// Opens a reader for one partition. Each is used by one worker thread only.
+bool OpenReader(const std::string& path, Connection* db) {
+  return db->Open(path, Connection::OPEN_READ_ONLY | Connection::OPEN_NO_MUTEX);
+}
+
+// Orders rows on the first |columns| columns.
+class GroupLess {
+ public:
+  explicit GroupLess(int columns) : columns_(columns) {}
+
+  bool operator()(const Row& a, const Row& b) const {
+    for (int i = 0; i < columns_; ++i) {
+      int result = a[i].Compare(b[i]);
+      if (result != 0)
+        return result < 0;
+    }
+    return false;
+  }
+
+ private:
+  int columns_;
+};
+
+// The position of the next unmerged row of one partition.
+struct MergeCursor {
+  size_t partition;
+  size_t index;
+};
+
+}  // namespace
+
+ParallelQuery::ParallelQuery()
+    : partitions_(static_cast<int>(std::thread::hardware_concurrency())),
+      key_column_("rowid"),
+      merge_mode_(MERGE_CONCATENATE),
+      order_column_(0),
+      descending_(false),
+      group_columns_(0) {
+  if (partitions_ < 1)
+    partitions_ = 1;
+}
+
+ParallelQuery::~ParallelQuery() {
+}
+
+bool ParallelQuery::Run(const std::string& path,
+                        const std::string& sql,
+                        const Row& params,
+                        std::vector<Row>* rows) {
+  if (!rows || table_.empty())
+    return false;
+  rows->clear();
+
+  // The coordinator's read transaction stays open until every reader is
+  // done. Besides giving the serial fallback its consistency, it stops the
+  // WAL from being checkpointed past the snapshot while readers open it.
+  Connection coordinator;
+  if (!OpenReader(path, &coordinator))
+    return false;
+
+  Transaction transaction(&coordinator);
+  if (!transaction.Begin())
+    return false;
+
+  std::vector<Range> ranges;
+  if (!ComputeRanges(&coordinator, &ranges))
+    return false;
+
+  std::vector<std::vector<Row> > results(ranges.size());
+
+  Snapshot snapshot;
+  if (ranges.size() > 1 && snapshot.Take(&coordinator)) {
+    // Each reader uses its own slot, so no locking is needed. vector<bool>
+    // is avoided since its elements share storage.
+    std::vector<char> succeeded(ranges.size(), 0);
+    std::vector<std::thread> threads;
+    threads.reserve(ranges.size());
+
+    for (size_t i = 0; i < ranges.size(); ++i) {
+      threads.push_back(std::thread([&, i]() {
+        Connection reader;
+        if (!OpenReader(path, &reader))
+          return;
+        Transaction read(&reader);
+        if (!read.Begin() || !snapshot.Open(&reader))
+          return;
+        if (RunPartition(&reader, sql, params, ranges[i], &results[i]))
+          succeeded[i] = read.Commit();
+      }));
+    }
+    for (size_t i = 0; i < threads.size(); ++i)
+      threads[i].join();
+
+    for (size_t i = 0; i < succeeded.size(); ++i) {
+      if (!succeeded[i])
+        return false;
+    }
+  } else {
+    for (size_t i = 0; i < ranges.size(); ++i) {
+      if (!RunPartition(&coordinator, sql, params, ranges[i], &results[i]))
+        return false;
+    }
+  }
+
+  transaction.Commit();
+
+  Merge(&results, rows);
+  return true;
+}
+
+bool ParallelQuery::ComputeRanges(Connection* db,
+                                  std::vector<Range>* ranges) const {
+  std::string table = quote_identifier(table_);
+  std::string key = quote_identifier(key_column_);
+  int partitions = partitions_ < 1 ? 1 : partitions_;
+
+  Statement bounds(db->GetUniqueStatement(
+      "SELECT MIN(" + key + "), MAX(" + key + "), COUNT(" + key + ") "
+      "FROM " + table));
+  if (!bounds || !bounds.Step())
+    return false;
+
+  Value min_key = bounds.ColumnValue(0);
+  Value max_key = bounds.ColumnValue(1);
+  int64 count = bounds.ColumnInt64(2);
+
+  if (max_key.type() == COLUMN_TYPE_BLOB)
+    return false;  // There's no upper bound above a BLOB.
+
+  Range range;
+  if (count == 0) {
+    // An empty table still gets one partition, so that aggregates without a
+    // GROUP BY produce their usual single row.
+    range.lower = LowestKey();
+    range.upper = HighestKey();
+    ranges->push_back(range);
+    return true;
+  }
+
+  if (min_key.type() == COLUMN_TYPE_INTEGER &&
+      max_key.type() == COLUMN_TYPE_INTEGER) {
+    // Split the value range evenly. The arithmetic is unsigned so that the
+    // span of the full int64 range fits. Each partition covers
+    // span / partitions + 1 of the span + 1 values, which can only wrap
+    // around for a single partition, and that one covers everything.
+    int64 min = min_key.AsInt64();
+    int64 max = max_key.AsInt64();
+    uint64 span = static_cast<uint64>(max) - static_cast<uint64>(min);
+    uint64 step = partitions > 1 ? span / partitions + 1 : 0;
+
+    uint64 lower = static_cast<uint64>(min);
+    for (int i = 0; i < partitions; ++i) {
+      range.lower = Value(static_cast<int64>(lower));
+      uint64 remaining = static_cast<uint64>(max) - lower;
+      if (partitions == 1 || remaining < step) {
+        range.upper = max == kint64max ? HighestKey() : Value(max + 1);
+        ranges->push_back(range);
+        break;
+      }
+      lower += step;
+      range.upper = Value(static_cast<int64>(lower));
+      ranges->push_back(range);
+    }
+    return true;
+  }
+
+  // Other keys are split on quantiles, which an index makes cheap to find.
+  Statement quantile(db->GetUniqueStatement(
+      "SELECT " + key + " FROM " + table + " WHERE " + key + " IS NOT NULL "
+      "ORDER BY " + key + " LIMIT 1 OFFSET ?"));
+  if (!quantile)
+    return false;
+
+  range.lower = LowestKey();
+  for (int i = 1; i < partitions; ++i) {
+    quantile.Reset();
+    quantile.BindInt64(0, count * i / partitions);
+    if (!quantile.Step())
+      return false;
+
+    Value boundary = quantile.ColumnValue(0);
+    if (boundary.Compare(range.lower) <= 0)
+      continue;  // Skewed keys; this partition would be empty.
+    range.upper = boundary;
+    ranges->push_back(range);
+    range.lower = boundary;
+  }
+  range.upper = HighestKey();
+  ranges->push_back(range);
+  return true;
+}
+
+// static
+bool ParallelQuery::RunPartition(Connection* db,
+                                 const std::string& sql,
+                                 const Row& params,
+                                 const Range& range,
+                                 std::vector<Row>* rows) {
+  Statement statement(db->GetUniqueStatement(sql));
+  if (!statement)
+    return false;
+
+  statement.BindValue(0, range.lower);
+  statement.BindValue(1, range.upper);
+  for (size_t i = 0; i < params.size(); ++i)
+    statement.BindValue(static_cast<int>(i) + 2, params[i]);
+
+  while (statement.Step()) {
+    rows->push_back(Row());
+    statement.ColumnRow(&rows->back());
+  }
+  return statement.Succeeded();
+}
+
+void ParallelQuery::Merge(std::vector<std::vector<Row> >* results,
+                          std::vector<Row>* rows) const {
+  size_t total = 0;
+  for (size_t i = 0; i < results->size(); ++i)
+    total += (*results)[i].size();
+
+  switch (merge_mode_) {
+    case MERGE_CONCATENATE: {
+      rows->reserve(total);
+      for (size_t i = 0; i < results->size(); ++i) {
+        std::vector<Row>& result = (*results)[i];
+        for (size_t j = 0; j < result.size(); ++j) {
+          rows->push_back(Row());
+          rows->back().swap(result[j]);
+        }
+      }
+      break;
+    }
+
+    case MERGE_ORDERED: {
+      // A k-way merge: the queue holds the head of every partition.
+      int column = order_column_;
+      bool descending = descending_;
+      std::vector<std::vector<Row> >& parts = *results;
+      auto after = [&parts, column, descending](const MergeCursor& a,
+                                                const MergeCursor& b) {
+        const Row& row_a = parts[a.partition][a.index];
+        const Row& row_b = parts[b.partition][b.index];
+        int result = 0;
+        if (column < static_cast<int>(row_a.size()) &&
+            column < static_cast<int>(row_b.size()))
+          result = row_a[column].Compare(row_b[column]);
+        if (result == 0)
+          return a.partition > b.partition;  // Keep the merge stable.
+        return descending ? result < 0 : result > 0;
+      };
+      std::priority_queue<MergeCursor, std::vector<MergeCursor>,
+                          decltype(after)> heads(after);
+
+      for (size_t i = 0; i < parts.size(); ++i) {
+        if (!parts[i].empty()) {
+          MergeCursor cursor = { i, 0 };
+          heads.push(cursor);
+        }
+      }
+
+      rows->reserve(total);
+      while (!heads.empty()) {
+        MergeCursor cursor = heads.top();
+        heads.pop();
+        rows->push_back(Row());
+        rows->back().swap(parts[cursor.partition][cursor.index]);
+        if (++cursor.index < parts[cursor.partition].size())
+          heads.push(cursor);
+      }
+      break;
+    }
+
+    case MERGE_COMBINE: {
+      typedef std::map<Row, Row, GroupLess> GroupMap;
+      GroupMap groups((GroupLess(group_columns_)));
+
+      for (size_t i = 0; i < results->size(); ++i) {
+        std::vector<Row>& result = (*results)[i];
+        for (size_t j = 0; j < result.size(); ++j) {
+          Row& row = result[j];
+          if (static_cast<int>(row.size()) < group_columns_)
+            continue;
+          Row group(row.begin(), row.begin() + group_columns_);
+          GroupMap::iterator found = groups.find(group);
+          if (found == groups.end())
+            groups[group].swap(row);
+          else if (combine_)
+            combine_(row, &found->second);
+        }
+      }
+
+      rows->reserve(groups.size());
+      for (GroupMap::iterator i = groups.begin(); i != groups.end(); ++i) {
+        rows->push_back(Row());
+        rows->back().swap(i->second);
+      }
+      break;
+    }
+  }
+}
+
+}  // namespace sql
@@ -0,0 +1,145 @@
+// Copyright (c) 2010 Garrett R. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef SQL_PARALLEL_QUERY_H_
+#define SQL_PARALLEL_QUERY_H_
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "basictypes.h"
+#include "value.h"
+
+namespace sql {
+
+class Connection;
+
+// ParallelQuery splits one query into key ranges and runs each range on its
+// own read-only Connection and thread, then merges the partial results. All
+// of the readers are pinned to a single sql::Snapshot, so together they see
+// one consistent state of the database while writers keep committing.
+//
+// The query must contain two parameters, ?1 and ?2, that are bound to the
+// inclusive lower and exclusive upper bound of each partition's range of the
+// partition key. Any additional |params| are bound from ?3 onwards.
+//
+// Example, summing a column per kind over 8 readers:
+//   sql::ParallelQuery query;
+//   query.set_partitions(8);
+//   query.set_partition_key("events", "rowid");
+//   query.set_combine(1, [](const sql::Row& partial, sql::Row* total) {
+//     (*total)[1] = sql::Value((*total)[1].AsInt64() + partial[1].AsInt64());
+//   });
+//   std::vector<sql::Row> rows;
+//   query.Run(path,
+//             "SELECT kind, SUM(size) FROM events "
+//             "WHERE rowid >= ?1 AND rowid < ?2 GROUP BY kind",
+//             sql::Row(), &rows);
+//
+// Partitioning needs the key to be the rowid or to have an index. Integer
+// keys are split into even value ranges, other keys into ranges holding
+// roughly the same number of rows. Rows whose key is NULL belong to no
+// partition, and BLOB keys cannot be split.
+//
+// When the database is not in WAL mode or sqlite lacks snapshot support, the
+// partitions run one after another inside a single read transaction instead,
+// which gives the same result without the speedup.
+class ParallelQuery {
+ public:
+  // How the partial results of the partitions are put together.
+  enum MergeMode {
+    // Partition results are appended in key range order.
+    MERGE_CONCATENATE,
+    // Partition results are each sorted on a column and are merged into one
+    // sorted result.
+    MERGE_ORDERED,
+    // Rows with equal leading group columns are folded together with a
+    // CombineFunction, for example to add up partial aggregates.
+    MERGE_COMBINE,
+  };
+
+  // Folds |partial| into |accumulated|. Both have the same columns and the
+  // same values in the group columns.
+  typedef std::function<void(const Row& partial, Row* accumulated)>
+      CombineFunction;
+
+  ParallelQuery();
+  ~ParallelQuery();
+
+  // Sets the number of partitions, each of which gets its own reader. The
+  // default is the number of hardware threads.
+  void set_partitions(int partitions) { partitions_ = partitions; }
+
+  // Sets the table and column whose values are split into ranges.
+  void set_partition_key(const std::string& table, const std::string& column) {
+    table_ = table;
+    key_column_ = column;
+  }
+
+  // Selects MERGE_CONCATENATE. This is the default.
+  void set_concatenate() { merge_mode_ = MERGE_CONCATENATE; }
+
+  // Selects MERGE_ORDERED on the 0-based |column|. Each partition's query
+  // must itself return rows sorted the same way.
+  void set_ordered_merge(int column, bool descending) {
+    merge_mode_ = MERGE_ORDERED;
+    order_column_ = column;
+    descending_ = descending;
+  }
+
+  // Selects MERGE_COMBINE, grouping on the first |group_columns| columns. The
+  // merged rows are sorted by group. With no group columns every row is
+  // folded into a single result row.
+  void set_combine(int group_columns, const CombineFunction& combine) {
+    merge_mode_ = MERGE_COMBINE;
+    group_columns_ = group_columns;
+    combine_ = combine;
+  }
+
+  // Runs |sql| over the database at |path| and stores the merged result in
+  // |rows|. Returns false if the database could not be opened, the query
+  // failed on any partition, or the partition key could not be split.
+  bool Run(const std::string& path,
+           const std::string& sql,
+           const Row& params,
+           std::vector<Row>* rows);
+
+ private:
+  // The half-open key range [lower, upper) covered by one partition.
+  struct Range {
+    Value lower;
+    Value upper;
+  };
+
+  // Computes the partition ranges using the open read transaction on |db|.
+  bool ComputeRanges(Connection* db, std::vector<Range>* ranges) const;
+
+  // Runs |sql| for |range| on |db| and appends the rows to |rows|.
+  static bool RunPartition(Connection* db,
+                           const std::string& sql,
+                           const Row& params,
+                           const Range& range,
+                           std::vector<Row>* rows);
+
+  // Merges |results| into |rows| according to the merge mode.
+  void Merge(std::vector<std::vector<Row> >* results,
+             std::vector<Row>* rows) const;
+
+  int partitions_;
+  std::string table_;
+  std::string key_column_;
+
+  MergeMode merge_mode_;
+  int order_column_;
+  bool descending_;
+  int group_columns_;
+  CombineFunction combine_;
+
+  DISALLOW_COPY_AND_ASSIGN(ParallelQuery);
+};
+
+}  // namespace sql
+
+#endif  // SQL_PARALLEL_QUERY_H_
@@ -17,23 +17,6 @@ RefCountedBase::RefCountedBase()
 
 RefCountedBase::~RefCountedBase() {}
 
-void RefCountedBase::AddRef() {
-  // TODO(maruel): Add back once it doesn't assert 500 times/sec.
-  // Current thread books the critical section "AddRelease" without release it.
-  // DFAKE_SCOPED_LOCK_THREAD_LOCKED(add_release_);
-  ++ref_count_;
-}
-
-bool RefCountedBase::Release() {
-  // TODO(maruel): Add back once it doesn't assert 500 times/sec.
-  // Current thread books the critical section "AddRelease" without release it.
-  // DFAKE_SCOPED_LOCK_THREAD_LOCKED(add_release_);
-  if (--ref_count_ == 0) {
-    return true;
-  }
-  return false;
-}
-
 }  // namespace subtle
 
 }  // namespace base
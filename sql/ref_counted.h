@@ -27,10 +27,23 @@ class RefCountedBase {
   RefCountedBase();
   ~RefCountedBase();
 
-  void AddRef();
+  // These are inline since they run every time a scoped_refptr is copied.
+  void AddRef() {
+    // TODO(maruel): Add back once it doesn't assert 500 times/sec.
+    // Current thread books the critical section "AddRelease" without release
+    // it.
+    // DFAKE_SCOPED_LOCK_THREAD_LOCKED(add_release_);
+    ++ref_count_;
+  }
 
   // Returns true if the object should self-delete.
-  bool Release();
+  bool Release() {
+    // TODO(maruel): Add back once it doesn't assert 500 times/sec.
+    // Current thread books the critical section "AddRelease" without release
+    // it.
+    // DFAKE_SCOPED_LOCK_THREAD_LOCKED(add_release_);
+    return --ref_count_ == 0;
+  }
 
  private:
   int ref_count_;
@@ -73,7 +86,7 @@ class RefCounted : public subtle::RefCountedBase {
   }
 
  private:
-  DISALLOW_COPY_AND_ASSIGN(RefCounted<T>);
+  DISALLOW_COPY_AND_ASSIGN(RefCounted);
 };
 
 }  // namespace base
@@ -142,6 +155,11 @@ class scoped_refptr {
       ptr_->AddRef();
   }
 
+  // Takes over |r|'s reference without touching the reference count.
+  scoped_refptr(scoped_refptr<T>&& r) : ptr_(r.ptr_) {
+    r.ptr_ = NULL;
+  }
+
   template <typename U>
   scoped_refptr(const scoped_refptr<U>& r) : ptr_(r.get()) {
     if (ptr_)
@@ -182,6 +200,18 @@ class scoped_refptr {
     return *this = r.ptr_;
   }
 
+  // Takes over |r|'s reference, releasing the one held before.
+  scoped_refptr<T>& operator=(scoped_refptr<T>&& r) {
+    if (this != &r) {
+      T* old = ptr_;
+      ptr_ = r.ptr_;
+      r.ptr_ = NULL;
+      if (old)
+        old->Release();
+    }
+    return *this;
+  }
+
   template <typename U>
   scoped_refptr<T>& operator=(const scoped_refptr<U>& r) {
     return *this = r.get();
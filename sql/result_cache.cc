@@ -0,0 +1,341 @@
+// Copyright (c) 2010 Garrett R. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "result_cache.h"
+
+#include <sqlite3.h>
+
+#include "statement.h"
+
+namespace sql {
+
+namespace {
+
+// Rough per-entry bookkeeping cost on top of the key and the rows.
+const size_t kEntryOverhead = 128;
+
+// Functions whose result isn't a function of the database contents.
+const char* const kVolatileFunctions[] = {
+  "random", "randomblob", "changes", "total_changes", "last_insert_rowid",
+  "date", "time", "datetime", "julianday", "strftime", "unixepoch",
+  "current_date", "current_time", "current_timestamp",
+};
+
+// Filled in by the authorizer while a query is being prepared.
+struct AuthorizerState {
+  AuthorizerState() : cacheable(true), authorizer(NULL), arg(NULL) {}
+
+  bool cacheable;
+  std::vector<std::string> tables;
+
+  // The connection's own authorizer, which still decides.
+  Connection::Authorizer authorizer;
+  void* arg;
+};
+
+int CollectTables(void* state, int action, const char* arg1, const char* arg2,
+                  const char* database, const char* trigger) {
+  AuthorizerState* collected = static_cast<AuthorizerState*>(state);
+  if (collected->authorizer) {
+    int decision = collected->authorizer(collected->arg, action, arg1, arg2,
+                                         database, trigger);
+    if (decision != SQLITE_OK)
+      return decision;
+  }
+
+  switch (action) {
+    case SQLITE_READ:
+      if (arg1) {
+        std::string table(arg1);
+        for (size_t i = 0; i < collected->tables.size(); ++i) {
+          if (collected->tables[i] == table)
+            return SQLITE_OK;
+        }
+        collected->tables.push_back(table);
+      }
+      break;
+
+    case SQLITE_FUNCTION:
+      for (size_t i = 0; arg2 && i < arraysize(kVolatileFunctions); ++i) {
+        if (sqlite3_stricmp(arg2, kVolatileFunctions[i]) == 0)
+          collected->cacheable = false;
+      }
+      break;
+
+    case SQLITE_SELECT:
+      break;
+
+    default:
+      // Pragmas, writes, attaches and the like are never cached.
+      collected->cacheable = false;
+      break;
+  }
+  return SQLITE_OK;
+}
+
+void AppendInt64(int64 value, std::string* out) {
+  out->append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+void AppendUint32(uint32 value, std::string* out) {
+  out->append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+size_t RowsByteSize(const std::vector<Row>& rows) {
+  size_t size = rows.capacity() * sizeof(Row);
+  for (size_t i = 0; i < rows.size(); ++i) {
+    for (size_t j = 0; j < rows[i].size(); ++j)
+      size += rows[i][j].ByteSize();
+  }
+  return size;
+}
+
+void AppendValue(const Value& value, std::string* out) {
+  out->push_back(static_cast<char>(value.type()));
+  switch (value.type()) {
+    case COLUMN_TYPE_INTEGER:
+      AppendInt64(value.AsInt64(), out);
+      break;
+    case COLUMN_TYPE_FLOAT: {
+      double number = value.AsDouble();
+      out->append(reinterpret_cast<const char*>(&number), sizeof(number));
+      break;
+    }
+    case COLUMN_TYPE_TEXT:
+    case COLUMN_TYPE_BLOB:
+      AppendUint32(static_cast<uint32>(value.bytes().size()), out);
+      out->append(value.bytes());
+      break;
+    case COLUMN_TYPE_NULL:
+      break;
+  }
+}
+
+}  // namespace
+
+ResultCache::ResultCache(Connection* db, size_t max_bytes)
+    : db_(db),
+      max_bytes_(max_bytes),
+      bytes_(0),
+      data_version_(db->GetDataVersion()),
+      total_changes_(db->GetTotalChangeCount()),
+      reported_changes_(0),
+      checked_transaction_(0),
+      sole_writer_(false),
+      hits_(0),
+      misses_(0) {
+  schema_version_ = GetSchemaVersion();
+  db_->AddChangeObserver(this);
+}
+
+ResultCache::~ResultCache() {
+  db_->RemoveChangeObserver(this);
+}
+
+bool ResultCache::Query(const StatementID& id,
+                        const char* sql,
+                        const Row& params,
+                        std::vector<Row>* rows) {
+  if (!rows || !sql)
+    return false;
+  rows->clear();
+
+  Validate();
+
+  const QueryInfo& info = GetQueryInfo(sql);
+  if (!info.cacheable)
+    return db_->QueryRows(id, sql, params, rows);
+
+  std::string key;
+  EncodeKey(sql, params, &key);
+
+  EntryMap::iterator found = entries_.find(key);
+  if (found != entries_.end()) {
+    const Dependencies& dependencies = found->second.dependencies;
+    bool current = true;
+    for (size_t i = 0; current && i < dependencies.size(); ++i)
+      current = *dependencies[i].first == dependencies[i].second;
+
+    if (current) {
+      ++hits_;
+      lru_.splice(lru_.begin(), lru_, found->second.lru_position);
+      *rows = found->second.rows;
+      return true;
+    }
+    Erase(found);
+  }
+
+  ++misses_;
+  if (!db_->QueryRows(id, sql, params, rows))
+    return false;
+  Insert(key, info, *rows);
+  return true;
+}
+
+void ResultCache::Clear() {
+  ClearResults();
+  queries_.clear();
+}
+
+void ResultCache::OnRowChanged(ChangeType /*type*/,
+                               const char* /*database*/,
+                               const char* table,
+                               int64 /*rowid*/) {
+  ++reported_changes_;
+  GenerationMap::iterator generation = generations_.find(table);
+  if (generation != generations_.end())
+    ++generation->second;
+}
+
+void ResultCache::OnRollback() {
+  // We don't know which of the reported changes were undone.
+  ClearResults();
+}
+
+void ResultCache::CheckSchema() {
+  int64 schema_version = GetSchemaVersion();
+  if (schema_version != schema_version_) {
+    // Tables may have become views, or been replaced, so what was learned
+    // about each query is out of date too.
+    Clear();
+    schema_version_ = schema_version;
+  }
+}
+
+void ResultCache::Validate() {
+  // A change counted by sqlite but not reported to OnRowChanged could have
+  // been to any table, so nothing cached can be trusted. Rows replaced by
+  // ON CONFLICT REPLACE may be reported without being counted.
+  int64 total_changes = db_->GetTotalChangeCount();
+  bool changed = total_changes - total_changes_ > reported_changes_;
+  total_changes_ = total_changes;
+  reported_changes_ = 0;
+
+  // Another connection's commit only shows up when a transaction starts,
+  // so within one of ours the data version is checked once. Checking starts
+  // the read transaction if there wasn't one yet.
+  bool in_transaction = db_->transaction_nesting() > 0;
+  if (in_transaction ? checked_transaction_ != db_->transaction_count()
+                     : !sole_writer_) {
+    checked_transaction_ = in_transaction ? db_->transaction_count() : 0;
+    int64 data_version = db_->GetDataVersion();
+    if (data_version != data_version_) {
+      data_version_ = data_version;
+      // The commit may have changed the schema too.
+      CheckSchema();
+      changed = true;
+    }
+  }
+
+  if (changed)
+    ClearResults();
+}
+
+int64 ResultCache::GetSchemaVersion() {
+  // Temp tables have a version of their own. Both only ever grow, so their
+  // sum changes whenever either does.
+  Statement main_version(db_->GetCachedStatement(SQL_FROM_HERE,
+      "PRAGMA schema_version"));
+  Statement temp_version(db_->GetCachedStatement(SQL_FROM_HERE,
+      "PRAGMA temp.schema_version"));
+  if (!main_version || !main_version.Step() ||
+      !temp_version || !temp_version.Step())
+    return -1;
+  return main_version.ColumnInt64(0) + temp_version.ColumnInt64(0);
+}
+
+const ResultCache::QueryInfo& ResultCache::GetQueryInfo(const char* sql) {
+  std::unordered_map<std::string, QueryInfo>::iterator found =
+      queries_.find(sql);
+  if (found != queries_.end())
+    return found->second;
+
+  static const QueryInfo kUncacheable;
+  sqlite3* db = db_->db_;
+  if (!db)
+    return kUncacheable;
+
+  QueryInfo& info = queries_[sql];
+
+  // Prepare a throwaway copy with an authorizer to learn what it reads. This
+  // only happens once per SQL string.
+  AuthorizerState state;
+  state.authorizer = db_->authorizer_;
+  state.arg = db_->authorizer_arg_;
+  sqlite3_stmt* stmt = NULL;
+  sqlite3_set_authorizer(db, &CollectTables, &state);
+  int err = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+  sqlite3_set_authorizer(db, db_->authorizer_, db_->authorizer_arg_);
+
+  bool cacheable = err == SQLITE_OK && stmt && state.cacheable &&
+                   sqlite3_stmt_readonly(stmt) &&
+                   sqlite3_column_count(stmt) > 0;
+  sqlite3_finalize(stmt);
+
+  // The update hook only reports changes to ordinary tables, so reading
+  // anything else (virtual tables, the schema) makes the result uncacheable.
+  Statement table_sql(db_->GetCachedStatement(SQL_FROM_HERE,
+      "SELECT sql FROM sqlite_master WHERE type='table' AND name=?1 "
+      "UNION ALL "
+      "SELECT sql FROM sqlite_temp_master WHERE type='table' AND name=?1"));
+  for (size_t i = 0; cacheable && i < state.tables.size(); ++i) {
+    table_sql.Reset();
+    table_sql.BindString(0, state.tables[i]);
+    cacheable = table_sql.Step() &&
+        sqlite3_strnicmp(table_sql.ColumnString(0).c_str(),
+                         "CREATE VIRTUAL", 14) != 0;
+  }
+
+  info.cacheable = cacheable;
+  info.tables.swap(state.tables);
+  return info;
+}
+
+void ResultCache::Insert(const std::string& key,
+                         const QueryInfo& info,
+                         const std::vector<Row>& rows) {
+  size_t size = key.size() + RowsByteSize(rows) + kEntryOverhead;
+  if (size > max_bytes_)
+    return;
+
+  while (bytes_ + size > max_bytes_ && !lru_.empty())
+    Erase(entries_.find(*lru_.back()));
+
+  EntryMap::iterator inserted = entries_.insert(
+      EntryMap::value_type(key, Entry())).first;
+  Entry& entry = inserted->second;
+  for (size_t i = 0; i < info.tables.size(); ++i) {
+    const uint64* generation = &generations_[info.tables[i]];
+    entry.dependencies.push_back(std::make_pair(generation, *generation));
+  }
+  entry.rows = rows;
+  entry.size = size;
+  lru_.push_front(&inserted->first);
+  inserted->second.lru_position = lru_.begin();
+  bytes_ += size;
+}
+
+void ResultCache::ClearResults() {
+  entries_.clear();
+  lru_.clear();
+  bytes_ = 0;
+}
+
+void ResultCache::Erase(EntryMap::iterator entry) {
+  bytes_ -= entry->second.size;
+  lru_.erase(entry->second.lru_position);
+  entries_.erase(entry);
+}
+
+// static
+void ResultCache::EncodeKey(const char* sql,
+                            const Row& params,
+                            std::string* key) {
+  key->assign(sql);
+  key->push_back('\0');
+  for (size_t i = 0; i < params.size(); ++i)
+    AppendValue(params[i], key);
+}
+
+}  // namespace sql
@@ -0,0 +1,165 @@
+// Copyright (c) 2010 Garrett R. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef SQL_RESULT_CACHE_H_
+#define SQL_RESULT_CACHE_H_
+
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "basictypes.h"
+#include "connection.h"
+#include "value.h"
+
+namespace sql {
+
+// ResultCache remembers the rows returned by read-only queries on one
+// Connection, keyed by the SQL and its bound values, so that repeating a
+// query costs a hash lookup instead of a trip through the B-tree. It is
+// enabled with Connection::EnableResultCache() and used through
+// Connection::CachedQuery().
+//
+// Each cached result is invalidated precisely when a table it read from
+// changes through this connection (see ChangeObserver), and the whole cache
+// is dropped when:
+//   - another connection commits (PRAGMA data_version changes), which is
+//     checked on every query outside of a transaction, unless
+//     set_sole_writer() was called, and once per transaction inside of one,
+//   - a transaction is rolled back,
+//   - rows change in a way that isn't reported, which only happens while a
+//     ChangeRecorder is recording or sqlite lacks the preupdate hook, for
+//     WITHOUT ROWID tables and "DELETE FROM t" without a WHERE,
+//   - the schema changes through Connection::Execute(), which is how schema
+//     changes are normally made.
+//
+// Queries that read virtual tables or call functions such as random() are
+// never cached. Queries whose result depends on the time or on other
+// non-deterministic input should not be run through the cache.
+//
+// Results are kept as the rows themselves, so a hit only copies them, and
+// are evicted least recently used first once |max_bytes| is exceeded.
+class ResultCache : public ChangeObserver {
+ public:
+  ResultCache(Connection* db, size_t max_bytes);
+  virtual ~ResultCache();
+
+  // Call if no other connection writes the database, for example because
+  // it uses exclusive locking. Queries outside of a transaction then skip
+  // checking the data version, which costs about as much as a small query.
+  void set_sole_writer() { sole_writer_ = true; }
+
+  // Runs |sql| with |params| bound in order, or returns its cached rows.
+  // Returns false if the query failed. See Connection::CachedQuery.
+  bool Query(const StatementID& id,
+             const char* sql,
+             const Row& params,
+             std::vector<Row>* rows);
+
+  // Drops every cached result, and what was learned about each query. Call
+  // this after changing the schema other than through Connection::Execute.
+  void Clear();
+
+  // Calls Clear() if the schema changed since the last check. Called by
+  // Connection::Execute().
+  void CheckSchema();
+
+  // Statistics.
+  size_t bytes() const { return bytes_; }
+  size_t max_bytes() const { return max_bytes_; }
+  size_t entry_count() const { return entries_.size(); }
+  int64 hits() const { return hits_; }
+  int64 misses() const { return misses_; }
+
+  // ChangeObserver implementation.
+  virtual void OnRowChanged(ChangeType type,
+                            const char* database,
+                            const char* table,
+                            int64 rowid);
+  virtual void OnRollback();
+
+ private:
+  // What we know about one SQL string.
+  struct QueryInfo {
+    QueryInfo() : cacheable(false) {}
+
+    bool cacheable;
+    std::vector<std::string> tables;
+  };
+
+  // A table's generation is bumped on every change to it. Results remember
+  // the generations they saw. The counters live in |generations_|, whose
+  // nodes never move, so results can point at them directly.
+  typedef std::unordered_map<std::string, uint64> GenerationMap;
+  typedef std::vector<std::pair<const uint64*, uint64> > Dependencies;
+
+  // Points at the keys of |entries_|, most recently used first.
+  typedef std::list<const std::string*> LruList;
+
+  struct Entry {
+    Entry() : size(0) {}
+
+    Dependencies dependencies;
+    std::vector<Row> rows;
+
+    // The memory counted against |max_bytes_| for this entry.
+    size_t size;
+
+    // This entry's position in |lru_|.
+    LruList::iterator lru_position;
+  };
+  typedef std::unordered_map<std::string, Entry> EntryMap;
+
+  // Drops everything if the database changed in a way we weren't told about
+  // since the last check.
+  void Validate();
+
+  // Returns a number that changes whenever the main or temp schema does.
+  int64 GetSchemaVersion();
+
+  // Finds out which tables |sql| reads and whether it may be cached.
+  const QueryInfo& GetQueryInfo(const char* sql);
+
+  // Drops every cached result but keeps |queries_|.
+  void ClearResults();
+
+  void Insert(const std::string& key, const QueryInfo& info,
+              const std::vector<Row>& rows);
+  void Erase(EntryMap::iterator entry);
+
+  static void EncodeKey(const char* sql, const Row& params, std::string* key);
+
+  Connection* db_;
+  size_t max_bytes_;
+  size_t bytes_;
+
+  std::unordered_map<std::string, QueryInfo> queries_;
+  GenerationMap generations_;
+  EntryMap entries_;
+  LruList lru_;
+
+  // Used by Validate() to notice changes we weren't told about.
+  int64 data_version_;
+  int64 total_changes_;
+  int64 reported_changes_;
+  int64 schema_version_;
+
+  // The Connection::transaction_count() of the transaction in which the
+  // data version was last checked, or 0 if outside of one.
+  uint64 checked_transaction_;
+
+  // See set_sole_writer().
+  bool sole_writer_;
+
+  int64 hits_;
+  int64 misses_;
+
+  DISALLOW_COPY_AND_ASSIGN(ResultCache);
+};
+
+}  // namespace sql
+
+#endif  // SQL_RESULT_CACHE_H_
@@ -0,0 +1,262 @@
+// Copyright (c) 2010 Garrett R. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "schema_catalog.h"
+
+#include <cctype>
+#include <strings.h>
+
+#include "connection.h"
+#include "statement.h"
+
+namespace sql {
+
+ColumnInfo::ColumnInfo()
+    : affinity(AFFINITY_BLOB),
+      not_null(false),
+      primary_key(0),
+      has_default(false) {
+}
+
+IndexInfo::IndexInfo() : unique(false) {
+}
+
+TableInfo::TableInfo() : is_view(false) {
+}
+
+const ColumnInfo* TableInfo::GetColumn(const std::string& column) const {
+  for (size_t i = 0; i < columns.size(); ++i) {
+    if (columns[i].name == column)
+      return &columns[i];
+  }
+  return NULL;
+}
+
+SchemaCatalog::SchemaCatalog(Connection* db)
+    : db_(db),
+      loaded_(false),
+      schema_version_(0),
+      temp_schema_version_(0) {
+}
+
+SchemaCatalog::~SchemaCatalog() {
+}
+
+bool SchemaCatalog::DoesTableOrViewExist(const std::string& name) {
+  if (GetTable(name))
+    return true;
+  std::vector<std::string> columns;
+  return QueryColumnNames(name, &columns);
+}
+
+bool SchemaCatalog::DoesColumnExist(const std::string& table,
+                                    const std::string& column) {
+  const TableInfo* info = GetTable(table);
+  if (info)
+    return info->GetColumn(column) != NULL;
+
+  std::vector<std::string> columns;
+  if (!QueryColumnNames(table, &columns))
+    return false;
+  for (size_t i = 0; i < columns.size(); ++i) {
+    if (columns[i] == column)
+      return true;
+  }
+  return false;
+}
+
+bool SchemaCatalog::DoesIndexExist(const std::string& index) {
+  return GetIndex(index) != NULL;
+}
+
+const TableInfo* SchemaCatalog::GetTable(const std::string& table) {
+  if (!Refresh())
+    return NULL;
+  TableMap::const_iterator found = tables_.find(table);
+  return found == tables_.end() ? NULL : &found->second;
+}
+
+const IndexInfo* SchemaCatalog::GetIndex(const std::string& index) {
+  if (!Refresh())
+    return NULL;
+  IndexMap::const_iterator found = indexes_.find(index);
+  return found == indexes_.end() ? NULL : &found->second;
+}
+
+std::vector<std::string> SchemaCatalog::GetTableNames() {
+  std::vector<std::string> names;
+  if (!Refresh())
+    return names;
+  for (TableMap::const_iterator i = tables_.begin(); i != tables_.end(); ++i)
+    names.push_back(i->first);
+  return names;
+}
+
+// static
+ColumnAffinity SchemaCatalog::AffinityForType(
+    const std::string& declared_type) {
+  std::string type(declared_type);
+  for (size_t i = 0; i < type.size(); ++i)
+    type[i] = static_cast<char>(toupper(static_cast<unsigned char>(type[i])));
+
+  // The rules are applied in this order, so "CHARINT" is an INTEGER.
+  if (type.find("INT") != std::string::npos)
+    return AFFINITY_INTEGER;
+  if (type.find("CHAR") != std::string::npos ||
+      type.find("CLOB") != std::string::npos ||
+      type.find("TEXT") != std::string::npos)
+    return AFFINITY_TEXT;
+  if (type.empty() || type.find("BLOB") != std::string::npos)
+    return AFFINITY_BLOB;
+  if (type.find("REAL") != std::string::npos ||
+      type.find("FLOA") != std::string::npos ||
+      type.find("DOUB") != std::string::npos)
+    return AFFINITY_REAL;
+  return AFFINITY_NUMERIC;
+}
+
+bool SchemaCatalog::Refresh() {
+  if (!db_ || !db_->is_open())
+    return false;
+
+  Statement version(db_->GetCachedStatement(SQL_FROM_HERE,
+      "PRAGMA schema_version"));
+  if (!version || !version.Step())
+    return false;
+
+  int64 schema_version = version.ColumnInt64(0);
+
+  // Temp tables have a version of their own.
+  Statement temp_version(db_->GetCachedStatement(SQL_FROM_HERE,
+      "PRAGMA temp.schema_version"));
+  if (!temp_version || !temp_version.Step())
+    return false;
+  int64 temp_schema_version = temp_version.ColumnInt64(0);
+
+  if (loaded_ && schema_version == schema_version_ &&
+      temp_schema_version == temp_schema_version_)
+    return true;
+
+  // Record the versions before loading. If the schema changes while
+  // loading, the next query sees a different version and loads again.
+  schema_version_ = schema_version;
+  temp_schema_version_ = temp_schema_version;
+  return Load();
+}
+
+bool SchemaCatalog::NameLess::operator()(const std::string& a,
+                                         const std::string& b) const {
+  return strcasecmp(a.c_str(), b.c_str()) < 0;
+}
+
+bool SchemaCatalog::Load() {
+  tables_.clear();
+  indexes_.clear();
+  loaded_ = false;
+
+  // Temp objects come last, so that they replace main ones of the same name
+  // the way they hide them from queries.
+  Statement list(db_->GetCachedStatement(SQL_FROM_HERE,
+      "SELECT 'main', name, type FROM main.sqlite_master "
+      "WHERE type IN ('table', 'view') "
+      "UNION ALL "
+      "SELECT 'temp', name, type FROM temp.sqlite_master "
+      "WHERE type IN ('table', 'view')"));
+  if (!list)
+    return false;
+
+  std::vector<TableInfo> tables;
+  while (list.Step()) {
+    tables.push_back(TableInfo());
+    tables.back().schema = list.ColumnString(0);
+    tables.back().name = list.ColumnString(1);
+    tables.back().is_view = list.ColumnString(2) == "view";
+  }
+  if (!list.Succeeded())
+    return false;
+
+  // Columns are read one table at a time, so that a table sqlite can't
+  // describe is listed without its columns instead of failing the load.
+  for (size_t i = 0; i < tables.size(); ++i) {
+    if (!LoadColumns(&tables[i]))
+      tables[i].columns.clear();
+    tables_[tables[i].name] = tables[i];
+  }
+
+  Statement indexes(db_->GetCachedStatement(SQL_FROM_HERE,
+      "SELECT m.name, m.tbl_name, l.\"unique\", i.name, i.seqno "
+      "FROM main.sqlite_master m "
+      "JOIN pragma_index_list(m.tbl_name, 'main') l ON l.name=m.name "
+      "JOIN pragma_index_info(m.name, 'main') i "
+      "WHERE m.type='index' "
+      "UNION ALL "
+      "SELECT m.name, m.tbl_name, l.\"unique\", i.name, i.seqno "
+      "FROM temp.sqlite_master m "
+      "JOIN pragma_index_list(m.tbl_name, 'temp') l ON l.name=m.name "
+      "JOIN pragma_index_info(m.name, 'temp') i "
+      "WHERE m.type='index' "
+      "ORDER BY 1, 5"));
+  if (!indexes)
+    return false;
+
+  while (indexes.Step()) {
+    IndexInfo& index = indexes_[indexes.ColumnString(0)];
+    if (index.name.empty()) {
+      index.name = indexes.ColumnString(0);
+      index.table = indexes.ColumnString(1);
+      index.unique = indexes.ColumnBool(2);
+
+      TableMap::iterator table = tables_.find(index.table);
+      if (table != tables_.end())
+        table->second.indexes.push_back(index.name);
+    }
+    index.columns.push_back(indexes.ColumnString(3));
+  }
+  if (!indexes.Succeeded())
+    return false;
+
+  loaded_ = true;
+  return true;
+}
+
+bool SchemaCatalog::LoadColumns(TableInfo* table) {
+  Statement columns(db_->GetCachedStatement(SQL_FROM_HERE,
+      "SELECT name, type, \"notnull\", dflt_value, pk "
+      "FROM pragma_table_info(?, ?) ORDER BY cid"));
+  if (!columns)
+    return false;
+  columns.BindString(0, table->name);
+  columns.BindString(1, table->schema);
+
+  while (columns.Step()) {
+    ColumnInfo column;
+    column.name = columns.ColumnString(0);
+    column.declared_type = columns.ColumnString(1);
+    column.affinity = AffinityForType(column.declared_type);
+    column.not_null = columns.ColumnBool(2);
+    column.has_default = columns.ColumnType(3) != COLUMN_TYPE_NULL;
+    column.default_value = columns.ColumnString(3);
+    column.primary_key = columns.ColumnInt(4);
+    table->columns.push_back(column);
+  }
+  return columns.Succeeded();
+}
+
+bool SchemaCatalog::QueryColumnNames(const std::string& table,
+                                     std::vector<std::string>* columns) {
+  if (!db_ || !db_->is_open())
+    return false;
+
+  // Without a schema, the pragma searches every database like a query does.
+  Statement names(db_->GetCachedStatement(SQL_FROM_HERE,
+      "SELECT name FROM pragma_table_info(?)"));
+  if (!names)
+    return false;
+  names.BindString(0, table);
+  while (names.Step())
+    columns->push_back(names.ColumnString(0));
+  return names.Succeeded() && !columns->empty();
+}
+
+}  // namespace sql
@@ -0,0 +1,154 @@
+// Copyright (c) 2010 Garrett R. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef SQL_SCHEMA_CATALOG_H_
+#define SQL_SCHEMA_CATALOG_H_
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "basictypes.h"
+
+namespace sql {
+
+class Connection;
+
+// The type affinity sqlite gives a column based on its declared type. See
+// "Determination Of Column Affinity" on sqlite.org.
+enum ColumnAffinity {
+  AFFINITY_INTEGER,
+  AFFINITY_TEXT,
+  AFFINITY_BLOB,
+  AFFINITY_REAL,
+  AFFINITY_NUMERIC,
+};
+
+// A column of a table, as reported by "PRAGMA table_info".
+struct ColumnInfo {
+  ColumnInfo();
+
+  std::string name;
+
+  // The type as written in the CREATE TABLE statement, possibly empty.
+  std::string declared_type;
+  ColumnAffinity affinity;
+
+  bool not_null;
+
+  // The 1-based position of the column in the primary key, or 0.
+  int primary_key;
+
+  // The text of the DEFAULT clause, if |has_default|.
+  bool has_default;
+  std::string default_value;
+};
+
+// An index, including the automatic ones behind UNIQUE and PRIMARY KEY
+// constraints.
+struct IndexInfo {
+  IndexInfo();
+
+  std::string name;
+  std::string table;
+  bool unique;
+
+  // The indexed columns in index order. Expressions have an empty name.
+  std::vector<std::string> columns;
+};
+
+struct TableInfo {
+  TableInfo();
+
+  std::string name;
+
+  // "main" or "temp", and whether this is a view rather than a table.
+  std::string schema;
+  bool is_view;
+
+  // Empty if the columns couldn't be read, for example for a virtual table
+  // whose module isn't loaded.
+  std::vector<ColumnInfo> columns;
+
+  // Names of the indexes on this table, see SchemaCatalog::GetIndex.
+  std::vector<std::string> indexes;
+
+  // Returns the column with the given name, or NULL.
+  const ColumnInfo* GetColumn(const std::string& column) const;
+};
+
+// SchemaCatalog holds the tables, views, columns and indexes of a
+// connection's main and temp databases in memory. It is loaded on first use
+// and checks "PRAGMA schema_version" on each query, reloading only when the
+// schema has changed, so repeated introspection during startup and
+// migrations doesn't have to prepare new statements every time.
+//
+// Get one through Connection::GetSchemaCatalog(). Table and index names are
+// matched without regard to ASCII case, as sqlite does, and a temp table
+// hides a main one of the same name. Column names are matched exactly.
+// DoesTableOrViewExist and DoesColumnExist also find the tables of attached
+// databases, by asking sqlite about names the catalog doesn't have. Pointers
+// returned by GetTable and GetIndex are invalidated by the next call that
+// reloads the catalog.
+class SchemaCatalog {
+ public:
+  explicit SchemaCatalog(Connection* db);
+  ~SchemaCatalog();
+
+  // Unlike Connection::DoesTableExist, which only finds tables of the main
+  // database under their exact name, this finds views and the tables of
+  // every database, the way a query would resolve |name|.
+  bool DoesTableOrViewExist(const std::string& name);
+  bool DoesColumnExist(const std::string& table, const std::string& column);
+  bool DoesIndexExist(const std::string& index);
+
+  // Return the named table or index, or NULL if there is none.
+  const TableInfo* GetTable(const std::string& table);
+  const IndexInfo* GetIndex(const std::string& index);
+
+  // Returns the names of every table and view, in sorted order.
+  std::vector<std::string> GetTableNames();
+
+  // Forces a reload on the next query.
+  void Invalidate() { loaded_ = false; }
+
+  // Returns the affinity sqlite gives a column declared as |declared_type|.
+  static ColumnAffinity AffinityForType(const std::string& declared_type);
+
+ private:
+  // Orders names the way sqlite compares them, ignoring ASCII case.
+  struct NameLess {
+    bool operator()(const std::string& a, const std::string& b) const;
+  };
+  typedef std::map<std::string, TableInfo, NameLess> TableMap;
+  typedef std::map<std::string, IndexInfo, NameLess> IndexMap;
+
+  // Reloads the catalog if it was never loaded or the schema has changed.
+  // Returns false if it could not be loaded.
+  bool Refresh();
+  bool Load();
+
+  // Reads the columns of |table|. Returns false if sqlite can't report them.
+  bool LoadColumns(TableInfo* table);
+
+  // Reads the column names of |table| in whichever database has it, for
+  // tables the catalog doesn't hold. Returns false if there is no such table.
+  bool QueryColumnNames(const std::string& table,
+                        std::vector<std::string>* columns);
+
+  Connection* db_;
+
+  bool loaded_;
+  int64 schema_version_;
+  int64 temp_schema_version_;
+
+  TableMap tables_;
+  IndexMap indexes_;
+
+  DISALLOW_COPY_AND_ASSIGN(SchemaCatalog);
+};
+
+}  // namespace sql
+
+#endif  // SQL_SCHEMA_CATALOG_H_
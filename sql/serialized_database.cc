@@ -0,0 +1,117 @@
+// Copyright (c) 2010 Garrett R. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "serialized_database.h"
+
+#include <cstdio>
+
+#include <sqlite3.h>
+
+#include "build_config.h"
+
+#if !defined(OS_WIN)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace sql {
+
+namespace {
+
+// The offsets of the file format version numbers in the database header.
+// They are 2 for databases in WAL mode, which sqlite's in-memory VFS can't
+// open, and 1 otherwise.
+const size_t kWriteVersionOffset = 18;
+const size_t kReadVersionOffset = 19;
+const size_t kHeaderSize = 100;
+
+}  // namespace
+
+SerializedDatabase::SerializedDatabase()
+    : data_(NULL),
+      size_(0),
+      ownership_(NONE) {
+}
+
+SerializedDatabase::~SerializedDatabase() {
+  Reset();
+}
+
+bool SerializedDatabase::MapFile(const std::string& path) {
+  Reset();
+
+#if defined(OS_WIN)
+  //NOTIMPLEMENTED();
+  return false;
+#else
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+
+  struct stat info;
+  void* data = MAP_FAILED;
+  if (fstat(fd, &info) == 0 && info.st_size > 0) {
+    // A private writable mapping lets Adopt() fix up the header without
+    // touching the file. Only that page gets copied.
+    data = mmap(NULL, static_cast<size_t>(info.st_size),
+                PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  if (data == MAP_FAILED)
+    return false;
+
+  Adopt(static_cast<unsigned char*>(data), static_cast<size_t>(info.st_size),
+        MAPPED);
+  return true;
+#endif
+}
+
+bool SerializedDatabase::WriteToFile(const std::string& path) const {
+  FILE* file = fopen(path.c_str(), "wb");
+  if (!file)
+    return false;
+  bool success = fwrite(data_, 1, size_, file) == size_;
+  return fclose(file) == 0 && success;
+}
+
+void SerializedDatabase::Reset() {
+  switch (ownership_) {
+    case SQLITE_MEMORY:
+      sqlite3_free(data_);
+      break;
+    case MAPPED:
+#if !defined(OS_WIN)
+      munmap(data_, size_);
+#endif
+      break;
+    case NONE:
+    case BORROWED:
+      break;
+  }
+  data_ = NULL;
+  size_ = 0;
+  ownership_ = NONE;
+}
+
+void SerializedDatabase::Adopt(unsigned char* data,
+                               size_t size,
+                               Ownership ownership) {
+  Reset();
+  data_ = data;
+  size_ = size;
+  ownership_ = ownership;
+
+  // Images of WAL databases say so in their header. Their pages are
+  // complete, so just mark them as rollback journal databases. Borrowed
+  // buffers never are WAL, and aren't ours to change.
+  if (ownership != BORROWED && size_ >= kHeaderSize &&
+      data_[kWriteVersionOffset] == 2 && data_[kReadVersionOffset] == 2) {
+    data_[kWriteVersionOffset] = 1;
+    data_[kReadVersionOffset] = 1;
+  }
+}
+
+}  // namespace sql
@@ -0,0 +1,85 @@
+// Copyright (c) 2010 Garrett R. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef SQL_SERIALIZED_DATABASE_H_
+#define SQL_SERIALIZED_DATABASE_H_
+
+#include <string>
+
+#include "basictypes.h"
+
+namespace sql {
+
+class Connection;
+
+// SerializedDatabase holds a whole database as one contiguous buffer, in the
+// same format as a database file. It is produced by Connection::Serialize()
+// or by mapping a database file with MapFile(), and turned back into a live
+// database with Connection::Deserialize().
+//
+// A prebuilt in-memory dataset can be cloned into any number of connections
+// this way without going through the backup machinery:
+//
+//   sql::SerializedDatabase image;
+//   builder.Serialize(&image);
+//   ...
+//   // On each worker:
+//   sql::Connection db;
+//   db.Deserialize(image, true);
+//
+// Read-only connections use the buffer in place, so |image| must outlive
+// them. Writable ones get their own copy.
+class SerializedDatabase {
+ public:
+  SerializedDatabase();
+  ~SerializedDatabase();
+
+  const unsigned char* data() const { return data_; }
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+
+  // Returns true if the buffer is the memory of a live in-memory database,
+  // see Connection::Serialize().
+  bool is_borrowed() const { return ownership_ == BORROWED; }
+
+  // Maps the database file at |path| read-only into memory, replacing the
+  // current contents. The file must not be written while it is mapped; a
+  // copy made with sql::Snapshot or BackupTo() is the usual source. Returns
+  // false if the file can't be mapped or is empty.
+  bool MapFile(const std::string& path);
+
+  // Writes the buffer to |path|, replacing the file if it exists. The file
+  // can be opened as a database.
+  bool WriteToFile(const std::string& path) const;
+
+  // Frees or unmaps the buffer.
+  void Reset();
+
+ private:
+  friend class Connection;
+
+  enum Ownership {
+    // No buffer.
+    NONE,
+    // Allocated by sqlite3_serialize().
+    SQLITE_MEMORY,
+    // Mapped by MapFile().
+    MAPPED,
+    // Owned by a connection, see is_borrowed().
+    BORROWED,
+  };
+
+  // Takes over |data| of |size| bytes.
+  void Adopt(unsigned char* data, size_t size, Ownership ownership);
+
+  unsigned char* data_;
+  size_t size_;
+  Ownership ownership_;
+
+  DISALLOW_COPY_AND_ASSIGN(SerializedDatabase);
+};
+
+}  // namespace sql
+
+#endif  // SQL_SERIALIZED_DATABASE_H_
@@ -0,0 +1,456 @@
+// Copyright (c) 2010 Garrett R. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "sharded_database.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#include "connection.h"
+#include "meta_table.h"
+#include "statement.h"
+#include "transaction.h"
+#include "utility.h"
+
+namespace sql {
+
+namespace {
+
+// The keys in each shard's meta table.
+const char kShardCountKey[] = "shard_count";
+const char kShardIndexKey[] = "shard_index";
+
+// The rows each shard reads ahead of a MergedScan at a time.
+const size_t kScanBatchRows = 256;
+
+// Shards are found by these hashes, which must never change: rows written
+// by one version would be looked for in the wrong shard by the next.
+uint64 Mix(uint64 value) {
+  value ^= value >> 30;
+  value *= 0xbf58476d1ce4e5b9ULL;
+  value ^= value >> 27;
+  value *= 0x94d049bb133111ebULL;
+  value ^= value >> 31;
+  return value;
+}
+
+uint64 HashBytes(const std::string& bytes) {
+  // FNV-1a.
+  uint64 hash = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < bytes.size(); ++i) {
+    hash ^= static_cast<unsigned char>(bytes[i]);
+    hash *= 0x100000001b3ULL;
+  }
+  return Mix(hash);
+}
+
+uint64 HashKey(const Value& key) {
+  switch (key.type()) {
+    case COLUMN_TYPE_INTEGER:
+      return Mix(static_cast<uint64>(key.AsInt64()));
+    case COLUMN_TYPE_FLOAT: {
+      // A REAL equal to an integer is the same key as the integer.
+      double value = key.AsDouble();
+      if (value == std::floor(value) && value >= -9.2e18 && value <= 9.2e18)
+        return Mix(static_cast<uint64>(static_cast<int64>(value)));
+      uint64 bits;
+      memcpy(&bits, &value, sizeof(bits));
+      return Mix(bits ^ 0x165667b19e3779f9ULL);
+    }
+    case COLUMN_TYPE_TEXT:
+    case COLUMN_TYPE_BLOB:
+      return HashBytes(key.bytes());
+    case COLUMN_TYPE_NULL:
+      break;
+  }
+  return 0;
+}
+
+// Opens shard |index| of |shard_count| at |path|, checking or recording
+// where it belongs in the meta table. Runs on the shard's thread.
+bool OpenShard(const std::string& path, int index, int shard_count,
+               Connection* connection) {
+  if (!connection->Open(path))
+    return false;
+
+  MetaTable meta;
+  if (!meta.Init(connection, 0, 0))
+    return false;
+  int stored_count;
+  int stored_index;
+  if (meta.GetValue(kShardCountKey, &stored_count) &&
+      meta.GetValue(kShardIndexKey, &stored_index))
+    return stored_count == shard_count && stored_index == index;
+
+  sql::Transaction transaction(connection);
+  if (!transaction.Begin())
+    return false;
+  if (!meta.SetValue(kShardCountKey, shard_count) ||
+      !meta.SetValue(kShardIndexKey, index))
+    return false;
+  return transaction.Commit();
+}
+
+}  // namespace
+
+MergedScan::MergedScan()
+    : column_(0),
+      descending_(false),
+      failed_(false),
+      current_(-1) {
+}
+
+MergedScan::~MergedScan() {
+  Close();
+}
+
+bool MergedScan::Next() {
+  std::function<bool(int, int)> after =
+      [this](int a, int b) { return After(a, b); };
+
+  // Put the shard read last back in its place, if it has rows left.
+  if (current_ >= 0) {
+    if (Advance(&cursors_[current_])) {
+      heap_.push_back(current_);
+      std::push_heap(heap_.begin(), heap_.end(), after);
+    }
+    current_ = -1;
+  }
+
+  if (failed_ || heap_.empty())
+    return false;
+  std::pop_heap(heap_.begin(), heap_.end(), after);
+  current_ = heap_.back();
+  heap_.pop_back();
+  return true;
+}
+
+// static
+MergedScan::Batch MergedScan::ReadBatch(Statement* statement,
+                                        size_t max_rows) {
+  Batch batch;
+  while (batch.rows.size() < max_rows) {
+    if (!statement->Step()) {
+      batch.succeeded = statement->Succeeded();
+      batch.done = true;
+      // Ends the read transaction now rather than when the scan goes away.
+      statement->Reset();
+      return batch;
+    }
+    batch.rows.push_back(Row());
+    statement->ColumnRow(&batch.rows.back());
+  }
+  batch.succeeded = true;
+  return batch;
+}
+
+void MergedScan::FetchNext(Cursor* cursor) {
+  std::shared_ptr<Statement> statement = cursor->statement;
+  cursor->next = cursor->shard->Run<Batch>(
+      [statement](Connection*) {
+        return ReadBatch(statement.get(), kScanBatchRows);
+      });
+}
+
+bool MergedScan::Advance(Cursor* cursor) {
+  if (++cursor->position < cursor->rows.size())
+    return true;
+  if (cursor->done)
+    return false;
+
+  Batch batch = cursor->next.get();
+  if (!batch.succeeded) {
+    failed_ = true;
+    cursor->done = true;
+    return false;
+  }
+  cursor->rows.swap(batch.rows);
+  cursor->position = 0;
+  cursor->done = batch.done;
+  if (!cursor->done)
+    FetchNext(cursor);
+  return !cursor->rows.empty();
+}
+
+void MergedScan::Close() {
+  // A statement must be finalized on the thread that uses its connection,
+  // after any batch still being read.
+  for (size_t i = 0; i < cursors_.size(); ++i) {
+    std::shared_ptr<Statement> statement = cursors_[i].statement;
+    if (!statement)
+      continue;
+    cursors_[i].shard->Run<bool>([statement](Connection*) {
+      *statement = Statement();
+      return true;
+    });
+  }
+  cursors_.clear();
+  heap_.clear();
+  current_ = -1;
+  failed_ = false;
+}
+
+bool MergedScan::After(int a, int b) const {
+  const Row& row_a = cursors_[a].rows[cursors_[a].position];
+  const Row& row_b = cursors_[b].rows[cursors_[b].position];
+  int order = row_a[column_].Compare(row_b[column_]);
+  // Equal rows come in shard order.
+  if (order == 0)
+    return a > b;
+  return descending_ ? order < 0 : order > 0;
+}
+
+ShardedDatabase::ShardedDatabase() {
+}
+
+ShardedDatabase::~ShardedDatabase() {
+  Close();
+}
+
+bool ShardedDatabase::Open(const std::string& path, int shard_count) {
+  Close();
+  if (shard_count <= 0)
+    return false;
+
+  // Shard 0 goes first, so that opening with the wrong shard count fails
+  // before any other shard's file is created and stamped with it. The rest
+  // open in parallel.
+  bool succeeded = true;
+  std::vector<std::future<bool> > opened;
+  for (int i = 0; i < shard_count && succeeded; ++i) {
+    shards_.push_back(
+        std::unique_ptr<AsyncConnection>(new AsyncConnection()));
+    std::string shard_path = GetShardPath(path, i);
+    opened.push_back(shards_.back()->Run<bool>(
+        [shard_path, i, shard_count](Connection* connection) {
+          return OpenShard(shard_path, i, shard_count, connection);
+        }));
+    if (i == 0)
+      succeeded = opened[0].get();
+  }
+
+  for (size_t i = 1; i < opened.size(); ++i)
+    succeeded &= opened[i].get();
+  if (!succeeded) {
+    Close();
+    return false;
+  }
+  path_ = path;
+  return true;
+}
+
+void ShardedDatabase::Close() {
+  // Each destructor waits for its shard's queued work, so start closing all
+  // of them first.
+  std::vector<std::future<bool> > closed;
+  for (size_t i = 0; i < shards_.size(); ++i)
+    closed.push_back(shards_[i]->Close());
+  for (size_t i = 0; i < closed.size(); ++i)
+    closed[i].wait();
+  shards_.clear();
+  path_.clear();
+}
+
+// static
+std::string ShardedDatabase::GetShardPath(const std::string& path,
+                                          int index) {
+  return sql::printf("%s.%d", path.c_str(), index);
+}
+
+int ShardedDatabase::GetShard(const Value& key) const {
+  if (shards_.empty())
+    return 0;
+  return static_cast<int>(HashKey(key) % shards_.size());
+}
+
+std::future<bool> ShardedDatabase::Execute(const Value& key,
+                                           const std::string& sql,
+                                           const Row& params) {
+  return shards_[GetShard(key)]->Run<bool>(
+      [sql, params](Connection* connection) {
+        return ExecuteWithParams(sql, params, connection);
+      });
+}
+
+std::future<QueryResult> ShardedDatabase::Query(const Value& key,
+                                                const std::string& sql,
+                                                const Row& params) {
+  return shards_[GetShard(key)]->Query(sql, params);
+}
+
+std::future<bool> ShardedDatabase::Transaction(
+    const Value& key,
+    const TransactionCallback& callback) {
+  return shards_[GetShard(key)]->Transaction(callback);
+}
+
+bool ShardedDatabase::ExecuteOnAll(const std::string& sql) {
+  if (shards_.empty())
+    return false;
+
+  std::vector<std::future<bool> > executed;
+  for (size_t i = 0; i < shards_.size(); ++i)
+    executed.push_back(shards_[i]->Execute(sql));
+  bool succeeded = true;
+  for (size_t i = 0; i < executed.size(); ++i)
+    succeeded &= executed[i].get();
+  return succeeded;
+}
+
+bool ShardedDatabase::ExecuteBatch(const std::string& sql,
+                                   const std::vector<KeyedRow>& rows) {
+  if (shards_.empty())
+    return false;
+
+  typedef std::vector<Row> Rows;
+  std::vector<std::shared_ptr<Rows> > shard_rows(shards_.size());
+  for (size_t i = 0; i < shard_rows.size(); ++i)
+    shard_rows[i].reset(new Rows);
+  for (size_t i = 0; i < rows.size(); ++i)
+    shard_rows[GetShard(rows[i].first)]->push_back(rows[i].second);
+
+  std::vector<std::future<bool> > committed;
+  for (size_t i = 0; i < shards_.size(); ++i) {
+    std::shared_ptr<Rows> params = shard_rows[i];
+    if (params->empty())
+      continue;
+    committed.push_back(shards_[i]->Run<bool>(
+        [sql, params](Connection* connection) {
+          sql::Transaction transaction(connection);
+          if (!transaction.Begin())
+            return false;
+          Statement statement(connection->GetUniqueStatement(sql));
+          if (!statement)
+            return false;
+          for (size_t row = 0; row < params->size(); ++row) {
+            const Row& values = (*params)[row];
+            for (size_t i = 0; i < values.size(); ++i)
+              statement.BindValue(static_cast<int>(i), values[i]);
+            if (!statement.Run())
+              return false;
+            statement.Reset(true);
+          }
+          return transaction.Commit();
+        }));
+  }
+
+  bool succeeded = true;
+  for (size_t i = 0; i < committed.size(); ++i)
+    succeeded &= committed[i].get();
+  return succeeded;
+}
+
+bool ShardedDatabase::Scan(const std::string& sql,
+                           const Row& params,
+                           int order_column,
+                           bool descending,
+                           MergedScan* scan) {
+  scan->Close();
+  if (shards_.empty())
+    return false;
+
+  // Every shard prepares its statement and reads its first batch in
+  // parallel.
+  std::vector<std::future<MergedScan::Batch> > first_batches;
+  scan->cursors_.resize(shards_.size());
+  for (size_t i = 0; i < shards_.size(); ++i) {
+    MergedScan::Cursor& cursor = scan->cursors_[i];
+    cursor.shard = shards_[i].get();
+    cursor.statement.reset(new Statement);
+    std::shared_ptr<Statement> statement = cursor.statement;
+    first_batches.push_back(cursor.shard->Run<MergedScan::Batch>(
+        [sql, params, statement](Connection* connection) {
+          *statement = Statement(connection->GetUniqueStatement(sql));
+          if (!*statement)
+            return MergedScan::Batch();
+          for (size_t i = 0; i < params.size(); ++i)
+            statement->BindValue(static_cast<int>(i), params[i]);
+          return MergedScan::ReadBatch(statement.get(), kScanBatchRows);
+        }));
+  }
+
+  bool succeeded = true;
+  for (size_t i = 0; i < first_batches.size(); ++i) {
+    MergedScan::Batch batch = first_batches[i].get();
+    MergedScan::Cursor& cursor = scan->cursors_[i];
+    // Rows too short to have the column can't be ordered.
+    succeeded &= batch.succeeded &&
+                 (batch.rows.empty() ||
+                  static_cast<int>(batch.rows[0].size()) > order_column);
+    cursor.rows.swap(batch.rows);
+    cursor.done = batch.done;
+  }
+  if (!succeeded) {
+    scan->Close();
+    return false;
+  }
+
+  scan->column_ = order_column;
+  scan->descending_ = descending;
+  for (size_t i = 0; i < scan->cursors_.size(); ++i) {
+    MergedScan::Cursor& cursor = scan->cursors_[i];
+    if (!cursor.done)
+      scan->FetchNext(&cursor);
+    if (!cursor.rows.empty())
+      scan->heap_.push_back(static_cast<int>(i));
+  }
+  std::make_heap(scan->heap_.begin(), scan->heap_.end(),
+                 [scan](int a, int b) { return scan->After(a, b); });
+  return true;
+}
+
+bool ShardedDatabase::AttachShards(Connection* reader) {
+  if (shards_.empty() || !reader->is_open())
+    return false;
+
+  for (int i = 0; i < shard_count(); ++i) {
+    Statement attach(reader->GetUniqueStatement(
+        sql::printf("ATTACH DATABASE ? AS shard%d", i)));
+    if (!attach)
+      return false;
+    attach.BindString(0, GetShardPath(path_, i));
+    if (!attach.Run())
+      return false;
+  }
+
+  // Our meta table differs from shard to shard, so it gets no view.
+  std::vector<std::string> tables;
+  Statement list(reader->GetUniqueStatement(
+      "SELECT name FROM shard0.sqlite_master WHERE type = 'table' "
+      "AND name NOT LIKE 'sqlite\\_%' ESCAPE '\\' AND name != 'meta'"));
+  if (!list)
+    return false;
+  while (list.Step())
+    tables.push_back(list.ColumnString(0));
+  if (!list.Succeeded())
+    return false;
+
+  for (size_t t = 0; t < tables.size(); ++t) {
+    std::string table = quote_identifier(tables[t]);
+    std::string view = "CREATE TEMP VIEW IF NOT EXISTS " + table + " AS ";
+    for (int i = 0; i < shard_count(); ++i) {
+      if (i)
+        view += " UNION ALL ";
+      view += sql::printf("SELECT * FROM shard%d.", i) + table;
+    }
+    if (!reader->Execute(view))
+      return false;
+  }
+  return true;
+}
+
+// static
+bool ShardedDatabase::ExecuteWithParams(const std::string& sql,
+                                        const Row& params,
+                                        Connection* connection) {
+  Statement statement(connection->GetUniqueStatement(sql));
+  if (!statement)
+    return false;
+  for (size_t i = 0; i < params.size(); ++i)
+    statement.BindValue(static_cast<int>(i), params[i]);
+  return statement.Run();
+}
+
+}  // namespace sql
@@ -0,0 +1,241 @@
+// Copyright (c) 2010 Garrett R. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef SQL_SHARDED_DATABASE_H_
+#define SQL_SHARDED_DATABASE_H_
+
+#include <functional>
+#include <future>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "async_connection.h"
+#include "basictypes.h"
+#include "value.h"
+
+namespace sql {
+
+class Connection;
+class Statement;
+
+// The rows of a query run on every shard, merged into one order as they are
+// read. See ShardedDatabase::Scan().
+//
+//   sql::MergedScan scan;
+//   shards.Scan("SELECT id, name FROM users ORDER BY id", sql::Row(), 0,
+//               false, &scan);
+//   while (scan.Next())
+//     Use(scan.row());
+//   if (scan.failed())
+//     ...
+//
+// Each shard's statement stays open on its thread and hands over its rows
+// in batches, the next one being read while the current one is merged, so
+// memory doesn't grow with the size of the result. The MergedScan must be
+// destroyed before its ShardedDatabase is closed.
+class MergedScan {
+ public:
+  MergedScan();
+  ~MergedScan();
+
+  // Moves to the next row, returning false after the last one or if a shard
+  // failed.
+  bool Next();
+
+  // True if a shard failed while its rows were being read.
+  bool failed() const { return failed_; }
+
+  // The current row, and the shard it came from.
+  const Row& row() const {
+    return cursors_[current_].rows[cursors_[current_].position];
+  }
+  int shard() const { return current_; }
+
+ private:
+  friend class ShardedDatabase;
+
+  // Rows read from a shard in one go.
+  struct Batch {
+    Batch() : succeeded(false), done(false) {}
+
+    bool succeeded;
+
+    // True if the statement has no rows after these.
+    bool done;
+
+    std::vector<Row> rows;
+  };
+
+  // One shard's statement and the rows read from it.
+  struct Cursor {
+    Cursor() : shard(NULL), position(0), done(false) {}
+
+    AsyncConnection* shard;
+
+    // Only used on the shard's thread.
+    std::shared_ptr<Statement> statement;
+
+    std::vector<Row> rows;
+    size_t position;
+    bool done;
+
+    // The batch after |rows|, unless |done|.
+    std::future<Batch> next;
+  };
+
+  // Reads the next batch of at most |max_rows| rows from |statement|. Runs on
+  // the shard's thread.
+  static Batch ReadBatch(Statement* statement, size_t max_rows);
+
+  // Starts reading the batch after |cursor|'s rows.
+  void FetchNext(Cursor* cursor);
+
+  // Moves |cursor| to its next row, waiting for its next batch if needed.
+  // Returns false once it has no rows left or failed.
+  bool Advance(Cursor* cursor);
+
+  // Closes the statements of the previous scan on their shards.
+  void Close();
+
+  // Returns true if the row shard |a| is at comes after the one shard |b|
+  // is at, which makes |heap_| a min-heap.
+  bool After(int a, int b) const;
+
+  std::vector<Cursor> cursors_;
+  int column_;
+  bool descending_;
+  bool failed_;
+
+  // The shards with rows left, ordered by their current row, except
+  // |current_| while it is being read.
+  std::vector<int> heap_;
+  int current_;
+
+  DISALLOW_COPY_AND_ASSIGN(MergedScan);
+};
+
+// ShardedDatabase spreads rows over several database files by a hash of
+// their key, so that as many writers as there are shards can commit at
+// once. Each shard is an AsyncConnection, with its own connection and
+// thread:
+//
+//   sql::ShardedDatabase events;
+//   if (!events.Open("/path/to/events", 8))
+//     return false;
+//   events.ExecuteOnAll("CREATE TABLE IF NOT EXISTS events"
+//                       "(id INTEGER PRIMARY KEY, body TEXT)");
+//   events.Execute(sql::Value(id), "INSERT INTO events VALUES (?, ?)", row);
+//
+// Shard i of |path| is the file "<path>.<i>". Each one records the number
+// of shards in its meta table, and Open() refuses to use them with another
+// number, since every key would then map to a different shard.
+//
+// Keys are hashed by type and value, so a key must always be given with the
+// same type: the TEXT "5" and the INTEGER 5 usually live in different
+// shards. Each write runs on one shard, and nothing is atomic across
+// shards.
+//
+// Queries that span shards either run on every shard in parallel and merge
+// the results (Scan()), or go through one connection that attaches every
+// shard (AttachShards()), which is simpler and slower.
+class ShardedDatabase {
+ public:
+  typedef std::function<bool(Connection* connection)> TransactionCallback;
+
+  // A key and the parameters to run a statement with, see ExecuteBatch().
+  typedef std::pair<Value, Row> KeyedRow;
+
+  ShardedDatabase();
+
+  // Closes the shards, waiting for their queued work.
+  ~ShardedDatabase();
+
+  // Opens or creates |shard_count| shards of |path|. Returns false if any
+  // fails to open, or was created with another shard count.
+  bool Open(const std::string& path, int shard_count);
+
+  // Finishes the queued work of every shard and closes them.
+  void Close();
+
+  int shard_count() const { return static_cast<int>(shards_.size()); }
+
+  // Returns the file name of shard |index| of |path|.
+  static std::string GetShardPath(const std::string& path, int index);
+
+  // Returns the shard |key| lives in.
+  int GetShard(const Value& key) const;
+
+  // Point operations ----------------------------------------------------------
+  //
+  // These run |sql| with |params| bound in order on the shard of |key|.
+
+  std::future<bool> Execute(const Value& key,
+                            const std::string& sql,
+                            const Row& params);
+  std::future<QueryResult> Query(const Value& key,
+                                 const std::string& sql,
+                                 const Row& params);
+
+  // Runs |callback| inside a transaction on the shard of |key|, see
+  // AsyncConnection::Transaction().
+  std::future<bool> Transaction(const Value& key,
+                                const TransactionCallback& callback);
+
+  // Every shard ---------------------------------------------------------------
+
+  // Executes |sql|, such as a schema change, on every shard in parallel.
+  // Returns true if it succeeded on all of them.
+  bool ExecuteOnAll(const std::string& sql);
+
+  // Runs |sql| once for each of |rows|, on the shard of its key and with its
+  // parameters bound. Each shard runs its rows in one transaction, in
+  // parallel with the others, which is the fast way to load data. Returns
+  // true if every shard committed.
+  bool ExecuteBatch(const std::string& sql, const std::vector<KeyedRow>& rows);
+
+  // Runs |sql| with |params| on every shard in parallel, and merges the
+  // results into |scan| by |order_column|, which each shard's rows must be
+  // sorted on: ascending, or descending if |descending|. A LIMIT in |sql|
+  // applies per shard, so stop reading |scan| once enough rows are read;
+  // the shards then stop reading too. Writes queued on a shard while its
+  // rows are read run between batches, and the scan may or may not see
+  // them. Returns false if the query failed on any shard.
+  bool Scan(const std::string& sql,
+            const Row& params,
+            int order_column,
+            bool descending,
+            MergedScan* scan);
+
+  // Attaches every shard to |reader|, which must be open, as "shard0",
+  // "shard1" and so on. A temporary view is created for each table of the
+  // first shard, with the same name, that unions the table of every shard,
+  // so that the shards can be queried as one database:
+  //
+  //   sql::Connection reader;
+  //   reader.OpenInMemory();
+  //   events.AttachShards(&reader);
+  //   sql::Statement count(reader.GetUniqueStatement(
+  //       "SELECT COUNT(*) FROM events"));
+  //
+  // sqlite allows 10 attached databases by default, so this fails for more
+  // shards unless sqlite was built with a higher SQLITE_MAX_ATTACHED. The
+  // reader is meant for reading: it has no part in the shards' transactions.
+  bool AttachShards(Connection* reader);
+
+ private:
+  // Runs |sql| with |params| on |connection|.
+  static bool ExecuteWithParams(const std::string& sql, const Row& params,
+                                Connection* connection);
+
+  std::string path_;
+  std::vector<std::unique_ptr<AsyncConnection> > shards_;
+
+  DISALLOW_COPY_AND_ASSIGN(ShardedDatabase);
+};
+
+}  // namespace sql
+
+#endif  // SQL_SHARDED_DATABASE_H_
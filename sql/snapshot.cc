@@ -0,0 +1,103 @@
+// Copyright (c) 2010 Garrett R. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "snapshot.h"
+
+#include <sqlite3.h>
+
+#include "connection.h"
+#include "statement.h"
+
+namespace sql {
+
+Snapshot::Snapshot() : snapshot_(NULL) {
+}
+
+Snapshot::~Snapshot() {
+  Reset();
+}
+
+// static
+bool Snapshot::IsSupported() {
+#if defined(SQL_HAVE_SQLITE_SNAPSHOT)
+  return true;
+#else
+  return false;
+#endif
+}
+
+bool Snapshot::Take(Connection* connection, const char* schema) {
+  Reset();
+
+#if defined(SQL_HAVE_SQLITE_SNAPSHOT)
+  if (!connection || !connection->is_open())
+    return false;
+
+  // sqlite3_snapshot_get needs an open read transaction, so start one if the
+  // caller doesn't have one. Reading the schema is enough to begin it.
+  bool own_transaction = connection->transaction_nesting() == 0;
+  if (own_transaction) {
+    if (!connection->BeginTransaction())
+      return false;
+
+    Statement read(connection->GetCachedStatement(SQL_FROM_HERE,
+        "SELECT COUNT(*) FROM sqlite_master"));
+    if (!read || !read.Step()) {
+      connection->RollbackTransaction();
+      return false;
+    }
+  }
+
+  int err = sqlite3_snapshot_get(connection->db_, schema, &snapshot_);
+  if (err != SQLITE_OK)
+    snapshot_ = NULL;
+
+  if (own_transaction)
+    connection->CommitTransaction();
+#else
+  (void)connection;
+  (void)schema;
+#endif
+
+  return is_valid();
+}
+
+bool Snapshot::Open(Connection* connection, const char* schema) const {
+#if defined(SQL_HAVE_SQLITE_SNAPSHOT)
+  if (!snapshot_ || !connection || !connection->is_open())
+    return false;
+
+  // Only the read transaction of an explicit transaction can be pinned.
+  if (connection->transaction_nesting() == 0)
+    return false;
+
+  return sqlite3_snapshot_open(connection->db_, schema,
+                               snapshot_) == SQLITE_OK;
+#else
+  (void)connection;
+  (void)schema;
+  return false;
+#endif
+}
+
+int Snapshot::Compare(const Snapshot& other) const {
+#if defined(SQL_HAVE_SQLITE_SNAPSHOT)
+  if (snapshot_ && other.snapshot_)
+    return sqlite3_snapshot_cmp(snapshot_, other.snapshot_);
+#endif
+  // Treat an empty snapshot as older than any real one.
+  if (!snapshot_ == !other.snapshot_)
+    return 0;
+  return snapshot_ ? 1 : -1;
+}
+
+void Snapshot::Reset() {
+#if defined(SQL_HAVE_SQLITE_SNAPSHOT)
+  if (snapshot_)
+    sqlite3_snapshot_free(snapshot_);
+#endif
+  snapshot_ = NULL;
+}
+
+}  // namespace sql
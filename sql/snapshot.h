@@ -0,0 +1,81 @@
+// Copyright (c) 2010 Garrett R. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef SQL_SNAPSHOT_H_
+#define SQL_SNAPSHOT_H_
+
+#include "basictypes.h"
+
+struct sqlite3_snapshot;
+
+namespace sql {
+
+class Connection;
+
+// A Snapshot records the state of a WAL-mode database at one point in time.
+// It is taken on one Connection and can then be opened inside read
+// transactions on any number of other connections to the same file, which
+// will all see exactly the same data however many commits happen in the
+// meantime. This is what allows a long export to be split across several
+// readers without falling back to a single serial read transaction.
+//
+// Normal usage:
+//   sql::Snapshot snapshot;
+//   if (!snapshot.Take(&writer))
+//     return false;  // Not in WAL mode or not supported by sqlite.
+//
+//   // On each reader, possibly on other threads:
+//   sql::Transaction transaction(&reader);
+//   if (!transaction.Begin() || !snapshot.Open(&reader))
+//     return false;
+//   ... read ...
+//   transaction.Commit();
+//
+// A snapshot can become unusable once the WAL is checkpointed past it, in
+// which case Open() returns false. Holding a read transaction open on the
+// snapshot prevents that.
+//
+// Snapshot::Open() may be called from several threads at once; Take() and
+// Reset() must not race with anything else.
+class Snapshot {
+ public:
+  Snapshot();
+  ~Snapshot();
+
+  // Returns true if the linked sqlite was built with SQLITE_ENABLE_SNAPSHOT.
+  // When it isn't, Take() always fails.
+  static bool IsSupported();
+
+  // Records the current state of |schema| as seen by |connection|. If the
+  // connection has no open transaction a short one is used, otherwise the
+  // current transaction must already have read from the database and must
+  // not have written to it. Returns false on failure, including when the
+  // database is not in WAL mode.
+  bool Take(Connection* connection, const char* schema = "main");
+
+  // Returns true if the snapshot holds a state taken with Take().
+  bool is_valid() const { return !!snapshot_; }
+
+  // Makes the read transaction on |connection| see this snapshot. The
+  // connection must have begun a transaction (see sql::Transaction) that
+  // has not yet read anything from the database.
+  bool Open(Connection* connection, const char* schema = "main") const;
+
+  // Returns a negative number if this snapshot is older than |other|, zero if
+  // they are the same and a positive number if it is newer. Only meaningful
+  // for snapshots of the same database.
+  int Compare(const Snapshot& other) const;
+
+  // Frees the recorded state. This is automatically performed on destruction.
+  void Reset();
+
+ private:
+  sqlite3_snapshot* snapshot_;
+
+  DISALLOW_COPY_AND_ASSIGN(Snapshot);
+};
+
+}  // namespace sql
+
+#endif  // SQL_SNAPSHOT_H_
@@ -9,6 +9,7 @@
 #include "statement.h"
 
 #include <cstring>
+#include <utility>
 
 #include <sqlite3.h>
 
@@ -16,19 +17,33 @@
 
 namespace sql {
 
-// This empty constructor initializes our reference with an empty one so that
-// we don't have to NULL-check the ref_ to see if the statement is valid: we
-// only have to check the ref's validity bit.
+// An unassigned statement has no reference at all rather than an empty one,
+// so that declaring one doesn't allocate.
 Statement::Statement()
-    : ref_(new Connection::StatementRef),
-      succeeded_(false) {
+    : succeeded_(false) {
 }
 
 Statement::Statement(scoped_refptr<Connection::StatementRef> ref)
-    : ref_(ref),
+    : ref_(std::move(ref)),
       succeeded_(false) {
 }
 
+Statement::Statement(Statement&& other)
+    : ref_(std::move(other.ref_)),
+      succeeded_(other.succeeded_) {
+  other.succeeded_ = false;
+}
+
+Statement& Statement::operator=(Statement&& other) {
+  if (this != &other) {
+    Reset();
+    ref_ = std::move(other.ref_);
+    succeeded_ = other.succeeded_;
+    other.succeeded_ = false;
+  }
+  return *this;
+}
+
 Statement::~Statement() {
   // Free the resources associated with this statement. We assume there's only
   // one statement active for a given sqlite3_stmt at any time, so this won't
@@ -38,28 +53,40 @@ Statement::~Statement() {
 
 void Statement::Assign(scoped_refptr<Connection::StatementRef> ref) {
   Reset();
-  ref_ = ref;
+  ref_ = std::move(ref);
 }
 
 bool Statement::Run() {
   if (!is_valid())
     return false;
+  ref_->stepped_ = true;
   return CheckError(sqlite3_step(ref_->stmt())) == SQLITE_DONE;
 }
 
 bool Statement::Step() {
   if (!is_valid())
     return false;
+  ref_->stepped_ = true;
   return CheckError(sqlite3_step(ref_->stmt())) == SQLITE_ROW;
 }
 
 void Statement::Reset() {
+  Reset(true);
+}
+
+void Statement::Reset(bool clear_bound_vars) {
   if (is_valid()) {
+    if (clear_bound_vars && ref_->has_bindings_) {
+      sqlite3_clear_bindings(ref_->stmt());
+      ref_->has_bindings_ = false;
+    }
     // We don't call CheckError() here because sqlite3_reset() returns
     // the last error that Step() caused thereby generating a second
     // spurious error callback.
-    sqlite3_clear_bindings(ref_->stmt());
-    sqlite3_reset(ref_->stmt());
+    if (ref_->stepped_) {
+      sqlite3_reset(ref_->stmt());
+      ref_->stepped_ = false;
+    }
   }
   succeeded_ = false;
 }
@@ -73,7 +100,10 @@ bool Statement::Succeeded() const {
 bool Statement::BindNull(int col) {
   if (is_valid()) {
     int err = CheckError(sqlite3_bind_null(ref_->stmt(), col + 1));
-    return err == SQLITE_OK;
+    if (err != SQLITE_OK)
+      return false;
+    ref_->has_bindings_ = true;
+    return true;
   }
   return false;
 }
@@ -85,7 +115,10 @@ bool Statement::BindBool(int col, bool val) {
 bool Statement::BindInt(int col, int val) {
   if (is_valid()) {
     int err = CheckError(sqlite3_bind_int(ref_->stmt(), col + 1, val));
-    return err == SQLITE_OK;
+    if (err != SQLITE_OK)
+      return false;
+    ref_->has_bindings_ = true;
+    return true;
   }
   return false;
 }
@@ -93,7 +126,10 @@ bool Statement::BindInt(int col, int val) {
 bool Statement::BindInt64(int col, int64 val) {
   if (is_valid()) {
     int err = CheckError(sqlite3_bind_int64(ref_->stmt(), col + 1, val));
-    return err == SQLITE_OK;
+    if (err != SQLITE_OK)
+      return false;
+    ref_->has_bindings_ = true;
+    return true;
   }
   return false;
 }
@@ -101,7 +137,10 @@ bool Statement::BindInt64(int col, int64 val) {
 bool Statement::BindDouble(int col, double val) {
   if (is_valid()) {
     int err = CheckError(sqlite3_bind_double(ref_->stmt(), col + 1, val));
-    return err == SQLITE_OK;
+    if (err != SQLITE_OK)
+      return false;
+    ref_->has_bindings_ = true;
+    return true;
   }
   return false;
 }
@@ -110,7 +149,10 @@ bool Statement::BindCString(int col, const char* val) {
   if (is_valid()) {
     int err = CheckError(sqlite3_bind_text(ref_->stmt(), col + 1, val, -1,
                          SQLITE_TRANSIENT));
-    return err == SQLITE_OK;
+    if (err != SQLITE_OK)
+      return false;
+    ref_->has_bindings_ = true;
+    return true;
   }
   return false;
 }
@@ -120,7 +162,10 @@ bool Statement::BindString(int col, const std::string& val) {
     int err = CheckError(sqlite3_bind_text(ref_->stmt(), col + 1, val.data(),
                                            static_cast<int>(val.size()),
                                            SQLITE_TRANSIENT));
-    return err == SQLITE_OK;
+    if (err != SQLITE_OK)
+      return false;
+    ref_->has_bindings_ = true;
+    return true;
   }
   return false;
 }
@@ -129,11 +174,31 @@ bool Statement::BindBlob(int col, const void* val, int val_len) {
   if (is_valid()) {
     int err = CheckError(sqlite3_bind_blob(ref_->stmt(), col + 1,
                          val, val_len, SQLITE_TRANSIENT));
-    return err == SQLITE_OK;
+    if (err != SQLITE_OK)
+      return false;
+    ref_->has_bindings_ = true;
+    return true;
   }
   return false;
 }
 
+bool Statement::BindValue(int col, const Value& val) {
+  switch (val.type()) {
+    case COLUMN_TYPE_INTEGER:
+      return BindInt64(col, val.AsInt64());
+    case COLUMN_TYPE_FLOAT:
+      return BindDouble(col, val.AsDouble());
+    case COLUMN_TYPE_TEXT:
+      return BindString(col, val.bytes());
+    case COLUMN_TYPE_BLOB:
+      return BindBlob(col, val.bytes().data(),
+                      static_cast<int>(val.bytes().size()));
+    case COLUMN_TYPE_NULL:
+      break;
+  }
+  return BindNull(col);
+}
+
 int Statement::ColumnCount() const {
   if (!is_valid()) {
     //NOTREACHED();
@@ -237,7 +302,41 @@ void Statement::ColumnBlobAsVector(
   ColumnBlobAsVector(col, reinterpret_cast< std::vector<char>* >(val));
 }
 
+Value Statement::ColumnValue(int col) const {
+  if (!is_valid()) {
+    //NOTREACHED();
+    return Value();
+  }
+
+  switch (ColumnType(col)) {
+    case COLUMN_TYPE_INTEGER:
+      return Value(ColumnInt64(col));
+    case COLUMN_TYPE_FLOAT:
+      return Value(ColumnDouble(col));
+    case COLUMN_TYPE_TEXT:
+      return Value(ColumnString(col));
+    case COLUMN_TYPE_BLOB:
+      return Value::Blob(ColumnBlob(col), ColumnByteLength(col));
+    case COLUMN_TYPE_NULL:
+      break;
+  }
+  return Value();
+}
+
+void Statement::ColumnRow(Row* row) const {
+  if (!row)
+    return;
+
+  int count = ColumnCount();
+  row->resize(count);
+  for (int i = 0; i < count; ++i)
+    (*row)[i] = ColumnValue(i);
+}
+
 const char* Statement::GetSQLStatement() const {
+  if (!ref_)
+    return NULL;
+
   // sqlite3_sql is non-mutating, so this cast is OK.
   scoped_refptr<Connection::StatementRef>& stmt_ref =
     *const_cast<scoped_refptr<Connection::StatementRef>*>(&ref_);
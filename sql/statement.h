@@ -15,19 +15,10 @@
 #include "basictypes.h"
 #include "connection.h"
 #include "ref_counted.h"
+#include "value.h"
 
 namespace sql {
 
-// Possible return values from ColumnType in a statement. These should match
-// the values in sqlite3.h.
-enum ColType {
-  COLUMN_TYPE_INTEGER = 1,
-  COLUMN_TYPE_FLOAT = 2,
-  COLUMN_TYPE_TEXT = 3,
-  COLUMN_TYPE_BLOB = 4,
-  COLUMN_TYPE_NULL = 5,
-};
-
 // Normal usage:
 //   sql::Statement s(connection_.GetUniqueStatement(...));
 //   if (!s)  // You should check for errors before using the statement.
@@ -49,6 +40,11 @@ class Statement {
   explicit Statement(scoped_refptr<Connection::StatementRef> ref);
   ~Statement();
 
+  // Statements can't be copied but can be moved, which leaves |other|
+  // invalid. Moving never touches the heap or the reference count.
+  Statement(Statement&& other);
+  Statement& operator=(Statement&& other);
+
   // Initializes this object with the given statement, which may or may not
   // be valid. Use is_valid() to check if it's OK.
   void Assign(scoped_refptr<Connection::StatementRef> ref);
@@ -58,7 +54,7 @@ class Statement {
   // default value. This is because the statement can become invalid in the
   // middle of executing a command if there is a serioud error and the database
   // has to be reset.
-  bool is_valid() const { return ref_->is_valid(); }
+  bool is_valid() const { return ref_ && ref_->is_valid(); }
 
   // These operators allow conveniently checking if the statement is valid
   // or not. See the pattern above for an example.
@@ -90,6 +86,22 @@ class Statement {
   // the bound variables and any current result row.
   void Reset();
 
+  // Resets the statement so it can run again, clearing the bound variables
+  // only if |clear_bound_vars| is true. Keeping them lets a loop bind the
+  // parameters that stay the same once and only rebind the others:
+  //
+  //   s.BindInt(0, kind);
+  //   for (size_t i = 0; i < values.size(); ++i) {
+  //     s.BindInt64(1, values[i]);
+  //     if (!s.Run())
+  //       return false;
+  //     s.Reset(false);
+  //   }
+  //
+  // Nothing is done if the statement hasn't run since it was last reset, or
+  // has nothing bound, so calling this when unsure is cheap.
+  void Reset(bool clear_bound_vars);
+
   // Returns true if the last executed thing in this statement succeeded. If
   // there was no last executed thing or the statement is invalid, this will
   // return false.
@@ -109,6 +121,7 @@ class Statement {
   bool BindCString(int col, const char* val);
   bool BindString(int col, const std::string& val);
   bool BindBlob(int col, const void* value, int value_len);
+  bool BindValue(int col, const Value& val);
 
   // Retrieving ----------------------------------------------------------------
 
@@ -138,6 +151,11 @@ class Statement {
   void ColumnBlobAsVector(int col, std::vector<char>* val) const;
   void ColumnBlobAsVector(int col, std::vector<unsigned char>* val) const;
 
+  // Copies the given column, or every column of the current row, into
+  // sql::Values that stay valid after the statement moves on.
+  Value ColumnValue(int col) const;
+  void ColumnRow(Row* row) const;
+
   // Diagnostics --------------------------------------------------------------
 
   // Returns the original text of sql statement. Do not keep a pointer to it.
@@ -151,8 +169,8 @@ class Statement {
   int CheckError(int err);
 
   // The actual sqlite statement. This may be unique to us, or it may be cached
-  // by the connection, which is why it's refcounted. This pointer is
-  // guaranteed non-NULL.
+  // by the connection, which is why it's refcounted. This is NULL for
+  // statements that were never assigned or have been moved from.
   scoped_refptr<Connection::StatementRef> ref_;
 
   // See Succeeded() for what this holds.
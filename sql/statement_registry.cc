@@ -0,0 +1,56 @@
+// Copyright (c) 2010 Garrett R. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "statement_registry.h"
+
+namespace sql {
+
+// static
+StatementRegistry* StatementRegistry::GetInstance() {
+  // Leaked on purpose so that statements registered by static objects in
+  // other translation units never see it destroyed.
+  static StatementRegistry* instance = new StatementRegistry;
+  return instance;
+}
+
+StatementRegistry::StatementRegistry() {
+}
+
+StatementRegistry::~StatementRegistry() {
+}
+
+void StatementRegistry::Register(const StatementID& id, const char* sql) {
+  if (!sql)
+    return;
+
+  std::lock_guard<std::mutex> lock(lock_);
+  statements_.erase(id);
+  statements_.insert(StatementMap::value_type(id, sql));
+}
+
+const char* StatementRegistry::GetSQL(const StatementID& id) const {
+  std::lock_guard<std::mutex> lock(lock_);
+  StatementMap::const_iterator found = statements_.find(id);
+  return found == statements_.end() ? NULL : found->second;
+}
+
+std::vector<StatementRegistry::Entry> StatementRegistry::GetEntries() const {
+  std::vector<Entry> entries;
+
+  std::lock_guard<std::mutex> lock(lock_);
+  entries.reserve(statements_.size());
+  for (StatementMap::const_iterator i = statements_.begin();
+       i != statements_.end(); ++i)
+    entries.push_back(Entry(i->first, i->second));
+  return entries;
+}
+
+RegisteredStatement::RegisteredStatement(const StatementID& id,
+                                         const char* sql)
+    : id_(id),
+      sql_(sql) {
+  StatementRegistry::GetInstance()->Register(id, sql);
+}
+
+}  // namespace sql
@@ -0,0 +1,81 @@
+// Copyright (c) 2010 Garrett R. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef SQL_STATEMENT_REGISTRY_H_
+#define SQL_STATEMENT_REGISTRY_H_
+
+#include <map>
+#include <mutex>
+#include <vector>
+
+#include "basictypes.h"
+#include "connection.h"
+
+namespace sql {
+
+// StatementRegistry is the process-wide list of statements that connections
+// prepare ahead of time with Connection::WarmStatements(). Declaring the
+// statements a service uses here moves their parse and plan cost, and any
+// errors in their SQL, from the first request to startup.
+//
+// Statements are normally registered at static initialization time through
+// RegisteredStatement below. As with GetCachedStatement, the StatementID and
+// the SQL must always correspond to one-another, and both must be static
+// strings.
+class StatementRegistry {
+ public:
+  struct Entry {
+    Entry(const StatementID& id, const char* sql) : id(id), sql(sql) {}
+
+    StatementID id;
+    const char* sql;
+  };
+
+  static StatementRegistry* GetInstance();
+
+  // Adds a statement. Registering the same ID again replaces its SQL.
+  void Register(const StatementID& id, const char* sql);
+
+  // Returns the SQL registered for |id|, or NULL if there is none.
+  const char* GetSQL(const StatementID& id) const;
+
+  // Returns every registered statement.
+  std::vector<Entry> GetEntries() const;
+
+ private:
+  typedef std::map<StatementID, const char*> StatementMap;
+
+  StatementRegistry();
+  ~StatementRegistry();
+
+  mutable std::mutex lock_;
+  StatementMap statements_;
+
+  DISALLOW_COPY_AND_ASSIGN(StatementRegistry);
+};
+
+// Registers a statement when it is constructed, which makes it convenient to
+// declare statements next to the code that uses them:
+//
+//   static const sql::RegisteredStatement kGetUser(
+//       sql::StatementID("GetUser"), "SELECT name FROM users WHERE id=?");
+//   ...
+//   sql::Statement s(db->GetCachedStatement(kGetUser));
+class RegisteredStatement {
+ public:
+  RegisteredStatement(const StatementID& id, const char* sql);
+
+  const StatementID& id() const { return id_; }
+  const char* sql() const { return sql_; }
+
+ private:
+  StatementID id_;
+  const char* sql_;
+
+  DISALLOW_COPY_AND_ASSIGN(RegisteredStatement);
+};
+
+}  // namespace sql
+
+#endif  // SQL_STATEMENT_REGISTRY_H_
@@ -0,0 +1,899 @@
+// Copyright (c) 2010 Garrett R. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "uring_vfs.h"
+
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include <sqlite3.h>
+
+#if defined(SQL_HAVE_IO_URING)
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "connection.h"
+
+namespace sql {
+
+// static
+const char UringVfs::kName[] = "sql-io-uring";
+
+UringVfs::Stats::Stats()
+    : io_uring_active(false),
+      writes(0),
+      submissions(0),
+      max_in_flight(0),
+      readaheads(0),
+      readahead_bytes(0) {
+}
+
+#if defined(SQL_HAVE_IO_URING)
+
+namespace {
+
+// The size of each file's ring. A few entries are kept for read-ahead.
+const unsigned kQueueDepth = 64;
+const unsigned kReadaheadEntries = 8;
+
+// Read-ahead starts after this many reads in a row that move forward, and
+// its window grows from the minimum to the maximum.
+const int kSequentialReads = 4;
+const int64 kMinReadahead = 128 * 1024;
+const int64 kMaxReadahead = 2 * 1024 * 1024;
+
+// The user_data of read-ahead requests. Writes use their slot index + 1.
+const uint64 kReadaheadTag = 0;
+
+// A file control of our own that fills in a UringVfs::Stats, see the one in
+// compressed_vfs.cc.
+const int kStatsFileControl = 0x53514c02;
+
+// A minimal io_uring, set up with raw system calls so that liburing isn't
+// needed.
+class Ring {
+ public:
+  Ring()
+      : fd_(-1),
+        sq_ring_(NULL),
+        sq_ring_size_(0),
+        cq_ring_(NULL),
+        cq_ring_size_(0),
+        sqes_(NULL),
+        sqes_size_(0),
+        sqe_tail_(0) {
+  }
+
+  ~Ring() {
+    if (sqes_)
+      munmap(sqes_, sqes_size_);
+    if (cq_ring_ && cq_ring_ != sq_ring_)
+      munmap(cq_ring_, cq_ring_size_);
+    if (sq_ring_)
+      munmap(sq_ring_, sq_ring_size_);
+    if (fd_ >= 0)
+      close(fd_);
+  }
+
+  // Returns false if the kernel doesn't allow io_uring.
+  bool Init(unsigned entries) {
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    fd_ = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+    if (fd_ < 0)
+      return false;
+
+    sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size_ =
+        params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single_mmap)
+      sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+
+    sq_ring_ = Map(sq_ring_size_, IORING_OFF_SQ_RING);
+    if (!sq_ring_)
+      return false;
+    cq_ring_ = single_mmap ? sq_ring_ : Map(cq_ring_size_, IORING_OFF_CQ_RING);
+    if (!cq_ring_)
+      return false;
+    sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+    sqes_ = static_cast<io_uring_sqe*>(Map(sqes_size_, IORING_OFF_SQES));
+    if (!sqes_)
+      return false;
+
+    char* sq = static_cast<char*>(sq_ring_);
+    sq_head_ = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    sq_tail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    sq_mask_ = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    sq_entries_ = params.sq_entries;
+    sq_array_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    char* cq = static_cast<char*>(cq_ring_);
+    cq_head_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    cq_mask_ = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+    sqe_tail_ = *sq_tail_;
+    return true;
+  }
+
+  // Returns a cleared submission to fill in, or NULL if the queue is full.
+  io_uring_sqe* GetSqe() {
+    unsigned head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+    if (sqe_tail_ - head >= sq_entries_)
+      return NULL;
+    io_uring_sqe* sqe = &sqes_[sqe_tail_ & sq_mask_];
+    ++sqe_tail_;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+  }
+
+  // Submits the entries gotten since the last call and waits until at
+  // least |wait| completions are available. Returns the number submitted,
+  // or -errno.
+  int Submit(unsigned wait) {
+    unsigned tail = *sq_tail_;
+    unsigned count = sqe_tail_ - tail;
+    for (; tail != sqe_tail_; ++tail)
+      sq_array_[tail & sq_mask_] = tail & sq_mask_;
+    __atomic_store_n(sq_tail_, tail, __ATOMIC_RELEASE);
+
+    if (!count && !wait)
+      return 0;
+    unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
+    for (;;) {
+      long result = syscall(__NR_io_uring_enter, fd_, count, wait, flags,
+                            NULL, 0);
+      if (result >= 0)
+        return static_cast<int>(result);
+      if (errno != EINTR)
+        return -errno;
+    }
+  }
+
+  // Calls |handle(user_data, result)| for each completion available.
+  template <typename Handler>
+  void Reap(Handler handle) {
+    unsigned head = *cq_head_;
+    unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head) {
+      const io_uring_cqe& cqe = cqes_[head & cq_mask_];
+      handle(cqe.user_data, cqe.res);
+    }
+    __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+  }
+
+ private:
+  void* Map(size_t size, off_t offset) {
+    void* memory = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, fd_, offset);
+    return memory == MAP_FAILED ? NULL : memory;
+  }
+
+  int fd_;
+  void* sq_ring_;
+  size_t sq_ring_size_;
+  void* cq_ring_;
+  size_t cq_ring_size_;
+  io_uring_sqe* sqes_;
+  size_t sqes_size_;
+
+  unsigned* sq_head_;
+  unsigned* sq_tail_;
+  unsigned sq_mask_;
+  unsigned sq_entries_;
+  unsigned* sq_array_;
+  unsigned* cq_head_;
+  unsigned* cq_tail_;
+  unsigned cq_mask_;
+  io_uring_cqe* cqes_;
+
+  // The tail including entries not submitted yet.
+  unsigned sqe_tail_;
+
+  DISALLOW_COPY_AND_ASSIGN(Ring);
+};
+
+// A copy of a page being written.
+struct PendingWrite {
+  PendingWrite()
+      : data(NULL), capacity(0), offset(0), length(0), busy(false) {}
+
+  unsigned char* data;
+  size_t capacity;
+  int64 offset;
+  int length;
+
+  // Queued or in flight.
+  bool busy;
+};
+
+// The state of one open database file.
+struct FileState {
+  FileState()
+      : fd(-1),
+        ring_active(false),
+        queued(0),
+        in_flight(0),
+        busy_writes(0),
+        error(SQLITE_OK),
+        last_read_end(-1),
+        sequential_reads(0),
+        readahead_end(0),
+        readahead_window(kMinReadahead) {
+  }
+
+  ~FileState() {
+    for (size_t i = 0; i < writes.size(); ++i)
+      delete[] writes[i].data;
+  }
+
+  // Our own descriptor for the file, or -1. See OpenDescriptor().
+  int fd;
+
+  Ring ring;
+  bool ring_active;
+
+  std::vector<PendingWrite> writes;
+  std::vector<int> free_writes;
+
+  // Entries waiting to be submitted, entries submitted but not completed,
+  // and writes in either state.
+  unsigned queued;
+  unsigned in_flight;
+  unsigned busy_writes;
+
+  // The first error a write completed with, reported by the next Flush().
+  int error;
+
+  // See MaybeReadAhead().
+  int64 last_read_end;
+  int sequential_reads;
+  int64 readahead_end;
+  int64 readahead_window;
+
+  UringVfs::Stats stats;
+};
+
+// An open file. sqlite allocates this, followed by the file of the
+// underlying VFS.
+struct UringFile {
+  sqlite3_file base;
+  FileState* state;
+
+  sqlite3_file* real() {
+    return reinterpret_cast<sqlite3_file*>(this + 1);
+  }
+};
+
+UringFile* ToUringFile(sqlite3_file* file) {
+  return reinterpret_cast<UringFile*>(file);
+}
+
+sqlite3_vfs* BaseVfs(sqlite3_vfs* vfs) {
+  return static_cast<sqlite3_vfs*>(vfs->pAppData);
+}
+
+// The files open through the VFS, by device and inode, with how many
+// connections have each open and the descriptors of the ones that closed.
+struct OpenInode {
+  OpenInode() : files(0) {}
+
+  int files;
+  std::vector<int> parked;
+};
+
+typedef std::map<std::pair<dev_t, ino_t>, OpenInode> OpenInodeMap;
+
+std::mutex g_descriptor_lock;
+
+OpenInodeMap& OpenInodes() {
+  // Leaked on purpose, like sqlite's own list of open files.
+  static OpenInodeMap* inodes = new OpenInodeMap;
+  return *inodes;
+}
+
+// Opens a descriptor of our own for the database file |name|, which the
+// unix VFS has just opened, to submit its writes with. sqlite offers no way
+// to borrow the unix VFS's one. Returns -1 on failure.
+int OpenDescriptor(const char* name, bool read_only) {
+  int fd = open(name, (read_only ? O_RDONLY : O_RDWR) | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+  struct stat file;
+  if (fstat(fd, &file) != 0) {
+    close(fd);
+    return -1;
+  }
+  std::lock_guard<std::mutex> lock(g_descriptor_lock);
+  ++OpenInodes()[std::make_pair(file.st_dev, file.st_ino)].files;
+  return fd;
+}
+
+// Closing any descriptor of a file drops every POSIX lock the process holds
+// on it, including those of other connections, which is why the unix VFS
+// defers closing its own. |fd| is parked until no other connection has its
+// file open through this VFS, when there can be no locks left to drop.
+void ReleaseDescriptor(int fd) {
+  struct stat file;
+  if (fstat(fd, &file) != 0) {
+    close(fd);
+    return;
+  }
+  std::lock_guard<std::mutex> lock(g_descriptor_lock);
+  OpenInodeMap::iterator inode =
+      OpenInodes().find(std::make_pair(file.st_dev, file.st_ino));
+  if (inode == OpenInodes().end()) {
+    close(fd);
+    return;
+  }
+  inode->second.parked.push_back(fd);
+  if (--inode->second.files > 0)
+    return;
+  for (size_t i = 0; i < inode->second.parked.size(); ++i)
+    close(inode->second.parked[i]);
+  OpenInodes().erase(inode);
+}
+
+// Writes what a short write left out, synchronously.
+int FinishWrite(FileState* state, const PendingWrite& write, int done) {
+  while (done < write.length) {
+    ssize_t written = pwrite(state->fd, write.data + done,
+                             write.length - done, write.offset + done);
+    if (written < 0 && errno == EINTR)
+      continue;
+    if (written <= 0)
+      return errno == ENOSPC ? SQLITE_FULL : SQLITE_IOERR_WRITE;
+    done += static_cast<int>(written);
+  }
+  return SQLITE_OK;
+}
+
+void HandleCompletion(FileState* state, uint64 user_data, int result) {
+  --state->in_flight;
+  if (user_data == kReadaheadTag)
+    return;
+
+  int index = static_cast<int>(user_data - 1);
+  const PendingWrite& write = state->writes[index];
+  int err = SQLITE_OK;
+  if (result < 0)
+    err = result == -ENOSPC ? SQLITE_FULL : SQLITE_IOERR_WRITE;
+  else if (result < write.length)
+    err = FinishWrite(state, write, result);
+  if (err != SQLITE_OK && state->error == SQLITE_OK)
+    state->error = err;
+
+  state->writes[index].busy = false;
+  state->free_writes.push_back(index);
+  --state->busy_writes;
+}
+
+// Submits the queued entries and, if |wait|, waits for one to complete.
+// Then handles every completion available.
+int SubmitAndReap(FileState* state, bool wait) {
+  int submitted = state->ring.Submit(wait ? 1 : 0);
+  if (submitted < 0 && submitted != -EAGAIN && submitted != -EBUSY)
+    return SQLITE_IOERR_WRITE;
+  if (submitted > 0) {
+    state->queued -= submitted;
+    state->in_flight += submitted;
+    ++state->stats.submissions;
+    if (state->in_flight > state->stats.max_in_flight)
+      state->stats.max_in_flight = state->in_flight;
+  }
+
+  state->ring.Reap([state](uint64 user_data, int result) {
+    HandleCompletion(state, user_data, result);
+  });
+  return SQLITE_OK;
+}
+
+// Waits for every queued write to be done. Returns the first error any of
+// them had.
+int Flush(FileState* state) {
+  while (state->queued || state->in_flight) {
+    int err = SubmitAndReap(state, state->in_flight || state->queued);
+    if (err != SQLITE_OK)
+      return err;
+  }
+  int err = state->error;
+  state->error = SQLITE_OK;
+  return err;
+}
+
+// Returns true if a write queued or in flight overlaps |length| bytes at
+// |offset|.
+bool OverlapsBusyWrite(const FileState* state, int64 offset, int length) {
+  if (!state->busy_writes)
+    return false;
+  for (size_t i = 0; i < state->writes.size(); ++i) {
+    const PendingWrite& write = state->writes[i];
+    if (write.busy && write.offset < offset + length &&
+        offset < write.offset + write.length)
+      return true;
+  }
+  return false;
+}
+
+int QueueWrite(FileState* state, const void* buffer, int amount,
+               sqlite3_int64 offset) {
+  // The ring may complete writes in any order, so a write over one that
+  // hasn't completed waits for it, or the older data could land last.
+  if (OverlapsBusyWrite(state, offset, amount)) {
+    int err = Flush(state);
+    if (err != SQLITE_OK)
+      return err;
+  }
+
+  while (state->free_writes.empty()) {
+    int err = SubmitAndReap(state, true);
+    if (err != SQLITE_OK)
+      return err;
+  }
+
+  int index = state->free_writes.back();
+  PendingWrite& write = state->writes[index];
+  if (write.capacity < static_cast<size_t>(amount)) {
+    delete[] write.data;
+    write.data = new unsigned char[amount];
+    write.capacity = amount;
+  }
+  memcpy(write.data, buffer, amount);
+  write.offset = offset;
+  write.length = amount;
+  write.busy = true;
+
+  // There is always room: the writes and read-ahead both have their share
+  // of the queue.
+  io_uring_sqe* sqe = state->ring.GetSqe();
+  if (!sqe)
+    return SQLITE_IOERR_WRITE;
+  state->free_writes.pop_back();
+  sqe->opcode = IORING_OP_WRITE;
+  sqe->fd = state->fd;
+  sqe->addr = reinterpret_cast<uint64>(write.data);
+  sqe->len = amount;
+  sqe->off = offset;
+  sqe->user_data = index + 1;
+  ++state->queued;
+  ++state->busy_writes;
+  ++state->stats.writes;
+
+  // Submitted right away, without waiting for it. Nothing tells the last
+  // write of a commit from the others, and a write left in the queue would
+  // be lost if the process died before the next flush.
+  return SubmitAndReap(state, false);
+}
+
+// Asks the kernel to read ahead of reads that move forward through the
+// file, in a window that doubles up to kMaxReadahead.
+void MaybeReadAhead(FileState* state, int amount, sqlite3_int64 offset) {
+  if (state->fd < 0)
+    return;
+
+  int64 end = offset + amount;
+  if (state->last_read_end >= 0 && offset >= state->last_read_end &&
+      offset - state->last_read_end <= amount) {
+    ++state->sequential_reads;
+  } else {
+    state->sequential_reads = 0;
+    state->readahead_end = 0;
+    state->readahead_window = kMinReadahead;
+  }
+  state->last_read_end = end;
+
+  if (state->sequential_reads < kSequentialReads)
+    return;
+  if (state->readahead_end < end)
+    state->readahead_end = end;
+  if (state->readahead_end - end > state->readahead_window / 2)
+    return;
+
+  // Nothing to read past the end of the file.
+  struct stat file_stat;
+  if (fstat(state->fd, &file_stat) != 0 ||
+      state->readahead_end >= file_stat.st_size)
+    return;
+  int64 start = state->readahead_end;
+  int64 length = std::min(state->readahead_window,
+                          static_cast<int64>(file_stat.st_size) - start);
+  bool requested = false;
+  if (state->ring_active && state->in_flight + state->queued < kQueueDepth) {
+    io_uring_sqe* sqe = state->ring.GetSqe();
+    if (sqe) {
+      sqe->opcode = IORING_OP_FADVISE;
+      sqe->fd = state->fd;
+      sqe->off = start;
+      sqe->len = static_cast<uint32>(length);
+      sqe->fadvise_advice = POSIX_FADV_WILLNEED;
+      sqe->user_data = kReadaheadTag;
+      ++state->queued;
+      requested = SubmitAndReap(state, false) == SQLITE_OK;
+    }
+  } else if (!state->ring_active) {
+    requested = posix_fadvise(state->fd, start, length,
+                              POSIX_FADV_WILLNEED) == 0;
+  }
+  if (!requested)
+    return;
+
+  ++state->stats.readaheads;
+  state->stats.readahead_bytes += length;
+  state->readahead_end = start + length;
+  state->readahead_window =
+      std::min(state->readahead_window * 2, kMaxReadahead);
+}
+
+// sqlite3_io_methods --------------------------------------------------------
+
+int UringClose(sqlite3_file* base) {
+  UringFile* file = ToUringFile(base);
+  int err = Flush(file->state);
+  int fd = file->state->fd;
+  delete file->state;
+  file->state = NULL;
+  int close_err = file->real()->pMethods->xClose(file->real());
+  if (fd >= 0)
+    ReleaseDescriptor(fd);
+  return err != SQLITE_OK ? err : close_err;
+}
+
+int UringRead(sqlite3_file* base, void* buffer, int amount,
+              sqlite3_int64 offset) {
+  UringFile* file = ToUringFile(base);
+  FileState* state = file->state;
+  if (state->busy_writes) {
+    int err = Flush(state);
+    if (err != SQLITE_OK)
+      return err;
+  }
+  int err = file->real()->pMethods->xRead(file->real(), buffer, amount,
+                                          offset);
+  MaybeReadAhead(state, amount, offset);
+  return err;
+}
+
+int UringWrite(sqlite3_file* base, const void* buffer, int amount,
+               sqlite3_int64 offset) {
+  UringFile* file = ToUringFile(base);
+  if (!file->state->ring_active)
+    return file->real()->pMethods->xWrite(file->real(), buffer, amount,
+                                          offset);
+  return QueueWrite(file->state, buffer, amount, offset);
+}
+
+int UringTruncate(sqlite3_file* base, sqlite3_int64 size) {
+  UringFile* file = ToUringFile(base);
+  int err = Flush(file->state);
+  if (err != SQLITE_OK)
+    return err;
+  return file->real()->pMethods->xTruncate(file->real(), size);
+}
+
+int UringSync(sqlite3_file* base, int flags) {
+  UringFile* file = ToUringFile(base);
+  int err = Flush(file->state);
+  if (err != SQLITE_OK)
+    return err;
+  return file->real()->pMethods->xSync(file->real(), flags);
+}
+
+int UringFileSize(sqlite3_file* base, sqlite3_int64* size) {
+  UringFile* file = ToUringFile(base);
+  int err = Flush(file->state);
+  if (err != SQLITE_OK)
+    return err;
+  return file->real()->pMethods->xFileSize(file->real(), size);
+}
+
+int UringLock(sqlite3_file* base, int level) {
+  sqlite3_file* real = ToUringFile(base)->real();
+  return real->pMethods->xLock(real, level);
+}
+
+int UringUnlock(sqlite3_file* base, int level) {
+  // Other connections may read the file as soon as it is unlocked.
+  UringFile* file = ToUringFile(base);
+  int err = Flush(file->state);
+  if (err != SQLITE_OK)
+    return err;
+  return file->real()->pMethods->xUnlock(file->real(), level);
+}
+
+int UringCheckReservedLock(sqlite3_file* base, int* reserved) {
+  sqlite3_file* real = ToUringFile(base)->real();
+  return real->pMethods->xCheckReservedLock(real, reserved);
+}
+
+int UringFileControl(sqlite3_file* base, int op, void* arg) {
+  UringFile* file = ToUringFile(base);
+  if (op == kStatsFileControl) {
+    UringVfs::Stats* stats = static_cast<UringVfs::Stats*>(arg);
+    *stats = file->state->stats;
+    stats->io_uring_active = file->state->ring_active;
+    return SQLITE_OK;
+  }
+
+  switch (op) {
+    // A checkpoint's writes must be in place before it is recorded in the
+    // WAL index.
+    case SQLITE_FCNTL_CKPT_DONE:
+    // Sent at every commit, even with synchronous=OFF when xSync isn't
+    // called, before the rollback journal is deleted.
+    case SQLITE_FCNTL_SYNC:
+    // The unix VFS extends the file by writing to it past what it thinks is
+    // the end, and maps the file by its size.
+    case SQLITE_FCNTL_SIZE_HINT:
+    case SQLITE_FCNTL_MMAP_SIZE:
+    // An atomic batch is made of the writes between these.
+    case SQLITE_FCNTL_BEGIN_ATOMIC_WRITE:
+    case SQLITE_FCNTL_COMMIT_ATOMIC_WRITE:
+    case SQLITE_FCNTL_ROLLBACK_ATOMIC_WRITE: {
+      int err = Flush(file->state);
+      if (err != SQLITE_OK)
+        return err;
+      break;
+    }
+  }
+  return file->real()->pMethods->xFileControl(file->real(), op, arg);
+}
+
+int UringSectorSize(sqlite3_file* base) {
+  sqlite3_file* real = ToUringFile(base)->real();
+  return real->pMethods->xSectorSize(real);
+}
+
+int UringDeviceCharacteristics(sqlite3_file* base) {
+  sqlite3_file* real = ToUringFile(base)->real();
+  // Queued writes may complete in any order.
+  return real->pMethods->xDeviceCharacteristics(real) &
+         ~SQLITE_IOCAP_SEQUENTIAL;
+}
+
+int UringShmMap(sqlite3_file* base, int region, int size, int extend,
+                void volatile** memory) {
+  sqlite3_file* real = ToUringFile(base)->real();
+  return real->pMethods->xShmMap(real, region, size, extend, memory);
+}
+
+int UringShmLock(sqlite3_file* base, int offset, int count, int flags) {
+  sqlite3_file* real = ToUringFile(base)->real();
+  return real->pMethods->xShmLock(real, offset, count, flags);
+}
+
+void UringShmBarrier(sqlite3_file* base) {
+  sqlite3_file* real = ToUringFile(base)->real();
+  real->pMethods->xShmBarrier(real);
+}
+
+int UringShmUnmap(sqlite3_file* base, int delete_flag) {
+  sqlite3_file* real = ToUringFile(base)->real();
+  return real->pMethods->xShmUnmap(real, delete_flag);
+}
+
+int UringFetch(sqlite3_file* base, sqlite3_int64 offset, int amount,
+               void** pointer) {
+  UringFile* file = ToUringFile(base);
+  if (file->state->busy_writes) {
+    int err = Flush(file->state);
+    if (err != SQLITE_OK)
+      return err;
+  }
+  return file->real()->pMethods->xFetch(file->real(), offset, amount,
+                                        pointer);
+}
+
+int UringUnfetch(sqlite3_file* base, sqlite3_int64 offset, void* pointer) {
+  sqlite3_file* real = ToUringFile(base)->real();
+  return real->pMethods->xUnfetch(real, offset, pointer);
+}
+
+const sqlite3_io_methods kIoMethods = {
+  3,
+  &UringClose,
+  &UringRead,
+  &UringWrite,
+  &UringTruncate,
+  &UringSync,
+  &UringFileSize,
+  &UringLock,
+  &UringUnlock,
+  &UringCheckReservedLock,
+  &UringFileControl,
+  &UringSectorSize,
+  &UringDeviceCharacteristics,
+  &UringShmMap,
+  &UringShmLock,
+  &UringShmBarrier,
+  &UringShmUnmap,
+  &UringFetch,
+  &UringUnfetch,
+};
+
+// sqlite3_vfs ---------------------------------------------------------------
+
+int VfsOpen(sqlite3_vfs* vfs, const char* name, sqlite3_file* base,
+            int flags, int* out_flags) {
+  sqlite3_vfs* base_vfs = BaseVfs(vfs);
+
+  // Only database files are worth it; see the class comment.
+  if (!name || !(flags & SQLITE_OPEN_MAIN_DB))
+    return base_vfs->xOpen(base_vfs, name, base, flags, out_flags);
+
+  UringFile* file = ToUringFile(base);
+  memset(file, 0, sizeof(*file));
+  int opened_flags = 0;
+  int err = base_vfs->xOpen(base_vfs, name, file->real(), flags,
+                            &opened_flags);
+  if (err != SQLITE_OK) {
+    if (file->real()->pMethods)
+      file->real()->pMethods->xClose(file->real());
+    return err;
+  }
+  if (out_flags)
+    *out_flags = opened_flags;
+
+  FileState* state = new FileState;
+  state->fd = OpenDescriptor(name,
+                             (opened_flags & SQLITE_OPEN_READONLY) != 0);
+  if (state->fd >= 0 && file->real()->pMethods->iVersion >= 3 &&
+      state->ring.Init(kQueueDepth)) {
+    state->ring_active = true;
+    state->writes.resize(kQueueDepth - kReadaheadEntries);
+    for (size_t i = state->writes.size(); i > 0; --i)
+      state->free_writes.push_back(static_cast<int>(i - 1));
+  }
+  file->state = state;
+  file->base.pMethods = &kIoMethods;
+  return SQLITE_OK;
+}
+
+int VfsDelete(sqlite3_vfs* vfs, const char* name, int sync_dir) {
+  sqlite3_vfs* base_vfs = BaseVfs(vfs);
+  return base_vfs->xDelete(base_vfs, name, sync_dir);
+}
+
+int VfsAccess(sqlite3_vfs* vfs, const char* name, int flags, int* result) {
+  sqlite3_vfs* base_vfs = BaseVfs(vfs);
+  return base_vfs->xAccess(base_vfs, name, flags, result);
+}
+
+int VfsFullPathname(sqlite3_vfs* vfs, const char* name, int size,
+                    char* out) {
+  sqlite3_vfs* base_vfs = BaseVfs(vfs);
+  return base_vfs->xFullPathname(base_vfs, name, size, out);
+}
+
+void* VfsDlOpen(sqlite3_vfs* vfs, const char* name) {
+  sqlite3_vfs* base_vfs = BaseVfs(vfs);
+  return base_vfs->xDlOpen(base_vfs, name);
+}
+
+void VfsDlError(sqlite3_vfs* vfs, int size, char* message) {
+  sqlite3_vfs* base_vfs = BaseVfs(vfs);
+  base_vfs->xDlError(base_vfs, size, message);
+}
+
+void (*VfsDlSym(sqlite3_vfs* vfs, void* handle, const char* symbol))(void) {
+  sqlite3_vfs* base_vfs = BaseVfs(vfs);
+  return base_vfs->xDlSym(base_vfs, handle, symbol);
+}
+
+void VfsDlClose(sqlite3_vfs* vfs, void* handle) {
+  sqlite3_vfs* base_vfs = BaseVfs(vfs);
+  base_vfs->xDlClose(base_vfs, handle);
+}
+
+int VfsRandomness(sqlite3_vfs* vfs, int size, char* out) {
+  sqlite3_vfs* base_vfs = BaseVfs(vfs);
+  return base_vfs->xRandomness(base_vfs, size, out);
+}
+
+int VfsSleep(sqlite3_vfs* vfs, int microseconds) {
+  sqlite3_vfs* base_vfs = BaseVfs(vfs);
+  return base_vfs->xSleep(base_vfs, microseconds);
+}
+
+int VfsCurrentTime(sqlite3_vfs* vfs, double* now) {
+  sqlite3_vfs* base_vfs = BaseVfs(vfs);
+  return base_vfs->xCurrentTime(base_vfs, now);
+}
+
+int VfsGetLastError(sqlite3_vfs* vfs, int size, char* message) {
+  sqlite3_vfs* base_vfs = BaseVfs(vfs);
+  return base_vfs->xGetLastError(base_vfs, size, message);
+}
+
+int VfsCurrentTimeInt64(sqlite3_vfs* vfs, sqlite3_int64* now) {
+  sqlite3_vfs* base_vfs = BaseVfs(vfs);
+  return base_vfs->xCurrentTimeInt64(base_vfs, now);
+}
+
+std::mutex g_register_lock;
+sqlite3_vfs g_vfs;
+bool g_registered = false;
+
+}  // namespace
+
+// static
+bool UringVfs::IsSupported() {
+  return true;
+}
+
+// static
+bool UringVfs::Register() {
+  std::lock_guard<std::mutex> lock(g_register_lock);
+  if (g_registered)
+    return true;
+
+  // Writes go to the file named by the unix VFS, see OpenDescriptor().
+  sqlite3_vfs* base_vfs = sqlite3_vfs_find(NULL);
+  if (!base_vfs || base_vfs->iVersion < 2 ||
+      strncmp(base_vfs->zName, "unix", 4) != 0)
+    return false;
+
+  memset(&g_vfs, 0, sizeof(g_vfs));
+  g_vfs.iVersion = 2;
+  g_vfs.szOsFile = static_cast<int>(sizeof(UringFile)) + base_vfs->szOsFile;
+  g_vfs.mxPathname = base_vfs->mxPathname;
+  g_vfs.zName = kName;
+  g_vfs.pAppData = base_vfs;
+  g_vfs.xOpen = &VfsOpen;
+  g_vfs.xDelete = &VfsDelete;
+  g_vfs.xAccess = &VfsAccess;
+  g_vfs.xFullPathname = &VfsFullPathname;
+  g_vfs.xDlOpen = &VfsDlOpen;
+  g_vfs.xDlError = &VfsDlError;
+  g_vfs.xDlSym = &VfsDlSym;
+  g_vfs.xDlClose = &VfsDlClose;
+  g_vfs.xRandomness = &VfsRandomness;
+  g_vfs.xSleep = &VfsSleep;
+  g_vfs.xCurrentTime = &VfsCurrentTime;
+  g_vfs.xGetLastError = &VfsGetLastError;
+  g_vfs.xCurrentTimeInt64 = &VfsCurrentTimeInt64;
+
+  if (sqlite3_vfs_register(&g_vfs, 0) != SQLITE_OK)
+    return false;
+  g_registered = true;
+  return true;
+}
+
+// static
+bool UringVfs::GetStats(Connection* db, Stats* stats) {
+  if (!db->is_open())
+    return false;
+  return sqlite3_file_control(db->db_, "main", kStatsFileControl, stats) ==
+         SQLITE_OK;
+}
+
+#else  // defined(SQL_HAVE_IO_URING)
+
+// static
+bool UringVfs::IsSupported() {
+  return false;
+}
+
+// static
+bool UringVfs::Register() {
+  return false;
+}
+
+// static
+bool UringVfs::GetStats(Connection* db, Stats* stats) {
+  return false;
+}
+
+#endif  // defined(SQL_HAVE_IO_URING)
+
+}  // namespace sql
@@ -0,0 +1,82 @@
+// Copyright (c) 2010 Garrett R. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef SQL_URING_VFS_H_
+#define SQL_URING_VFS_H_
+
+#include "basictypes.h"
+
+namespace sql {
+
+class Connection;
+
+// UringVfs is an sqlite VFS for Linux that writes database pages through
+// io_uring instead of one blocking pwrite() at a time. It sits on top of the
+// default unix VFS and is selected per connection by opening with
+// Connection::OPEN_IO_URING.
+//
+// Writes to the database file are copied and submitted without waiting for
+// them, so a checkpoint, a commit of many pages or a backup into the
+// database keeps the device busy with many writes at once. sqlite waits for
+// them whenever it needs them to have happened: before syncing, reading,
+// truncating or unlocking the file, at the end of a commit and before a
+// checkpoint is recorded as done, and a write over one still in flight
+// waits for it. Journal and WAL
+// writes are passed through, since sqlite relies on them being in place as
+// soon as they return.
+//
+// The writes go through a descriptor the VFS opens itself, next to the one
+// the unix VFS locks the file with. Since closing it would drop the locks
+// other connections in the process hold on the file, it is only closed once
+// no connection has the file open through this VFS. A process shouldn't
+// also open the file without it, as such connections aren't counted.
+//
+// Reads are passed through too, but once they look sequential, as in a
+// large scan, the VFS asks the kernel to read ahead of them with a growing
+// window.
+//
+// Where io_uring isn't available, because of the kernel or a sandbox, the
+// VFS falls back to plain pread() and pwrite(), still with read-ahead.
+class UringVfs {
+ public:
+  // The name the VFS is registered under.
+  static const char kName[];
+
+  struct Stats {
+    Stats();
+
+    // False if the file fell back to synchronous writes.
+    bool io_uring_active;
+
+    // Writes queued, and the system calls that submitted them.
+    int64 writes;
+    int64 submissions;
+
+    // The most writes that were in flight at once.
+    int64 max_in_flight;
+
+    // Read-ahead requests and the bytes they covered.
+    int64 readaheads;
+    int64 readahead_bytes;
+  };
+
+  // Returns true if the VFS was built in, which needs Linux headers with
+  // io_uring. Even then, io_uring itself may turn out to be unavailable.
+  static bool IsSupported();
+
+  // Registers the VFS with sqlite. It is not made the default. Calling this
+  // more than once is harmless. Returns false if the VFS isn't supported.
+  static bool Register();
+
+  // Fills in |stats| for the main database of |db|. Returns false if the
+  // database isn't open through this VFS.
+  static bool GetStats(Connection* db, Stats* stats);
+
+ private:
+  DISALLOW_IMPLICIT_CONSTRUCTORS(UringVfs);
+};
+
+}  // namespace sql
+
+#endif  // SQL_URING_VFS_H_
@@ -58,6 +58,23 @@ inline std::string quote(const std::string &unquoted) {
   return quoted;
 }
 
+/**
+ * Quotes and escapes the string for use as an sqlite identifier such as a
+ * table or column name
+ *
+ * @param  unquoted the unescaped identifier
+ * @return double quoted and escaped form of the unquoted identifier
+ */
+inline std::string quote_identifier(const std::string &unquoted) {
+  std::string quoted;
+  char *tmp;
+
+  quoted = tmp = sqlite3_mprintf("\"%w\"", unquoted.c_str());
+  sqlite3_free(tmp);
+
+  return quoted;
+}
+
 } // end namespace sql
 
 #endif
@@ -0,0 +1,176 @@
+// Copyright (c) 2010 Garrett R. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "value.h"
+
+#include <cstdlib>
+#include <cstring>
+
+#include <sqlite3.h>
+
+namespace sql {
+
+namespace {
+
+// Returns the sort class of a type, see Value::Compare.
+int TypeRank(ColType type) {
+  switch (type) {
+    case COLUMN_TYPE_NULL:
+      return 0;
+    case COLUMN_TYPE_INTEGER:
+    case COLUMN_TYPE_FLOAT:
+      return 1;
+    case COLUMN_TYPE_TEXT:
+      return 2;
+    case COLUMN_TYPE_BLOB:
+      return 3;
+  }
+  return 0;
+}
+
+bool IsNumeric(ColType type) {
+  return type == COLUMN_TYPE_INTEGER || type == COLUMN_TYPE_FLOAT;
+}
+
+}  // namespace
+
+Value::Value()
+    : type_(COLUMN_TYPE_NULL),
+      int_(0),
+      double_(0.0) {
+}
+
+Value::Value(int value)
+    : type_(COLUMN_TYPE_INTEGER),
+      int_(value),
+      double_(0.0) {
+}
+
+Value::Value(int64 value)
+    : type_(COLUMN_TYPE_INTEGER),
+      int_(value),
+      double_(0.0) {
+}
+
+Value::Value(double value)
+    : type_(COLUMN_TYPE_FLOAT),
+      int_(0),
+      double_(value) {
+}
+
+Value::Value(const char* text)
+    : type_(text ? COLUMN_TYPE_TEXT : COLUMN_TYPE_NULL),
+      int_(0),
+      double_(0.0) {
+  if (text)
+    bytes_.assign(text);
+}
+
+Value::Value(const std::string& text)
+    : type_(COLUMN_TYPE_TEXT),
+      int_(0),
+      double_(0.0),
+      bytes_(text) {
+}
+
+// static
+Value Value::Blob(const void* data, int len) {
+  Value value;
+  value.type_ = COLUMN_TYPE_BLOB;
+  if (data && len > 0)
+    value.bytes_.assign(static_cast<const char*>(data), len);
+  return value;
+}
+
+int64 Value::AsInt64() const {
+  switch (type_) {
+    case COLUMN_TYPE_INTEGER:
+      return int_;
+    case COLUMN_TYPE_FLOAT:
+      return static_cast<int64>(double_);
+    case COLUMN_TYPE_TEXT:
+    case COLUMN_TYPE_BLOB: {
+      // Like sqlite, use the longest numeric prefix. Something like "3.7"
+      // converts through a double so that it truncates rather than stops.
+      const char* str = bytes_.c_str();
+      char* end = NULL;
+      int64 result = strtoll(str, &end, 10);
+      if (end && (*end == '.' || *end == 'e' || *end == 'E'))
+        result = static_cast<int64>(strtod(str, NULL));
+      return result;
+    }
+    case COLUMN_TYPE_NULL:
+      break;
+  }
+  return 0;
+}
+
+double Value::AsDouble() const {
+  switch (type_) {
+    case COLUMN_TYPE_INTEGER:
+      return static_cast<double>(int_);
+    case COLUMN_TYPE_FLOAT:
+      return double_;
+    case COLUMN_TYPE_TEXT:
+    case COLUMN_TYPE_BLOB:
+      return strtod(bytes_.c_str(), NULL);
+    case COLUMN_TYPE_NULL:
+      break;
+  }
+  return 0.0;
+}
+
+std::string Value::AsString() const {
+  char buffer[64];
+
+  switch (type_) {
+    case COLUMN_TYPE_INTEGER:
+      sqlite3_snprintf(sizeof(buffer), buffer, "%lld",
+                       static_cast<sqlite3_int64>(int_));
+      return buffer;
+    case COLUMN_TYPE_FLOAT:
+      sqlite3_snprintf(sizeof(buffer), buffer, "%!.15g", double_);
+      return buffer;
+    case COLUMN_TYPE_TEXT:
+    case COLUMN_TYPE_BLOB:
+      return bytes_;
+    case COLUMN_TYPE_NULL:
+      break;
+  }
+  return "";
+}
+
+int Value::Compare(const Value& other) const {
+  int rank = TypeRank(type_);
+  int other_rank = TypeRank(other.type_);
+  if (rank != other_rank)
+    return rank < other_rank ? -1 : 1;
+
+  if (IsNumeric(type_)) {
+    if (type_ == COLUMN_TYPE_INTEGER && other.type_ == COLUMN_TYPE_INTEGER) {
+      if (int_ == other.int_)
+        return 0;
+      return int_ < other.int_ ? -1 : 1;
+    }
+    double a = AsDouble();
+    double b = other.AsDouble();
+    if (a == b)
+      return 0;
+    return a < b ? -1 : 1;
+  }
+
+  if (type_ == COLUMN_TYPE_NULL)
+    return 0;
+
+  size_t len = bytes_.size() < other.bytes_.size() ? bytes_.size()
+                                                   : other.bytes_.size();
+  int result = len ? memcmp(bytes_.data(), other.bytes_.data(), len) : 0;
+  if (result != 0)
+    return result;
+  if (bytes_.size() == other.bytes_.size())
+    return 0;
+  return bytes_.size() < other.bytes_.size() ? -1 : 1;
+}
+
+}  // namespace sql
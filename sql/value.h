@@ -0,0 +1,83 @@
+// Copyright (c) 2010 Garrett R. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef SQL_VALUE_H_
+#define SQL_VALUE_H_
+
+#include <string>
+#include <vector>
+
+#include "basictypes.h"
+
+namespace sql {
+
+// Possible return values from ColumnType in a statement. These should match
+// the values in sqlite3.h.
+enum ColType {
+  COLUMN_TYPE_INTEGER = 1,
+  COLUMN_TYPE_FLOAT = 2,
+  COLUMN_TYPE_TEXT = 3,
+  COLUMN_TYPE_BLOB = 4,
+  COLUMN_TYPE_NULL = 5,
+};
+
+// A single decoded sqlite value. This is used whenever a result has to
+// outlive the statement that produced it, for example when rows are handed
+// to another thread.
+//
+// Conversions follow sqlite's own rules, so AsInt64() on a TEXT value gives
+// the same answer as Statement::ColumnInt64() would have on the column.
+//
+// This object is copyable and assignable.
+class Value {
+ public:
+  // Creates a NULL value.
+  Value();
+
+  explicit Value(int value);
+  explicit Value(int64 value);
+  explicit Value(double value);
+  explicit Value(const char* text);
+  explicit Value(const std::string& text);
+
+  // Creates a BLOB value holding a copy of |len| bytes at |data|.
+  static Value Blob(const void* data, int len);
+
+  ColType type() const { return type_; }
+  bool is_null() const { return type_ == COLUMN_TYPE_NULL; }
+
+  bool AsBool() const { return AsInt64() != 0; }
+  int AsInt() const { return static_cast<int>(AsInt64()); }
+  int64 AsInt64() const;
+  double AsDouble() const;
+  std::string AsString() const;
+
+  // Returns the raw bytes of a TEXT or BLOB value, empty for other types.
+  const std::string& bytes() const { return bytes_; }
+
+  // Returns the approximate number of bytes this value occupies.
+  size_t ByteSize() const { return sizeof(*this) + bytes_.size(); }
+
+  // Compares using sqlite's ordering for values without a collation:
+  // NULL < INTEGER/FLOAT < TEXT < BLOB, TEXT and BLOB compared bytewise.
+  // Returns a negative, zero or positive number like strcmp.
+  int Compare(const Value& other) const;
+
+  bool operator==(const Value& other) const { return Compare(other) == 0; }
+  bool operator!=(const Value& other) const { return Compare(other) != 0; }
+  bool operator<(const Value& other) const { return Compare(other) < 0; }
+
+ private:
+  ColType type_;
+  int64 int_;
+  double double_;
+  std::string bytes_;
+};
+
+// A result row. Column |i| of the statement is element |i|.
+typedef std::vector<Value> Row;
+
+}  // namespace sql
+
+#endif  // SQL_VALUE_H_
@@ -0,0 +1,489 @@
+// Copyright (c) 2010 Garrett R. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "vector_functions.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <sqlite3.h>
+
+#include "build_config.h"
+#include "connection.h"
+
+#if defined(COMPILER_GCC) && defined(ARCH_CPU_X86_FAMILY)
+#include <immintrin.h>
+#define SQL_VECTOR_X86_KERNELS 1
+#endif
+
+namespace sql {
+
+namespace {
+
+// Blobs aren't necessarily aligned for float, so the kernels take bytes.
+// The SIMD loads are unaligned ones, and the scalar code reads through
+// memcpy.
+typedef const unsigned char* Bytes;
+
+inline float LoadFloat(Bytes data, size_t index) {
+  float value;
+  memcpy(&value, data + index * sizeof(float), sizeof(float));
+  return value;
+}
+
+inline const float* AsFloats(Bytes data, size_t index) {
+  return reinterpret_cast<const float*>(data + index * sizeof(float));
+}
+
+// The sums vec_cosine() needs, all in one pass.
+struct CosineSums {
+  float dot;
+  float a_squared;
+  float b_squared;
+};
+
+struct Kernels {
+  const char* name;
+  float (*dot)(Bytes a, Bytes b, size_t count);
+  float (*l2_squared)(Bytes a, Bytes b, size_t count);
+  void (*cosine)(Bytes a, Bytes b, size_t count, CosineSums* sums);
+};
+
+// Scalar kernels, also used for the tails of the SIMD ones -----------------
+
+float ScalarDot(Bytes a, Bytes b, size_t count) {
+  float sum = 0;
+  for (size_t i = 0; i < count; ++i)
+    sum += LoadFloat(a, i) * LoadFloat(b, i);
+  return sum;
+}
+
+float ScalarL2Squared(Bytes a, Bytes b, size_t count) {
+  float sum = 0;
+  for (size_t i = 0; i < count; ++i) {
+    float difference = LoadFloat(a, i) - LoadFloat(b, i);
+    sum += difference * difference;
+  }
+  return sum;
+}
+
+void ScalarCosine(Bytes a, Bytes b, size_t count, CosineSums* sums) {
+  for (size_t i = 0; i < count; ++i) {
+    float x = LoadFloat(a, i);
+    float y = LoadFloat(b, i);
+    sums->dot += x * y;
+    sums->a_squared += x * x;
+    sums->b_squared += y * y;
+  }
+}
+
+const Kernels kScalarKernels = {
+  "scalar", &ScalarDot, &ScalarL2Squared, &ScalarCosine,
+};
+
+#if defined(SQL_VECTOR_X86_KERNELS)
+
+// SSE2 ---------------------------------------------------------------------
+
+__attribute__((target("sse2")))
+float HorizontalSum(__m128 v) {
+  v = _mm_add_ps(v, _mm_movehl_ps(v, v));
+  v = _mm_add_ss(v, _mm_shuffle_ps(v, v, 1));
+  return _mm_cvtss_f32(v);
+}
+
+__attribute__((target("sse2")))
+float Sse2Dot(Bytes a, Bytes b, size_t count) {
+  __m128 sum = _mm_setzero_ps();
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(AsFloats(a, i)),
+                                     _mm_loadu_ps(AsFloats(b, i))));
+  }
+  return HorizontalSum(sum) + ScalarDot(a + i * 4, b + i * 4, count - i);
+}
+
+__attribute__((target("sse2")))
+float Sse2L2Squared(Bytes a, Bytes b, size_t count) {
+  __m128 sum = _mm_setzero_ps();
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m128 difference = _mm_sub_ps(_mm_loadu_ps(AsFloats(a, i)),
+                                   _mm_loadu_ps(AsFloats(b, i)));
+    sum = _mm_add_ps(sum, _mm_mul_ps(difference, difference));
+  }
+  return HorizontalSum(sum) +
+         ScalarL2Squared(a + i * 4, b + i * 4, count - i);
+}
+
+__attribute__((target("sse2")))
+void Sse2Cosine(Bytes a, Bytes b, size_t count, CosineSums* sums) {
+  __m128 dot = _mm_setzero_ps();
+  __m128 a_squared = _mm_setzero_ps();
+  __m128 b_squared = _mm_setzero_ps();
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m128 x = _mm_loadu_ps(AsFloats(a, i));
+    __m128 y = _mm_loadu_ps(AsFloats(b, i));
+    dot = _mm_add_ps(dot, _mm_mul_ps(x, y));
+    a_squared = _mm_add_ps(a_squared, _mm_mul_ps(x, x));
+    b_squared = _mm_add_ps(b_squared, _mm_mul_ps(y, y));
+  }
+  sums->dot = HorizontalSum(dot);
+  sums->a_squared = HorizontalSum(a_squared);
+  sums->b_squared = HorizontalSum(b_squared);
+  ScalarCosine(a + i * 4, b + i * 4, count - i, sums);
+}
+
+const Kernels kSse2Kernels = {
+  "sse2", &Sse2Dot, &Sse2L2Squared, &Sse2Cosine,
+};
+
+// AVX2 ---------------------------------------------------------------------
+//
+// Two accumulators hide the latency of the fused multiply-adds.
+
+__attribute__((target("avx2,fma")))
+float HorizontalSum(__m256 v) {
+  __m128 sum = _mm_add_ps(_mm256_castps256_ps128(v),
+                          _mm256_extractf128_ps(v, 1));
+  sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+  sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+  return _mm_cvtss_f32(sum);
+}
+
+__attribute__((target("avx2,fma")))
+float Avx2Dot(Bytes a, Bytes b, size_t count) {
+  __m256 sum0 = _mm256_setzero_ps();
+  __m256 sum1 = _mm256_setzero_ps();
+  size_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    sum0 = _mm256_fmadd_ps(_mm256_loadu_ps(AsFloats(a, i)),
+                           _mm256_loadu_ps(AsFloats(b, i)), sum0);
+    sum1 = _mm256_fmadd_ps(_mm256_loadu_ps(AsFloats(a, i + 8)),
+                           _mm256_loadu_ps(AsFloats(b, i + 8)), sum1);
+  }
+  for (; i + 8 <= count; i += 8) {
+    sum0 = _mm256_fmadd_ps(_mm256_loadu_ps(AsFloats(a, i)),
+                           _mm256_loadu_ps(AsFloats(b, i)), sum0);
+  }
+  return HorizontalSum(_mm256_add_ps(sum0, sum1)) +
+         ScalarDot(a + i * 4, b + i * 4, count - i);
+}
+
+__attribute__((target("avx2,fma")))
+float Avx2L2Squared(Bytes a, Bytes b, size_t count) {
+  __m256 sum0 = _mm256_setzero_ps();
+  __m256 sum1 = _mm256_setzero_ps();
+  size_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    __m256 difference0 = _mm256_sub_ps(_mm256_loadu_ps(AsFloats(a, i)),
+                                       _mm256_loadu_ps(AsFloats(b, i)));
+    __m256 difference1 = _mm256_sub_ps(_mm256_loadu_ps(AsFloats(a, i + 8)),
+                                       _mm256_loadu_ps(AsFloats(b, i + 8)));
+    sum0 = _mm256_fmadd_ps(difference0, difference0, sum0);
+    sum1 = _mm256_fmadd_ps(difference1, difference1, sum1);
+  }
+  for (; i + 8 <= count; i += 8) {
+    __m256 difference = _mm256_sub_ps(_mm256_loadu_ps(AsFloats(a, i)),
+                                      _mm256_loadu_ps(AsFloats(b, i)));
+    sum0 = _mm256_fmadd_ps(difference, difference, sum0);
+  }
+  return HorizontalSum(_mm256_add_ps(sum0, sum1)) +
+         ScalarL2Squared(a + i * 4, b + i * 4, count - i);
+}
+
+__attribute__((target("avx2,fma")))
+void Avx2Cosine(Bytes a, Bytes b, size_t count, CosineSums* sums) {
+  __m256 dot = _mm256_setzero_ps();
+  __m256 a_squared = _mm256_setzero_ps();
+  __m256 b_squared = _mm256_setzero_ps();
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256 x = _mm256_loadu_ps(AsFloats(a, i));
+    __m256 y = _mm256_loadu_ps(AsFloats(b, i));
+    dot = _mm256_fmadd_ps(x, y, dot);
+    a_squared = _mm256_fmadd_ps(x, x, a_squared);
+    b_squared = _mm256_fmadd_ps(y, y, b_squared);
+  }
+  sums->dot = HorizontalSum(dot);
+  sums->a_squared = HorizontalSum(a_squared);
+  sums->b_squared = HorizontalSum(b_squared);
+  ScalarCosine(a + i * 4, b + i * 4, count - i, sums);
+}
+
+const Kernels kAvx2Kernels = {
+  "avx2", &Avx2Dot, &Avx2L2Squared, &Avx2Cosine,
+};
+
+// AVX-512 ------------------------------------------------------------------
+//
+// Masked loads handle the tail, so there is no scalar loop.
+
+__attribute__((target("avx512f")))
+__mmask16 TailMask(size_t remaining) {
+  return static_cast<__mmask16>((1u << remaining) - 1);
+}
+
+__attribute__((target("avx512f")))
+float Avx512Dot(Bytes a, Bytes b, size_t count) {
+  __m512 sum0 = _mm512_setzero_ps();
+  __m512 sum1 = _mm512_setzero_ps();
+  size_t i = 0;
+  for (; i + 32 <= count; i += 32) {
+    sum0 = _mm512_fmadd_ps(_mm512_loadu_ps(AsFloats(a, i)),
+                           _mm512_loadu_ps(AsFloats(b, i)), sum0);
+    sum1 = _mm512_fmadd_ps(_mm512_loadu_ps(AsFloats(a, i + 16)),
+                           _mm512_loadu_ps(AsFloats(b, i + 16)), sum1);
+  }
+  for (; i + 16 <= count; i += 16) {
+    sum0 = _mm512_fmadd_ps(_mm512_loadu_ps(AsFloats(a, i)),
+                           _mm512_loadu_ps(AsFloats(b, i)), sum0);
+  }
+  if (i < count) {
+    __mmask16 mask = TailMask(count - i);
+    sum1 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, AsFloats(a, i)),
+                           _mm512_maskz_loadu_ps(mask, AsFloats(b, i)), sum1);
+  }
+  return _mm512_reduce_add_ps(_mm512_add_ps(sum0, sum1));
+}
+
+__attribute__((target("avx512f")))
+float Avx512L2Squared(Bytes a, Bytes b, size_t count) {
+  __m512 sum = _mm512_setzero_ps();
+  size_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    __m512 difference = _mm512_sub_ps(_mm512_loadu_ps(AsFloats(a, i)),
+                                      _mm512_loadu_ps(AsFloats(b, i)));
+    sum = _mm512_fmadd_ps(difference, difference, sum);
+  }
+  if (i < count) {
+    __mmask16 mask = TailMask(count - i);
+    __m512 difference =
+        _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, AsFloats(a, i)),
+                      _mm512_maskz_loadu_ps(mask, AsFloats(b, i)));
+    sum = _mm512_fmadd_ps(difference, difference, sum);
+  }
+  return _mm512_reduce_add_ps(sum);
+}
+
+__attribute__((target("avx512f")))
+void Avx512Cosine(Bytes a, Bytes b, size_t count, CosineSums* sums) {
+  __m512 dot = _mm512_setzero_ps();
+  __m512 a_squared = _mm512_setzero_ps();
+  __m512 b_squared = _mm512_setzero_ps();
+  size_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    __m512 x = _mm512_loadu_ps(AsFloats(a, i));
+    __m512 y = _mm512_loadu_ps(AsFloats(b, i));
+    dot = _mm512_fmadd_ps(x, y, dot);
+    a_squared = _mm512_fmadd_ps(x, x, a_squared);
+    b_squared = _mm512_fmadd_ps(y, y, b_squared);
+  }
+  if (i < count) {
+    __mmask16 mask = TailMask(count - i);
+    __m512 x = _mm512_maskz_loadu_ps(mask, AsFloats(a, i));
+    __m512 y = _mm512_maskz_loadu_ps(mask, AsFloats(b, i));
+    dot = _mm512_fmadd_ps(x, y, dot);
+    a_squared = _mm512_fmadd_ps(x, x, a_squared);
+    b_squared = _mm512_fmadd_ps(y, y, b_squared);
+  }
+  sums->dot = _mm512_reduce_add_ps(dot);
+  sums->a_squared = _mm512_reduce_add_ps(a_squared);
+  sums->b_squared = _mm512_reduce_add_ps(b_squared);
+}
+
+const Kernels kAvx512Kernels = {
+  "avx512", &Avx512Dot, &Avx512L2Squared, &Avx512Cosine,
+};
+
+#endif  // defined(SQL_VECTOR_X86_KERNELS)
+
+const Kernels* ChooseKernels() {
+#if defined(SQL_VECTOR_X86_KERNELS)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f"))
+    return &kAvx512Kernels;
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+    return &kAvx2Kernels;
+  if (__builtin_cpu_supports("sse2"))
+    return &kSse2Kernels;
+#endif
+  return &kScalarKernels;
+}
+
+const Kernels& GetKernels() {
+  static const Kernels* kernels = ChooseKernels();
+  return *kernels;
+}
+
+// SQL functions -------------------------------------------------------------
+
+// Gets the two vector arguments of |name|. Returns false, having set the
+// result, if the function returns without comparing them.
+bool GetVectors(sqlite3_context* context, const char* name,
+                sqlite3_value** argv, Bytes* a, Bytes* b, size_t* count) {
+  if (sqlite3_value_type(argv[0]) == SQLITE_NULL ||
+      sqlite3_value_type(argv[1]) == SQLITE_NULL) {
+    sqlite3_result_null(context);
+    return false;
+  }
+
+  // Get the pointers before the sizes, as sqlite documents.
+  *a = static_cast<Bytes>(sqlite3_value_blob(argv[0]));
+  *b = static_cast<Bytes>(sqlite3_value_blob(argv[1]));
+  int a_size = sqlite3_value_bytes(argv[0]);
+  int b_size = sqlite3_value_bytes(argv[1]);
+  if (a_size != b_size || a_size % sizeof(float) != 0) {
+    std::string error(name);
+    error.append("() needs float32 vectors of the same length");
+    sqlite3_result_error(context, error.c_str(), -1);
+    return false;
+  }
+  *count = a_size / sizeof(float);
+  return true;
+}
+
+void VecDot(sqlite3_context* context, int /*argc*/, sqlite3_value** argv) {
+  Bytes a, b;
+  size_t count;
+  if (GetVectors(context, "vec_dot", argv, &a, &b, &count))
+    sqlite3_result_double(context, GetKernels().dot(a, b, count));
+}
+
+void VecCosine(sqlite3_context* context, int /*argc*/,
+               sqlite3_value** argv) {
+  Bytes a, b;
+  size_t count;
+  if (!GetVectors(context, "vec_cosine", argv, &a, &b, &count))
+    return;
+
+  CosineSums sums = { 0, 0, 0 };
+  GetKernels().cosine(a, b, count, &sums);
+  if (sums.a_squared == 0 || sums.b_squared == 0) {
+    sqlite3_result_null(context);
+    return;
+  }
+  sqlite3_result_double(
+      context, sums.dot / (std::sqrt(static_cast<double>(sums.a_squared)) *
+                           std::sqrt(static_cast<double>(sums.b_squared))));
+}
+
+void VecL2(sqlite3_context* context, int /*argc*/, sqlite3_value** argv) {
+  Bytes a, b;
+  size_t count;
+  if (GetVectors(context, "vec_l2", argv, &a, &b, &count)) {
+    sqlite3_result_double(
+        context, std::sqrt(static_cast<double>(
+            GetKernels().l2_squared(a, b, count))));
+  }
+}
+
+// The state of one vec_top_k() aggregate: a min-heap of the best |k| rows
+// seen, so each row costs O(log k).
+struct TopK {
+  typedef std::pair<double, sqlite3_int64> Entry;
+
+  explicit TopK(size_t k) : k(k) {}
+
+  size_t k;
+  std::vector<Entry> heap;
+};
+
+TopK* GetTopK(sqlite3_context* context, bool create) {
+  TopK** top_k = static_cast<TopK**>(
+      sqlite3_aggregate_context(context, create ? sizeof(TopK*) : 0));
+  return top_k ? *top_k : NULL;
+}
+
+void VecTopKStep(sqlite3_context* context, int /*argc*/,
+                 sqlite3_value** argv) {
+  TopK** slot = static_cast<TopK**>(
+      sqlite3_aggregate_context(context, sizeof(TopK*)));
+  if (!slot) {
+    sqlite3_result_error_nomem(context);
+    return;
+  }
+  if (!*slot) {
+    sqlite3_int64 k = sqlite3_value_int64(argv[2]);
+    if (k <= 0) {
+      sqlite3_result_error(context, "vec_top_k() needs a positive k", -1);
+      return;
+    }
+    *slot = new TopK(static_cast<size_t>(k));
+  }
+  if (sqlite3_value_type(argv[1]) == SQLITE_NULL)
+    return;
+
+  TopK* top_k = *slot;
+  TopK::Entry entry(sqlite3_value_double(argv[1]),
+                    sqlite3_value_int64(argv[0]));
+  std::greater<TopK::Entry> worse_first;
+  if (top_k->heap.size() < top_k->k) {
+    top_k->heap.push_back(entry);
+    std::push_heap(top_k->heap.begin(), top_k->heap.end(), worse_first);
+  } else if (entry.first > top_k->heap.front().first) {
+    std::pop_heap(top_k->heap.begin(), top_k->heap.end(), worse_first);
+    top_k->heap.back() = entry;
+    std::push_heap(top_k->heap.begin(), top_k->heap.end(), worse_first);
+  }
+}
+
+void VecTopKFinal(sqlite3_context* context) {
+  TopK* top_k = GetTopK(context, false);
+  std::string json("[");
+  if (top_k) {
+    std::sort_heap(top_k->heap.begin(), top_k->heap.end(),
+                   std::greater<TopK::Entry>());
+    for (size_t i = 0; i < top_k->heap.size(); ++i) {
+      if (i)
+        json.push_back(',');
+      json.append(std::to_string(top_k->heap[i].second));
+    }
+    delete top_k;
+  }
+  json.push_back(']');
+  sqlite3_result_text(context, json.c_str(), static_cast<int>(json.size()),
+                      SQLITE_TRANSIENT);
+  sqlite3_result_subtype(context, 'J');
+}
+
+}  // namespace
+
+// static
+bool VectorFunctions::Register(Connection* db) {
+  if (!db->is_open())
+    return false;
+
+  // Choose the kernels now rather than in the first query.
+  GetKernels();
+
+  int flags = SQLITE_UTF8 | SQLITE_DETERMINISTIC;
+#if defined(SQLITE_INNOCUOUS)
+  flags |= SQLITE_INNOCUOUS;
+#endif
+  sqlite3* handle = db->db_;
+  return sqlite3_create_function_v2(handle, "vec_dot", 2, flags, NULL,
+                                    &VecDot, NULL, NULL, NULL) == SQLITE_OK &&
+         sqlite3_create_function_v2(handle, "vec_cosine", 2, flags, NULL,
+                                    &VecCosine, NULL, NULL,
+                                    NULL) == SQLITE_OK &&
+         sqlite3_create_function_v2(handle, "vec_l2", 2, flags, NULL,
+                                    &VecL2, NULL, NULL, NULL) == SQLITE_OK &&
+         sqlite3_create_function_v2(handle, "vec_top_k", 3, flags, NULL,
+                                    NULL, &VecTopKStep, &VecTopKFinal,
+                                    NULL) == SQLITE_OK;
+}
+
+// static
+const char* VectorFunctions::GetKernelName() {
+  return GetKernels().name;
+}
+
+}  // namespace sql
@@ -0,0 +1,61 @@
+// Copyright (c) 2010 Garrett R. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef SQL_VECTOR_FUNCTIONS_H_
+#define SQL_VECTOR_FUNCTIONS_H_
+
+#include "basictypes.h"
+
+namespace sql {
+
+class Connection;
+
+// VectorFunctions adds SQL functions for comparing embeddings stored as
+// blobs of native-endian float32 values, such as those bound with
+//
+//   statement.BindBlob(1, &embedding[0], embedding.size() * sizeof(float));
+//
+// so that similarity searches run inside sqlite instead of copying every
+// blob out with ColumnBlobAsVector():
+//
+//   vec_dot(a, b)     The dot product of a and b.
+//   vec_cosine(a, b)  The cosine similarity of a and b, from -1 to 1. NULL
+//                     if either has a length of zero.
+//   vec_l2(a, b)      The Euclidean distance between a and b.
+//
+//   vec_top_k(id, score, k)
+//                     An aggregate returning the |id|s of the |k| rows with
+//                     the highest |score|, best first, as a JSON array. Rows
+//                     with a NULL score are skipped.
+//
+// For example, the ten items nearest to ?1:
+//
+//   SELECT value FROM json_each((
+//       SELECT vec_top_k(rowid, vec_cosine(embedding, ?1), 10) FROM items))
+//
+// For a distance, where lower is better, rank by its negation, as in
+// vec_top_k(rowid, -vec_l2(embedding, ?1), 10).
+//
+// The functions read the blobs where sqlite keeps them, without copying
+// them. They use the widest of AVX-512, AVX2 and SSE2 the processor
+// supports, chosen when the functions are first registered. A NULL argument
+// gives NULL; blobs of different lengths, or of a length that isn't a
+// multiple of 4, are an error.
+class VectorFunctions {
+ public:
+  // Registers the functions on |db|, which must be open. Returns false on
+  // error.
+  static bool Register(Connection* db);
+
+  // The name of the instruction set the functions use: "avx512", "avx2",
+  // "sse2" or "scalar".
+  static const char* GetKernelName();
+
+ private:
+  DISALLOW_IMPLICIT_CONSTRUCTORS(VectorFunctions);
+};
+
+}  // namespace sql
+
+#endif  // SQL_VECTOR_FUNCTIONS_H_